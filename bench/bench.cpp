@@ -0,0 +1,370 @@
+// bench.cpp
+// hevnet_bench: sends messages from one TBD socket to another over
+// loopback and reports throughput, one way and round trip latency and
+// the CPU time spent per message as JSON, so runs of different
+// versions can be compared
+#include "bufferpool.h"
+#include "errors.h"
+#include "impairment.h"
+#include "localtransport.h"
+#include "metrics.h"
+#include "rudp.h"
+#ifdef HEVNET_IO_URING
+#include "uringtransport.h"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+
+#ifndef HEVNET_VERSION
+#define HEVNET_VERSION "unknown"
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  // bytes in each message, at least STAMP_LEN
+  size_t payload = 64;
+  // messages per second, 0 to send as fast as the socket takes them
+  uint64_t rate = 0;
+  double duration = 5;
+  uint8_t channel = Hev::Channel::RELIABLE;
+  // the receiver answers every message so round trips can be timed
+  bool echo = true;
+  // the receiver binds port and the sender port + 1
+  int port = 47000;
+  // the sender's link both ways, nothing by default
+  Hev::ImpairmentConfig impairment;
+  std::string transport = "udp";
+};
+
+// the front of every message, its number and when it was meant to go
+struct Stamp {
+  uint64_t number;
+  int64_t sent_ns;
+};
+constexpr size_t STAMP_LEN = sizeof(Stamp);
+// how long to wait for messages still in flight once sending stops
+constexpr std::chrono::seconds DRAIN_TIME{2};
+constexpr std::chrono::milliseconds POLL_TIME{50};
+// how long to back off while the socket is full, short enough not to
+// starve it and long enough not to count spinning as CPU per message
+constexpr std::chrono::microseconds FULL_BACKOFF{20};
+
+const char *CHANNEL_NAMES[Hev::Channel::COUNT] = {"unreliable", "sequenced",
+                                                  "reliable", "ordered"};
+const char *DROP_NAMES[Hev::MetricsSnapshot::DROP_REASONS] = {
+    "unknown_peer", "malformed", "duplicate", "stale", "no_room",
+    "send_failed", "queue_overflow"};
+
+int64_t Nanos(const Clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+double CpuSeconds() {
+  rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void Usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --payload BYTES   size of each message (default 64, min %zu)\n"
+          "  --rate N          messages per second, 0 for as fast as\n"
+          "                    possible (default 0)\n"
+          "  --duration SECS   how long to send for (default 5)\n"
+          "  --channel NAME    unreliable, sequenced, reliable or ordered\n"
+          "                    (default reliable)\n"
+          "  --no-echo         don't answer messages, no round trips\n"
+          "  --port PORT       ports PORT and PORT + 1 on 127.0.0.1\n"
+          "                    (default 47000)\n"
+          "  --transport NAME  udp, local, shm"
+#ifdef HEVNET_IO_URING
+          " or uring"
+#endif
+          " (default udp)\n"
+          "  --loss PERCENT    datagrams lost each way (default 0)\n"
+          "  --delay MS        latency added each way (default 0)\n"
+          "  --jitter MS       up to this much more latency at random\n"
+          "                    (default 0)\n"
+          "  --seed N          where the random losses and delays start\n"
+          "                    from (default 1)\n",
+          name, STAMP_LEN);
+}
+
+bool Parse(int argc, char **argv, Options *options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--no-echo") {
+      options->echo = false;
+    } else if (arg == "--payload" && has_value) {
+      options->payload = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--rate" && has_value) {
+      options->rate = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--duration" && has_value) {
+      options->duration = std::strtod(argv[++i], nullptr);
+    } else if (arg == "--port" && has_value) {
+      options->port = std::atoi(argv[++i]);
+    } else if (arg == "--loss" && has_value) {
+      options->impairment.outbound.loss = std::strtod(argv[++i], nullptr) / 100;
+    } else if (arg == "--delay" && has_value) {
+      options->impairment.outbound.delay =
+          std::chrono::milliseconds(std::strtoull(argv[++i], nullptr, 10));
+    } else if (arg == "--jitter" && has_value) {
+      options->impairment.outbound.jitter =
+          std::chrono::milliseconds(std::strtoull(argv[++i], nullptr, 10));
+    } else if (arg == "--seed" && has_value) {
+      options->impairment.seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--transport" && has_value) {
+      options->transport = argv[++i];
+    } else if (arg == "--channel" && has_value) {
+      const std::string name = argv[++i];
+      size_t channel = 0;
+      while (channel < Hev::Channel::COUNT && name != CHANNEL_NAMES[channel])
+        channel++;
+      if (channel == Hev::Channel::COUNT)
+        return false;
+      options->channel = channel;
+    } else {
+      return false;
+    }
+  }
+  options->impairment.inbound = options->impairment.outbound;
+  const double loss = options->impairment.outbound.loss;
+  return options->payload >= STAMP_LEN && options->duration > 0 &&
+         options->port > 0 && options->port < 65535 && loss >= 0 && loss <= 1;
+}
+
+void PrintLatency(const char *name, const Hev::HistogramSnapshot &latency) {
+  if (latency.count == 0) {
+    printf("  \"%s\": null,\n", name);
+    return;
+  }
+  printf("  \"%s\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+         "\"max\": %.1f, \"mean\": %.1f},\n",
+         name, latency.Percentile(50) / 1e3, latency.Percentile(99) / 1e3,
+         latency.Percentile(99.9) / 1e3, latency.max / 1e3,
+         latency.Mean() / 1e3);
+}
+
+// the packets a socket threw away by why, last says whether more
+// follows it
+void PrintDrops(const char *name, const Hev::MetricsSnapshot &metrics,
+                const bool last) {
+  printf("  \"%s\": {", name);
+  for (size_t i = 0; i < Hev::MetricsSnapshot::DROP_REASONS; i++)
+    printf("%s\"%s\": %lu", i > 0 ? ", " : "", DROP_NAMES[i],
+           metrics.drops[i]);
+  printf("}%s\n", last ? "" : ",");
+}
+
+/* BindTransport
+ * returns: the transport called name bound to port on 127.0.0.1, null
+ *  if there's no such transport or it couldn't be bound
+ */
+std::unique_ptr<Hev::Transport> BindTransport(const std::string &name,
+                                              const int port) {
+  if (name == "udp")
+    return Hev::UdpTransport::Bind("127.0.0.1", port);
+  if (name == "local")
+    return Hev::LocalTransport::Bind("127.0.0.1", port);
+  if (name == "shm")
+    return Hev::SharedMemoryTransport::Bind("127.0.0.1", port);
+#ifdef HEVNET_IO_URING
+  if (name == "uring")
+    return Hev::UringTransport::Bind("127.0.0.1", port);
+#endif
+  return nullptr;
+}
+
+/* Send
+ * sends a message, waiting for room while the socket is full
+ * returns: 0 once it is queued, the error otherwise
+ */
+int Send(Hev::TBD &socket, Hev::Buffer &message, const size_t length,
+         const uint8_t channel) {
+  int status;
+  while ((status = socket.Send(message, length, Hev::PacketType::MSG,
+                               channel)) == QUEUE_FULL)
+    std::this_thread::sleep_for(FULL_BACKOFF);
+  return status;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!Parse(argc, argv, &options)) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  Hev::BufferPool &pool = Hev::BufferPool::Instance();
+  auto receiving_transport = BindTransport(options.transport, options.port);
+  auto sending_transport = BindTransport(options.transport, options.port + 1);
+  if (!receiving_transport || !sending_transport) {
+    fprintf(stderr, "couldn't bind %s transport on ports %d and %d\n",
+            options.transport.c_str(), options.port, options.port + 1);
+    return 1;
+  }
+  Hev::TBD receiver = Hev::TBD::Bind(std::move(receiving_transport));
+  Hev::TBD sender = Hev::TBD::Bind(std::move(sending_transport));
+  sender.SetImpairment(options.impairment);
+  int listened = HANDSHAKE_FAIL;
+  std::thread listener([&]() {
+    listened = receiver.Listen("127.0.0.1", options.port + 1);
+  });
+  const int connected = sender.Connect("127.0.0.1", options.port);
+  listener.join();
+  if (connected != 0 || listened != 0) {
+    fprintf(stderr, "handshake failed: connect %d listen %d\n", connected,
+            listened);
+    return 1;
+  }
+
+  // latencies are kept in nanoseconds and reported in microseconds
+  Hev::Histogram one_way;
+  Hev::Histogram round_trip;
+  std::atomic<uint64_t> received(0);
+  // when the last message came in, the end of the run for throughput
+  std::atomic<int64_t> last_received_ns(0);
+  std::atomic<uint64_t> answered(0);
+  std::atomic_bool running(true);
+
+  std::thread receiving([&]() {
+    Hev::Buffer message;
+    while (running) {
+      if (receiver.Receive(&message, POLL_TIME) != 0)
+        continue;
+      Stamp stamp;
+      std::memcpy(&stamp, message.get(), STAMP_LEN);
+      const int64_t now_ns = Nanos(Clock::now());
+      one_way.Record(now_ns - stamp.sent_ns);
+      last_received_ns = now_ns;
+      received++;
+      if (!options.echo)
+        continue;
+      // the stamp goes back so the sender can time the round trip
+      Hev::Buffer answer = pool.Acquire(STAMP_LEN);
+      std::memcpy(answer.get(), &stamp, STAMP_LEN);
+      Send(receiver, answer, STAMP_LEN, options.channel);
+    }
+  });
+  std::thread answers([&]() {
+    Hev::Buffer answer;
+    while (running && options.echo) {
+      if (sender.Receive(&answer, POLL_TIME) != 0)
+        continue;
+      Stamp stamp;
+      std::memcpy(&stamp, answer.get(), STAMP_LEN);
+      round_trip.Record(Nanos(Clock::now()) - stamp.sent_ns);
+      answered++;
+    }
+  });
+
+  const double cpu_start = CpuSeconds();
+  const auto start = Clock::now();
+  const auto stop =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(options.duration));
+  const auto interval =
+      options.rate > 0 ? std::chrono::nanoseconds(1000000000 / options.rate)
+                       : std::chrono::nanoseconds(0);
+  uint64_t sent = 0;
+  auto next = start;
+  while (Clock::now() < stop) {
+    // at a fixed rate a message is timed from when it was due rather
+    // than from when the socket took it, a stall then shows up in the
+    // latency of everything that had to wait on it
+    if (options.rate > 0) {
+      std::this_thread::sleep_until(next);
+    } else {
+      next = Clock::now();
+    }
+    Hev::Buffer message = pool.Acquire(options.payload);
+    const Stamp stamp = {.number = sent, .sent_ns = Nanos(next)};
+    std::memcpy(message.get(), &stamp, STAMP_LEN);
+    std::memset(message.get() + STAMP_LEN, 0, options.payload - STAMP_LEN);
+    if (Send(sender, message, options.payload, options.channel) != 0)
+      break;
+    sent++;
+    next += interval;
+  }
+
+  // let whatever is still in flight arrive
+  const auto drain_until = Clock::now() + DRAIN_TIME;
+  while (Clock::now() < drain_until &&
+         (received < sent || (options.echo && answered < received)))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  const double cpu = CpuSeconds() - cpu_start;
+  // up to the last message that made it, however long the drain then
+  // waited for ones that were lost
+  const int64_t end_ns =
+      std::max(last_received_ns.load(), Nanos(std::min(Clock::now(), stop)));
+  const double elapsed = (end_ns - Nanos(start)) / 1e9;
+  running = false;
+  receiving.join();
+  answers.join();
+
+  Hev::MetricsSnapshot metrics;
+  sender.GetMetrics(&metrics);
+  Hev::MetricsSnapshot receiver_metrics;
+  receiver.GetMetrics(&receiver_metrics);
+  const Hev::HistogramSnapshot one_way_snapshot = one_way.Snapshot();
+  const Hev::HistogramSnapshot round_trip_snapshot = round_trip.Snapshot();
+  const uint64_t delivered = received.load();
+
+  printf("{\n");
+  printf("  \"version\": \"%s\",\n", HEVNET_VERSION);
+  printf("  \"payload_bytes\": %zu,\n", options.payload);
+  printf("  \"rate\": %lu,\n", options.rate);
+  printf("  \"duration_s\": %.3f,\n", options.duration);
+  printf("  \"channel\": \"%s\",\n", CHANNEL_NAMES[options.channel]);
+  printf("  \"transport\": \"%s\",\n", options.transport.c_str());
+  printf("  \"echo\": %s,\n", options.echo ? "true" : "false");
+  printf("  \"loss\": %.3f,\n", options.impairment.outbound.loss);
+  printf("  \"delay_ms\": %ld,\n",
+         long(options.impairment.outbound.delay.count() / 1000));
+  printf("  \"jitter_ms\": %ld,\n",
+         long(options.impairment.outbound.jitter.count() / 1000));
+  printf("  \"sent\": %lu,\n", sent);
+  printf("  \"received\": %lu,\n", delivered);
+  printf("  \"answered\": %lu,\n", answered.load());
+  printf("  \"elapsed_s\": %.3f,\n", elapsed);
+  printf("  \"messages_per_sec\": %.1f,\n", delivered / elapsed);
+  printf("  \"bytes_per_sec\": %.1f,\n",
+         delivered * options.payload / elapsed);
+  PrintLatency("one_way_us", one_way_snapshot);
+  PrintLatency("rtt_us", round_trip_snapshot);
+  printf("  \"cpu_s\": %.3f,\n", cpu);
+  printf("  \"cpu_us_per_message\": %.3f,\n",
+         delivered > 0 ? cpu * 1e6 / delivered : 0.0);
+  printf("  \"datagrams_out\": %lu,\n", metrics.datagrams_out);
+  printf("  \"datagrams_per_send\": %.2f,\n",
+         metrics.send_calls > 0
+             ? double(metrics.datagrams_out) / metrics.send_calls
+             : 0.0);
+  printf("  \"datagrams_per_receive\": %.2f,\n",
+         receiver_metrics.receive_calls > 0
+             ? double(receiver_metrics.datagrams_in) /
+                   receiver_metrics.receive_calls
+             : 0.0);
+  printf("  \"retransmits\": %lu,\n", metrics.retransmits);
+  PrintDrops("sender_drops", metrics, false);
+  PrintDrops("receiver_drops", receiver_metrics, true);
+  printf("}\n");
+  return 0;
+}
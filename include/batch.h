@@ -0,0 +1,203 @@
+// batch.h
+// Holds the headers and buffers needed to move many datagrams
+// through the socket with a single recvmmsg/sendmmsg call
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "packet.h"
+
+namespace Hev {
+
+class DatagramBatch {
+public:
+  // the most datagrams the kernel splits one buffer into or hands over
+  // in one, UDP_MAX_SEGMENTS
+  static const size_t MAX_SEGMENTS = 64;
+  // the longest buffer of datagrams the kernel takes or hands over,
+  // the most a UDP datagram can carry over IPv4
+  static const size_t MAX_SEGMENTED_LEN = 65535 - 28;
+
+  /* Constructor
+   * params:
+   *  capacity: the most datagrams moved in a single call
+   *  datagram_len: the size of each receive buffer. Not used when the
+   *    batch is only used for sending
+   */
+  DatagramBatch(const size_t capacity, const size_t datagram_len = 0);
+  DatagramBatch(const DatagramBatch &other) = delete;
+  ~DatagramBatch() = default;
+
+  /* Receive
+   * Reads as many datagrams as are waiting on the socket, up to the
+   * capacity of the batch, without blocking.
+   * params:
+   *  sock: the socket to read from
+   *  coalesced: whether the socket has UDP_GRO on and may hand over
+   *    several datagrams from a peer in one buffer. They're split back
+   *    up so each is its own datagram in the batch, and the receive
+   *    buffers grow to MAX_SEGMENTED_LEN to hold them
+   * returns:
+   *  the number of datagrams received or -1 on error with errno set
+   */
+  const int Receive(const int sock, const bool coalesced = false);
+
+  /* Put
+   * Copies a datagram into the next receive buffer, for transports
+   * that don't read from a socket. Clear the batch before the first
+   * one. Anything past the buffer is cut off and marked Truncated
+   * params:
+   *  data: the datagram
+   *  length: its length
+   *  from: who sent it
+   *  truncated: whether it was already cut off on the way in
+   * returns:
+   *  false if the batch is full
+   */
+  const bool Put(const uint8_t *data, const size_t length,
+                 const sockaddr_in &from, const bool truncated = false);
+
+  /* Add
+   * Adds a datagram to be sent with the next Send. The header and
+   * payload are gathered by the kernel so neither is copied, they must
+   * stay alive until the batch is sent
+   * params:
+   *  header: the serialized header
+   *  header_len: the length of the header
+   *  payload: the payload that follows the header, may be null
+   *  payload_len: the length of the payload
+   *  peer: who to send it to
+   * returns:
+   *  false if the batch is already full
+   */
+  const bool Add(const uint8_t *header, const size_t header_len,
+                 const uint8_t *payload, const size_t payload_len,
+                 const sockaddr_in &peer);
+
+  /* Append
+   * Adds another header and payload to the end of the last datagram
+   * added, so several packets go out in a single datagram. At most
+   * Capacity() headers and payloads fit in a batch altogether
+   * params:
+   *  header: the serialized header
+   *  header_len: the length of the header
+   *  payload: the payload that follows the header, may be null
+   *  payload_len: the length of the payload
+   * returns:
+   *  false if nothing was added yet or there's no room left
+   */
+  const bool Append(const uint8_t *header, const size_t header_len,
+                    const uint8_t *payload, const size_t payload_len);
+
+  /* Send
+   * Sends the added datagrams starting at offset with one sendmmsg
+   * params:
+   *  sock: the socket to write to
+   *  offset: the first datagram to send, anything before it is
+   *    considered already sent
+   *  segment: whether to hand runs of datagrams the same size going
+   *    to the same peer to the kernel as one buffer it splits up
+   *    (UDP_SEGMENT). A run goes out whole or not at all, EINVAL if
+   *    its datagrams are too big for the path and EIO if the device
+   *    can't split them
+   * returns:
+   *  the number of datagrams sent or -1 on error with errno set
+   */
+  const int Send(const int sock, const size_t offset = 0,
+                 const bool segment = false);
+
+  /* Clear
+   * forgets every datagram added or received
+   */
+  void Clear();
+
+  /* Total
+   * params:
+   *  i: an added datagram, less than Size()
+   * returns: the length of its headers and payloads together
+   */
+  const size_t Total(const size_t i) const;
+
+  /* Gather
+   * copies the headers and payloads of an added datagram one after
+   * another, for when it can't be sent straight from them
+   * params:
+   *  i: the datagram, less than Size()
+   *  out: where to copy it, at least Total(i) long
+   */
+  void Gather(const size_t i, uint8_t *out) const;
+
+  /* Flatten
+   * Gather into a buffer of its own
+   * params:
+   *  i: the datagram, less than Size()
+   * returns: the bytes of the datagram
+   */
+  std::vector<uint8_t> Flatten(const size_t i) const;
+
+  const size_t Size() const { return m_count; }
+  const size_t Capacity() const { return m_headers.size(); }
+
+  /* accessors for a received datagram. i must be less than Size() */
+  const uint8_t *Data(const size_t i) const {
+    if (m_coalesced)
+      return m_buffers[m_segments[i].message].get() + m_segments[i].offset;
+    return m_buffers[i].get();
+  }
+  const size_t Length(const size_t i) const {
+    return m_coalesced ? m_segments[i].length : m_headers[i].msg_len;
+  }
+  const sockaddr_in &Address(const size_t i) const {
+    return m_addrs[m_coalesced ? m_segments[i].message : i];
+  }
+  /* Truncated: whether the datagram was larger than the receive buffer */
+  const bool Truncated(const size_t i) const {
+    if (m_coalesced)
+      return m_segments[i].truncated;
+    return m_headers[i].msg_hdr.msg_flags & MSG_TRUNC;
+  }
+
+private:
+  /* Segment
+   * where a datagram handed over along with others is in its buffer
+   */
+  struct Segment {
+    uint32_t message;
+    uint32_t offset;
+    uint32_t length;
+    bool truncated;
+  };
+
+  /* SendSegmented
+   * Send with segment set, for when there's a run to segment
+   * returns: the number of datagrams sent, -1 if none were sent, or -2
+   *  if there's no run worth segmenting
+   */
+  const int SendSegmented(const int sock, const size_t offset);
+
+  std::vector<mmsghdr> m_headers;
+  // two per packet, the header and the payload. A datagram's are next
+  // to each other so it can point at the first one
+  std::vector<iovec> m_iovecs;
+  size_t m_iov_count;
+  std::vector<sockaddr_in> m_addrs;
+  std::vector<Buffer> m_buffers;
+  size_t m_datagram_len;
+  size_t m_count;
+  // room for one control message per datagram, the segment size sent
+  // or received with UDP_SEGMENT or UDP_GRO
+  std::vector<uint8_t> m_controls;
+  // a run's header and how many datagrams it sends, for Send with
+  // segment set
+  std::vector<mmsghdr> m_runs;
+  std::vector<size_t> m_run_lengths;
+  // whether the last Receive was coalesced and its datagrams are in
+  // m_segments rather than one per buffer
+  bool m_coalesced;
+  std::vector<Segment> m_segments;
+};
+
+} // namespace Hev
@@ -0,0 +1,126 @@
+// bufferpool.h
+// A pool of packet buffers so that receiving, rebuilding and
+// handing payloads to the user recycles memory rather than
+// going through malloc and free for every datagram
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "packet.h"
+
+namespace Hev {
+
+class BufferPool {
+public:
+  // sizes buffers are rounded up to, anything bigger isn't pooled
+  static constexpr size_t SIZE_CLASSES[] = {64, 256, 1024, 2048, 16384, 65536};
+  static constexpr size_t NUM_CLASSES =
+      sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+  // default for how many free buffers of each class are kept around
+  static const size_t DEFAULT_CAPACITY = 4096;
+  // free buffers a thread keeps for itself before sharing them
+  static const size_t THREAD_CACHE_LEN = 64;
+
+  /* ClassStats
+   * usage of one size class
+   */
+  struct ClassStats {
+    size_t size;
+    // buffers currently owned by someone
+    size_t in_use;
+    // most buffers that were ever in use at once
+    size_t high_water;
+    // free buffers waiting in the shared list
+    size_t cached;
+    // acquires served from a free buffer vs from malloc
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  /* Instance
+   * the pool every socket shares. It is never destroyed so buffers
+   * can outlive anything else in the library
+   */
+  static BufferPool &Instance();
+
+  /* Acquire
+   * Gets a buffer of at least length bytes. The buffer goes back to
+   * the pool when the Buffer (or a SharedBuffer made from it) is
+   * destroyed, from whichever thread that happens on.
+   * params:
+   *  length: the number of bytes needed
+   * returns:
+   *  the buffer, its contents are undefined
+   */
+  Buffer Acquire(const size_t length);
+
+  /* Release
+   * Returns a buffer to the pool. Called by BufferDeleter, nothing
+   * else should need to.
+   * params:
+   *  data: a buffer that came from Acquire
+   */
+  void Release(uint8_t *data);
+
+  /* SetCapacity
+   * Sets how many free buffers of each size class are kept in the
+   * shared list. Anything released past that is freed.
+   * params:
+   *  buffers_per_class: free buffers to keep per size class
+   */
+  void SetCapacity(const size_t buffers_per_class);
+
+  /* Stats
+   * returns: the usage of every size class
+   */
+  std::vector<ClassStats> Stats() const;
+
+private:
+  BufferPool();
+
+  /* BlockHeader
+   * lives right in front of the data handed out so a released
+   * buffer knows which size class it belongs to
+   */
+  struct alignas(16) BlockHeader {
+    uint32_t size_class;
+  };
+
+  /* ThreadCache
+   * free buffers only the owning thread touches. Handed back to
+   * the shared lists when the thread exits
+   */
+  struct ThreadCache {
+    std::vector<uint8_t *> free[NUM_CLASSES];
+    ~ThreadCache();
+  };
+
+  /* SizeClass
+   * the shared free list and counters for a single size class
+   */
+  struct SizeClass {
+    mutable std::mutex mutex;
+    std::vector<uint8_t *> free;
+    std::atomic<size_t> in_use{0};
+    std::atomic<size_t> high_water{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+  };
+
+  static ThreadCache &LocalCache();
+  uint8_t *Allocate(const size_t size_class);
+  void Free(uint8_t *data);
+  /* Refill: moves up to half a thread cache worth from the shared list */
+  void Refill(ThreadCache &cache, const size_t size_class);
+  /* Spill: moves half the thread cache back to the shared list */
+  void Spill(ThreadCache &cache, const size_t size_class);
+
+private:
+  SizeClass m_classes[NUM_CLASSES];
+  std::atomic<size_t> m_capacity;
+};
+
+} // namespace Hev
@@ -0,0 +1,182 @@
+// congestion.h
+// Decides how much a connection can have in flight and how fast it
+// sends so that it doesn't fill up the queues along the path
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+namespace Hev {
+
+/* CongestionController
+ * Keeps the congestion window of one connection from the acks and
+ * losses it sees. Implementations only need to be safe to call from
+ * one thread at a time, the connection serializes the calls
+ */
+class CongestionController {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Micros = std::chrono::microseconds;
+
+  // bytes one full packet is assumed to be when growing the window
+  static constexpr size_t SEGMENT = 1200;
+  static constexpr size_t INITIAL_WINDOW = 10 * SEGMENT;
+  static constexpr size_t MIN_WINDOW = 2 * SEGMENT;
+
+  /* Stats
+   * the state of a connection's congestion control
+   */
+  struct Stats {
+    // bytes that can be in flight and that are right now
+    size_t window;
+    size_t in_flight;
+    // bytes per second the sends are spread out to, 0 if not paced
+    uint64_t pacing_rate;
+    // smoothed round trip, the lowest one seen and how much the
+    // newest one is above it, which is how long packets sit in queues
+    Micros srtt;
+    Micros min_rtt;
+    Micros queue_delay;
+    // times the window was cut for a lost packet or a timeout
+    uint64_t losses;
+    uint64_t timeouts;
+
+    /* Merge: adds up the stats of another connection */
+    void Merge(const Stats &other);
+  };
+
+  virtual ~CongestionController() = default;
+
+  /* OnAck
+   * params:
+   *  bytes: how many bytes were just acknowledged
+   *  rtt: the round trip the ack measured, zero if it didn't
+   *  now: when the ack arrived
+   */
+  virtual void OnAck(const size_t bytes, const Micros rtt,
+                     const Clock::time_point now) = 0;
+
+  /* OnLoss
+   * params:
+   *  timeout: true if a retransmission timeout passed rather than the
+   *    peer acknowledging packets sent after a missing one
+   *  srtt: the smoothed round trip
+   *  now: the current time
+   */
+  virtual void OnLoss(const bool timeout, const Micros srtt,
+                      const Clock::time_point now) = 0;
+
+  /* Window
+   * returns: the bytes that can be in flight
+   */
+  virtual size_t Window() const = 0;
+
+  /* PacingGain
+   * returns: how much faster than a window per round trip to send
+   */
+  virtual double PacingGain() const { return 1.25; }
+};
+
+/* CongestionFactory
+ * makes the controller for each new connection
+ */
+using CongestionFactory =
+    std::function<std::unique_ptr<CongestionController>()>;
+
+/* NewRenoController
+ * Loss based AIMD. The window doubles every round trip until the first
+ * loss, then grows by a segment per round trip and is halved on loss.
+ * A timeout starts over from the smallest window
+ */
+class NewRenoController : public CongestionController {
+public:
+  NewRenoController();
+
+  void OnAck(const size_t bytes, const Micros rtt,
+             const Clock::time_point now) override;
+  void OnLoss(const bool timeout, const Micros srtt,
+              const Clock::time_point now) override;
+  size_t Window() const override { return m_window; }
+  double PacingGain() const override;
+
+private:
+  size_t m_window;
+  size_t m_ssthresh;
+  // losses before this are part of the one the window was cut for
+  Clock::time_point m_recovery_end;
+};
+
+/* DelayController
+ * Delay based, in the style of LEDBAT. Keeps the round trip within
+ * TARGET of the lowest one seen, growing the window while there is
+ * less queueing than that and shrinking it while there is more, so it
+ * backs off before the queues overflow. Losses still halve the window
+ */
+class DelayController : public CongestionController {
+public:
+  static constexpr Micros TARGET{25000};
+  // how fast the window moves towards the target per round trip
+  static constexpr double GAIN = 1.0;
+
+  DelayController();
+
+  void OnAck(const size_t bytes, const Micros rtt,
+             const Clock::time_point now) override;
+  void OnLoss(const bool timeout, const Micros srtt,
+              const Clock::time_point now) override;
+  size_t Window() const override { return m_window; }
+
+private:
+  size_t m_window;
+  Micros m_base_rtt;
+  Micros m_queue_delay;
+  Clock::time_point m_recovery_end;
+};
+
+/* Pacer
+ * A token bucket that spreads the sends of a connection over time
+ * instead of putting a whole window on the wire at once. Tokens are
+ * bytes that build up at the pacing rate. A packet can go while there
+ * are any tokens left and may take the bucket into debt, which keeps
+ * packets bigger than the bucket from waiting forever
+ */
+class Pacer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // how much sending the bucket lets build up, in time at the rate
+  static constexpr std::chrono::milliseconds BURST{10};
+  static constexpr size_t MIN_BURST = 2 * CongestionController::SEGMENT;
+
+  Pacer();
+
+  /* SetRate
+   * safe to call from any thread
+   * params:
+   *  rate: bytes per second, 0 doesn't pace at all
+   */
+  void SetRate(const uint64_t rate) { m_rate.store(rate); }
+  uint64_t Rate() const { return m_rate.load(); }
+
+  /* TryTake
+   * Only the sender calls this
+   * params:
+   *  bytes: the size of the packet to send
+   *  now: the current time
+   *  next: out - when to try again if the packet can't go yet
+   * returns:
+   *  true if the packet can be sent now
+   */
+  bool TryTake(const size_t bytes, const Clock::time_point now,
+               Clock::time_point *next);
+
+private:
+  std::atomic<uint64_t> m_rate;
+  double m_tokens;
+  Clock::time_point m_last;
+};
+
+} // namespace Hev
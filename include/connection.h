@@ -0,0 +1,608 @@
+// connection.h
+// State that a TBD socket keeps for every peer it is
+// talking to. A socket in server mode holds many of these
+// in a table keyed by the peer's address
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <queue>
+#include <set>
+#include <vector>
+
+#include "congestion.h"
+#include "metrics.h"
+#include "packet.h"
+#include "reassembly.h"
+#include "reorder.h"
+#include "timerwheel.h"
+
+namespace Hev {
+
+/* PeerKey
+ * an ipv4 address and port packed into a single integer so that
+ * a peer can be looked up in the connection table without comparing
+ * whole sockaddr_in structs
+ */
+using PeerKey = uint64_t;
+
+/* MakePeerKey
+ * Packs the address and port of a peer into a PeerKey
+ * params:
+ *  addr: the address of the peer
+ * returns:
+ *  the key identifying the peer
+ */
+PeerKey MakePeerKey(const sockaddr_in &addr);
+
+/* SendPacket
+ * internal struct that will be used to queue up the packets
+ * that are ready to be sent. Contains the serialized header, the
+ * payload the user handed us, the sequence number for this specific
+ * packet and the peer it is going to. The payload is shared so a
+ * retransmit sends the same memory again rather than a copy of it.
+ * The fragments of a message all share its payload, each one sending
+ * payload_len bytes from payload_offset.
+ * Unless stamp_ack is cleared the ack fields of the header are filled
+ * in, and the header serialized for the peer, right before the packet
+ * is sent. A packet that does clear it is serialized when it is queued.
+ * coalesced is only used while sending, it marks a packet that shares
+ * a datagram with the one before it. queued_at is when it last went
+ * into the send queue.
+ */
+struct SendPacket {
+  WireHeader header;
+  SharedBuffer payload;
+  size_t payload_len;
+  uint32_t sequence;
+  sockaddr_in peer;
+  size_t payload_offset = 0;
+  bool stamp_ack = true;
+  bool coalesced = false;
+  std::chrono::steady_clock::time_point queued_at = {};
+
+  SendPacket() = default;
+  SendPacket(const WireHeader &_header, SharedBuffer _payload,
+             size_t _payload_len, uint32_t _sequence, const sockaddr_in &_peer)
+      : header(_header), payload(std::move(_payload)),
+        payload_len(_payload_len), sequence(_sequence), peer(_peer) {}
+
+  /* total length of the datagram on the wire */
+  size_t Length() const { return header.length + payload_len; }
+};
+
+/* RttEstimator
+ * Keeps the smoothed round trip time and its variance the way
+ * RFC 6298 does and works out the retransmission timeout from
+ * them. Samples come from the receiver thread, everything can be
+ * read from any thread
+ */
+class RttEstimator {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Micros = std::chrono::microseconds;
+
+  static constexpr Micros INITIAL_RTO{250000};
+  static constexpr Micros MIN_RTO{50000};
+  static constexpr Micros MAX_RTO{10000000};
+
+  RttEstimator();
+
+  /* Sample
+   * feeds in the time it took for a packet to be acknowledged
+   * params:
+   *  rtt: the measured round trip
+   */
+  void Sample(const Clock::duration rtt);
+
+  Micros Srtt() const { return Micros(m_srtt.load()); }
+  Micros Rttvar() const { return Micros(m_rttvar.load()); }
+  Micros Rto() const { return Micros(m_rto.load()); }
+  // the newest sample and the lowest one ever
+  Micros Latest() const { return Micros(m_latest.load()); }
+  Micros Min() const { return Micros(m_min.load()); }
+  // smoothed difference between one sample and the next (RFC 3550)
+  Micros Jitter() const { return Micros(m_jitter.load()); }
+
+private:
+  // all in microseconds
+  std::atomic<int64_t> m_srtt;
+  std::atomic<int64_t> m_rttvar;
+  std::atomic<int64_t> m_jitter;
+  std::atomic<int64_t> m_rto;
+  std::atomic<int64_t> m_latest;
+  std::atomic<int64_t> m_min;
+  std::atomic_bool m_has_sample;
+};
+
+/* RateMeter
+ * Counts bytes going one way and how many of them went in the last
+ * second. Meant for one thread to add to and any thread to read
+ * without a lock
+ */
+class RateMeter {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::chrono::seconds WINDOW{1};
+
+  RateMeter();
+
+  /* Add
+   * params:
+   *  bytes: how many bytes went by
+   *  now: when they did
+   */
+  void Add(const size_t bytes, const Clock::time_point now);
+
+  /* Rate
+   * params:
+   *  now: the current time
+   * returns: bytes per second over the last whole window
+   */
+  uint64_t Rate(const Clock::time_point now) const;
+
+  /* Total
+   * returns: every byte ever added
+   */
+  uint64_t Total() const { return m_total.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> m_total;
+  // the window being counted, in WINDOWs since the clock's epoch
+  std::atomic<int64_t> m_window;
+  std::atomic<uint64_t> m_current;
+  // what the window before m_window ended up with
+  std::atomic<uint64_t> m_previous;
+};
+
+/* ConnectionStats
+ * how well the connection to a peer is doing, for picking servers or
+ * compensating for lag
+ */
+struct ConnectionStats {
+  using Micros = std::chrono::microseconds;
+
+  // smoothed round trip and the newest and lowest ones, from ACKs and
+  // from PING/PONG when there is nothing else going on
+  Micros srtt;
+  Micros latest_rtt;
+  Micros min_rtt;
+  // how much the round trip changes from one sample to the next
+  Micros jitter;
+  // recent share of reliable packets that were lost and of sends that
+  // were retransmits, 0 to 1
+  float loss;
+  float retransmit_rate;
+  // reliable packets sent for the first time, sent again and lost
+  uint64_t packets_sent;
+  uint64_t retransmits;
+  uint64_t packets_lost;
+  // bytes of datagrams, headers included, both ways in total and over
+  // the last second
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t bytes_in_per_sec;
+  uint64_t bytes_out_per_sec;
+
+  /* Merge: adds up the stats of another connection, the round trips,
+   * jitter and loss are then the worst of the two */
+  void Merge(const ConnectionStats &other);
+};
+
+/* Connection
+ * Everything that is specific to a single peer. The sequence
+ * is shared between the game thread (Send) and the receiver
+ * thread so it is atomic and the unacked packets are behind
+ * their own lock. The receive state is only touched by the
+ * receiver thread.
+ */
+struct Connection {
+  using Clock = std::chrono::steady_clock;
+
+  // how many sequences one header can acknowledge
+  static const uint32_t ACK_WINDOW = 32;
+  // how far ahead of the oldest missing sequence a reliable packet can
+  // be, the most a sender keeps in flight
+  static const uint32_t RECEIVE_WINDOW = ReorderBuffer::DEFAULT_WINDOW;
+  // a packet counts as lost once this many sent after it are acked
+  static const uint32_t LOSS_THRESHOLD = 3;
+  // datagram size assumed to get through until a bigger one is probed,
+  // small enough for practically any path
+  static const uint32_t DEFAULT_MTU = 1200;
+
+  /* AckState
+   * the ack fields of a header, see TBHeader
+   */
+  struct AckState {
+    uint32_t ack;
+    uint32_t bits;
+  };
+
+  /* ChannelState
+   * numbering and receive state of one channel
+   */
+  struct ChannelState {
+    // the number the next message sent on the channel gets
+    std::atomic<uint32_t> next_sequence{1};
+    // newest message received on a sequenced channel, receiver only
+    uint32_t newest_received = 0;
+    // newest message received on any channel, what a COMPACT header's
+    // channel sequence is expanded around. Receiver only
+    uint32_t highest_received = 0;
+    // messages waiting on earlier ones when the channel is delivered
+    // in order. Only the receiver touches it, apart from its stats
+    ReorderBuffer reorder;
+  };
+
+  /* Inflight
+   * a reliable packet that hasn't been acknowledged yet
+   */
+  struct Inflight {
+    SendPacket packet;
+    // when it was last sent
+    Clock::time_point sent_at;
+    // when it is due to be retransmitted
+    Clock::time_point deadline;
+    uint32_t transmissions;
+    // set when newer packets were acknowledged and it is being sent
+    // again without waiting for its timeout
+    bool fast_retransmit;
+  };
+
+  Connection(const sockaddr_in &peer_addr);
+  Connection(const Connection &other) = delete;
+  ~Connection();
+
+  /* NextSequence
+   * reserves the next sequence for a packet. Sequences count
+   * packets so that an ACK can name exactly the packet it is for
+   * returns:
+   *  the sequence the packet should be sent with
+   */
+  uint32_t NextSequence();
+
+  /* Heard
+   * marks that a packet was just received from this peer
+   */
+  void Heard();
+
+  /* Track
+   * starts waiting on an ACK for a reliable packet
+   * params:
+   *  packet: the packet that is being sent
+   *  now: when it was queued
+   */
+  void Track(const SendPacket &packet, const Clock::time_point now);
+
+  /* Sent
+   * Notes that a tracked packet actually went out. Packets can wait in
+   * the send queue and the pacer for a while after being tracked, that
+   * time shouldn't count towards their round trip or timeout
+   * params:
+   *  sequence: the sequence of the packet
+   *  now: when it was sent
+   */
+  void Sent(const uint32_t sequence, const Clock::time_point now);
+
+  /* Acknowledge
+   * the peer acknowledged every packet in the ack fields of one of
+   * its headers, they are all forgotten in one pass. If the newest one
+   * was only sent once the round trip is sampled (Karn's algorithm).
+   * A packet still missing behind LOSS_THRESHOLD acknowledged ones is
+   * taken as lost, its deadline is brought forward to now and the
+   * congestion controller is told
+   * params:
+   *  state: the ack fields the peer sent
+   *  now: when the header arrived
+   * returns:
+   *  the number of packets that were waiting on an ACK
+   */
+  size_t Acknowledge(const AckState &state, const Clock::time_point now);
+
+  /* CollectExpired
+   * Finds every packet whose retransmission timeout has passed. Each
+   * one's timeout is doubled, up to MAX_RTO, before it is due again.
+   * Timeouts are a loss for the congestion controller
+   * params:
+   *  now: the current time
+   *  expired: out - the packets to retransmit are appended to it
+   */
+  void CollectExpired(const Clock::time_point now,
+                      std::vector<SendPacket> &expired);
+
+  /* NextDeadline
+   * returns: the soonest any unacked packet could need retransmitting,
+   *  max if nothing is waiting on an ACK
+   */
+  Clock::time_point NextDeadline();
+
+  /* SetCongestionControl
+   * params:
+   *  controller: the controller for the connection, null to send
+   *    without a window or pacing
+   */
+  void SetCongestionControl(std::unique_ptr<CongestionController> controller);
+
+  /* SetMetrics
+   * params:
+   *  metrics: the socket's metrics, round trips and unacked packets are
+   *    counted in them. Set before anything is sent
+   */
+  void SetMetrics(std::shared_ptr<Metrics> metrics);
+
+  /* WindowOpen
+   * params:
+   *  bytes: the size of what is about to be sent
+   * returns:
+   *  false if sending it would put more in flight than the congestion
+   *  window allows. Something can always be sent while nothing is
+   */
+  bool WindowOpen(const size_t bytes);
+
+  /* Pace
+   * Only the sender calls this
+   * params:
+   *  bytes: the size of the datagram about to go out
+   *  now: the current time
+   *  next: out - when to try again if it can't go yet
+   * returns:
+   *  true if it can be sent now
+   */
+  bool Pace(const size_t bytes, const Clock::time_point now,
+            Clock::time_point *next);
+
+  /* CongestionStats
+   * returns: the state of the congestion control
+   */
+  CongestionController::Stats CongestionStats();
+
+  /* UnackedCount
+   * returns: the number of packets waiting on an ACK
+   */
+  size_t UnackedCount();
+
+  /* UnackedSpan
+   * returns: how many sequences there are from the oldest packet still
+   *  waiting on an ACK to the next one to be sent. The peer may have to
+   *  hold everything in between to deliver it in order
+   */
+  uint32_t UnackedSpan();
+
+  /* ExpectSequence
+   * sets the first sequence the peer's data starts at. Only has an
+   * effect until the first packet is received
+   * params:
+   *  first: the first sequence the peer will send
+   */
+  void ExpectSequence(const uint32_t first);
+
+  /* InReceiveWindow
+   * whether a reliable packet is close enough to the oldest one still
+   * missing to be kept track of. The peer never has more than
+   * RECEIVE_WINDOW in flight, anything further ahead is dropped
+   * unacknowledged so the set of packets received ahead stays bounded
+   * params:
+   *  sequence: the sequence of a reliable packet
+   */
+  bool InReceiveWindow(const uint32_t sequence) const;
+
+  /* WasReceived
+   * params:
+   *  sequence: the sequence of a reliable packet
+   * returns:
+   *  true if it was already received, nothing is changed
+   */
+  bool WasReceived(const uint32_t sequence) const;
+
+  /* MarkReceived
+   * records that a reliable packet arrived so that retransmits of it
+   * can be told apart from new packets
+   * params:
+   *  sequence: the sequence of the received packet
+   * returns:
+   *  false if the packet was already received before
+   */
+  bool MarkReceived(const uint32_t sequence);
+
+  /* MarkNewest
+   * records a message received on a sequenced channel
+   * params:
+   *  channel: the channel it came on
+   *  channel_sequence: its number within the channel
+   * returns:
+   *  false if a newer message was already received, this one is stale
+   */
+  bool MarkNewest(const uint8_t channel, const uint32_t channel_sequence);
+
+  /* ExpandHeader
+   * fills in the sequences a COMPACT header only sent the low 16 bits
+   * of, from the ones closest to what was last sent and received.
+   * Receiver only
+   * params:
+   *  header: the header as it was read
+   */
+  void ExpandHeader(TBHeader &header);
+
+  /* RaiseMtu
+   * notes that a probe of some size made it to the peer
+   * params:
+   *  probed: the size of the probe
+   * returns:
+   *  true if the mtu went up
+   */
+  bool RaiseMtu(const uint32_t probed);
+
+  /* ReorderStats
+   * returns: the stats of every channel's reorder buffer added up
+   */
+  ReorderBuffer::Stats ReorderStats() const;
+
+  /* Pinged
+   * notes a PING to time the PONG against
+   * params:
+   *  sequence: the sequence the PING was sent with
+   *  now: when it was queued
+   */
+  void Pinged(const uint32_t sequence, const Clock::time_point now);
+
+  /* Ponged
+   * samples the round trip from the PONG to the last PING
+   * params:
+   *  sequence: the sequence the PONG echoed
+   *  now: when it arrived
+   */
+  void Ponged(const uint32_t sequence, const Clock::time_point now);
+
+  /* Stats
+   * gathers the quality stats, takes no lock
+   * params:
+   *  now: the current time
+   * returns: the stats
+   */
+  ConnectionStats Stats(const Clock::time_point now) const;
+
+  /* InAckWindow
+   * whether the ack fields we send still cover a received sequence
+   * params:
+   *  sequence: a sequence that was received
+   * returns:
+   *  false if it is too far behind the newest sequence received and
+   *  needs an ACK of its own
+   */
+  bool InAckWindow(const uint32_t sequence) const;
+
+  /* TakeAck
+   * gets the ack fields for a packet that is about to be sent to the
+   * peer. Since that packet acknowledges everything, any delayed ACK
+   * waiting to be sent is cancelled
+   * returns:
+   *  the ack fields to send
+   */
+  AckState TakeAck();
+
+  /* ScheduleAck
+   * asks for a standalone ACK to be sent at due unless some other
+   * packet goes to the peer first. Doesn't push back an ACK that is
+   * already scheduled
+   * params:
+   *  due: when the ACK should be sent
+   * returns:
+   *  true if half the ack window was received since the last ACK went
+   *  out, the caller should send one now before any fall out of it
+   */
+  bool ScheduleAck(const Clock::time_point due);
+
+  /* AckDue
+   * checks if the delayed ACK is due and claims it if it is
+   * params:
+   *  now: the current time
+   * returns:
+   *  true if the caller should send a standalone ACK
+   */
+  bool AckDue(const Clock::time_point now);
+
+  /* AckDeadline
+   * returns: when the delayed ACK is due, max if none is waiting
+   */
+  Clock::time_point AckDeadline() const;
+
+  /* Timer
+   * one of the connection's timers on the socket's timer wheel, at is
+   * the time it is armed for and max when it isn't armed
+   */
+  struct Timer {
+    std::mutex mutex;
+    TimerWheel::TimerId id = TimerWheel::INVALID;
+    Clock::time_point at = Clock::time_point::max();
+  };
+
+  sockaddr_in addr;
+  PeerKey key;
+
+  std::atomic<uint32_t> sequence;
+
+  RttEstimator rtt;
+
+  ChannelState channels[Channel::COUNT];
+
+  // the biggest datagram known to reach the peer without being
+  // fragmented by IP, messages are split to fit in it
+  std::atomic<uint32_t> mtu;
+
+  // the HeaderVersion the peer said it speaks in the handshake,
+  // FULL until then
+  std::atomic<uint8_t> header_version;
+
+  // messages still missing fragments, receiver only
+  Reassembler reassembly;
+
+  // last time anything was heard from the peer, used by the
+  // keepalive timer to detect dead connections
+  std::atomic<Clock::time_point> last_heard;
+
+  // goes off at the soonest retransmission deadline
+  Timer retransmit_timer;
+  // goes off when the delayed ACK is due
+  Timer ack_timer;
+  // pings the peer every keepalive interval
+  Timer keepalive_timer;
+
+  // bytes received from and sent to the peer
+  RateMeter inbound;
+  RateMeter outbound;
+
+private:
+  using Deadline = std::pair<Clock::time_point, uint32_t>;
+
+  /* UpdatePacing: works out the pacing rate from the window */
+  void UpdatePacing();
+
+  // keeps track of any sequences that aren't acked yet, oldest first.
+  // The lock covers the congestion controller too
+  std::mutex m_unacked_mutex;
+  std::map<uint32_t, Inflight> m_unacked;
+  size_t m_inflight_bytes;
+  std::unique_ptr<CongestionController> m_congestion;
+  uint64_t m_losses;
+  uint64_t m_timeouts;
+  Pacer m_pacer;
+  // packet counts for Stats, written under the lock and read without
+  std::atomic<uint64_t> m_packets_sent;
+  std::atomic<uint64_t> m_retransmits;
+  std::atomic<uint64_t> m_packets_lost;
+  // moving averages of how many packets are lost and retransmitted, in
+  // millionths
+  std::atomic<uint32_t> m_loss_ppm;
+  std::atomic<uint32_t> m_retransmit_ppm;
+  // the last PING that hasn't been answered, max once it has
+  std::atomic<uint32_t> m_ping_sequence;
+  std::atomic<Clock::time_point> m_ping_sent_at;
+  std::shared_ptr<Metrics> m_metrics;
+  // one entry per unacked packet ordered by deadline. Entries of
+  // packets that get acked are skipped once they come up
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>>
+      m_deadlines;
+
+  // every sequence below this was received, anything above it that
+  // was received is in m_received_ahead
+  uint32_t m_receive_base;
+  std::set<uint32_t> m_received_ahead;
+  bool m_receiving;
+
+  // newest sequence received and the bits behind it. Only the receiver
+  // updates them, the packed copy is what the sender reads
+  uint32_t m_highest_received;
+  uint32_t m_ack_bits;
+  std::atomic<uint64_t> m_ack_state;
+  // when a standalone ACK has to go out, max if none is waiting
+  std::atomic<Clock::time_point> m_ack_due;
+  // packets received since the ack fields were last sent
+  std::atomic<uint32_t> m_unreported;
+};
+
+} // namespace Hev
@@ -0,0 +1,192 @@
+// datagramring.h
+// A lock-free ring of whole datagrams laid out in a block of memory
+// the caller provides, so the same ring works on the heap between
+// threads and in shared memory between processes
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+
+namespace Hev {
+
+/* DatagramRing
+ * Any number of producers copy datagrams in and a single consumer
+ * copies them out. Slots carry a sequence number the way MPSCQueue's
+ * do. Nothing in it blocks: a consumer that wants to sleep marks
+ * itself waiting with Sleep and the next producer to publish is told
+ * to wake it by Wake, however the two sides arrange that
+ */
+class DatagramRing {
+public:
+  // written last by Create so a process attaching to a ring still
+  // being laid out doesn't use it
+  static constexpr uint32_t MAGIC = 0x48657652;
+
+  /* Bytes
+   * params:
+   *  capacity: the most datagrams held at once, rounded up to a power
+   *    of two
+   *  slot_len: the longest datagram it holds
+   * returns: the memory a ring of that size takes
+   */
+  static size_t Bytes(const size_t capacity, const size_t slot_len);
+
+  /* Create
+   * Lays out an empty ring
+   * params:
+   *  memory: at least Bytes(capacity, slot_len), aligned to a cache line
+   *  capacity: the most datagrams held at once
+   *  slot_len: the longest datagram it holds
+   * returns: the ring
+   */
+  static DatagramRing Create(void *memory, const size_t capacity,
+                             const size_t slot_len);
+
+  /* Attach
+   * Uses a ring another thread or process laid out with Create
+   * params:
+   *  memory: where it was created
+   *  bytes: how much of memory can be used
+   * returns: the ring, not Valid if memory doesn't hold one
+   */
+  static DatagramRing Attach(void *memory, const size_t bytes);
+
+  DatagramRing() : m_header(nullptr), m_slots(nullptr), m_stride(0) {}
+
+  const bool Valid() const { return m_header != nullptr; }
+  const size_t SlotLength() const { return m_header->slot_len; }
+
+  /* Push
+   * Claims a slot, has fill copy the datagram in and publishes it.
+   * Safe to call from any thread or process
+   * params:
+   *  length: the length of the datagram
+   *  from: who sent it
+   *  fill: called with where to copy the length bytes to
+   * returns: false if the ring is full or the datagram is longer than
+   *  a slot
+   */
+  template <class Fill>
+  bool Push(const size_t length, const sockaddr_in &from, Fill fill) {
+    if (length > m_header->slot_len)
+      return false;
+    uint64_t pos = m_header->tail.load(std::memory_order_relaxed);
+    Slot *slot = nullptr;
+    while (true) {
+      slot = SlotAt(pos);
+      const uint64_t sequence =
+          slot->sequence.load(std::memory_order_acquire);
+      const int64_t diff = (int64_t)(sequence - pos);
+      if (diff == 0) {
+        // slot is free, try to claim it
+        if (m_header->tail.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        // consumer hasn't freed this slot yet, we're full
+        return false;
+      } else {
+        pos = m_header->tail.load(std::memory_order_relaxed);
+      }
+    }
+    slot->length = length;
+    slot->from = from;
+    fill(Data(slot));
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Pop
+   * Hands the datagram at the head to consume then frees its slot.
+   * Only the consumer may call this
+   * params:
+   *  consume: called with the datagram, its length and who sent it
+   * returns: false if the ring was empty
+   */
+  template <class Consume> bool Pop(Consume consume) {
+    const uint64_t head = m_header->head.load(std::memory_order_relaxed);
+    Slot *slot = SlotAt(head);
+    if (slot->sequence.load(std::memory_order_acquire) != head + 1)
+      return false;
+    consume(Data(slot), slot->length, slot->from);
+    slot->sequence.store(head + m_header->capacity,
+                         std::memory_order_release);
+    m_header->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Empty: whether the datagram at the head is still to be published */
+  const bool Empty() const;
+
+  /* Sleep
+   * Marks the consumer as about to wait. Check Empty once more after,
+   * a datagram published in between may not be woken for
+   */
+  void Sleep();
+
+  /* Wake
+   * Called by producers after Push
+   * returns: true if the consumer was asleep and has to be woken, only
+   *  one producer is told. It wakes the consumer then calls Ring
+   */
+  const bool Wake();
+
+  /* Ring
+   * Called after waking the consumer, so the next TakeRung returns
+   * true. Only after, or the consumer could clear the wake up before
+   * it happened and be woken for nothing from then on
+   */
+  void Ring();
+
+  /* TakeRung
+   * returns: true if the consumer has been woken since it last asked,
+   *  so it knows to clear whatever woke it
+   */
+  const bool TakeRung();
+
+  /* Close
+   * Marks the ring as given up on by its consumer so producers holding
+   * on to it know to stop
+   */
+  void Close();
+  const bool Closed() const;
+
+private:
+  struct Header {
+    std::atomic<uint32_t> magic;
+    std::atomic<uint32_t> closed;
+    uint32_t capacity;
+    uint32_t slot_len;
+    // consumer and producer indices on their own cache lines
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> waiting;
+    std::atomic<uint32_t> rung;
+  };
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    uint32_t length;
+    sockaddr_in from;
+  };
+  // shared between processes these can't fall back on a lock
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+  static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+  /* Stride: the size of a slot and its datagram, in whole cache lines */
+  static size_t Stride(const size_t slot_len);
+
+  Slot *SlotAt(const uint64_t pos) const {
+    return reinterpret_cast<Slot *>(
+        m_slots + (pos & (m_header->capacity - 1)) * m_stride);
+  }
+  static uint8_t *Data(Slot *slot) {
+    return reinterpret_cast<uint8_t *>(slot) + sizeof(Slot);
+  }
+
+  Header *m_header;
+  uint8_t *m_slots;
+  size_t m_stride;
+};
+
+} // namespace Hev
@@ -7,6 +7,9 @@ namespace Net {
 #define BIND_SOCKET_ERROR 0x3003
 #define HANDSHAKE_FAIL 0x3004
 #define INVALID_PEER 0x3005
+#define ALREADY_CONNECTED 0x3006
+#define QUEUE_FULL 0x3007
+#define MESSAGE_TOO_LARGE 0x3008
 
 #define RECEIVE_ERROR 0x3100
 #define TIMEOUT 0x3101
@@ -17,6 +20,11 @@ namespace Net {
 #define RECEIVED_PACKET 0x3202
 #define RECEIVED_PING 0x3203
 #define RECEIVED_PONG 0x3204
+#define RECEIVED_DUPLICATE 0x3205
+#define RECEIVED_HELD 0x3206
+#define RECEIVED_STALE 0x3207
+#define RECEIVED_FRAGMENT 0x3208
+#define RECEIVED_PROBE 0x3209
 
 #define INVALID_PARAM 0x0001
 } // namespace Net
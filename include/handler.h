@@ -0,0 +1,89 @@
+// handler.h
+// Callbacks that received messages are handed to by their type rather
+// than being queued up for Receive
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <span>
+
+namespace Hev {
+
+/* Message
+ * what a handler is given, the payload is only valid during the call
+ */
+struct Message {
+  // the first byte of the payload
+  uint8_t type;
+  // the whole payload, type included
+  std::span<const uint8_t> payload;
+  // the peer it came from
+  sockaddr_in peer;
+  // the Channel it came on
+  uint8_t channel;
+};
+
+using Handler = std::function<void(const Message &)>;
+
+/* Dispatch
+ * where handlers are run
+ */
+enum class Dispatch : uint8_t {
+  // right on the receiver or reactor thread as the message comes in
+  INLINE,
+  // on whichever thread calls Pump, in the order they came in
+  PUMPED,
+};
+
+/* HandlerRegistry
+ * A handler for each of the 256 message types an application can put
+ * in the first byte of its payloads. Set up before the socket starts,
+ * looking a type up after that takes no lock
+ */
+class HandlerRegistry {
+public:
+  static const size_t TYPES = 256;
+
+  HandlerRegistry();
+  HandlerRegistry(const HandlerRegistry &other) = delete;
+  HandlerRegistry &operator=(HandlerRegistry &&other) = default;
+
+  /* Set
+   * params:
+   *  type: the message type to handle
+   *  handler: what to call with every message of the type, null to
+   *    leave them to Receive again
+   */
+  void Set(const uint8_t type, Handler handler);
+
+  /* Find
+   * params:
+   *  payload: a received payload
+   *  length: its length
+   * returns:
+   *  the handler for the payload's type, null if there is none
+   */
+  const Handler *Find(const uint8_t *payload, const size_t length) const;
+
+  /* Share
+   * params:
+   *  type: a message type
+   * returns:
+   *  the type's handler, kept alive even if it is replaced, for a
+   *  message that is handled later. Null if there is none
+   */
+  std::shared_ptr<const Handler> Share(const uint8_t type) const;
+
+  /* Empty
+   * returns: true if there are no handlers at all
+   */
+  bool Empty() const;
+
+private:
+  std::shared_ptr<const Handler> m_handlers[TYPES];
+  size_t m_count;
+};
+
+} // namespace Hev
@@ -0,0 +1,151 @@
+// impairment.h
+// A simulated bad network between a socket and the wire, so loss,
+// latency, jitter, duplication, reordering and slow links can be
+// reproduced on loopback
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <netinet/in.h>
+#include <random>
+#include <vector>
+
+namespace Hev {
+
+/* LinkConditions
+ * how badly one direction of the link behaves. Everything off by
+ * default
+ */
+struct LinkConditions {
+  // chance from 0 to 1 that a datagram is lost
+  double loss = 0;
+  // added to every datagram
+  std::chrono::microseconds delay{0};
+  // up to this much more is added to each datagram at random, which
+  // also reorders datagrams sent closer together than it
+  std::chrono::microseconds jitter{0};
+  // chance that a datagram arrives twice
+  double duplicate = 0;
+  // chance that a datagram skips the delay and jumps ahead of the ones
+  // still on their way. Only does anything with a delay or jitter
+  double reorder = 0;
+  // bytes per second the link carries, 0 for no limit. Datagrams queue
+  // up behind the ones still going out
+  uint64_t bandwidth = 0;
+  // bytes that can queue behind the bandwidth limit, anything past that
+  // is lost the way a full router queue drops it
+  size_t queue_limit = 64 * 1024;
+
+  /* Active: whether any of it is turned on */
+  bool Active() const;
+};
+
+/* ImpairmentConfig
+ * the conditions each way and the seed every random choice comes from,
+ * the same seed and traffic gives the same losses and delays
+ */
+struct ImpairmentConfig {
+  LinkConditions outbound;
+  LinkConditions inbound;
+  uint64_t seed = 1;
+};
+
+/* ImpairedLink
+ * One direction of the simulated link. Datagrams go in with Submit and
+ * are held until they are due, those that aren't lost come back out of
+ * Release in the order they are due. Safe to use from any thread
+ */
+class ImpairedLink {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Datagram {
+    std::vector<uint8_t> data;
+    sockaddr_in peer;
+    Clock::time_point due;
+    // breaks ties between datagrams due at once, earlier ones first
+    uint64_t order;
+  };
+
+  struct Stats {
+    uint64_t submitted;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t reordered;
+    // lost to the queue behind the bandwidth limit
+    uint64_t overflowed;
+  };
+
+  /* Constructor
+   * params:
+   *  conditions: how the link behaves
+   *  seed: where its random choices start from
+   */
+  ImpairedLink(const LinkConditions &conditions, const uint64_t seed);
+  ImpairedLink(const ImpairedLink &other) = delete;
+
+  /* Submit
+   * puts a datagram on the link
+   * params:
+   *  data: the whole datagram
+   *  peer: the address it is going to or came from
+   *  now: when it was sent or received
+   */
+  void Submit(std::vector<uint8_t> data, const sockaddr_in &peer,
+              const Clock::time_point now);
+
+  /* Release
+   * params:
+   *  now: the current time
+   *  due: out - the datagrams that are due are added to the end
+   *  max: the most to take
+   * returns: how many were added
+   */
+  size_t Release(const Clock::time_point now, std::vector<Datagram> &due,
+                 const size_t max = SIZE_MAX);
+
+  /* NextDue
+   * returns: when the next held datagram is due, max if none are held
+   */
+  Clock::time_point NextDue();
+
+  /* GetStats: what the link has done to the datagrams so far */
+  Stats GetStats();
+
+private:
+  /* Hold: queues a copy of a datagram to come out at due */
+  void Hold(std::vector<uint8_t> data, const sockaddr_in &peer,
+            const Clock::time_point due);
+
+  /* Due
+   * works out when a datagram sent now gets to the other end
+   * returns: false if it doesn't fit in the queue and is lost
+   */
+  bool Due(const size_t length, const Clock::time_point now,
+           const bool reordered, const double jitter,
+           Clock::time_point *due);
+
+  const LinkConditions m_conditions;
+  std::mutex m_mutex;
+  std::mt19937_64 m_random;
+  std::uniform_real_distribution<double> m_chance;
+  // a heap, soonest due first
+  std::vector<Datagram> m_held;
+  uint64_t m_order;
+  // when the bandwidth limit has finished sending everything so far
+  Clock::time_point m_free_at;
+  Stats m_stats;
+};
+
+/* Impairment
+ * both directions of a socket's simulated link
+ */
+struct Impairment {
+  ImpairedLink outbound;
+  ImpairedLink inbound;
+
+  Impairment(const ImpairmentConfig &config);
+};
+
+} // namespace Hev
@@ -0,0 +1,221 @@
+// localtransport.h
+// Transports for peers on the same machine that skip the kernel's
+// network stack. A datagram is copied straight into a ring the
+// receiving socket reads from, a system call is only made to wake a
+// receiver that has gone to sleep waiting
+#pragma once
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "datagramring.h"
+#include "transport.h"
+
+namespace Hev {
+
+/* RingTransport
+ * What the in-process and shared memory transports have in common: a
+ * ring the socket's datagrams arrive in and a doorbell file descriptor
+ * it sleeps on. Peers are told apart by port alone, they're all on
+ * this machine
+ */
+class RingTransport : public Transport {
+public:
+  static const size_t DEFAULT_CAPACITY = 256;
+  // the longest datagram TBD sends, anything longer is dropped like one
+  // too big for the path
+  static const size_t SLOT_LEN = 9000 - 28;
+
+  RingTransport(const RingTransport &other) = delete;
+  ~RingTransport() override;
+
+  const int Receive(DatagramBatch &batch) override;
+  const int ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                        sockaddr_in *from) override;
+  const int Send(DatagramBatch &batch, const size_t offset) override;
+  const int SendTo(const uint8_t *data, const size_t length,
+                   const sockaddr_in &peer) override;
+  const int Wait(const bool write,
+                 const std::chrono::microseconds timeout) override;
+  void Interrupt() override { RingSelf(); }
+  const int Fd() const override { return m_bell; }
+
+protected:
+  /* Outgoing
+   * a datagram being sent, either whole or one added to a batch
+   */
+  struct Outgoing {
+    const uint8_t *data;
+    const DatagramBatch *batch;
+    size_t index;
+    size_t length;
+
+    /* CopyTo: copies the length bytes of the datagram to out */
+    void CopyTo(uint8_t *out) const;
+  };
+
+  /* Constructor
+   * params:
+   *  local: the address the transport is bound to, what peers see
+   *    datagrams coming from
+   *  memory: mmapped memory the ring was created in, unmapped with it
+   *  bytes: the size of memory
+   *  bell: the doorbell, readable once the ring has been rung
+   */
+  RingTransport(const sockaddr_in &local, void *memory, const size_t bytes,
+                const int bell);
+
+  /* Deliver
+   * Puts a datagram in the ring of the peer it is going to and wakes
+   * the peer if it is asleep
+   * params:
+   *  datagram: the datagram
+   *  peer: who it is going to
+   * returns: false if there is no such peer or its ring is full, the
+   *  datagram is lost just like UDP would lose it
+   */
+  virtual bool Deliver(const Outgoing &datagram, const sockaddr_in &peer) = 0;
+
+  /* RingSelf
+   * wakes this transport's own receiver, for datagrams left in the ring
+   */
+  virtual void RingSelf() = 0;
+
+  /* ClearBell
+   * empties the doorbell once the ring says it was rung
+   */
+  virtual void ClearBell() = 0;
+
+  /* Push
+   * params:
+   *  ring: the peer's ring
+   *  datagram: what to put in it
+   * returns: whether it fit, and whether the peer has to be woken
+   */
+  bool Push(DatagramRing &ring, const Outgoing &datagram, bool *wake) const;
+
+  sockaddr_in m_local;
+  void *m_memory;
+  size_t m_bytes;
+  DatagramRing m_ring;
+  int m_bell;
+};
+
+/* LocalTransport
+ * Between sockets in the same process, like a listen server's host
+ * and the server itself. Rings are in the process's own memory and
+ * the doorbell is an eventfd. A sender looks a peer's ring up once and
+ * keeps it, the ring stays mapped until the last sender lets go of it
+ */
+class LocalTransport : public RingTransport {
+public:
+  /* Bind
+   * params:
+   *  local_addr: what peers see datagrams coming from, 127.0.0.1 if
+   *    it's 0.0.0.0
+   *  local_port: the port, only one transport in the process can have
+   *    it
+   *  capacity: the most datagrams that can wait to be received
+   * returns: the transport, null if the port is taken or the address
+   *  doesn't parse
+   */
+  static std::unique_ptr<Transport>
+  Bind(const char *local_addr, const int local_port,
+       const size_t capacity = DEFAULT_CAPACITY);
+
+  ~LocalTransport() override;
+
+  /* Peer
+   * a transport's ring mapped a second time and its doorbell, what
+   * senders deliver to. Outlives the transport for senders that still
+   * have it, they see the ring closed
+   */
+  struct Peer {
+    void *memory;
+    size_t bytes;
+    DatagramRing ring;
+    int bell;
+
+    ~Peer();
+  };
+
+private:
+  LocalTransport(const sockaddr_in &local, void *memory, const size_t bytes,
+                 const int bell, std::shared_ptr<Peer> self);
+
+  bool Deliver(const Outgoing &datagram, const sockaddr_in &peer) override;
+  void RingSelf() override;
+  void ClearBell() override;
+
+  /* Open
+   * looks up the ring of the transport bound to port, replacing a
+   * closed one
+   * returns: false if nothing is bound to the port
+   */
+  bool Open(const uint16_t port);
+  /* Wake: rings a peer's eventfd */
+  static void Wake(Peer &peer);
+
+  // this transport as its peers see it
+  std::shared_ptr<Peer> m_self;
+  std::shared_mutex m_peers_mutex;
+  std::unordered_map<uint16_t, std::shared_ptr<Peer>> m_peers;
+};
+
+/* SharedMemoryTransport
+ * Between processes on the same machine, like bots next to a server.
+ * The ring is a POSIX shared memory object named after the port that
+ * senders map in, and the doorbell is a unix datagram socket in the
+ * abstract namespace
+ */
+class SharedMemoryTransport : public RingTransport {
+public:
+  /* Bind
+   * params:
+   *  local_addr: what peers see datagrams coming from, 127.0.0.1 if
+   *    it's 0.0.0.0
+   *  local_port: the port, only one transport on the machine can have
+   *    it
+   *  capacity: the most datagrams that can wait to be received
+   * returns: the transport, null if the port is taken or the shared
+   *  memory couldn't be set up
+   */
+  static std::unique_ptr<Transport>
+  Bind(const char *local_addr, const int local_port,
+       const size_t capacity = DEFAULT_CAPACITY);
+
+  ~SharedMemoryTransport() override;
+
+private:
+  /* Peer
+   * a peer's ring mapped into this process
+   */
+  struct Peer {
+    void *memory;
+    size_t bytes;
+    DatagramRing ring;
+  };
+
+  SharedMemoryTransport(const sockaddr_in &local, void *memory,
+                        const size_t bytes, const int bell);
+
+  bool Deliver(const Outgoing &datagram, const sockaddr_in &peer) override;
+  void RingSelf() override;
+  void ClearBell() override;
+
+  /* Open
+   * maps in the ring of the peer on port, replacing a stale one
+   * returns: false if nothing is bound to the port
+   */
+  bool Open(const uint16_t port);
+  /* Wake
+   * sends a byte to the doorbell of the peer on port. A peer that is
+   * gone without closing its ring has it closed for it
+   */
+  void Wake(const uint16_t port, DatagramRing &ring) const;
+
+  std::shared_mutex m_peers_mutex;
+  std::unordered_map<uint16_t, Peer> m_peers;
+};
+
+} // namespace Hev
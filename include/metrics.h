@@ -0,0 +1,254 @@
+// metrics.h
+// Counters, gauges and latency histograms the sockets keep about what
+// they are doing, and the registry that adds them up across the
+// library so an exporter can scrape them
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Hev {
+
+/* Counter
+ * A count that only goes up. Each one has a cache line to itself so
+ * the receiver and sender threads bumping different counters don't
+ * fight over it
+ */
+class alignas(64) Counter {
+public:
+  void Add(const uint64_t n = 1) {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t Load() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> m_value{0};
+};
+
+/* Gauge
+ * A level that goes up and down, like how full a queue is
+ */
+class alignas(64) Gauge {
+public:
+  void Set(const int64_t value) {
+    m_value.store(value, std::memory_order_relaxed);
+  }
+  void Add(const int64_t n) {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+  int64_t Load() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<int64_t> m_value{0};
+};
+
+/* HistogramSnapshot
+ * A copy of a Histogram's buckets at one point in time that the
+ * percentiles are worked out from
+ */
+struct HistogramSnapshot {
+  // the bits of precision each power of two is split into, values are
+  // kept to within 1/16th (6.25%)
+  static constexpr size_t SUB_BITS = 4;
+  static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BITS;
+  static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  std::array<uint64_t, BUCKETS> counts{};
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = 0;
+  uint64_t max = 0;
+
+  /* BucketOf
+   * params:
+   *  value: a recorded value
+   * returns: the index of the bucket it is counted in
+   */
+  static size_t BucketOf(const uint64_t value);
+
+  /* BucketHigh
+   * params:
+   *  bucket: the index of a bucket
+   * returns: the highest value that is counted in it
+   */
+  static uint64_t BucketHigh(const size_t bucket);
+
+  /* Percentile
+   * params:
+   *  percentile: between 0 and 100
+   * returns:
+   *  the value that many percent of the recorded ones are at or
+   *  below, to within the precision of a bucket. 0 if nothing was
+   *  recorded
+   */
+  uint64_t Percentile(const double percentile) const;
+
+  /* Mean: the average of the recorded values, 0 if there are none */
+  double Mean() const;
+
+  /* Merge: adds in the values of another histogram */
+  void Merge(const HistogramSnapshot &other);
+};
+
+/* Histogram
+ * Counts values, like latencies in microseconds, in buckets that get
+ * wider as the values get bigger (the way HdrHistogram does) so any
+ * value from 0 to 2^64 fits while each one is kept to a few percent.
+ * Recording is a couple of relaxed atomic adds, safe from any thread
+ */
+class Histogram {
+public:
+  Histogram();
+  Histogram(const Histogram &other) = delete;
+
+  /* Record
+   * params:
+   *  value: the value to count
+   */
+  void Record(const uint64_t value);
+
+  /* Snapshot
+   * returns: a copy of the buckets. Values recorded while it is taken
+   *  may or may not be in it
+   */
+  HistogramSnapshot Snapshot() const;
+
+private:
+  std::array<std::atomic<uint64_t>, HistogramSnapshot::BUCKETS> m_counts;
+  std::atomic<uint64_t> m_sum;
+  std::atomic<uint64_t> m_min;
+  std::atomic<uint64_t> m_max;
+};
+
+/* DropReason
+ * why a received packet was thrown away or a datagram wasn't sent
+ */
+enum class DropReason : uint8_t {
+  // from an address with no connection, UNRECOGNIZED_PEER
+  UNKNOWN_PEER,
+  // cut short by the receive buffer or a header that doesn't parse
+  MALFORMED,
+  // a reliable packet we already had, its ACK was lost
+  DUPLICATE,
+  // an UNRELIABLE_SEQUENCED message older than one already delivered
+  STALE,
+  // no room to deliver it, the peer sends it again
+  NO_ROOM,
+  // the socket wouldn't take it after MAX_TRIES
+  SEND_FAILED,
+  // an ACK, control packet or retransmit the full send queue wouldn't
+  // take
+  QUEUE_OVERFLOW,
+  COUNT,
+};
+
+/* MetricsSnapshot
+ * Everything a socket, or the whole library, has counted up to one
+ * point in time. Counters never go down, gauges are levels right now
+ * and histograms are in microseconds
+ */
+struct MetricsSnapshot {
+  static constexpr size_t DROP_REASONS = size_t(DropReason::COUNT);
+
+  uint64_t datagrams_in;
+  uint64_t datagrams_out;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  // calls into the transport that moved datagrams, a system call each
+  // for UDP. datagrams_out / send_calls is how many datagrams went out
+  // per call, more than the sendmmsg batch once the kernel splits
+  // them up
+  uint64_t send_calls;
+  uint64_t receive_calls;
+  // standalone ACK packets, not the ones that ride along with data
+  uint64_t acks_in;
+  uint64_t acks_out;
+  uint64_t retransmits;
+  // peers dropped for going quiet past the timeout
+  uint64_t peer_timeouts;
+  std::array<uint64_t, DROP_REASONS> drops;
+  // packets waiting to go out and messages waiting for Receive
+  int64_t send_queue;
+  int64_t received_queue;
+  // reliable packets sent and not yet acknowledged
+  int64_t unacked_packets;
+  // round trips of acknowledged packets and PINGs
+  HistogramSnapshot rtt;
+  // from a packet being queued to it being handed to the socket,
+  // coalescing and pacing included
+  HistogramSnapshot send_delay;
+
+  /* Merge: adds up the metrics of another socket */
+  void Merge(const MetricsSnapshot &other);
+};
+
+/* Metrics
+ * The live counters of one socket
+ */
+struct Metrics {
+  Counter datagrams_in;
+  Counter datagrams_out;
+  Counter bytes_in;
+  Counter bytes_out;
+  Counter send_calls;
+  Counter receive_calls;
+  Counter acks_in;
+  Counter acks_out;
+  Counter retransmits;
+  Counter peer_timeouts;
+  Counter drops[MetricsSnapshot::DROP_REASONS];
+  Gauge send_queue;
+  Gauge received_queue;
+  Gauge unacked_packets;
+  Histogram rtt;
+  Histogram send_delay;
+
+  /* Drop
+   * params:
+   *  reason: why a packet was dropped
+   */
+  void Drop(const DropReason reason) { drops[size_t(reason)].Add(); }
+
+  /* Snapshot
+   * params:
+   *  snapshot: filled with the current values
+   */
+  void Snapshot(MetricsSnapshot *snapshot) const;
+};
+
+/* MetricsRegistry
+ * Hands every socket its Metrics and adds them all up when asked. The
+ * counters of sockets that have since closed are kept so library-wide
+ * totals never go backwards
+ */
+class MetricsRegistry {
+public:
+  /* Global: the registry the sockets register with */
+  static MetricsRegistry &Global();
+
+  /* Create
+   * returns: new metrics for a socket, counted until the last
+   *  reference to them is let go
+   */
+  std::shared_ptr<Metrics> Create();
+
+  /* Snapshot
+   * params:
+   *  snapshot: filled with the totals of every socket. Taking one
+   *    copies a few kilobytes per open socket and takes no lock any
+   *    socket waits on, so it can be scraped often
+   */
+  void Snapshot(MetricsSnapshot *snapshot);
+
+private:
+  std::mutex m_mutex;
+  std::vector<std::shared_ptr<Metrics>> m_metrics;
+  // what closed sockets counted, gauges left out
+  MetricsSnapshot m_retired{};
+};
+
+} // namespace Hev
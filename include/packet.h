@@ -1,11 +1,25 @@
 // basic structure for the packets that a TBD
 // socket will/should be receiving
 #pragma once
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 
 namespace Hev {
-using Buffer = std::unique_ptr<uint8_t[]>;
+/* BufferDeleter
+ * frees a Buffer. Buffers that came from the BufferPool go back to
+ * it, anything else was allocated with new[]. Converts from the
+ * default deleter so std::make_unique<uint8_t[]> still makes a Buffer
+ */
+struct BufferDeleter {
+  BufferDeleter(const bool _pooled = false) : pooled(_pooled) {}
+  BufferDeleter(const std::default_delete<uint8_t[]> &) : pooled(false) {}
+  void operator()(uint8_t *data) const;
+
+  bool pooled;
+};
+
+using Buffer = std::unique_ptr<uint8_t[], BufferDeleter>;
 using SharedBuffer = std::shared_ptr<uint8_t[]>;
 
 struct PacketType {
@@ -15,19 +29,172 @@ struct PacketType {
   static const uint16_t PING = 0x04;
   static const uint16_t PONG = 0x08;
   static const uint16_t MSG = 0x10;
+  // path MTU discovery, a probe is padded to the size being tested
+  // and carries that size in its sequence
+  static const uint16_t PROBE = 0x20;
+  static const uint16_t PROBE_ACK = 0x40;
 };
 
+/* Channel
+ * how a message is delivered. Reliable messages share the sequence
+ * that gets acknowledged, on top of that every channel numbers its
+ * own messages so one channel never waits on another
+ */
+struct Channel {
+  // may be lost, duplicated or arrive in any order
+  static const uint8_t UNRELIABLE = 0;
+  // may be lost, anything older than the newest one received is dropped
+  static const uint8_t UNRELIABLE_SEQUENCED = 1;
+  // retransmitted until acknowledged, delivered as it arrives
+  static const uint8_t RELIABLE = 2;
+  // retransmitted until acknowledged, delivered in the order it was sent
+  static const uint8_t RELIABLE_ORDERED = 3;
+  static const uint8_t COUNT = 4;
+
+  static bool IsReliable(const uint8_t channel) {
+    return channel == RELIABLE || channel == RELIABLE_ORDERED;
+  }
+};
+
+/* TBHeader
+ * Every packet also acknowledges what the sender has received so far.
+ * ack is the newest sequence received and bit i of ack_bits is set
+ * when sequence ack - i was received, so one header acknowledges up
+ * to 32 packets. No bits set means nothing is acknowledged.
+ * sequence is only used by reliable packets, channel_sequence numbers
+ * the messages of the channel the packet is on. A message too big for
+ * one datagram is split into fragment_count packets that all share its
+ * channel_sequence, each with its own sequence so a lost fragment is
+ * resent on its own
+ */
 struct TBHeader {
   uint16_t type;
+  uint8_t channel;
   uint32_t sequence;
   uint32_t length;
+  uint32_t ack;
+  uint32_t ack_bits;
+  uint32_t channel_sequence;
+  uint16_t fragment_index;
+  uint16_t fragment_count;
 };
 
+/* HeaderVersion
+ * How a header is laid out on the wire. FULL is every field of TBHeader
+ * at a fixed offset in network byte order, WireHeader::FULL_LEN bytes.
+ * COMPACT starts with a flags byte that has its top bit set (a FULL
+ * header always starts with 0), only carries the fields the packet
+ * needs, shortens sequences to their low 16 bits and leaves the length
+ * out of the last packet in a datagram. Peers say in the handshake
+ * which versions they speak, see TBD::Connect. Every peer since acks
+ * and channels were added speaks FULL. The 12 byte header from before
+ * them isn't understood, its length sits where FULL's does but would
+ * run past the end of the datagram so it is dropped as malformed
+ */
+struct HeaderVersion {
+  static const uint8_t FULL = 0;
+  static const uint8_t COMPACT = 1;
+  // the newest version this build speaks
+  static const uint8_t LATEST = COMPACT;
+};
+
+/* TBPacket
+ * A received packet. A COMPACT header only has the low 16 bits of the
+ * sequence, ack and channel_sequence of a message, the connection
+ * fills in the rest (see Connection::ExpandHeader)
+ */
 struct TBPacket {
   TBHeader header;
   Buffer payload;
+  uint8_t version;
+  // bytes it took up in the datagram, header included
+  uint32_t wire_length;
 };
 
+/* WireHeader
+ * A header already serialized for the network. Kept apart from the
+ * payload it describes so that both can be handed to the kernel in one
+ * scatter-gather send without copying the payload behind the header.
+ * The fields are kept too so it can be serialized again, in another
+ * version or with new acks
+ */
+struct WireHeader {
+  // type, channel, a reserved byte, the five 32 bit fields and the two
+  // fragment fields
+  static const size_t FULL_LEN = 28;
+  static const size_t MAX_LEN = FULL_LEN;
+  TBHeader fields;
+  uint8_t version;
+  uint8_t data[MAX_LEN];
+  size_t length;
+};
+
+/* BuildHeader
+ * Serializes just the header of a packet.
+ * params:
+ *  type: the type of message being sent. Preferably should be a
+ *    PacketType value
+ *  sequence: the sequence number of the packet being sent
+ *  payload_len: the length of the payload that goes after it
+ *  ack: the newest sequence received from the peer
+ *  ack_bits: which of the sequences up to ack were received
+ *  channel: the Channel the packet is on
+ *  channel_sequence: the number of the message within its channel
+ *  fragment_index: which fragment of the message the packet holds
+ *  fragment_count: how many fragments the message was split into
+ * return:
+ *  the serialized header
+ */
+WireHeader BuildHeader(uint32_t type, uint32_t sequence, uint32_t payload_len,
+                       uint32_t ack = 0, uint32_t ack_bits = 0,
+                       uint8_t channel = Channel::RELIABLE,
+                       uint32_t channel_sequence = 0,
+                       uint16_t fragment_index = 0,
+                       uint16_t fragment_count = 1);
+
+/* StampAck
+ * Overwrites the ack fields of a header and serializes it again, with
+ * its length. Lets a packet that was built earlier, or is being
+ * retransmitted, carry the acks that are current when it actually goes
+ * out
+ * params:
+ *  header: the header to update
+ *  ack: the newest sequence received from the peer
+ *  ack_bits: which of the sequences up to ack were received
+ *  version: the HeaderVersion the peer gets
+ */
+void StampAck(WireHeader &header, uint32_t ack, uint32_t ack_bits,
+              uint8_t version);
+
+/* EncodeHeader
+ * Serializes a header again from its fields. Packets whose type has no
+ * COMPACT form stay FULL
+ * params:
+ *  header: the header to serialize
+ *  version: the HeaderVersion to use
+ *  with_length: false leaves the length out of a COMPACT header, only
+ *    for the last packet in a datagram
+ */
+void EncodeHeader(WireHeader &header, uint8_t version, bool with_length);
+
+/* MaxHeaderLength
+ * params:
+ *  version: a HeaderVersion
+ * returns:
+ *  the most bytes a header can take up in that version
+ */
+size_t MaxHeaderLength(uint8_t version);
+
+/* ExpandSequence
+ * Recovers a sequence that was cut down to its low 16 bits
+ * params:
+ *  low: the low 16 bits that were sent
+ *  reference: a sequence known to be close to the one that was sent
+ * returns:
+ *  the sequence with those low bits nearest to reference
+ */
+uint32_t ExpandSequence(uint16_t low, uint32_t reference);
+
 /* BuildPacket
  * Builds the packet from the given data. Serializes all the data
  * to have it ready to send to the network router.
@@ -46,15 +213,18 @@ std::pair<Buffer, size_t> BuildPacket(uint32_t type, uint32_t sequence,
 
 /* RebuildPacket
  * Takes in a serialized packet and deserializes it so that the user
- * can inspect all of the elements of the packet. This relies on the fact
- * that the buffer is a TBPacket, if it is not behavior of this function
- * is undefined
+ * can inspect all of the elements of the packet. Reads it out of a
+ * buffer it doesn't own, such as a receive buffer that gets reused for
+ * the next datagram. Either header version is understood, the length
+ * in the header is checked against the length of the buffer
  * params:
- *  buffer: the serialized packet *Note* it takes ownership so use of buffer
- *    after this is undefined
- *  returns:
- *    the rebuilt packet containing all  the information ready for the
- *    host to inspect.
+ *  buffer: the serialized packet
+ *  buffer_len: how many bytes of buffer were received
+ *  packet: out - the rebuilt packet
+ * returns:
+ *  how many bytes of buffer the packet took up, 0 if the buffer doesn't
+ *  hold a whole packet, packet is then undefined
  */
-TBPacket RebuildPacket(Buffer buffer);
+size_t RebuildPacket(const uint8_t *buffer, const size_t buffer_len,
+                     TBPacket *packet);
 } // namespace Hev
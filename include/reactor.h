@@ -0,0 +1,93 @@
+// reactor.h
+// An epoll based event loop that many sockets can share.
+// A handful of I/O threads wait on every registered file
+// descriptor and run its callback whenever it becomes ready,
+// so sockets don't each need their own set of polling threads
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Hev {
+
+class Reactor {
+public:
+  using Callback = std::function<void()>;
+
+  /* Constructor
+   * Creates the epoll instance and starts the I/O threads
+   * params:
+   *  io_threads: the number of threads running callbacks
+   *  cpu: the core to keep the I/O threads on, -1 to let them run
+   *    anywhere. Ignored if the core doesn't exist
+   */
+  Reactor(const size_t io_threads = 1, const int cpu = -1);
+  Reactor(const Reactor &other) = delete;
+  /* Destructor
+   * Stops and joins the I/O threads. Everything registered should
+   * be removed before the reactor is destroyed
+   */
+  ~Reactor();
+
+  /* Add
+   * Starts watching a file descriptor. on_ready is called from one
+   * of the I/O threads whenever fd is readable. A callback is never
+   * run by two threads at once, the fd is only rearmed after the
+   * callback returns
+   * params:
+   *  fd: the file descriptor to watch
+   *  on_ready: called when fd is readable
+   * returns: 0 on success, INVALID_PARAM if fd can't be watched
+   */
+  const int Add(const int fd, Callback on_ready);
+
+  /* Remove
+   * Stops watching a file descriptor. Blocks until a running callback
+   * for fd finishes so it is safe to destroy whatever it references
+   * once this returns. Called from fd's own callback it returns right
+   * away and the callback isn't run again, fd can then be added back
+   * before the callback returns
+   * params:
+   *  fd: the file descriptor to stop watching
+   * returns: 0 on success, INVALID_PARAM if fd wasn't being watched
+   */
+  const int Remove(const int fd);
+
+private:
+  /* Handler
+   * a registered fd, running is held while the callback executes
+   */
+  struct Handler {
+    int fd;
+    Callback on_ready;
+    std::mutex running;
+    bool active;
+    // the thread running the callback, so it can remove itself
+    std::atomic<std::thread::id> runner;
+  };
+
+  /* Run
+   * body of the I/O threads. Waits on epoll with no timeout and
+   * dispatches to the handlers until the reactor is stopped
+   */
+  void Run();
+
+private:
+  int m_epoll;
+  // written to once to wake every I/O thread on shutdown
+  int m_stop_fd;
+
+  std::mutex m_mut;
+  std::unordered_map<int, std::shared_ptr<Handler>> m_handlers;
+
+  std::vector<std::thread> m_threads;
+
+  static const int MAX_EVENTS = 64;
+};
+
+} // namespace Hev
@@ -0,0 +1,105 @@
+// reassembly.h
+// Puts messages that were too big for a single datagram back
+// together from their fragments
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "packet.h"
+
+namespace Hev {
+
+class Reassembler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // bytes of unfinished messages held before new ones are turned away
+  static const size_t DEFAULT_BUDGET = 4 << 20;
+  // most fragments a single message can be split into
+  static const uint16_t MAX_FRAGMENTS = 256;
+  // how long an unreliable message waits on a fragment that may never
+  // come. Reliable ones are always finished by retransmits
+  static constexpr std::chrono::seconds UNRELIABLE_TIMEOUT{5};
+
+  /* Fragment
+   * one piece of a message as it came off the wire
+   */
+  struct Fragment {
+    uint8_t channel;
+    uint32_t channel_sequence;
+    uint16_t index;
+    uint16_t count;
+    Buffer payload;
+    size_t length;
+  };
+
+  /* Constructor
+   * params:
+   *  budget: the most bytes held across unfinished messages
+   */
+  Reassembler(const size_t budget = DEFAULT_BUDGET);
+  Reassembler(const Reassembler &other) = delete;
+
+  /* Accepts
+   * Checks if a fragment can be taken. Fragments of messages already
+   * being put together always can, a new message can only be started
+   * while there is budget left
+   * params:
+   *  channel: the channel the fragment came on
+   *  channel_sequence: the message it belongs to
+   *  count: how many fragments the message has
+   * returns:
+   *  false if the fragment should be dropped, a reliable one is then
+   *  left unacknowledged so it is sent again later
+   */
+  bool Accepts(const uint8_t channel, const uint32_t channel_sequence,
+               const uint16_t count) const;
+
+  /* Insert
+   * Adds a fragment. Once every fragment of its message is in, they
+   * are copied into a single pooled buffer in order
+   * params:
+   *  fragment: the fragment, its payload is owned by the reassembler
+   *  now: when it arrived
+   *  message: out - the whole message once it is complete
+   *  message_len: out - the length of the message
+   * returns:
+   *  true if the message is complete
+   */
+  bool Insert(Fragment fragment, const Clock::time_point now, Buffer *message,
+              size_t *message_len);
+
+  /* Held
+   * returns: the bytes held in unfinished messages
+   */
+  size_t Held() const { return m_held; }
+
+private:
+  /* Partial
+   * a message that is still missing fragments
+   */
+  struct Partial {
+    std::vector<Buffer> fragments;
+    std::vector<size_t> lengths;
+    uint16_t received;
+    size_t bytes;
+    Clock::time_point started;
+  };
+
+  static uint64_t Key(const uint8_t channel, const uint32_t channel_sequence) {
+    return (static_cast<uint64_t>(channel) << 32) | channel_sequence;
+  }
+
+  /* Expire: drops unreliable messages that have waited too long */
+  void Expire(const Clock::time_point now);
+
+private:
+  size_t m_budget;
+  size_t m_held;
+  std::unordered_map<uint64_t, Partial> m_partials;
+};
+
+} // namespace Hev
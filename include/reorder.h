@@ -0,0 +1,152 @@
+// reorder.h
+// Holds payloads that arrived ahead of a gap so that a connection
+// can hand them to the user in the order they were sent
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "packet.h"
+
+namespace Hev {
+
+class ReorderBuffer {
+public:
+  using Clock = std::chrono::steady_clock;
+  using Micros = std::chrono::microseconds;
+
+  // how far ahead of the next expected sequence a payload can be held
+  static const size_t DEFAULT_WINDOW = 1024;
+
+  /* Stats
+   * how much reordering a connection has had to absorb
+   */
+  struct Stats {
+    // payloads handed over in order
+    uint64_t delivered;
+    // payloads that arrived early and had to wait
+    uint64_t reordered;
+    // payloads waiting right now and the most that ever waited at once
+    size_t depth;
+    size_t max_depth;
+    // times delivery stopped behind a missing sequence and how long
+    // it stayed stopped in total and at most
+    uint64_t stalls;
+    Micros stall_time;
+    Micros max_stall;
+
+    /* Merge: adds up the stats of another buffer */
+    void Merge(const Stats &other);
+  };
+
+  /* Ready
+   * a payload that can be handed to the user
+   */
+  struct Ready {
+    Buffer payload;
+    size_t length;
+  };
+
+  /* Constructor
+   * params:
+   *  window: the most sequences ahead of the next one that are held.
+   *    Memory for them is only allocated once something arrives early
+   */
+  ReorderBuffer(const size_t window = DEFAULT_WINDOW);
+  ReorderBuffer(const ReorderBuffer &other) = delete;
+
+  /* Reset
+   * forgets anything held and starts over
+   * params:
+   *  next: the first sequence to deliver
+   */
+  void Reset(const uint32_t next);
+
+  /* Fits
+   * params:
+   *  sequence: the sequence of a payload that arrived
+   * returns:
+   *  false if the sequence is too far ahead to be held
+   */
+  bool Fits(const uint32_t sequence) const;
+
+  /* Deliverable
+   * The common case, the payload is the next one and nothing is
+   * waiting. It is counted as delivered and can be handed over
+   * without going through the buffer
+   * params:
+   *  sequence: the sequence of a payload that just arrived
+   * returns:
+   *  false if the payload has to be inserted instead
+   */
+  bool Deliverable(const uint32_t sequence);
+
+  /* Insert
+   * Takes a payload that has to be delivered in order. The caller
+   * makes sure it fits and isn't a duplicate
+   * params:
+   *  sequence: the sequence it was sent with
+   *  payload: the payload, owned by the buffer after
+   *  length: the length of the payload
+   *  now: when it arrived
+   */
+  void Insert(const uint32_t sequence, Buffer payload, const size_t length,
+              const Clock::time_point now);
+
+  /* Pop
+   * Takes the next payload if it has arrived
+   * params:
+   *  ready: out - the payload to deliver
+   *  now: the current time
+   * returns:
+   *  false if delivery is waiting on a sequence that hasn't arrived
+   */
+  bool Pop(Ready &ready, const Clock::time_point now);
+
+  /* Held
+   * returns: how many payloads are waiting
+   */
+  size_t Held() const { return m_held.load(); }
+
+  /* GetStats
+   * safe to call from any thread
+   * returns: the stats of the buffer
+   */
+  Stats GetStats() const;
+
+private:
+  /* Slot
+   * a sequence that arrived early
+   */
+  struct Slot {
+    Buffer payload;
+    size_t length;
+    bool filled;
+  };
+
+  Slot &SlotFor(const uint32_t sequence) {
+    return m_slots[sequence % m_window];
+  }
+
+private:
+  size_t m_window;
+  std::vector<Slot> m_slots;
+  // the sequence to deliver next, everything before it was delivered
+  uint32_t m_next;
+  // set while delivery is stopped behind m_next
+  bool m_stalled;
+  Clock::time_point m_stalled_since;
+
+  // readable from other threads
+  std::atomic<size_t> m_held;
+  std::atomic<size_t> m_max_held;
+  std::atomic<uint64_t> m_delivered;
+  std::atomic<uint64_t> m_reordered;
+  std::atomic<uint64_t> m_stalls;
+  std::atomic<int64_t> m_stall_time;
+  std::atomic<int64_t> m_max_stall;
+};
+
+} // namespace Hev
@@ -0,0 +1,471 @@
+// ringqueue.h
+// Bounded lock-free queues built on ring buffers. Producers and
+// the consumer never take a lock, the consumer only sleeps on a
+// futex when the queue is empty and producers only make a
+// system call when they know the consumer is asleep
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <linux/futex.h>
+#include <memory>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Hev {
+
+/* QueueWaiter
+ * Lets the consumer of a lock-free queue sleep until a producer
+ * adds something. The epoch is bumped and the futex woken only
+ * when someone is actually waiting on it
+ */
+class QueueWaiter {
+public:
+  /* notify
+   * wakes any waiting consumer. Called by producers after they publish
+   */
+  void notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiters.load(std::memory_order_relaxed) == 0)
+      return;
+    m_epoch.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_epoch),
+            FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+  /* wait_for
+   * Sleeps until ready returns true or ms runs out.
+   * param:
+   *  ms: longest time to wait, negative waits forever
+   *  ready: checked before going to sleep and after every wake up
+   * returns:
+   *  the last result of ready
+   */
+  template <class Pred> bool wait_for(std::chrono::milliseconds ms, Pred ready) {
+    using Clock = std::chrono::steady_clock;
+    const auto deadline = Clock::now() + ms;
+    while (true) {
+      uint32_t epoch = m_epoch.load(std::memory_order_acquire);
+      m_waiters.fetch_add(1, std::memory_order_seq_cst);
+      if (ready()) {
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+      timespec timeout = {};
+      timespec *timeout_ptr = nullptr;
+      if (ms.count() >= 0) {
+        auto left = deadline - Clock::now();
+        if (left <= Clock::duration::zero()) {
+          m_waiters.fetch_sub(1, std::memory_order_relaxed);
+          return false;
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left);
+        timeout.tv_sec = ns.count() / 1000000000;
+        timeout.tv_nsec = ns.count() % 1000000000;
+        timeout_ptr = &timeout;
+      }
+      // only sleeps if nobody published since we read the epoch
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_epoch),
+              FUTEX_WAIT_PRIVATE, epoch, timeout_ptr, nullptr, 0);
+      m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  std::atomic<uint32_t> m_epoch{0};
+  std::atomic<uint32_t> m_waiters{0};
+};
+
+/* RoundUpCapacity
+ * ring buffers index with a mask so their size is a power of two
+ */
+inline size_t RoundUpCapacity(size_t capacity) {
+  size_t rounded = 2;
+  while (rounded < capacity)
+    rounded <<= 1;
+  return rounded;
+}
+
+/* Single producer single consumer queue
+ * A ring buffer where one thread pushes and one thread pops.
+ * Has the same waiting semantics as TSQueue. push fails rather
+ * than blocking when the queue is full
+ */
+template <class T> class SPSCQueue {
+public:
+  static const size_t DEFAULT_CAPACITY = 8192;
+
+  explicit SPSCQueue(const size_t capacity = DEFAULT_CAPACITY)
+      : m_capacity(RoundUpCapacity(capacity)),
+        m_slots(std::make_unique<T[]>(m_capacity)) {}
+  SPSCQueue(const SPSCQueue &other) = delete;
+
+  /* move assignment
+   * takes over the other queue. Neither queue may be in use by
+   * another thread while this happens
+   */
+  SPSCQueue &operator=(SPSCQueue &&other) {
+    if (this == &other)
+      return *this;
+    m_capacity = other.m_capacity;
+    m_slots = std::move(other.m_slots);
+    m_head.store(other.m_head.load());
+    m_tail.store(other.m_tail.load());
+    m_stopped.store(other.m_stopped.load());
+    other.m_capacity = 2;
+    other.m_slots = std::make_unique<T[]>(other.m_capacity);
+    other.m_head = 0;
+    other.m_tail = 0;
+    return *this;
+  }
+
+  /* push
+   * adds an element to the queue and wakes the consumer if it
+   * is waiting
+   * returns: false if the queue is full, value is left untouched
+   */
+  bool push(T &&value) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) >= m_capacity)
+      return false;
+    m_slots[tail & (m_capacity - 1)] = std::move(value);
+    m_tail.store(tail + 1, std::memory_order_release);
+    m_waiter.notify();
+    return true;
+  }
+
+  /* emplace
+   * constructs the element then pushes it
+   */
+  template <class... Args> bool emplace(Args &&...args) {
+    return push(T(std::forward<Args>(args)...));
+  }
+
+  /* try_pop
+   * pops the first element without waiting
+   * returns: false if the queue was empty
+   */
+  bool try_pop(T *item) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
+    T &slot = m_slots[head & (m_capacity - 1)];
+    *item = std::move(slot);
+    // don't hold on to whatever the element owns
+    slot = T();
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* pop_wait
+   * waits until an item is in the queue to pop it
+   * returns: false if the queue was released, item is then undefined
+   */
+  bool pop_wait(T *item) {
+    return pop_wait_till(std::chrono::milliseconds(-1), item);
+  }
+
+  /* pop_wait_till
+   * waits up to ms for an item to be in the queue to pop it
+   * returns: true if an item was retrieved, false otherwise and item
+   *  is undefined
+   */
+  bool pop_wait_till(std::chrono::milliseconds ms, T *item) {
+    if (!item)
+      return false;
+    if (try_pop(item))
+      return true;
+    m_waiter.wait_for(ms, [this]() { return m_stopped || !empty(); });
+    return !m_stopped && try_pop(item);
+  }
+
+  /* pop_many_wait_till
+   * same as pop_wait_till but takes out up to max items
+   * returns: the number of items retrieved
+   */
+  size_t pop_many_wait_till(std::chrono::milliseconds ms, std::vector<T> &items,
+                            const size_t max) {
+    if (empty())
+      m_waiter.wait_for(ms, [this]() { return m_stopped || !empty(); });
+    size_t count = 0;
+    T item;
+    while (count < max && try_pop(&item)) {
+      items.push_back(std::move(item));
+      count++;
+    }
+    return count;
+  }
+
+  bool empty() const {
+    return m_head.load(std::memory_order_acquire) ==
+           m_tail.load(std::memory_order_acquire);
+  }
+
+  bool full() const { return size() >= m_capacity; }
+
+  size_t size() const {
+    const size_t head = m_head.load(std::memory_order_acquire);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t capacity() const { return m_capacity; }
+
+  /* release_all_blocks
+   * wakes the consumer and makes every wait fail from now on
+   */
+  void release_all_blocks() {
+    m_stopped = true;
+    m_waiter.notify();
+  }
+
+private:
+  size_t m_capacity;
+  std::unique_ptr<T[]> m_slots;
+  // consumer and producer indices on their own cache lines
+  alignas(64) std::atomic<size_t> m_head{0};
+  alignas(64) std::atomic<size_t> m_tail{0};
+  QueueWaiter m_waiter;
+  std::atomic_bool m_stopped{false};
+};
+
+/* Multi producer single consumer queue
+ * A ring buffer where any number of threads push and a single
+ * thread pops. Every slot carries a sequence number so producers
+ * claim slots with a compare and swap and the consumer can tell
+ * when a claimed slot has been filled in
+ */
+template <class T> class MPSCQueue {
+public:
+  static const size_t DEFAULT_CAPACITY = 8192;
+
+  explicit MPSCQueue(const size_t capacity = DEFAULT_CAPACITY) {
+    Allocate(capacity);
+  }
+  MPSCQueue(const MPSCQueue &other) = delete;
+
+  /* move assignment
+   * takes over the other queue. Neither queue may be in use by
+   * another thread while this happens
+   */
+  MPSCQueue &operator=(MPSCQueue &&other) {
+    if (this == &other)
+      return *this;
+    m_capacity = other.m_capacity;
+    m_slots = std::move(other.m_slots);
+    m_head.store(other.m_head.load());
+    m_tail.store(other.m_tail.load());
+    m_stopped.store(other.m_stopped.load());
+    other.Allocate(2);
+    return *this;
+  }
+
+  /* push
+   * adds an element to the queue and wakes the consumer if it
+   * is waiting. Safe to call from any thread
+   * returns: false if the queue is full, value is left untouched
+   */
+  bool push(T &&value) {
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    Slot *slot = nullptr;
+    while (true) {
+      slot = &m_slots[pos & (m_capacity - 1)];
+      const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff == 0) {
+        // slot is free, try to claim it
+        if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        // consumer hasn't freed this slot yet, we're full
+        return false;
+      } else {
+        pos = m_tail.load(std::memory_order_relaxed);
+      }
+    }
+    slot->value = std::move(value);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    m_waiter.notify();
+    return true;
+  }
+
+  bool push(const T &value) {
+    T copy(value);
+    return push(std::move(copy));
+  }
+
+  /* claim
+   * reserves count slots in a row for fill, so a producer can queue
+   * several elements all or nothing. The consumer stops at the first
+   * claimed slot until it's filled, every claimed slot must be filled
+   * right away. Safe to call from any thread
+   * params:
+   *  count: the slots to reserve, at most the capacity
+   *  first: out - the position of the first one
+   * returns: false if there isn't room for all of them, nothing is
+   *  reserved then
+   */
+  bool claim(const size_t count, size_t *first) {
+    if (count == 0 || count > m_capacity)
+      return false;
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    while (true) {
+      const size_t sequence = m_slots[pos & (m_capacity - 1)].sequence.load(
+          std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+      if (diff > 0) {
+        pos = m_tail.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (diff < 0)
+        return false;
+      // slots are freed in order, if the last one is free so is every
+      // one before it
+      const size_t last = pos + count - 1;
+      if (m_slots[last & (m_capacity - 1)].sequence.load(
+              std::memory_order_acquire) != last)
+        return false;
+      if (m_tail.compare_exchange_weak(pos, pos + count,
+                                       std::memory_order_relaxed))
+        break;
+    }
+    *first = pos;
+    return true;
+  }
+
+  /* fill
+   * puts an element in a slot reserved by claim and wakes the
+   * consumer if it is waiting
+   * params:
+   *  pos: the position of the slot
+   *  value: the element
+   */
+  void fill(const size_t pos, T &&value) {
+    Slot &slot = m_slots[pos & (m_capacity - 1)];
+    slot.value = std::move(value);
+    slot.sequence.store(pos + 1, std::memory_order_release);
+    m_waiter.notify();
+  }
+
+  /* emplace
+   * constructs the element then pushes it
+   */
+  template <class... Args> bool emplace(Args &&...args) {
+    return push(T(std::forward<Args>(args)...));
+  }
+
+  /* try_pop
+   * pops the first element without waiting. Only the consumer
+   * may call this
+   * returns: false if the queue was empty
+   */
+  bool try_pop(T *item) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    Slot &slot = m_slots[head & (m_capacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+      return false;
+    *item = std::move(slot.value);
+    // don't hold on to whatever the element owns
+    slot.value = T();
+    slot.sequence.store(head + m_capacity, std::memory_order_release);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* pop_wait
+   * waits until an item is in the queue to pop it
+   * returns: false if the queue was released, item is then undefined
+   */
+  bool pop_wait(T *item) {
+    return pop_wait_till(std::chrono::milliseconds(-1), item);
+  }
+
+  /* pop_wait_till
+   * waits up to ms for an item to be in the queue to pop it
+   * returns: true if an item was retrieved, false otherwise and item
+   *  is undefined
+   */
+  bool pop_wait_till(std::chrono::milliseconds ms, T *item) {
+    if (!item)
+      return false;
+    if (try_pop(item))
+      return true;
+    m_waiter.wait_for(ms, [this]() { return m_stopped || ready(); });
+    return !m_stopped && try_pop(item);
+  }
+
+  /* pop_many_wait_till
+   * same as pop_wait_till but takes out up to max items
+   * returns: the number of items retrieved
+   */
+  size_t pop_many_wait_till(std::chrono::milliseconds ms, std::vector<T> &items,
+                            const size_t max) {
+    if (!ready())
+      m_waiter.wait_for(ms, [this]() { return m_stopped || ready(); });
+    size_t count = 0;
+    T item;
+    while (count < max && try_pop(&item)) {
+      items.push_back(std::move(item));
+      count++;
+    }
+    return count;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  bool full() const { return size() >= m_capacity; }
+
+  size_t size() const {
+    const size_t head = m_head.load(std::memory_order_acquire);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t capacity() const { return m_capacity; }
+
+  /* release_all_blocks
+   * wakes the consumer and makes every wait fail from now on
+   */
+  void release_all_blocks() {
+    m_stopped = true;
+    m_waiter.notify();
+  }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  void Allocate(const size_t capacity) {
+    m_capacity = RoundUpCapacity(capacity);
+    m_slots = std::make_unique<Slot[]>(m_capacity);
+    for (size_t i = 0; i < m_capacity; i++) {
+      m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    m_head = 0;
+    m_tail = 0;
+  }
+
+  /* ready: whether the element at the head has been filled in */
+  bool ready() const {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    return m_slots[head & (m_capacity - 1)].sequence.load(
+               std::memory_order_acquire) == head + 1;
+  }
+
+private:
+  size_t m_capacity;
+  std::unique_ptr<Slot[]> m_slots;
+  alignas(64) std::atomic<size_t> m_head{0};
+  alignas(64) std::atomic<size_t> m_tail{0};
+  QueueWaiter m_waiter;
+  std::atomic_bool m_stopped{false};
+};
+
+} // namespace Hev
@@ -2,23 +2,55 @@
 #include <arpa/inet.h>
 #include <atomic>
 #include <chrono>
+#include <coroutine>
 #include <cstdint>
 #include <memory.h>
+#include <mutex>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
 
+#include "batch.h"
+#include "connection.h"
+#include "handler.h"
+#include "impairment.h"
+#include "metrics.h"
 #include "packet.h"
+#include "reactor.h"
+#include "ringqueue.h"
+#include "task.h"
+#include "timerwheel.h"
+#include "transport.h"
 #include "tsmap.h"
-#include "tsqueue.h"
 
 namespace Hev {
 class TBD {
 public:
+  static const size_t DEFAULT_MAX_PEERS = 1024;
+  static const size_t CONNECTION_BUCKETS = 1024;
+  static const size_t DEFAULT_BATCH_SIZE = 32;
+  // the kernel won't take more than UIO_MAXIOV messages per call
+  static const size_t MAX_BATCH_SIZE = 1024;
+  // how long a received packet waits for its ACK to ride on another
+  // packet before a standalone ACK is sent
+  static constexpr std::chrono::milliseconds DEFAULT_ACK_DELAY{10};
+  // longer than this and the peer starts retransmitting before it
+  // hears back
+  static constexpr std::chrono::milliseconds MAX_ACK_DELAY{40};
+  // most sequences to one peer from the oldest one waiting on an ACK.
+  // Matches the reorder window so the peer can always hold what we send
+  static const size_t MAX_INFLIGHT = ReorderBuffer::DEFAULT_WINDOW;
+  // how long a queued packet can be held back waiting for more to share
+  // its datagram. By default only what is already queued is combined
+  static constexpr std::chrono::milliseconds DEFAULT_COALESCE_DELAY{0};
+  static constexpr std::chrono::milliseconds MAX_COALESCE_DELAY{40};
+
+
   /* Copy constructor
    * we don't want to deal with two connections to the same socket
    * at least right now so I'm chosing to delete the copy constructor
@@ -39,6 +71,15 @@ public:
    * to ensure that the socket is properly initalized
    */
   static TBD Bind(const char *local_addr, const int local_port);
+  /* Bind
+   * Creates a TBD socket on a transport other than UDP, like a
+   * LocalTransport for peers in the same process or a
+   * SharedMemoryTransport for peers on the same machine. Peers have to
+   * be on the same kind of transport
+   * params:
+   *  transport: already bound, the socket takes it over
+   */
+  static TBD Bind(std::unique_ptr<Transport> transport);
   /* Await for your peer to connect to you, essentially you invite a peer
    * and await for them acknowledge your invitation
    * Listen:
@@ -64,27 +105,69 @@ public:
    * Returns: status of the connection 0 if successful, else otherwise
    */
   const int Connect(const char *peer_ip, const int peer_port);
+  /* Host:
+   * Puts the socket in server mode. Rather than waiting on a single
+   * invited peer, any peer that reaches out with Connect is accepted
+   * up to max_peers at a time. Each peer gets its own sequence and
+   * acknowledgement state which is looked up by the address packets
+   * come from, so a single bound port can serve many clients.
+   * Unblocking call, handshakes are finished by the receiver thread.
+   * params:
+   *  max_peers: the most peers that can be connected at the same time
+   * Returns: status of the call, 0 if the socket is accepting peers
+   */
+  const int Host(const size_t max_peers = DEFAULT_MAX_PEERS);
   /* Send:
    * Sends a message to the peer connected to. Unblocking call and instead
    * queues the message to be sent whenever the peer and socket are ready.
-   * Messages will not be guaranteed in order but are guaranteed to be
-   * received.
+   * If the send queue is full, or for a reliable message the oldest
+   * packet to the peer still waiting on an ACK is MAX_INFLIGHT packets
+   * back or the congestion window is full, the message isn't taken and
+   * QUEUE_FULL is returned so the caller can try again later.
+   * A message bigger than fits in one datagram to the peer is split
+   * into fragments that are put back together on the other side. Each
+   * fragment of a reliable message is acknowledged and retransmitted on
+   * its own. Messages that would take more than
+   * Reassembler::MAX_FRAGMENTS give MESSAGE_TOO_LARGE.
+   * How the message is delivered depends on the channel. Reliable
+   * messages are guaranteed to be received, RELIABLE ones in the order
+   * they arrive unless the peer called SetOrderedDelivery. Unreliable
+   * messages are never retransmitted or acknowledged.
    * Send before a connection is established is not guaranteed to be received
    * params
    *  buffer: The payload to send to the peer
    *  buffer_len: the length of the buffer to send
    *  type: type for the header of the packet. MSG by default since externally
    *    that makes the most sense but it's not restrictive.
+   *  channel: the Channel to send the message on
    * Return: integer indicating status of the send
    */
   const int Send(Buffer &buffer, const size_t buffer_len,
-                 const uint8_t type = PacketType::MSG);
+                 const uint8_t type = PacketType::MSG,
+                 const uint8_t channel = Channel::RELIABLE);
+  /* SendTo:
+   * Works just like Send but sends to a specific peer. This is how a
+   * socket in server mode talks to the peers that connected to it.
+   * params
+   *  peer: the address of the peer to send to
+   *  buffer: The payload to send to the peer
+   *  buffer_len: the length of the buffer to send
+   *  type: type for the header of the packet
+   *  channel: the Channel to send the message on
+   * Return: integer indicating status of the send, INVALID_PEER if the
+   *  peer isn't connected to this socket
+   */
+  const int SendTo(const sockaddr_in &peer, Buffer &buffer,
+                   const size_t buffer_len,
+                   const uint8_t type = PacketType::MSG,
+                   const uint8_t channel = Channel::RELIABLE);
 
   /* Receive:
    * Gets a message from the peer address. This is a blocking function
    * that won't return until a message is received. If the connection
    * has not been set up prior to this call then the call will block
-   * indefenitely.
+   * indefenitely. Received messages are handed out through a single
+   * consumer queue so only one thread should receive at a time.
    * params:
    *  buffer: uint8_t[] containing the received payload
    * returns:
@@ -100,12 +183,260 @@ public:
    * or nullptr if nothing was received.
    */
   const int Receive(Buffer *buffer, std::chrono::milliseconds ms);
+  /* Receive:
+   * Same as the above but also returns the address of the peer that sent
+   * the message. Used in server mode to tell the peers apart.
+   * params:
+   *  buffer: uint8_t[] containing the received payload
+   *  peer: out - the address of the peer the payload came from
+   */
+  const int Receive(Buffer *buffer, sockaddr_in *peer);
+  const int Receive(Buffer *buffer, sockaddr_in *peer,
+                    std::chrono::milliseconds ms);
+  /* ListenAsync:
+   * Listen for a coroutine. On a socket attached to a reactor nothing
+   * waits on the peer, the reactor runs the handshake as datagrams come
+   * in and the coroutine picks up on the executor once it's done.
+   * Otherwise the handshake blocks, the coroutine first moves to the
+   * executor to run it there, or runs it in place without one
+   * params:
+   *  peer_ip: the ip address of the peer you wish to connect to
+   *  peer_port: the port that the peer should be communicating through
+   * Returns: what Listen returns
+   */
+  Task<int> ListenAsync(std::string peer_ip, const int peer_port);
+  /* ConnectAsync:
+   * Connect for a coroutine, see ListenAsync
+   * params:
+   *  peer_ip: the ip address of the peer you wish to connect to
+   *  peer_port: the port that the peer should be communicating through
+   * Returns: what Connect returns
+   */
+  Task<int> ConnectAsync(std::string peer_ip, const int peer_port);
+  /* SendAsync:
+   * Send for a coroutine. Rather than giving back QUEUE_FULL the
+   * coroutine is suspended until the socket has made room, either by
+   * sending what was queued or by the peer acknowledging what is in
+   * flight, and the send is tried again.
+   * params
+   *  buffer: The payload to send to the peer, taken by the call
+   *  buffer_len: the length of the buffer to send
+   *  type: type for the header of the packet
+   *  channel: the Channel to send the message on
+   * Return: what Send returns, other than QUEUE_FULL
+   */
+  Task<int> SendAsync(Buffer buffer, const size_t buffer_len,
+                      const uint8_t type = PacketType::MSG,
+                      const uint8_t channel = Channel::RELIABLE);
+  /* SendToAsync:
+   * SendAsync to a specific peer, see SendTo
+   */
+  Task<int> SendToAsync(const sockaddr_in peer, Buffer buffer,
+                        const size_t buffer_len,
+                        const uint8_t type = PacketType::MSG,
+                        const uint8_t channel = Channel::RELIABLE);
+  /* ReceiveAsync:
+   * Receive for a coroutine. Suspends the coroutine rather than the
+   * thread until a message comes in or the connection is lost. Only
+   * one coroutine or thread should receive at a time.
+   * params:
+   *  buffer: out - the received payload
+   *  peer: out - the address of the peer the payload came from, can be
+   *    null
+   * returns: 0 once a message is received, SOCKET_CLOSED otherwise
+   */
+  Task<int> ReceiveAsync(Buffer *buffer, sockaddr_in *peer = nullptr);
+  /* SetHandler:
+   * Hands every message whose first byte is type to a handler instead
+   * of queuing it for Receive, the application's message type no
+   * longer has to be parsed and dispatched a second time. Where the
+   * handler runs is up to SetDispatch. Messages of types without a
+   * handler still go to Receive. Must be called before Listen, Connect
+   * or Host.
+   * params:
+   *  type: the first byte of the payloads to handle
+   *  handler: called with a view of each payload and who sent it, null
+   *    to leave the type to Receive again
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int SetHandler(const uint8_t type, Handler handler);
+  /* SetDispatch:
+   * Sets where handlers run. INLINE, the default, runs them on the
+   * receiver or reactor thread as soon as a message is complete and in
+   * order, so they should be quick and must not block. PUMPED queues
+   * the messages until Pump is called, for running them on a game or
+   * main loop thread. Must be called before Listen, Connect or Host.
+   * params:
+   *  dispatch: where to run the handlers
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int SetDispatch(const Dispatch dispatch);
+  /* Pump:
+   * Runs the handlers of the messages queued up for them when the
+   * dispatch is PUMPED, on the calling thread in the order the
+   * messages were received. Never blocks, only one thread should pump
+   * at a time.
+   * params:
+   *  max: the most messages to handle in this call
+   * Returns: the number of messages handled
+   */
+  const size_t Pump(const size_t max = SIZE_MAX);
+  /* PeerCount:
+   * Returns: the number of peers currently connected to this socket
+   */
+  const size_t PeerCount() const;
+  /* SetBatchSize:
+   * Sets how many datagrams the sender and receiver threads move
+   * through the socket per system call. Takes effect when the threads
+   * are started by Listen, Connect or Host.
+   * params:
+   *  batch_size: datagrams per recvmmsg/sendmmsg, 1 to MAX_BATCH_SIZE
+   * Returns: 0 on success, INVALID_PARAM if batch_size is out of range
+   */
+  const int SetBatchSize(const size_t batch_size);
+  /* SetAckDelay:
+   * Sets how long a received packet waits for its acknowledgement to
+   * be carried by a packet we send anyway. If nothing is sent to the
+   * peer within the delay a standalone ACK goes out. Delays are timed to
+   * the millisecond, 0 acknowledges every packet right away.
+   * params:
+   *  delay: 0 to MAX_ACK_DELAY
+   * Returns: 0 on success, INVALID_PARAM if delay is out of range
+   */
+  const int SetAckDelay(const std::chrono::milliseconds delay);
+  /* SetCoalesceDelay:
+   * Packets queued for the same peer are packed into one datagram, up
+   * to the peer's mtu, whenever they are sent together. This sets how
+   * long the first packet waits for others to be queued behind it
+   * before it is sent anyway. 0 only combines what is already queued
+   * and never holds anything back.
+   * params:
+   *  delay: 0 to MAX_COALESCE_DELAY
+   * Returns: 0 on success, INVALID_PARAM if delay is out of range
+   */
+  const int SetCoalesceDelay(const std::chrono::milliseconds delay);
+  /* SetOrderedDelivery:
+   * Makes Receive hand out every peer's RELIABLE messages in the order
+   * they were sent, just like RELIABLE_ORDERED ones. Messages that arrive
+   * ahead of a missing one wait in the connection's reorder buffer until
+   * it shows up. Messages too far ahead for the buffer are left
+   * unacknowledged so the peer sends them again later. Must be called
+   * before Listen, Connect or Host.
+   * params:
+   *  ordered: true to deliver in order, false to deliver on arrival
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int SetOrderedDelivery(const bool ordered);
+  /* SetCongestionControl:
+   * Sets the congestion control every peer gets. The controller keeps
+   * a window of how many bytes of reliable messages can wait on an ACK
+   * at once, and the sends to the peer are paced out at about a window
+   * per round trip. NewRenoController is used by default,
+   * DelayController backs off as soon as round trips start growing
+   * instead of waiting for packets to be lost. Must be called before
+   * Listen, Connect or Host.
+   * params:
+   *  factory: makes the controller for each peer, null to send as fast
+   *    as the socket allows
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int SetCongestionControl(CongestionFactory factory);
+  /* SetImpairment:
+   * Puts a simulated bad network between the socket and the wire, to
+   * reproduce loss, latency, jitter, duplication, reordering and slow
+   * links on loopback. Each way has its own conditions and every
+   * random choice comes from the seed, so the same traffic is impaired
+   * the same way every run. Must be called before Listen, Connect or
+   * Host.
+   * params:
+   *  config: the conditions, nothing turned on to take it away
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int SetImpairment(const ImpairmentConfig &config);
+  /* SetExecutor:
+   * Sets where coroutines suspended in the awaitable calls are resumed.
+   * Without an executor they are resumed on whichever thread finished
+   * the wait, the socket's own I/O threads or the reactor's, which then
+   * can't get to other work until the coroutine suspends again. Pass
+   * one that queues the coroutine on a job system to have a few worker
+   * threads serve many connections. Must be called before Listen,
+   * Connect or Host. The socket must not be moved or destroyed while a
+   * coroutine is waiting on it.
+   * params:
+   *  executor: resumes the coroutines, null to resume them in place
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int SetExecutor(Executor executor);
+  /* GetMetrics:
+   * Reports what the socket has been doing since it was made: datagrams,
+   * bytes, ACKs and retransmits, packets dropped and why, how full its
+   * queues are and histograms of round trips and send delays. Every
+   * socket's are added up by MetricsRegistry::Global().Snapshot
+   * params:
+   *  metrics: out - the metrics
+   * Returns: 0 on success
+   */
+  const int GetMetrics(MetricsSnapshot *metrics) const;
+  /* GetConnectionStats:
+   * Reports how well the connection is doing: round trip, jitter,
+   * loss, retransmits and bandwidth both ways. Kept up to date as
+   * packets, ACKs and PONGs come in and held in atomics, so it is cheap
+   * enough to call every frame
+   * params:
+   *  stats: out - the stats
+   *  peer: the peer to report on, or every peer added up if null. The
+   *    round trips, jitter and loss are then the worst of any peer
+   * Returns: 0 on success, INVALID_PEER if the peer isn't connected
+   */
+  const int GetConnectionStats(ConnectionStats *stats,
+                               const sockaddr_in *peer = nullptr) const;
+  /* GetCongestionStats:
+   * Reports the congestion window, pacing rate and queueing delay
+   * params:
+   *  stats: out - the stats
+   *  peer: the peer to report on, or every peer added up if null. The
+   *    round trips and delay are then the worst of any peer
+   * Returns: 0 on success, INVALID_PEER if the peer isn't connected
+   */
+  const int GetCongestionStats(CongestionController::Stats *stats,
+                               const sockaddr_in *peer = nullptr) const;
+  /* GetImpairmentStats:
+   * Reports what the simulated network has done to the datagrams going
+   * each way, all zero without SetImpairment
+   * params:
+   *  outbound: out + optional - the stats of sent datagrams
+   *  inbound: out + optional - the stats of received datagrams
+   * Returns: 0
+   */
+  const int GetImpairmentStats(ImpairedLink::Stats *outbound,
+                               ImpairedLink::Stats *inbound) const;
+  /* GetReorderStats:
+   * Reports how much the reorder buffers have had to hold back
+   * params:
+   *  stats: out - the stats
+   *  peer: the peer to report on, or every peer added up if null
+   * Returns: 0 on success, INVALID_PEER if the peer isn't connected
+   */
+  const int GetReorderStats(ReorderBuffer::Stats *stats,
+                            const sockaddr_in *peer = nullptr) const;
+  /* Attach:
+   * Hands the socket's I/O over to a shared reactor. Instead of starting
+   * its own sender, receiver and timer threads the socket registers with
+   * the reactor, whose I/O threads send, receive and ping for every
+   * attached socket as soon as there is work to do. Must be called
+   * before Listen, Connect or Host and the reactor must outlive the
+   * socket.
+   * params:
+   *  reactor: the reactor to drive this socket
+   * Returns: 0 on success, ALREADY_CONNECTED if the socket is running
+   */
+  const int Attach(Reactor &reactor);
 
 private:
   // private constructor. This class should be instantiated through the bind
   // method to make sure there is a valid address and that binding is successful
   // prior to any other calls
-  TBD(const char *local_addr, const int local_port);
+  TBD(std::unique_ptr<Transport> transport);
 
   /* SetUpPeerInfo:
    * Creates the peer information that this socket will connect to
@@ -118,69 +449,176 @@ private:
    *  0
    */
   const int SetUpPeerInfo(const char *peer_ip, const int peer_port);
+  /* FindConnection
+   * Looks up the connection state for the peer at addr
+   * params:
+   *  addr: the address of the peer
+   * returns:
+   *  the connection or nullptr if the peer isn't connected to us
+   */
+  std::shared_ptr<Connection> FindConnection(const sockaddr_in &addr) const;
+  /* AcceptConnection
+   * Creates the connection state for a peer that reached out to
+   * a socket in server mode and adds it to the connection table.
+   * params:
+   *  addr: the address of the peer
+   *  sequence: the sequence the peer started its handshake with
+   * returns:
+   *  the new connection or nullptr if we are already at max_peers
+   */
+  std::shared_ptr<Connection> AcceptConnection(const sockaddr_in &addr,
+                                               const uint32_t sequence);
+  /* DropConnection
+   * Forgets about a peer. If it is the only peer this socket was
+   * connected to the socket is closed and any blocked receives
+   * are released
+   * params:
+   *  conn: the connection to drop
+   */
+  void DropConnection(Connection &conn);
   /*
-   * BuildAndUpdatePacket
-   * builds the packet with the payload and updates the sequence
-   * number for this peer.
+   * BuildFragment
+   * builds the packet for one fragment of a message and takes the next
+   * sequence for this peer if the channel is reliable. Only the header
+   * is serialized, the fragment points into the payload of the message
    * params:
-   *  buffer: the payload to send to the peer
-   *  buffer_len: the length of the payload
+   *  conn: the peer the packet is for
+   *  payload: the whole message
+   *  offset: where the fragment starts in the message
+   *  length: the length of the fragment
    *  type: the type of packet being sent
-   * Returns: A pair with the serialized packet and the length of
-   *  the packet to send.
+   *  channel: the channel the packet is sent on
+   *  channel_sequence: the number of the message within its channel
+   *  index: which fragment it is
+   *  count: how many fragments the message has
+   * Returns: the packet ready to be queued
    */
-  std::pair<Buffer, size_t> BuildAndUpdatePacket(Buffer &buffer,
-                                                 const size_t buffer_len,
-                                                 const uint8_t type);
+  SendPacket BuildFragment(Connection &conn, const SharedBuffer &payload,
+                           const size_t offset, const size_t length,
+                           const uint8_t type, const uint8_t channel,
+                           const uint32_t channel_sequence,
+                           const uint16_t index, const uint16_t count);
   /* QueueSend
-   * Queues up a packet to send to the peer.
+   * Queues up a message to send to the peer. It is split into as many
+   * fragments as the mtu of the peer calls for, all of them are queued
+   * or none are. Fragments of a reliable message are tracked as unacked
+   * on the connection and retransmitted whenever their timeout passes
+   * until the peer acknowledges them. Unreliable ones are sent once and
+   * forgotten about.
    * params:
+   *  conn: the peer to send to
    *  buffer: the payload to send to the peer. THis is the unbuilt packet
    *    just the payload
    *  buffer_len: the length of the payload
    *  type: the type of packet to send
-   * return: status of the queue. Currently always returns 0
+   *  channel: the channel to send it on
+   * return: status of the queue, QUEUE_FULL if it wasn't taken and
+   *  MESSAGE_TOO_LARGE if it has too many fragments
    */
-  const int QueueSend(Buffer &buffer, const size_t buffer_len,
-                      const uint8_t type);
+  const int QueueSend(Connection &conn, Buffer &buffer,
+                      const size_t buffer_len, const uint8_t type,
+                      const uint8_t channel);
   /* QueueRetransmit
    * Queues up a packet to retransmit to the user. Same as Queue send
    * except this doesn't worry about building the packet and assume
    * theh buffer being passed in is already constructed
    * params:
-   *  buffer: the built packet to send to user
-   *  buffer_len: the length of the built packet
+   *  packet: the built packet along with who it's for
    * returns:
-   *  status of queue. CUrrently always 0
+   *  status of queue, QUEUE_FULL if it wasn't taken
    */
-  const int QueueRetransmit(SharedBuffer &buffer, const size_t buffer_len,
-                            const uint32_t sequence);
-  /* QueuePacket
-   * Queues up a packet to send to the user. This builds the packet
-   * and adds it to the queue of packets that the sender thread watches
+  const int QueueRetransmit(const SendPacket &packet);
+  /* QueueControl
+   * Queues up a packet that isn't tracked for acknowledgement, such as
+   * PINGs and SYNACKs
    * params:
-   *  buffer: the payload that will be sent to the user
-   *  buffer_len: the length of the payload
-   *  type: the type of packet that is being queued
-   *  sequence: the sequence that should be associated with the packet
+   *  peer: the address to send the packet to
+   *  type: the type of packet
+   *  sequence: the sequence to put in the header
+   *  payload: optional - what the packet carries, if anything
+   *  payload_len: the length of the payload
    * returns:
-   *  status of queue. CUrrently always 0
+   *  false if the send queue was full and the packet was dropped
+   */
+  bool QueueControl(const sockaddr_in &peer, const uint8_t type,
+                    const uint32_t sequence,
+                    const SharedBuffer &payload = nullptr,
+                    const size_t payload_len = 0);
+  /* ProbeMtu
+   * Queues a probe for every candidate mtu bigger than the one the
+   * peer is known to take. Each probe is padded to the size it tests
+   * and is sent with fragmentation disabled, so it only gets through,
+   * and gets a PROBE_ACK back, if the whole path takes that size
+   * params:
+   *  conn: the peer to probe
    */
-  const int QueuePacket(Buffer &buffer, const size_t buffer_len,
-                        const uint8_t type, const uint32_t sequence);
+  void ProbeMtu(const Connection &conn);
   /* SendConstructed
    * Immediately sends a constructed packet to the socket.
    * params:
    *  packet: the built packet to send
    *  packet_len: the length of the packet
+   *  peer: the address to send the packet to
    * returns: an integer indicating the success of the send
    */
-  const int SendConstructed(const Buffer &packet, const size_t packet_len);
+  const int SendConstructed(const Buffer &packet, const size_t packet_len,
+                            const sockaddr_in &peer);
   /* overwrite to send a shared pointer. Used for retransmitting */
   const int SendConstructed(const SharedBuffer &packet,
-                            const size_t packet_len);
+                            const size_t packet_len, const sockaddr_in &peer);
   /* overwrite to send an unmanaged pointer. Used to implement above*/
-  const int SendConstructed(const uint8_t *packet, const size_t packet_len);
+  const int SendConstructed(const uint8_t *packet, const size_t packet_len,
+                            const sockaddr_in &peer);
+  /* SendConstructedBatch
+   * Sends every constructed packet with as few sendmmsg calls as the
+   * kernel allows. Packets next to each other that go to the same peer
+   * share a datagram as long as it stays within the peer's mtu, every
+   * header and payload is gathered into it by the kernel. The headers
+   * are stamped with the current acks for their peer first and
+   * serialized in the header version the peer speaks. Gives up
+   * on a datagram after MAX_TRIES failed attempts.
+   * params:
+   *  packets: the built packets to send along with who they're for
+   *  batch: the batch to put the packets in, must be able to hold all
+   *    of them
+   * returns: the number of datagrams sent
+   */
+  const size_t SendConstructedBatch(std::vector<SendPacket> &packets,
+                                    DatagramBatch &batch);
+  /* SendDatagram
+   * Sends a whole datagram, through the simulated network if there is
+   * one
+   * params:
+   *  data: the datagram
+   *  length: its length
+   *  peer: who to send it to
+   * returns: the bytes sent or -1 on error
+   */
+  const int SendDatagram(const uint8_t *data, const size_t length,
+                         const sockaddr_in &peer);
+  /* FlushImpaired
+   * sends the datagrams the simulated network has let through so far
+   * and arms a timer for the next one. Before the socket is running
+   * nothing else would send them, the handshake is waiting on them so
+   * it waits for them here
+   */
+  void FlushImpaired();
+  /* ArmImpairment
+   * params:
+   *  when: when FlushImpaired should next run, the timer is only moved
+   *    sooner
+   */
+  void ArmImpairment(const Connection::Clock::time_point when);
+  /* WaitForSocket
+   * Waits for the transport to be readable or writable
+   * params:
+   *  write: wait to write if true, otherwise wait to read
+   *  timeout: how long to wait
+   * returns: 0 if the socket is ready, TIMEOUT or -1 on error
+   */
+  const int WaitForSocket(const bool write,
+                          const std::chrono::microseconds timeout =
+                              SOCKET_WAIT);
   /* SendAndWait
    * Sends a packet and waits until an ack is received. This waits for
    * a small ammount of time and currently breaks the multi-threaded set up.
@@ -193,12 +631,26 @@ private:
   const int SendAndWait(Buffer &buffer, const size_t buffer_len, uint8_t type);
   /*
    * QueueAck
-   * Queues up an acknowledgment to send to the peer. Nonblocking
+   * Queues up a standalone acknowledgment to send to the peer. The ack
+   * fields are fixed now rather than when the ACK is sent so a burst
+   * of ACKs covers everything received in between. Nonblocking, if
+   * the send queue is full another ACK is scheduled in its place
    * params:
-   *  sequence: sequence that's getting acknowledged
-   *  length: length of the payload that was received
+   *  conn: the peer to acknowledge
+   *  ack: the ack fields to send
+   */
+  void QueueAck(Connection &conn, const Connection::AckState &ack);
+  /* CountDrop
+   * counts a received packet ProcessPacket turned away
+   * params:
+   *  status: what ProcessPacket returned
    */
-  void QueueAck(uint32_t sequence, uint32_t length);
+  void CountDrop(const uint32_t status);
+  /* HandshakePayload
+   * returns: the payload of a SYN or SYNACK, the newest header version
+   *  this socket speaks
+   */
+  static Buffer HandshakePayload();
   /* AckPacket
    * immediately sends an ack to the peer. Breaks the multithreaded
    * design of the socket and should just be used in the threeway
@@ -221,23 +673,276 @@ private:
    *  the parameters
    */
   const int RetrievePacket(TBPacket &packet, sockaddr_in *received_addr);
+  /* RetrievePackets
+   * Same as RetrievePacket but drains every datagram waiting on the
+   * socket, up to the size of the batch, with one recvmmsg call.
+   * Datagrams that aren't whole packets are dropped.
+   * params:
+   *  batch: the batch to receive into
+   *  packets: out - the packets that were received
+   *  received_addrs: out - the address each packet came from
+   * returns:
+   *  0 if any packets were received, otherwise an error code
+   */
+  const int RetrievePackets(DatagramBatch &batch,
+                            std::vector<TBPacket> &packets,
+                            std::vector<sockaddr_in> &received_addrs);
   /* ProcessPacket
    * Takes in a packet and parses the header to determine what to do.
    * if the address is not from our connected peer we discard the message.
-   * An ack (SYNACK too) just gets noted, nothing more is done. Otherwise
-   * an ack is sent back to the peer and the payload is returned to the
-   * caller.
+   * The ack fields of every packet release what they acknowledge. An ack
+   * (SYNACK too) just gets noted, nothing more is done. Otherwise
+   * an ack is scheduled for the peer and the payload is returned to the
+   * caller. Payloads of unreliable channels aren't acknowledged and a
+   * stale sequenced one gives RECEIVED_STALE. On an ordered channel a
+   * payload that can't be returned yet goes to the reorder buffer and
+   * RECEIVED_HELD is returned. Fragments are held until their message
+   * is complete, RECEIVED_FRAGMENT is returned until then.
    * params:
    *  received_packet: in - the packet to process
    *  received_addr: in - the address that sent the packet
    *  retrieved_buffer: out + optional - the payload retrieved if any
+   *  retrieved_len: out + optional - the length of the payload
    * returns:
    *  A status code is returned depending on the packet that was received
    *  the payload if one was received is returned through the parameter
    */
   const uint32_t ProcessPacket(TBPacket &received_packet,
                                sockaddr_in &received_addr,
-                               Buffer *retrieved_buffer);
+                               Buffer *retrieved_buffer,
+                               size_t *retrieved_len = nullptr);
+  /* ReadPackets
+   * Reads whatever datagrams are waiting on the socket without blocking
+   * and rebuilds the whole packets in them. A datagram can hold several
+   * packets back to back
+   * params:
+   *  batch: the batch to receive into
+   *  packets: out - the packets that were received
+   *  received_addrs: out - the address each packet came from
+   * returns:
+   *  0 if any packets were received, otherwise an error code
+   */
+  const int ReadPackets(DatagramBatch &batch, std::vector<TBPacket> &packets,
+                        std::vector<sockaddr_in> &received_addrs);
+  /* ParseDatagram
+   * rebuilds the packets in a received datagram, one after another
+   * params:
+   *  data: the datagram
+   *  length: its length
+   *  addr: who it came from
+   *  packets: out - the packets are added to the end
+   *  received_addrs: out - addr is added for each one
+   */
+  void ParseDatagram(const uint8_t *data, const size_t length,
+                     const sockaddr_in &addr, std::vector<TBPacket> &packets,
+                     std::vector<sockaddr_in> &received_addrs);
+  /* ReleaseImpaired
+   * parses the received datagrams the simulated network has let
+   * through by now and, on a reactor, arms m_impair_fd for the next
+   * params:
+   *  packets: out - the packets are added to the end
+   *  received_addrs: out - the address each packet came from
+   */
+  void ReleaseImpaired(std::vector<TBPacket> &packets,
+                       std::vector<sockaddr_in> &received_addrs);
+  /* DeliverPackets
+   * Processes received packets and queues up any payloads for the
+   * user to receive
+   * params:
+   *  packets: the packets that were received
+   *  received_addrs: the address each packet came from
+   */
+  void DeliverPackets(std::vector<TBPacket> &packets,
+                      std::vector<sockaddr_in> &received_addrs);
+  /* CollectSends
+   * Pops what is on the send queue onto packets, up to what fits in a
+   * batch. If the batch isn't full, keeps taking packets as they are
+   * queued until the coalesce delay has passed since the first one was
+   * popped
+   * params:
+   *  batch: the batch the packets will be sent with
+   *  packets: in/out - packets already waiting, the popped ones are
+   *    added after them
+   *  wait: how long to wait for the first packet
+   * returns: the number of packets in packets
+   */
+  size_t CollectSends(DatagramBatch &batch, std::vector<SendPacket> &packets,
+                      const std::chrono::milliseconds wait);
+  /* Pace
+   * Moves the packets that their peer's pacer lets go now over to
+   * ready. The rest stay in packets, in order. Packets without a
+   * payload, such as ACKs, are never held
+   * params:
+   *  packets: in/out - the packets waiting to be sent
+   *  ready: out - the packets to send now
+   * returns: when the next packet left waiting can go, max if none are
+   */
+  Connection::Clock::time_point Pace(std::vector<SendPacket> &packets,
+                                     std::vector<SendPacket> &ready);
+  /* FlushSendQueue
+   * Sends everything in the send queue without waiting for more, as
+   * far as pacing allows
+   * params:
+   *  batch: the batch to send with
+   *  packets: the packets held back by pacing, more are popped off the
+   *    queue into it
+   *  ready: scratch space for the packets that can go
+   * returns: when the next packet held back can go, max if none are
+   */
+  Connection::Clock::time_point FlushSendQueue(DatagramBatch &batch,
+                                               std::vector<SendPacket> &packets,
+                                               std::vector<SendPacket> &ready);
+  /* EnqueueSend
+   * Puts a packet on the send queue and wakes up whoever sends it
+   * params:
+   *  packet: the built packet along with who it's for
+   * returns: false if the send queue is full and the packet was dropped
+   */
+  bool EnqueueSend(SendPacket packet);
+  /* FillSend
+   * Puts a packet in a send queue slot reserved with claim and wakes up
+   * whoever sends it
+   * params:
+   *  slot: the reserved slot
+   *  packet: the built packet along with who it's for
+   */
+  void FillSend(const size_t slot, SendPacket packet);
+  /* WakeSender
+   * Lets the reactor know there is something to flush in the send
+   * queue. Does nothing when the socket runs its own threads
+   */
+  void WakeSender();
+  /* WakeReceiver
+   * Resumes the coroutine waiting in ReceiveAsync, if there is one
+   */
+  void WakeReceiver();
+  /* WakeSenders
+   * Lets the coroutines waiting in SendAsync try again, called whenever
+   * the socket made room to queue more
+   */
+  void WakeSenders();
+  /* ScheduleFlush
+   * Arms the timer the reactor flushes the send queue on
+   * params:
+   *  delay: how long from now to flush
+   */
+  void ScheduleFlush(const Connection::Clock::duration delay);
+  /* ArmTimer
+   * Arms one of a peer's timers on the timer wheel unless it is already
+   * armed to go off sooner. Once it goes off the handler works out when
+   * it is needed next from the connection itself
+   * params:
+   *  conn: the peer
+   *  timer: which of its timers
+   *  when: when it should go off, max does nothing
+   *  handler: what to run when it goes off
+   */
+  void ArmTimer(Connection &conn, Connection::Timer Connection::*timer,
+                const Connection::Clock::time_point when,
+                void (TBD::*handler)(Connection &));
+  /* ArmRetransmit
+   * Arms the peer's retransmit timer for its soonest deadline
+   * params:
+   *  conn: the peer
+   */
+  void ArmRetransmit(Connection &conn);
+  /* CancelTimers
+   * Takes every timer of a peer off the wheel
+   * params:
+   *  conn: the peer
+   */
+  void CancelTimers(Connection &conn);
+  /* OnRetransmitTimer
+   * Queues up every unacked packet of the peer whose retransmission
+   * timeout has passed and re-arms for the next one
+   */
+  void OnRetransmitTimer(Connection &conn);
+  /* OnAckTimer
+   * Queues a standalone ACK if the peer is still waiting on one
+   */
+  void OnAckTimer(Connection &conn);
+  /* OnKeepaliveTimer
+   * Pings the peer, or drops it if it hasn't been heard from in too
+   * long
+   */
+  void OnKeepaliveTimer(Connection &conn);
+  /* AcknowledgeReceived
+   * Makes sure a received packet gets acknowledged, either by the ack
+   * fields of the next packet to the peer or on its own
+   * params:
+   *  conn: the peer the packet came from
+   *  sequence: the sequence of the packet
+   */
+  void AcknowledgeReceived(Connection &conn, const uint32_t sequence);
+  /* DeliverInOrder
+   * Puts a payload in a channel's reorder buffer and queues up
+   * everything that is now in order for the user
+   * params:
+   *  conn: the peer the payload came from
+   *  channel: the channel it came on
+   *  channel_sequence: the number of the payload within the channel
+   *  payload: the payload
+   *  length: the length of the payload
+   */
+  void DeliverInOrder(Connection &conn, const uint8_t channel,
+                      const uint32_t channel_sequence, Buffer payload,
+                      const size_t length);
+  /* Deliver
+   * Hands a complete payload to the handler of its type, or queues it
+   * for Pump or for Receive
+   * params:
+   *  payload: the payload
+   *  length: the length of the payload
+   *  peer: the peer it came from
+   *  channel: the channel it came on
+   */
+  void Deliver(Buffer payload, const size_t length, const sockaddr_in &peer,
+               const uint8_t channel);
+  /* DeliveryRoom
+   * returns: how many more payloads can be delivered before a queue
+   *  they might go to is full
+   */
+  size_t DeliveryRoom() const;
+  /* StartIO
+   * Starts sending and receiving for the connected socket, either on
+   * the sender, receiver and timer threads or on the attached reactor
+   */
+  void StartIO();
+  /* StopReactorIO
+   * Unregisters the socket from the reactor. Once this returns none
+   * of the reactor callbacks are running for this socket
+   */
+  void StopReactorIO();
+  // the async handshake's awaiter, defined with the others below
+  struct Handshake;
+  /* StartHandshake
+   * Sends the SYN when connecting and registers the handshake's
+   * callbacks with the reactor
+   * params:
+   *  awaiter: the suspended call, status is set if it fails right away
+   *  handle: the coroutine to resume once it is done
+   * returns: false if it failed right away and nothing was registered
+   */
+  bool StartHandshake(Handshake &awaiter, std::coroutine_handle<> handle);
+  /* StepHandshake
+   * Takes the handshake one step on from a reactor callback
+   * params:
+   *  readable: a datagram came in, otherwise the wait timed out
+   */
+  void StepHandshake(const bool readable);
+  /* FinishHandshake
+   * Unregisters the handshake, starts the socket if it worked and
+   * resumes the coroutine. Lets go of the handshake's lock
+   * params:
+   *  lock: the lock on m_handshake's mutex
+   *  status: what the call returns
+   */
+  void FinishHandshake(std::unique_lock<std::mutex> &lock, const int status);
+  /* CancelHandshake
+   * Ends a handshake that is still running with SOCKET_CLOSED, for a
+   * socket that is going away
+   */
+  void CancelHandshake();
   /* SetupSenderThread
    * Creates the thread that will continuously send the the messages
    * that are queued up. Uses a nameless function in order to capture
@@ -254,64 +959,240 @@ private:
    *  the thread object containing the id of the created thread
    */
   std::thread SetupReceiverThread();
-  /* SetupPingThread
-   * Creates a thread that will periodically send a ping to the
-   * peer to make sure the connection is still alive.
+  /* SetupTimerThread
+   * Creates the thread that runs the timer wheel. It sleeps until the
+   * next timer is due, retransmitting packets that weren't acknowledged
+   * in time, sending delayed ACKs and pinging every peer to make sure
+   * the connections are still alive
    * returns:
-   *  the thread that will maintain the pinging
+   *  the thread that will run the timers
    */
-  std::thread SetupPingThread();
+  std::thread SetupTimerThread();
 
 private:
-  /* SendPacket
-   * internal struct that will be used to queue up the packets
-   * that are ready to be sent. Contains the serialized buffer,
-   * size of the buffer and the sequence number for this
-   * specific packet.
-   */
-  struct SendPacket {
-    SharedBuffer buffer;
-    size_t buffer_len;
-    uint32_t sequence;
-
-    SendPacket() = default;
-    SendPacket(Buffer _buffer, size_t _buffer_len, uint32_t _sequence)
-        : buffer(std::move(_buffer)), buffer_len(_buffer_len),
-          sequence(_sequence) {}
-
-    SendPacket(SharedBuffer _buffer, size_t _buffer_len, uint32_t _sequence)
-        : buffer(_buffer), buffer_len(_buffer_len), sequence(_sequence) {}
+  /* ReceivedMessage
+   * internal struct for the payloads waiting for the user to
+   * receive them along with the peer that sent them
+   */
+  struct ReceivedMessage {
+    Buffer payload;
+    size_t length;
+    sockaddr_in peer;
+    uint8_t channel;
+    // what to run it with when it was queued for Pump, it may have
+    // been replaced since
+    std::shared_ptr<const Handler> handler;
+
+    ReceivedMessage() = default;
+    ReceivedMessage(Buffer _payload, size_t _length, const sockaddr_in &_peer,
+                    uint8_t _channel)
+        : payload(std::move(_payload)), length(_length), peer(_peer),
+          channel(_channel) {}
+  };
+
+  /* MessageReady
+   * suspends ReceiveAsync until there is a message to hand out or the
+   * connection is lost
+   */
+  struct MessageReady {
+    TBD *socket;
+
+    bool await_ready() const;
+    bool await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+  };
+
+  /* RoomToSend
+   * suspends SendAsync until the socket made room since progress was
+   * read
+   */
+  struct RoomToSend {
+    TBD *socket;
+    uint64_t progress;
+
+    bool await_ready() const;
+    bool await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+  };
+
+  /* Handshake
+   * a Listen or Connect the reactor runs for ListenAsync and
+   * ConnectAsync. Suspends the coroutine until the handshake is done,
+   * the steps are the same as the blocking calls take
+   */
+  struct Handshake {
+    TBD *socket;
+    bool listening;
+    const char *peer_ip;
+    int peer_port;
+    int status = 0;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    int await_resume() const { return status; }
+  };
+
+  /* HandshakeIO
+   * where a Handshake is up to, shared by its reactor callbacks
+   */
+  struct HandshakeIO {
+    Handshake *awaiter = nullptr;
+    std::coroutine_handle<> waiter;
+    bool listening = false;
+    // our SYN or SYNACK is out, the next datagram or timeout ends it
+    bool replied = false;
+    // datagrams or timeouts left to wait for a SYN in
+    int tries = 6;
+    bool done = false;
+    // one shot, goes off once a step has waited SOCKET_WAIT
+    int timer_fd = -1;
+    std::mutex mutex;
   };
 
+  /* OnExecutor
+   * moves the coroutine awaiting it onto the executor, so a blocking
+   * call after it doesn't hold up the thread it was running on. Does
+   * nothing without an executor
+   */
+  struct OnExecutor {
+    TBD *socket;
+
+    bool await_ready() const { return !socket->m_executor; }
+    void await_suspend(std::coroutine_handle<> handle) {
+      socket->m_executor(handle);
+    }
+    void await_resume() const {}
+  };
+
+  /* ConnectionTable
+   * every peer we're connected to keyed by its address. Sized to
+   * keep lock contention low with thousands of peers
+   */
+  using ConnectionTable =
+      TSMap<PeerKey, std::shared_ptr<Connection>, CONNECTION_BUCKETS>;
+
   /* empty buffer
    * this is often used to send acks or any non MSG packets
    * so it's better to just have one single buffer we can reference
    * rather than constructing a new one each time
    */
   static Buffer s_empty_buffer;
+  /* probe padding
+   * zeros that every mtu probe is padded with
+   */
+  static SharedBuffer s_probe_padding;
+  /* handshake payload
+   * the same as HandshakePayload for the SYNACKs the receiver queues
+   */
+  static SharedBuffer s_handshake_payload;
 
 private:
-  int m_sock;
-  sockaddr_in m_local_addr;
-  sockaddr_in m_peer_addr;
+  std::unique_ptr<Transport> m_transport;
+
+  // the peer from Listen/Connect, null in server mode
+  std::shared_ptr<Connection> m_peer;
+  ConnectionTable m_connections;
+  std::atomic<size_t> m_peer_count;
+  size_t m_max_peers;
+  bool m_hosting;
+
+  // datagrams per recvmmsg/sendmmsg
+  size_t m_batch_size;
+  std::atomic<std::chrono::milliseconds> m_ack_delay;
+  std::atomic<std::chrono::milliseconds> m_coalesce_delay;
+  // hand RELIABLE payloads out in the order they were sent too
+  bool m_ordered;
+  CongestionFactory m_congestion;
+  Executor m_executor;
+  // the simulated network, null unless SetImpairment turned it on
+  std::unique_ptr<Impairment> m_impairment;
+  // when held outbound datagrams are next sent
+  Connection::Timer m_impair_timer;
+  // registered with MetricsRegistry::Global, shared with a socket this
+  // one was moved from
+  std::shared_ptr<Metrics> m_metrics;
 
-  uint32_t m_sequence;
   std::atomic_bool m_connected;
 
-  // queues to put send and received packets
-  TSQueue<SendPacket> m_send_queue;
-  TSQueue<Buffer> m_received_queues;
+  // queues to put send and received packets. Anyone can queue a packet
+  // to send but only the sender pops them, only the receiver queues
+  // payloads and only the user pops those
+  MPSCQueue<SendPacket> m_send_queue;
+  SPSCQueue<ReceivedMessage> m_received_queues;
 
-  // keeps track of any sequences that aren't acked yet
-  TSMap<uint32_t, SendPacket> m_unacked_packets;
+  HandlerRegistry m_handlers;
+  Dispatch m_dispatch;
+  // messages waiting on Pump, only allocated for PUMPED dispatch
+  SPSCQueue<ReceivedMessage> m_pumped;
 
   // thread ids of the running threads
   std::thread m_sender_thread;
   std::thread m_receiver_thread;
 
-  // check if the peer is still alive
-  std::thread m_ping_thread;
-  std::atomic_bool m_ponged;
+  // runs m_timers when there is no reactor
+  std::thread m_timer_thread;
+
+  // retransmit, delayed ACK and keepalive timers of every peer
+  TimerWheel m_timers;
+
+  /* ReactorIO
+   * buffers the reactor callbacks use in place of the ones
+   * that live on the stacks of the I/O threads
+   */
+  struct ReactorIO {
+    DatagramBatch receive_batch;
+    std::vector<TBPacket> received_packets;
+    std::vector<sockaddr_in> received_addrs;
+    DatagramBatch send_batch;
+    std::vector<SendPacket> send_packets;
+    std::vector<SendPacket> ready_packets;
+
+    ReactorIO(const size_t batch_size, const size_t datagram_len)
+        : receive_batch(batch_size, datagram_len), send_batch(batch_size) {}
+  };
+
+  // set when the socket is driven by a reactor instead of its own threads
+  Reactor *m_reactor;
+  std::unique_ptr<ReactorIO> m_reactor_io;
+  // a ListenAsync or ConnectAsync the reactor is running
+  std::unique_ptr<HandshakeIO> m_handshake;
+  // one shot timerfd armed when the send queue gets something in it,
+  // fires once the coalesce delay is up
+  int m_wake_fd;
+  // one shot timerfd armed for whenever m_timers next needs advancing
+  int m_tick_fd;
+  // one shot timerfd armed for when the next held received datagram
+  // is due, only with an impairment
+  int m_impair_fd;
+  // the impairment's callback reads and delivers like the socket's,
+  // the two can't run at once
+  std::mutex m_receive_mutex;
+  std::atomic_bool m_flush_pending;
+
+  // coroutines waiting in ReceiveAsync and SendAsync
+  std::mutex m_waiters_mutex;
+  std::coroutine_handle<> m_receive_waiter;
+  std::vector<std::coroutine_handle<>> m_send_waiters;
+  std::atomic<size_t> m_send_waiting;
+  // bumped every time the socket makes room to send
+  std::atomic<uint64_t> m_send_progress;
+
+  // longest the socket is waited on before checking whether to stop
+  static constexpr std::chrono::seconds SOCKET_WAIT{2};
+  // time between pings
+  static constexpr std::chrono::seconds KEEPALIVE_INTERVAL{15};
+  // how long a peer can be silent before it is dropped
+  static constexpr std::chrono::seconds PEER_TIMEOUT{60};
+  // bytes of IPv4 and UDP header in front of every datagram
+  static const size_t UDP_OVERHEAD = 28;
+  // mtus probed for, the common ethernet, PPPoE and tunnel sizes up to
+  // jumbo frames
+  static constexpr uint32_t MTU_PROBES[] = {1280, 1400, 1492, 1500, 9000};
+  // biggest datagram we ever receive, anything bigger isn't sent
+  static constexpr size_t MAX_DATAGRAM_LEN = 9000 - UDP_OVERHEAD;
+  // receive batches a reactor callback reads before yielding to
+  // the other sockets
+  static const int MAX_DRAIN_ROUNDS = 8;
 
   // maximum tries for sending a packet before giving up
   static const uint8_t MAX_TRIES = 10;
@@ -0,0 +1,119 @@
+// shardedserver.h
+// One server port served by several sockets at once. Each shard is a
+// TBD socket bound to the same port with SO_REUSEPORT and driven by
+// its own reactor thread kept on one core. The kernel hands every
+// datagram from a peer to the same shard, so a peer's connection
+// lives on one shard and is never shared with the others
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "reactor.h"
+#include "rudp.h"
+#include "transport.h"
+
+namespace Hev {
+
+/* Steering
+ * How the kernel picks the shard a datagram goes to
+ */
+enum class Steering {
+  // a hash of the peer's address and port, a peer stays on its shard
+  // for as long as the server is up
+  HASH,
+  // the shard pinned to the core the datagram came in on, so it's
+  // handled without leaving that core's cache. Needs pin, datagrams
+  // from cores without a shard fall back to the hash. A peer only stays
+  // on one shard if the network card always hands its datagrams to the
+  // same core, which receive side scaling does. Not for loopback, where
+  // it's the core the sender happened to be running on
+  CPU,
+};
+
+/* ShardConfig
+ * How a ShardedServer splits up its port
+ */
+struct ShardConfig {
+  // the number of shards, 0 for one per core the process may run on
+  size_t shards = 0;
+  // keep each shard's reactor thread on its own core
+  bool pin = true;
+  Steering steering = Steering::HASH;
+  // the offloads each shard's socket asks for, the port is always
+  // shared
+  UdpConfig udp = {};
+};
+
+/* ShardedServer
+ * A server port whose peers are spread across shards, so receiving,
+ * handshakes, handlers and timers for different peers run on
+ * different cores
+ */
+class ShardedServer {
+public:
+  /* Bind
+   * Binds every shard to the port. Nothing else can be bound to the
+   * port without SO_REUSEPORT, and other sockets that do share it get
+   * some of the peers
+   * params:
+   *  local_addr: unused, the shards listen on every interface
+   *  local_port: the port to bind
+   *  config: how many shards and how peers are spread across them
+   * returns: the server. Throws like TBD::Bind if a shard couldn't be
+   *  bound
+   */
+  static ShardedServer Bind(const char *local_addr, const int local_port,
+                            const ShardConfig &config = {});
+
+  ShardedServer(const ShardedServer &other) = delete;
+  ShardedServer(ShardedServer &&other) = default;
+
+  /* Host
+   * Puts every shard in server mode. Handlers, the dispatch and the
+   * other settings have to be set on each shard before this
+   * params:
+   *  max_peers: the most peers each shard can have connected at once
+   * returns: 0 if every shard is accepting peers, otherwise the error
+   *  of the first that isn't
+   */
+  const int Host(const size_t max_peers = TBD::DEFAULT_MAX_PEERS);
+
+  /* Shards: the number of shards */
+  const size_t Shards() const { return m_shards.size(); }
+  /* Shard: one of the shards, to set up or to send and receive on */
+  TBD &Shard(const size_t index) { return m_shards[index]; }
+
+  /* PeerCount
+   * returns: the number of peers connected to any shard
+   */
+  const size_t PeerCount() const;
+
+  /* Steered
+   * returns: whether datagrams are steered by core, false if HASH was
+   *  asked for, the shards aren't pinned or the kernel wouldn't take
+   *  the steering program
+   */
+  const bool Steered() const { return m_steered; }
+
+private:
+  ShardedServer() = default;
+
+  /* SteerByCpu
+   * attaches a program to the port that picks the shard pinned to the
+   * core a datagram came in on
+   * params:
+   *  sock: any of the shards' sockets
+   *  shard_cpus: the core each shard is pinned to, in the order they
+   *    were bound
+   * returns: false if the kernel wouldn't take it
+   */
+  static bool SteerByCpu(const int sock, const std::vector<int> &shard_cpus);
+
+  // destroyed after the shards attached to them
+  std::vector<std::unique_ptr<Reactor>> m_reactors;
+  std::vector<TBD> m_shards;
+  bool m_steered = false;
+};
+
+} // namespace Hev
@@ -0,0 +1,133 @@
+// task.h
+// A coroutine type for the awaitable calls of the sockets and the hook
+// that decides where suspended coroutines pick up again
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace Hev {
+
+/* Executor
+ * Resumes a coroutine that was waiting on a socket. Called on the
+ * thread that finished the wait, such as the receiver thread or a
+ * reactor thread, so it should hand the coroutine off to wherever it
+ * is meant to run rather than doing the work there. Without one the
+ * coroutine is resumed right on that thread
+ */
+using Executor = std::function<void(std::coroutine_handle<>)>;
+
+/* Resume
+ * params:
+ *  executor: where to resume, null to resume on this thread
+ *  handle: the coroutine to resume
+ */
+inline void Resume(const Executor &executor, std::coroutine_handle<> handle) {
+  if (executor)
+    executor(handle);
+  else
+    handle.resume();
+}
+
+/* Task
+ * The result of a coroutine. It doesn't start until it is awaited, the
+ * awaiting coroutine picks up again once it finishes. A coroutine that
+ * nothing awaits, say the one serving a connection, is started with
+ * Detach and cleans up after itself
+ */
+template <class T = void> class Task {
+public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<>
+    await_suspend(Handle handle) noexcept {
+      promise_type &promise = handle.promise();
+      if (promise.continuation)
+        return promise.continuation;
+      // detached, nobody will look at the result
+      if (promise.detached)
+        handle.destroy();
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    bool detached = false;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  struct ValuePromise : PromiseBase {
+    std::optional<T> value;
+    void return_value(T result) { value = std::move(result); }
+    T Take() {
+      if (this->exception)
+        std::rethrow_exception(this->exception);
+      return std::move(*value);
+    }
+  };
+
+  struct VoidPromise : PromiseBase {
+    void return_void() {}
+    void Take() {
+      if (this->exception)
+        std::rethrow_exception(this->exception);
+    }
+  };
+
+  struct promise_type
+      : std::conditional_t<std::is_void_v<T>, VoidPromise, ValuePromise> {
+    Task get_return_object() { return Task(Handle::from_promise(*this)); }
+  };
+
+  Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, {})) {}
+  Task(const Task &other) = delete;
+  ~Task() {
+    if (m_handle)
+      m_handle.destroy();
+  }
+
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      if (m_handle)
+        m_handle.destroy();
+      m_handle = std::exchange(other.m_handle, {});
+    }
+    return *this;
+  }
+
+  bool await_ready() const noexcept { return !m_handle || m_handle.done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    m_handle.promise().continuation = awaiting;
+    return m_handle;
+  }
+  T await_resume() { return m_handle.promise().Take(); }
+
+  /* Detach
+   * starts the coroutine and lets it run on its own, its frame is freed
+   * once it finishes. Anything it throws is lost
+   */
+  void Detach() {
+    Handle handle = std::exchange(m_handle, {});
+    handle.promise().detached = true;
+    handle.resume();
+  }
+
+private:
+  explicit Task(Handle handle) : m_handle(handle) {}
+
+  Handle m_handle;
+};
+
+} // namespace Hev
@@ -1,12 +1,14 @@
 // timer.h
 // A timer which will start on call and call a
 // call back function when time ends.
-
+#pragma once
 #include <atomic>
 #include <chrono>
 #include <functional>
 #include <thread>
 #include <type_traits>
+
+#include "timerwheel.h"
 namespace Hev {
 
 template <class callable, class... arguments>
@@ -16,10 +18,8 @@ int timer(std::chrono::milliseconds &after, bool async, callable &&f,
       std::bind(std::forward<callable>(f), std::forward(args)...));
 
   if (async) {
-    std::thread([after, task]() {
-      std::this_thread::sleep_for(after);
-      task();
-    }).detach();
+    // runs on the shared wheel's thread rather than a thread of its own
+    TimerWheel::Shared().Schedule(TimerWheel::Clock::now() + after, task);
   } else {
     std::this_thread::sleep_for(after);
     task();
@@ -30,14 +30,16 @@ int timer(std::chrono::milliseconds &after, bool async, callable &&f,
 class Timeout {
 public:
   Timeout(const int timeout_in_ms);
-  ~Timeout() = default;
+  ~Timeout();
 
+  // starts over if it is already running
   const int Start();
   const bool IsFinished() const;
 
 private:
   std::chrono::milliseconds m_time;
   std::atomic<bool> m_finished;
+  TimerWheel::TimerId m_timer;
 };
 
 } // namespace Hev
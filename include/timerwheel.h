@@ -0,0 +1,170 @@
+// timerwheel.h
+// Runs any number of timers off one thread, or off whoever drives it,
+// without a thread or a system timer per timer
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace Hev {
+
+/* TimerWheel
+ * A hierarchical timing wheel. Timers go into one of LEVELS rings of
+ * SLOTS slots, the lowest ring covering the next SLOTS milliseconds a
+ * slot per millisecond and every ring above it SLOTS times as much.
+ * Once the lowest ring comes round to a slot of a higher one, the
+ * timers in that slot move down to where they now belong. Scheduling
+ * and cancelling are O(1) and expiring costs nothing for timers that
+ * don't expire. Timers further out than the top ring reaches keep
+ * going back into it until they're in range.
+ *
+ * Nothing fires on its own, whoever owns the wheel calls Advance. Wait
+ * blocks until the next timer could be due, or a WakeHook can arm some
+ * other timer (such as a timerfd) instead. Safe to use from any
+ * thread, callbacks run on the thread that calls Advance without the
+ * wheel locked so they can schedule and cancel timers themselves
+ */
+class TimerWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+  using TimerId = uint64_t;
+  using Callback = std::function<void()>;
+  /* WakeHook
+   * told the time the wheel next needs to be advanced at whenever it
+   * changes, max if there are no timers. Called with the wheel locked
+   */
+  using WakeHook = std::function<void(Clock::time_point)>;
+
+  static constexpr std::chrono::milliseconds RESOLUTION{1};
+  static constexpr size_t SLOT_BITS = 6;
+  static constexpr size_t SLOTS = 1 << SLOT_BITS;
+  // 64^5 milliseconds is about twelve days
+  static constexpr size_t LEVELS = 5;
+  // never returned by Schedule
+  static constexpr TimerId INVALID = 0;
+
+  TimerWheel();
+  TimerWheel(const TimerWheel &other) = delete;
+
+  /* Schedule
+   * params:
+   *  when: when to call callback, rounded up to the next millisecond.
+   *    Times that already passed fire on the next Advance
+   *  callback: what to call
+   * returns:
+   *  the id to cancel the timer with
+   */
+  TimerId Schedule(const Clock::time_point when, Callback callback);
+
+  /* Cancel
+   * params:
+   *  id: a timer from Schedule
+   * returns:
+   *  false if the timer already fired, is firing or was cancelled
+   */
+  bool Cancel(const TimerId id);
+
+  /* Advance
+   * fires every timer that is due
+   * params:
+   *  now: the current time
+   * returns:
+   *  how many timers fired
+   */
+  size_t Advance(const Clock::time_point now);
+
+  /* NextExpiry
+   * returns: a time at or before the soonest timer is due, the wheel
+   *  has nothing to do until then. max if there are no timers
+   */
+  Clock::time_point NextExpiry();
+
+  /* Wait
+   * blocks until the wheel needs advancing, a timer is scheduled sooner
+   * than that, limit passes or Interrupt is called
+   * params:
+   *  limit: the longest to wait until
+   */
+  void Wait(const Clock::time_point limit);
+
+  /* Interrupt
+   * wakes up Wait and keeps it from blocking from then on, for shutting
+   * down whatever thread runs the wheel
+   */
+  void Interrupt();
+
+  /* SetWakeHook
+   * params:
+   *  hook: called with every new time the wheel needs advancing at,
+   *    null to stop
+   */
+  void SetWakeHook(WakeHook hook);
+
+  /* Size
+   * returns: how many timers are scheduled
+   */
+  size_t Size();
+
+  /* Shared
+   * a wheel for timers that aren't part of a socket, run by a thread of
+   * its own that starts the first time it is used
+   * returns: the shared wheel
+   */
+  static TimerWheel &Shared();
+
+private:
+  static constexpr uint32_t NIL = UINT32_MAX;
+  static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+  struct Node {
+    Callback callback;
+    // the tick it is due at
+    uint64_t expiry;
+    uint32_t prev;
+    uint32_t next;
+    // bumped every time the node is freed so stale ids don't match
+    uint32_t generation;
+    // index into m_slots, NIL when not scheduled
+    uint32_t slot;
+  };
+
+  uint64_t ToTick(const Clock::time_point time, const bool round_up) const;
+  Clock::time_point ToTime(const uint64_t tick) const;
+
+  /* Link
+   * puts a node into the slot its expiry belongs in from m_tick, or
+   * earliest's slot if it is due before that
+   */
+  void Link(const uint32_t index, const uint64_t earliest);
+  /* Unlink: takes a node out of its slot */
+  void Unlink(const uint32_t index);
+  /* Release: frees a node that is no longer linked */
+  void Release(const uint32_t index);
+  /* Cascade: moves down the timers of higher slots m_tick reached */
+  void Cascade();
+  /* NextTick: the first tick anything might happen at, locked */
+  uint64_t NextTick() const;
+  /* UpdateWake: works out m_wake_at again and tells the hook */
+  void UpdateWake();
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  Clock::time_point m_start;
+  // the last tick that was advanced to
+  uint64_t m_tick;
+  std::vector<Node> m_nodes;
+  std::vector<uint32_t> m_free;
+  // heads of the slots, level by level
+  uint32_t m_slots[LEVELS * SLOTS];
+  size_t m_level_count[LEVELS];
+  size_t m_count;
+  Clock::time_point m_wake_at;
+  WakeHook m_hook;
+  bool m_interrupted;
+};
+
+} // namespace Hev
@@ -0,0 +1,156 @@
+// transport.h
+// Where a TBD socket's datagrams actually go. The protocol only needs
+// to send and receive whole datagrams to and from an address, so the
+// kernel's UDP sockets are one way of moving them among others
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+
+#include "batch.h"
+
+namespace Hev {
+
+/* Transport
+ * Moves datagrams between a bound address and its peers. A socket has
+ * one thread receiving at a time but any of its threads may send
+ */
+class Transport {
+public:
+  virtual ~Transport() = default;
+
+  /* Receive
+   * Reads as many datagrams as are waiting, up to the capacity of the
+   * batch, without blocking
+   * params:
+   *  batch: filled with the datagrams
+   * returns: the number received or -1 on error
+   */
+  virtual const int Receive(DatagramBatch &batch) = 0;
+
+  /* ReceiveFrom
+   * Reads one datagram without blocking. Where several came in
+   * together in one buffer the first is returned and the rest dropped
+   * params:
+   *  buffer: where the datagram goes
+   *  buffer_len: the size of buffer, anything past it is cut off
+   *  from: out - who sent it
+   * returns: the length of the datagram or -1 if there was none
+   */
+  virtual const int ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                                sockaddr_in *from) = 0;
+
+  /* Send
+   * Sends the datagrams added to a batch
+   * params:
+   *  batch: the datagrams
+   *  offset: the first one to send, anything before it is already sent
+   * returns: the number sent or -1 on error with errno set
+   */
+  virtual const int Send(DatagramBatch &batch, const size_t offset) = 0;
+
+  /* SendTo
+   * params:
+   *  data: a whole datagram
+   *  length: its length
+   *  peer: who to send it to
+   * returns: the bytes sent or -1 on error
+   */
+  virtual const int SendTo(const uint8_t *data, const size_t length,
+                           const sockaddr_in &peer) = 0;
+
+  /* Wait
+   * Waits for datagrams to receive or for room to send
+   * params:
+   *  write: wait to send if true, otherwise wait to receive
+   *  timeout: how long to wait
+   * returns: 0 if ready, TIMEOUT or -1 on error
+   */
+  virtual const int Wait(const bool write,
+                         const std::chrono::microseconds timeout) = 0;
+
+  /* Interrupt
+   * Makes a Wait in progress, or the next one, return early so the
+   * thread in it can see the socket is stopping
+   */
+  virtual void Interrupt() = 0;
+
+  /* Fd
+   * returns: a file descriptor that is readable while datagrams are
+   *  waiting, for a Reactor to watch
+   */
+  virtual const int Fd() const = 0;
+};
+
+/* UdpConfig
+ * Which of the kernel's UDP offloads a UdpTransport asks for, each is
+ * left off if the kernel doesn't have it, and whether it shares its port
+ */
+struct UdpConfig {
+  // hand runs of datagrams the same size going to the same peer, like
+  // a burst of snapshots or retransmits, to the kernel as one buffer
+  // it splits up (UDP_SEGMENT, Linux 4.18)
+  bool segment_sends = true;
+  // have the kernel hand over datagrams from the same peer together
+  // in one buffer (UDP_GRO, Linux 5.0). Off by default, every receive
+  // buffer in the batch grows to 64KB to hold them. ReceiveFrom keeps
+  // only the first datagram of a coalesced read
+  bool coalesce_receives = false;
+  // let other sockets bind the same port (SO_REUSEPORT), the kernel
+  // then spreads the peers across them. Every socket sharing the port
+  // has to ask for it
+  bool reuse_port = false;
+};
+
+/* UdpTransport
+ * A kernel UDP socket, moving datagrams with recvmmsg and sendmmsg
+ */
+class UdpTransport : public Transport {
+public:
+  /* Bind
+   * Creates a UDP socket bound to the port on every interface
+   * params:
+   *  local_addr: unused, the socket listens on every interface
+   *  local_port: the port to bind
+   *  config: the offloads to ask for and whether to share the port
+   * returns: the transport or null if the port couldn't be bound
+   */
+  static std::unique_ptr<Transport> Bind(const char *local_addr,
+                                         const int local_port,
+                                         const UdpConfig &config = {});
+
+  UdpTransport(const UdpTransport &other) = delete;
+  ~UdpTransport() override;
+
+  const int Receive(DatagramBatch &batch) override;
+  const int ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                        sockaddr_in *from) override;
+  const int Send(DatagramBatch &batch, const size_t offset) override;
+  const int SendTo(const uint8_t *data, const size_t length,
+                   const sockaddr_in &peer) override;
+  const int Wait(const bool write,
+                 const std::chrono::microseconds timeout) override;
+  void Interrupt() override;
+  const int Fd() const override { return m_sock; }
+
+  /* Segmenting: whether sends are still handed over in runs */
+  const bool Segmenting() const { return m_segment; }
+  /* Coalescing: whether the kernel hands over datagrams together */
+  const bool Coalescing() const { return m_coalesce; }
+
+private:
+  UdpTransport(const int sock, const int interrupt, const bool segment,
+               const bool coalesce);
+
+  int m_sock;
+  // an eventfd Wait watches along with the socket
+  int m_interrupt;
+  // turned off for good by the first run the device can't split
+  std::atomic_bool m_segment;
+  bool m_coalesce;
+};
+
+} // namespace Hev
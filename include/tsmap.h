@@ -1,6 +1,7 @@
 // tsmap.h
 // A thread safe hash map class to read and write
 // from a map in a safe manner
+#pragma once
 #include <map>
 #include <mutex>
 #include <shared_mutex>
@@ -19,6 +20,10 @@ template <typename K, typename V, size_t NumBuckets = 64> class TSMap {
     return m_buckets[std::hash<K>{}(key) % NumBuckets];
   }
 
+  const Bucket &get_bucket(const K &key) const {
+    return m_buckets[std::hash<K>{}(key) % NumBuckets];
+  }
+
 public:
   TSMap() : m_buckets(NumBuckets) {}
 
@@ -45,6 +50,32 @@ public:
     return false;
   }
 
+  /* size
+   * counts the elements across every bucket. Buckets are locked one
+   * at a time so the count may be stale by the time it returns
+   */
+  size_t size() const {
+    size_t total = 0;
+    for (const auto &bucket : m_buckets) {
+      std::shared_lock lock(bucket.mutex);
+      total += bucket.data.size();
+    }
+    return total;
+  }
+
+  /* for_each
+   * calls f(key, value) on every element of the map. Each bucket is
+   * read locked while it is walked so f must not modify the map
+   */
+  template <class F> void for_each(F &&f) const {
+    for (const auto &bucket : m_buckets) {
+      std::shared_lock lock(bucket.mutex);
+      for (const auto &[key, value] : bucket.data) {
+        f(key, value);
+      }
+    }
+  }
+
   std::vector<V> GetGreaterThan(const K &key) {
     std::vector<V> results(25);
     for (auto &bucket : m_buckets) {
@@ -1,11 +1,13 @@
 // A thread safe queue which just wraps the
 // std queue but adds a mutex to safely
 // read and write to the container
+#pragma once
 
 #include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <vector>
 
 #define LOCK(mut) std::unique_lock lock(mut)
 
@@ -172,7 +174,7 @@ public:
                          [this]() { return m_stopped || !m_queue.empty(); })) {
       return false;
     }
-    if (!item) {
+    if (!item || m_queue.empty()) {
       return false;
     }
     *(item) = std::move(m_queue.front());
@@ -180,6 +182,32 @@ public:
     return item;
   }
 
+  /* pop_many_wait_till
+   * Same as pop_wait_till but once an item is in the queue it takes
+   * out up to max items under a single lock instead of just one
+   * param:
+   *  ms: amount of time to wait for
+   *  items: out - the retrieved items are appended to it
+   *  max: the most items to retrieve
+   * returns:
+   *  the number of items retrieved
+   */
+  size_t pop_many_wait_till(std::chrono::milliseconds ms, std::vector<T> &items,
+                            const size_t max) {
+    LOCK(m_mut);
+    if (!m_cond.wait_for(lock, ms,
+                         [this]() { return m_stopped || !m_queue.empty(); })) {
+      return 0;
+    }
+    size_t count = 0;
+    while (count < max && !m_queue.empty()) {
+      items.push_back(std::move(m_queue.front()));
+      m_queue.pop();
+      count++;
+    }
+    return count;
+  }
+
   void release_all_blocks() {
     m_stopped = true;
     m_cond.notify_all();
@@ -189,7 +217,7 @@ private:
   std::queue<T, container> m_queue;
   std::mutex m_mut;
   std::condition_variable m_cond;
-  std::atomic_bool m_stopped;
+  std::atomic_bool m_stopped{false};
 };
 
 } // namespace Hev
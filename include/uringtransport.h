@@ -0,0 +1,212 @@
+// uringtransport.h
+// A UDP transport that moves datagrams through io_uring rather than
+// one system call per batch. Only built with HEVNET_IO_URING, it needs
+// Linux 6.0 or newer for multishot receives into a ring of provided
+// buffers
+#pragma once
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/socket.h>
+#include <vector>
+
+#include "transport.h"
+
+namespace Hev {
+
+/* UringConfig
+ * How much a UringTransport sets aside up front
+ */
+struct UringConfig {
+  // receive buffers the kernel fills as datagrams arrive, a power of
+  // two. Datagrams arriving with none free wait in the socket
+  uint32_t receive_buffers = 256;
+  // datagrams that can be in flight at once, sends past it wait
+  uint32_t send_slots = 256;
+  // the longest datagram sent or received, longer ones are cut off
+  uint32_t datagram_len = 9000 - 28;
+};
+
+/* UringTransport
+ * A kernel UDP socket driven by two io_uring instances. A multishot
+ * receive stays posted on one of them and the kernel completes it
+ * into pooled buffers as datagrams arrive, so receiving what's already
+ * there costs no system call. Sends are copied into slots and handed
+ * to the other in batches with one system call, their completions
+ * are collected on the next send
+ */
+class UringTransport : public Transport {
+public:
+  /* Bind
+   * Creates a UDP socket bound to the port on every interface and the
+   * rings to drive it
+   * params:
+   *  local_addr: unused, the socket listens on every interface
+   *  local_port: the port to bind
+   *  config: how many buffers to set aside
+   * returns: the transport or null if the port couldn't be bound or
+   *  the kernel doesn't support what we need from io_uring
+   */
+  static std::unique_ptr<Transport> Bind(const char *local_addr,
+                                         const int local_port,
+                                         const UringConfig &config = {});
+
+  UringTransport(const UringTransport &other) = delete;
+  ~UringTransport() override;
+
+  const int Receive(DatagramBatch &batch) override;
+  const int ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                        sockaddr_in *from) override;
+  const int Send(DatagramBatch &batch, const size_t offset) override;
+  const int SendTo(const uint8_t *data, const size_t length,
+                   const sockaddr_in &peer) override;
+  const int Wait(const bool write,
+                 const std::chrono::microseconds timeout) override;
+  void Interrupt() override;
+  /* Fd: the receive ring, readable while it has completions */
+  const int Fd() const override { return m_receive.fd; }
+
+private:
+  /* Ring
+   * one io_uring instance and its mapped submission and completion
+   * queues
+   */
+  struct Ring {
+    int fd = -1;
+    void *sq_memory = nullptr;
+    size_t sq_bytes = 0;
+    void *cq_memory = nullptr;
+    size_t cq_bytes = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_bytes = 0;
+    uint32_t *sq_head = nullptr;
+    uint32_t *sq_tail = nullptr;
+    uint32_t *sq_array = nullptr;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+    // submissions filled in but not yet handed to the kernel
+    uint32_t sq_pending = 0;
+    uint32_t *cq_head = nullptr;
+    uint32_t *cq_tail = nullptr;
+    uint32_t cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    /* Setup
+     * creates the instance and maps its queues
+     * params:
+     *  entries: the size of the submission queue
+     *  cq_entries: the size of the completion queue, 0 for the default
+     * returns: false if the kernel wouldn't
+     */
+    bool Setup(const uint32_t entries, const uint32_t cq_entries);
+    void Teardown();
+
+    /* Next
+     * returns: a cleared submission to fill in, null if the queue is
+     *  full
+     */
+    io_uring_sqe *Next();
+
+    /* Submit
+     * hands the submissions filled in since the last call to the
+     * kernel, without waiting for any of them
+     * returns: 0 or -1 on error, the submissions are then handed over
+     *  with the next call
+     */
+    const int Submit();
+
+    /* Wait
+     * waits for completions. Doesn't submit anything so it may be
+     * called while another thread submits
+     * params:
+     *  wait_for: how many completions to wait for
+     *  timeout: how long to wait for them
+     * returns: 0, TIMEOUT or -1 on error
+     */
+    const int Wait(const uint32_t wait_for,
+                   const std::chrono::microseconds timeout);
+
+    /* Peek: the oldest completion, null if there are none */
+    const io_uring_cqe *Peek() const;
+    /* Pop: gives the oldest completion's entry back to the kernel */
+    void Pop();
+  };
+
+  /* SendSlot
+   * the memory a datagram being sent lives in until it completes
+   */
+  struct SendSlot {
+    msghdr header;
+    iovec iov;
+    sockaddr_in peer;
+    uint8_t *data;
+  };
+
+  UringTransport(const int sock, const UringConfig &config);
+
+  /* SetupBuffers
+   * registers the receive buffers with the receive ring
+   * returns: false if the kernel wouldn't take them
+   */
+  bool SetupBuffers();
+  /* Recycle: gives a receive buffer back to the kernel */
+  void Recycle(const uint16_t id);
+  /* Arm
+   * posts the multishot receive if it isn't already, it stops when
+   * the kernel runs out of buffers or the thread that posted it exits
+   */
+  void Arm();
+  /* Take
+   * handles the receive completion at the front of the ring
+   * params:
+   *  data: out - the datagram, null if the completion didn't carry one
+   *  length: out - its length, cut off at the buffer
+   *  truncated: out - whether it was longer than the buffer
+   *  from: out - who sent it
+   * returns: the buffer to recycle once the datagram is copied out,
+   *  -1 if there is none
+   */
+  const int Take(const uint8_t **data, size_t *length, bool *truncated,
+                 sockaddr_in *from);
+  /* Reap
+   * frees the slots of sends that have completed. The caller holds
+   * m_send_mutex
+   */
+  void Reap();
+  /* Queue
+   * copies a datagram into a free slot and fills in its submission.
+   * The caller holds m_send_mutex
+   * returns: false if there's no free slot or submission
+   */
+  bool Queue(const uint8_t *data, const DatagramBatch *batch,
+             const size_t index, const size_t length,
+             const sockaddr_in &peer);
+  /* Cancel
+   * asks the kernel to cancel everything in flight on a ring, so none
+   * of our memory is used once it is freed. The cancellations still
+   * have to be waited for
+   */
+  void Cancel(Ring &ring);
+
+  int m_sock;
+  UringConfig m_config;
+  uint32_t m_buffer_len;
+
+  Ring m_receive;
+  // Interrupt submits to the receive ring from other threads
+  std::mutex m_receive_mutex;
+  bool m_armed;
+  // what the multishot receive is told about the buffers' layout
+  msghdr m_receive_header;
+  io_uring_buf_ring *m_buffer_ring;
+  size_t m_buffer_ring_bytes;
+  std::vector<uint8_t> m_buffers;
+
+  Ring m_send;
+  std::mutex m_send_mutex;
+  std::vector<SendSlot> m_slots;
+  std::vector<uint32_t> m_free_slots;
+  std::vector<uint8_t> m_send_buffers;
+};
+
+} // namespace Hev
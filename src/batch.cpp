@@ -0,0 +1,236 @@
+#include "batch.h"
+#include <algorithm>
+#include <cstring>
+#include <netinet/udp.h>
+
+namespace Hev {
+
+// a control message carrying a segment size, an int for UDP_GRO and a
+// uint16_t for UDP_SEGMENT
+static constexpr size_t CONTROL_LEN = CMSG_SPACE(sizeof(int));
+
+static bool SamePeer(const sockaddr_in &a, const sockaddr_in &b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+DatagramBatch::DatagramBatch(const size_t capacity, const size_t datagram_len)
+    : m_headers(capacity), m_iovecs(capacity * 2), m_iov_count(0),
+      m_addrs(capacity), m_buffers(datagram_len > 0 ? capacity : 0),
+      m_datagram_len(datagram_len), m_count(0),
+      m_controls(capacity * CONTROL_LEN), m_coalesced(false) {
+  for (auto &buffer : m_buffers) {
+    buffer = std::make_unique<uint8_t[]>(datagram_len);
+  }
+  m_runs.reserve(capacity);
+  m_run_lengths.reserve(capacity);
+}
+
+const int DatagramBatch::Receive(const int sock, const bool coalesced) {
+  m_count = 0;
+  m_iov_count = 0;
+  m_coalesced = false;
+  if (m_buffers.empty())
+    return -1;
+  if (coalesced && m_datagram_len < MAX_SEGMENTED_LEN) {
+    // anything shorter could cut off what the kernel coalesced
+    m_datagram_len = MAX_SEGMENTED_LEN;
+    for (auto &buffer : m_buffers)
+      buffer = std::make_unique<uint8_t[]>(m_datagram_len);
+  }
+  // the kernel overwrites the lengths so they are reset every call
+  for (size_t i = 0; i < m_headers.size(); i++) {
+    iovec *iov = &m_iovecs[i * 2];
+    *iov = {.iov_base = m_buffers[i].get(), .iov_len = m_datagram_len};
+    std::memset(&m_headers[i], 0, sizeof(mmsghdr));
+    m_headers[i].msg_hdr.msg_name = &m_addrs[i];
+    m_headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    m_headers[i].msg_hdr.msg_iov = iov;
+    m_headers[i].msg_hdr.msg_iovlen = 1;
+    if (coalesced) {
+      m_headers[i].msg_hdr.msg_control = &m_controls[i * CONTROL_LEN];
+      m_headers[i].msg_hdr.msg_controllen = CONTROL_LEN;
+    }
+  }
+  int received = recvmmsg(sock, m_headers.data(), m_headers.size(),
+                          MSG_DONTWAIT, nullptr);
+  if (received < 0)
+    return -1;
+  if (!coalesced) {
+    m_count = received;
+    return received;
+  }
+  // split each buffer back up at the segment size the kernel gave
+  m_coalesced = true;
+  m_segments.clear();
+  for (int i = 0; i < received; i++) {
+    msghdr &msg = m_headers[i].msg_hdr;
+    const size_t length = m_headers[i].msg_len;
+    size_t size = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+        continue;
+      int gso_size = 0;
+      std::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      size = gso_size;
+    }
+    // a datagram on its own
+    if (size == 0)
+      size = length;
+    size_t offset = 0;
+    do {
+      const size_t segment = std::min(size, length - offset);
+      m_segments.push_back({.message = uint32_t(i),
+                            .offset = uint32_t(offset),
+                            .length = uint32_t(segment),
+                            .truncated = false});
+      offset += segment;
+    } while (offset < length);
+    // only the end of what was handed over can be cut off
+    if (msg.msg_flags & MSG_TRUNC)
+      m_segments.back().truncated = true;
+  }
+  m_count = m_segments.size();
+  return m_count;
+}
+
+const bool DatagramBatch::Put(const uint8_t *data, const size_t length,
+                              const sockaddr_in &from, const bool truncated) {
+  if (m_count >= m_buffers.size())
+    return false;
+  const size_t kept = std::min(length, m_datagram_len);
+  std::memcpy(m_buffers[m_count].get(), data, kept);
+  std::memset(&m_headers[m_count], 0, sizeof(mmsghdr));
+  m_headers[m_count].msg_len = kept;
+  if (truncated || kept < length)
+    m_headers[m_count].msg_hdr.msg_flags = MSG_TRUNC;
+  m_addrs[m_count] = from;
+  m_count++;
+  return true;
+}
+
+const bool DatagramBatch::Add(const uint8_t *header, const size_t header_len,
+                              const uint8_t *payload, const size_t payload_len,
+                              const sockaddr_in &peer) {
+  if (m_count >= m_headers.size() || m_iov_count + 2 > m_iovecs.size())
+    return false;
+  m_addrs[m_count] = peer;
+  std::memset(&m_headers[m_count], 0, sizeof(mmsghdr));
+  m_headers[m_count].msg_hdr.msg_name = &m_addrs[m_count];
+  m_headers[m_count].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+  m_headers[m_count].msg_hdr.msg_iov = &m_iovecs[m_iov_count];
+  m_headers[m_count].msg_hdr.msg_iovlen = 0;
+  m_count++;
+  return Append(header, header_len, payload, payload_len);
+}
+
+const bool DatagramBatch::Append(const uint8_t *header, const size_t header_len,
+                                 const uint8_t *payload,
+                                 const size_t payload_len) {
+  if (m_count == 0 || m_iov_count + 2 > m_iovecs.size())
+    return false;
+  msghdr &msg = m_headers[m_count - 1].msg_hdr;
+  m_iovecs[m_iov_count++] = {.iov_base = const_cast<uint8_t *>(header),
+                             .iov_len = header_len};
+  msg.msg_iovlen++;
+  if (payload_len > 0) {
+    m_iovecs[m_iov_count++] = {.iov_base = const_cast<uint8_t *>(payload),
+                               .iov_len = payload_len};
+    msg.msg_iovlen++;
+  }
+  return true;
+}
+
+const int DatagramBatch::Send(const int sock, const size_t offset,
+                             const bool segment) {
+  if (offset >= m_count)
+    return 0;
+  if (segment) {
+    const int sent = SendSegmented(sock, offset);
+    if (sent != -2)
+      return sent;
+  }
+  return sendmmsg(sock, m_headers.data() + offset, m_count - offset, 0);
+}
+
+const int DatagramBatch::SendSegmented(const int sock, const size_t offset) {
+  m_runs.clear();
+  m_run_lengths.clear();
+  bool segmented = false;
+  for (size_t i = offset; i < m_count;) {
+    // every datagram in a run is the segment size except the last,
+    // which may be shorter. A datagram's iovecs come right after the
+    // one before's so the run's are too
+    const size_t size = Total(i);
+    size_t bytes = size;
+    size_t iov_len = m_headers[i].msg_hdr.msg_iovlen;
+    size_t end = i + 1;
+    while (end < m_count && end - i < MAX_SEGMENTS && size > 0 &&
+           SamePeer(m_addrs[end], m_addrs[i])) {
+      const size_t next = Total(end);
+      if (next > size || bytes + next > MAX_SEGMENTED_LEN)
+        break;
+      bytes += next;
+      iov_len += m_headers[end].msg_hdr.msg_iovlen;
+      end++;
+      if (next < size)
+        break;
+    }
+    mmsghdr run = {};
+    run.msg_hdr = m_headers[i].msg_hdr;
+    run.msg_hdr.msg_iovlen = iov_len;
+    if (end - i > 1) {
+      segmented = true;
+      run.msg_hdr.msg_control = &m_controls[m_runs.size() * CONTROL_LEN];
+      run.msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      cmsghdr *cmsg = CMSG_FIRSTHDR(&run.msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      const uint16_t gso_size = size;
+      std::memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+    m_runs.push_back(run);
+    m_run_lengths.push_back(end - i);
+    i = end;
+  }
+  if (!segmented)
+    return -2;
+  const int sent = sendmmsg(sock, m_runs.data(), m_runs.size(), 0);
+  if (sent < 0)
+    return -1;
+  size_t datagrams = 0;
+  for (int i = 0; i < sent; i++)
+    datagrams += m_run_lengths[i];
+  return datagrams;
+}
+
+const size_t DatagramBatch::Total(const size_t i) const {
+  const msghdr &msg = m_headers[i].msg_hdr;
+  size_t total = 0;
+  for (size_t j = 0; j < msg.msg_iovlen; j++)
+    total += msg.msg_iov[j].iov_len;
+  return total;
+}
+
+void DatagramBatch::Gather(const size_t i, uint8_t *out) const {
+  const msghdr &msg = m_headers[i].msg_hdr;
+  for (size_t j = 0; j < msg.msg_iovlen; j++) {
+    std::memcpy(out, msg.msg_iov[j].iov_base, msg.msg_iov[j].iov_len);
+    out += msg.msg_iov[j].iov_len;
+  }
+}
+
+std::vector<uint8_t> DatagramBatch::Flatten(const size_t i) const {
+  std::vector<uint8_t> data(Total(i));
+  Gather(i, data.data());
+  return data;
+}
+
+void DatagramBatch::Clear() {
+  m_count = 0;
+  m_iov_count = 0;
+  m_coalesced = false;
+}
+
+} // namespace Hev
@@ -0,0 +1,152 @@
+#include "bufferpool.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace Hev {
+
+void BufferDeleter::operator()(uint8_t *data) const {
+  if (!data)
+    return;
+  if (pooled)
+    BufferPool::Instance().Release(data);
+  else
+    delete[] data;
+}
+
+BufferPool::BufferPool() : m_capacity(DEFAULT_CAPACITY) {}
+
+BufferPool &BufferPool::Instance() {
+  // leaked on purpose so buffers freed during static destruction
+  // still have somewhere to go
+  static BufferPool *pool = new BufferPool();
+  return *pool;
+}
+
+BufferPool::ThreadCache &BufferPool::LocalCache() {
+  thread_local ThreadCache cache;
+  return cache;
+}
+
+BufferPool::ThreadCache::~ThreadCache() {
+  BufferPool &pool = BufferPool::Instance();
+  for (size_t i = 0; i < NUM_CLASSES; i++) {
+    std::lock_guard lock(pool.m_classes[i].mutex);
+    for (uint8_t *data : free[i]) {
+      if (pool.m_classes[i].free.size() < pool.m_capacity.load())
+        pool.m_classes[i].free.push_back(data);
+      else
+        pool.Free(data);
+    }
+    free[i].clear();
+  }
+}
+
+Buffer BufferPool::Acquire(const size_t length) {
+  size_t size_class = 0;
+  while (size_class < NUM_CLASSES && SIZE_CLASSES[size_class] < length)
+    size_class++;
+  // too big to pool
+  if (size_class == NUM_CLASSES)
+    return Buffer(new uint8_t[length]);
+
+  ThreadCache &cache = LocalCache();
+  auto &free = cache.free[size_class];
+  if (free.empty())
+    Refill(cache, size_class);
+
+  SizeClass &stats = m_classes[size_class];
+  uint8_t *data = nullptr;
+  if (!free.empty()) {
+    data = free.back();
+    free.pop_back();
+    stats.hits.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    data = Allocate(size_class);
+    stats.misses.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  size_t in_use = stats.in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+  size_t high_water = stats.high_water.load(std::memory_order_relaxed);
+  while (in_use > high_water &&
+         !stats.high_water.compare_exchange_weak(high_water, in_use,
+                                                 std::memory_order_relaxed)) {
+  }
+  return Buffer(data, BufferDeleter(true));
+}
+
+void BufferPool::Release(uint8_t *data) {
+  BlockHeader *header = reinterpret_cast<BlockHeader *>(data) - 1;
+  const size_t size_class = header->size_class;
+  m_classes[size_class].in_use.fetch_sub(1, std::memory_order_relaxed);
+
+  ThreadCache &cache = LocalCache();
+  cache.free[size_class].push_back(data);
+  if (cache.free[size_class].size() > THREAD_CACHE_LEN)
+    Spill(cache, size_class);
+}
+
+void BufferPool::SetCapacity(const size_t buffers_per_class) {
+  m_capacity = buffers_per_class;
+  for (auto &size_class : m_classes) {
+    std::lock_guard lock(size_class.mutex);
+    while (size_class.free.size() > buffers_per_class) {
+      Free(size_class.free.back());
+      size_class.free.pop_back();
+    }
+  }
+}
+
+std::vector<BufferPool::ClassStats> BufferPool::Stats() const {
+  std::vector<ClassStats> stats;
+  for (size_t i = 0; i < NUM_CLASSES; i++) {
+    const SizeClass &size_class = m_classes[i];
+    size_t cached = 0;
+    {
+      std::lock_guard lock(size_class.mutex);
+      cached = size_class.free.size();
+    }
+    stats.push_back({.size = SIZE_CLASSES[i],
+                     .in_use = size_class.in_use.load(),
+                     .high_water = size_class.high_water.load(),
+                     .cached = cached,
+                     .hits = size_class.hits.load(),
+                     .misses = size_class.misses.load()});
+  }
+  return stats;
+}
+
+uint8_t *BufferPool::Allocate(const size_t size_class) {
+  BlockHeader *header = static_cast<BlockHeader *>(
+      std::malloc(sizeof(BlockHeader) + SIZE_CLASSES[size_class]));
+  header->size_class = size_class;
+  return reinterpret_cast<uint8_t *>(header + 1);
+}
+
+void BufferPool::Free(uint8_t *data) {
+  std::free(reinterpret_cast<BlockHeader *>(data) - 1);
+}
+
+void BufferPool::Refill(ThreadCache &cache, const size_t size_class) {
+  SizeClass &shared = m_classes[size_class];
+  std::lock_guard lock(shared.mutex);
+  size_t count = std::min(shared.free.size(), THREAD_CACHE_LEN / 2);
+  auto &free = cache.free[size_class];
+  free.insert(free.end(), shared.free.end() - count, shared.free.end());
+  shared.free.resize(shared.free.size() - count);
+}
+
+void BufferPool::Spill(ThreadCache &cache, const size_t size_class) {
+  SizeClass &shared = m_classes[size_class];
+  auto &free = cache.free[size_class];
+  size_t count = free.size() / 2;
+  std::lock_guard lock(shared.mutex);
+  for (size_t i = 0; i < count; i++) {
+    if (shared.free.size() < m_capacity.load())
+      shared.free.push_back(free.back());
+    else
+      Free(free.back());
+    free.pop_back();
+  }
+}
+
+} // namespace Hev
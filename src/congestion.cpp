@@ -0,0 +1,98 @@
+#include "congestion.h"
+#include <algorithm>
+
+namespace Hev {
+
+void CongestionController::Stats::Merge(const Stats &other) {
+  window += other.window;
+  in_flight += other.in_flight;
+  pacing_rate += other.pacing_rate;
+  srtt = std::max(srtt, other.srtt);
+  min_rtt = std::max(min_rtt, other.min_rtt);
+  queue_delay = std::max(queue_delay, other.queue_delay);
+  losses += other.losses;
+  timeouts += other.timeouts;
+}
+
+NewRenoController::NewRenoController()
+    : m_window(INITIAL_WINDOW), m_ssthresh(SIZE_MAX) {}
+
+void NewRenoController::OnAck(const size_t bytes, const Micros,
+                              const Clock::time_point) {
+  if (m_window < m_ssthresh) {
+    // slow start
+    m_window += bytes;
+  } else {
+    // congestion avoidance, about a segment per window acknowledged
+    m_window += std::max<size_t>(SEGMENT * bytes / m_window, 1);
+  }
+}
+
+void NewRenoController::OnLoss(const bool timeout, const Micros srtt,
+                               const Clock::time_point now) {
+  if (now < m_recovery_end && !timeout)
+    return;
+  m_ssthresh = std::max(m_window / 2, MIN_WINDOW);
+  m_window = timeout ? MIN_WINDOW : m_ssthresh;
+  m_recovery_end = now + srtt;
+}
+
+double NewRenoController::PacingGain() const {
+  return m_window < m_ssthresh ? 2.0 : 1.25;
+}
+
+DelayController::DelayController()
+    : m_window(INITIAL_WINDOW), m_base_rtt(Micros::max()),
+      m_queue_delay(0) {}
+
+void DelayController::OnAck(const size_t bytes, const Micros rtt,
+                            const Clock::time_point) {
+  if (rtt.count() > 0) {
+    m_base_rtt = std::min(m_base_rtt, rtt);
+    m_queue_delay = rtt - m_base_rtt;
+  }
+  // off_target is 1 with no queueing and negative past the target
+  const double off_target =
+      static_cast<double>((TARGET - m_queue_delay).count()) / TARGET.count();
+  const double change = GAIN * off_target * bytes * SEGMENT / m_window;
+  if (change >= 0) {
+    m_window += std::max<size_t>(static_cast<size_t>(change), 1);
+    return;
+  }
+  // the cut can be bigger than the window when the queueing is well
+  // past the target, it must not wrap around
+  const size_t cut = static_cast<size_t>(-change);
+  m_window = m_window <= MIN_WINDOW + cut ? MIN_WINDOW : m_window - cut;
+}
+
+void DelayController::OnLoss(const bool timeout, const Micros srtt,
+                             const Clock::time_point now) {
+  if (now < m_recovery_end && !timeout)
+    return;
+  m_window = timeout ? MIN_WINDOW : std::max(m_window / 2, MIN_WINDOW);
+  m_recovery_end = now + srtt;
+}
+
+Pacer::Pacer() : m_rate(0), m_tokens(MIN_BURST), m_last(Clock::now()) {}
+
+bool Pacer::TryTake(const size_t bytes, const Clock::time_point now,
+                    Clock::time_point *next) {
+  const uint64_t rate = m_rate.load();
+  if (rate == 0)
+    return true;
+  const double burst = std::max<double>(
+      rate * std::chrono::duration<double>(BURST).count(), MIN_BURST);
+  m_tokens = std::min(
+      m_tokens + rate * std::chrono::duration<double>(now - m_last).count(),
+      burst);
+  m_last = now;
+  if (m_tokens <= 0) {
+    *next = now + std::chrono::duration_cast<Clock::duration>(
+                      std::chrono::duration<double>(-m_tokens / rate));
+    return false;
+  }
+  m_tokens -= bytes;
+  return true;
+}
+
+} // namespace Hev
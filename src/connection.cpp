@@ -0,0 +1,482 @@
+#include "connection.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace Hev {
+
+PeerKey MakePeerKey(const sockaddr_in &addr) {
+  // both are kept in network byte order, the key only needs to be unique
+  return (static_cast<PeerKey>(addr.sin_addr.s_addr) << 16) | addr.sin_port;
+}
+
+// how many packets the loss and retransmit averages are taken over
+static const int64_t AVERAGE_WEIGHT = 32;
+
+/* Average
+ * moves a moving average in millionths towards whether a packet hit
+ */
+static void Average(std::atomic<uint32_t> &average, const bool hit) {
+  const int64_t current = average.load(std::memory_order_relaxed);
+  average.store(current + ((hit ? 1000000 : 0) - current) / AVERAGE_WEIGHT,
+                std::memory_order_relaxed);
+}
+
+RttEstimator::RttEstimator()
+    : m_srtt(0), m_rttvar(0), m_jitter(0), m_rto(INITIAL_RTO.count()),
+      m_latest(0), m_min(0), m_has_sample(false) {}
+
+void RttEstimator::Sample(const Clock::duration rtt) {
+  const int64_t r = std::chrono::duration_cast<Micros>(rtt).count();
+  int64_t srtt = m_srtt.load();
+  int64_t rttvar = m_rttvar.load();
+  const int64_t previous = m_latest.exchange(r);
+  if (!m_has_sample.exchange(true)) {
+    srtt = r;
+    rttvar = r / 2;
+    m_min = r;
+  } else {
+    m_min = std::min(m_min.load(), r);
+    // J = J + (|D| - J) / 16
+    const int64_t jitter = m_jitter.load();
+    m_jitter = jitter + (std::llabs(r - previous) - jitter) / 16;
+    // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+    rttvar = (3 * rttvar + std::llabs(srtt - r)) / 4;
+    srtt = (7 * srtt + r) / 8;
+  }
+  int64_t rto = srtt + std::max<int64_t>(4 * rttvar, 1000);
+  rto = std::clamp<int64_t>(rto, MIN_RTO.count(), MAX_RTO.count());
+  m_srtt = srtt;
+  m_rttvar = rttvar;
+  m_rto = rto;
+}
+
+RateMeter::RateMeter()
+    : m_total(0), m_window(0), m_current(0), m_previous(0) {}
+
+void RateMeter::Add(const size_t bytes, const Clock::time_point now) {
+  m_total.fetch_add(bytes, std::memory_order_relaxed);
+  const int64_t window = now.time_since_epoch() / WINDOW;
+  int64_t counting = m_window.load();
+  if (window != counting &&
+      m_window.compare_exchange_strong(counting, window)) {
+    // what was counted is only the last whole window if it was the one
+    // right before, otherwise nothing went by in between
+    const uint64_t ended = m_current.exchange(bytes);
+    m_previous.store(window == counting + 1 ? ended : 0);
+    return;
+  }
+  m_current.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+uint64_t RateMeter::Rate(const Clock::time_point now) const {
+  const int64_t window = now.time_since_epoch() / WINDOW;
+  const int64_t counting = m_window.load();
+  // the window being counted is over, nothing was added since
+  if (window == counting + 1)
+    return m_current.load();
+  if (window == counting)
+    return m_previous.load();
+  return 0;
+}
+
+void ConnectionStats::Merge(const ConnectionStats &other) {
+  srtt = std::max(srtt, other.srtt);
+  latest_rtt = std::max(latest_rtt, other.latest_rtt);
+  min_rtt = std::max(min_rtt, other.min_rtt);
+  jitter = std::max(jitter, other.jitter);
+  loss = std::max(loss, other.loss);
+  retransmit_rate = std::max(retransmit_rate, other.retransmit_rate);
+  packets_sent += other.packets_sent;
+  retransmits += other.retransmits;
+  packets_lost += other.packets_lost;
+  bytes_in += other.bytes_in;
+  bytes_out += other.bytes_out;
+  bytes_in_per_sec += other.bytes_in_per_sec;
+  bytes_out_per_sec += other.bytes_out_per_sec;
+}
+
+Connection::Connection(const sockaddr_in &peer_addr)
+    : addr(peer_addr), key(MakePeerKey(peer_addr)), sequence(0),
+      mtu(DEFAULT_MTU), header_version(HeaderVersion::FULL),
+      last_heard(Clock::now()), m_inflight_bytes(0), m_losses(0),
+      m_timeouts(0), m_packets_sent(0), m_retransmits(0), m_packets_lost(0),
+      m_loss_ppm(0), m_retransmit_ppm(0), m_ping_sequence(0),
+      m_ping_sent_at(Clock::time_point::max()), m_receive_base(1),
+      m_receiving(false), m_highest_received(0), m_ack_bits(0),
+      m_ack_state(0), m_ack_due(Clock::time_point::max()), m_unreported(0) {}
+
+Connection::~Connection() {
+  // whatever is still unacked never will be
+  if (m_metrics)
+    m_metrics->unacked_packets.Add(-static_cast<int64_t>(m_unacked.size()));
+}
+
+uint32_t Connection::NextSequence() { return sequence.fetch_add(1); }
+
+void Connection::Heard() { last_heard.store(Clock::now()); }
+
+void Connection::Track(const SendPacket &packet, const Clock::time_point now) {
+  const Clock::time_point deadline = now + rtt.Rto();
+  std::lock_guard lock(m_unacked_mutex);
+  m_unacked[packet.sequence] = {.packet = packet,
+                                .sent_at = now,
+                                .deadline = deadline,
+                                .transmissions = 1,
+                                .fast_retransmit = false};
+  m_deadlines.emplace(deadline, packet.sequence);
+  m_inflight_bytes += packet.Length();
+  m_packets_sent.fetch_add(1, std::memory_order_relaxed);
+  Average(m_retransmit_ppm, false);
+  if (m_metrics)
+    m_metrics->unacked_packets.Add(1);
+}
+
+void Connection::Sent(const uint32_t sequence, const Clock::time_point now) {
+  std::lock_guard lock(m_unacked_mutex);
+  auto it = m_unacked.find(sequence);
+  if (it == m_unacked.end())
+    return;
+  // keep the same timeout, counted from now. The old deadline is
+  // skipped once it comes up
+  Inflight &inflight = it->second;
+  inflight.deadline = now + (inflight.deadline - inflight.sent_at);
+  inflight.sent_at = now;
+  m_deadlines.emplace(inflight.deadline, sequence);
+}
+
+size_t Connection::Acknowledge(const AckState &state,
+                               const Clock::time_point now) {
+  if (state.bits == 0)
+    return 0;
+  size_t released = 0;
+  size_t released_bytes = 0;
+  RttEstimator::Micros sample(0);
+  std::lock_guard lock(m_unacked_mutex);
+  for (uint32_t i = 0; i < ACK_WINDOW; i++) {
+    if (!(state.bits & (1u << i)))
+      continue;
+    auto it = m_unacked.find(state.ack - i);
+    if (it == m_unacked.end())
+      continue;
+    // a retransmitted packet's ACK could be for any of the copies and
+    // the older ones waited on a later packet to be acknowledged
+    if (i == 0 && it->second.transmissions == 1) {
+      sample = std::chrono::duration_cast<RttEstimator::Micros>(
+          now - it->second.sent_at);
+      rtt.Sample(sample);
+      if (m_metrics)
+        m_metrics->rtt.Record(sample.count());
+    }
+    released_bytes += it->second.packet.Length();
+    m_unacked.erase(it);
+    released++;
+    Average(m_loss_ppm, false);
+  }
+  m_inflight_bytes -= released_bytes;
+  if (m_metrics)
+    m_metrics->unacked_packets.Add(-static_cast<int64_t>(released));
+
+  // anything still missing with enough acked after it was lost, send
+  // it again now rather than waiting out its timeout
+  bool lost = false;
+  for (uint32_t i = LOSS_THRESHOLD; i < ACK_WINDOW; i++) {
+    const uint32_t acked_after =
+        __builtin_popcount(state.bits & ((1u << i) - 1));
+    if (state.bits & (1u << i) || acked_after < LOSS_THRESHOLD)
+      continue;
+    auto it = m_unacked.find(state.ack - i);
+    if (it == m_unacked.end() || it->second.transmissions > 1 ||
+        it->second.fast_retransmit)
+      continue;
+    it->second.fast_retransmit = true;
+    it->second.deadline = now;
+    m_deadlines.emplace(now, it->first);
+    lost = true;
+    m_packets_lost.fetch_add(1, std::memory_order_relaxed);
+    Average(m_loss_ppm, true);
+  }
+
+  if (m_congestion) {
+    if (released_bytes > 0)
+      m_congestion->OnAck(released_bytes, sample, now);
+    if (lost) {
+      m_congestion->OnLoss(false, rtt.Srtt(), now);
+      m_losses++;
+    }
+    UpdatePacing();
+  }
+  return released;
+}
+
+void Connection::CollectExpired(const Clock::time_point now,
+                                std::vector<SendPacket> &expired) {
+  std::lock_guard lock(m_unacked_mutex);
+  bool timed_out = false;
+  while (!m_deadlines.empty() && m_deadlines.top().first <= now) {
+    const auto [deadline, expired_seq] = m_deadlines.top();
+    m_deadlines.pop();
+    auto it = m_unacked.find(expired_seq);
+    // acked since it was scheduled, or rescheduled for a fast retransmit
+    if (it == m_unacked.end() || it->second.deadline != deadline)
+      continue;
+    Inflight &inflight = it->second;
+    // fast retransmits were counted lost when they were found
+    if (inflight.fast_retransmit) {
+      inflight.fast_retransmit = false;
+    } else {
+      timed_out = true;
+      m_packets_lost.fetch_add(1, std::memory_order_relaxed);
+      Average(m_loss_ppm, true);
+    }
+    m_retransmits.fetch_add(1, std::memory_order_relaxed);
+    Average(m_retransmit_ppm, true);
+    // exponential backoff, each retransmit waits twice as long
+    auto backoff = rtt.Rto();
+    for (uint32_t i = 0;
+         i < inflight.transmissions && backoff < RttEstimator::MAX_RTO; i++)
+      backoff *= 2;
+    backoff = std::min(backoff, RttEstimator::MAX_RTO);
+    inflight.transmissions++;
+    inflight.sent_at = now;
+    inflight.deadline = now + backoff;
+    m_deadlines.emplace(inflight.deadline, expired_seq);
+    expired.push_back(inflight.packet);
+  }
+  if (timed_out && m_congestion) {
+    m_congestion->OnLoss(true, rtt.Srtt(), now);
+    m_timeouts++;
+    UpdatePacing();
+  }
+}
+
+Connection::Clock::time_point Connection::NextDeadline() {
+  std::lock_guard lock(m_unacked_mutex);
+  // the top may be for a packet acked since, going off early for it
+  // only costs a look at the heap
+  if (m_deadlines.empty())
+    return Clock::time_point::max();
+  return m_deadlines.top().first;
+}
+
+void Connection::SetCongestionControl(
+    std::unique_ptr<CongestionController> controller) {
+  std::lock_guard lock(m_unacked_mutex);
+  m_congestion = std::move(controller);
+  UpdatePacing();
+}
+
+void Connection::SetMetrics(std::shared_ptr<Metrics> metrics) {
+  std::lock_guard lock(m_unacked_mutex);
+  m_metrics = std::move(metrics);
+}
+
+bool Connection::WindowOpen(const size_t bytes) {
+  std::lock_guard lock(m_unacked_mutex);
+  return !m_congestion || m_inflight_bytes == 0 ||
+         m_inflight_bytes + bytes <= m_congestion->Window();
+}
+
+bool Connection::Pace(const size_t bytes, const Clock::time_point now,
+                      Clock::time_point *next) {
+  return m_pacer.TryTake(bytes, now, next);
+}
+
+void Connection::UpdatePacing() {
+  const auto srtt = rtt.Srtt();
+  // nothing to go on until the first round trip is measured
+  if (!m_congestion || srtt.count() == 0) {
+    m_pacer.SetRate(0);
+    return;
+  }
+  m_pacer.SetRate(static_cast<uint64_t>(m_congestion->PacingGain() *
+                                        m_congestion->Window() * 1000000 /
+                                        srtt.count()));
+}
+
+CongestionController::Stats Connection::CongestionStats() {
+  std::lock_guard lock(m_unacked_mutex);
+  const auto latest = rtt.Latest();
+  const auto min = rtt.Min();
+  return {.window = m_congestion ? m_congestion->Window() : 0,
+          .in_flight = m_inflight_bytes,
+          .pacing_rate = m_pacer.Rate(),
+          .srtt = rtt.Srtt(),
+          .min_rtt = min,
+          .queue_delay = latest - min,
+          .losses = m_losses,
+          .timeouts = m_timeouts};
+}
+
+void Connection::Pinged(const uint32_t sequence, const Clock::time_point now) {
+  m_ping_sequence.store(sequence);
+  m_ping_sent_at.store(now);
+}
+
+void Connection::Ponged(const uint32_t sequence, const Clock::time_point now) {
+  Clock::time_point sent_at = m_ping_sent_at.load();
+  if (sent_at == Clock::time_point::max() ||
+      sequence != m_ping_sequence.load())
+    return;
+  // only the first PONG to a PING is timed
+  if (!m_ping_sent_at.compare_exchange_strong(sent_at,
+                                              Clock::time_point::max()))
+    return;
+  const auto sample =
+      std::chrono::duration_cast<RttEstimator::Micros>(now - sent_at);
+  rtt.Sample(sample);
+  if (m_metrics)
+    m_metrics->rtt.Record(sample.count());
+}
+
+ConnectionStats Connection::Stats(const Clock::time_point now) const {
+  return {.srtt = rtt.Srtt(),
+          .latest_rtt = rtt.Latest(),
+          .min_rtt = rtt.Min(),
+          .jitter = rtt.Jitter(),
+          .loss = m_loss_ppm.load(std::memory_order_relaxed) / 1e6f,
+          .retransmit_rate =
+              m_retransmit_ppm.load(std::memory_order_relaxed) / 1e6f,
+          .packets_sent = m_packets_sent.load(std::memory_order_relaxed),
+          .retransmits = m_retransmits.load(std::memory_order_relaxed),
+          .packets_lost = m_packets_lost.load(std::memory_order_relaxed),
+          .bytes_in = inbound.Total(),
+          .bytes_out = outbound.Total(),
+          .bytes_in_per_sec = inbound.Rate(now),
+          .bytes_out_per_sec = outbound.Rate(now)};
+}
+
+size_t Connection::UnackedCount() {
+  std::lock_guard lock(m_unacked_mutex);
+  return m_unacked.size();
+}
+
+uint32_t Connection::UnackedSpan() {
+  std::lock_guard lock(m_unacked_mutex);
+  if (m_unacked.empty())
+    return 0;
+  return sequence.load() - m_unacked.begin()->first;
+}
+
+void Connection::ExpectSequence(const uint32_t first) {
+  if (m_receiving)
+    return;
+  m_receive_base = first;
+}
+
+bool Connection::MarkNewest(const uint8_t channel,
+                            const uint32_t channel_sequence) {
+  ChannelState &state = channels[channel];
+  if (state.newest_received != 0 &&
+      static_cast<int32_t>(channel_sequence - state.newest_received) <= 0)
+    return false;
+  state.newest_received = channel_sequence;
+  return true;
+}
+
+ReorderBuffer::Stats Connection::ReorderStats() const {
+  ReorderBuffer::Stats stats = {};
+  for (const auto &channel : channels)
+    stats.Merge(channel.reorder.GetStats());
+  return stats;
+}
+
+void Connection::ExpandHeader(TBHeader &header) {
+  // acks are of what we sent lately
+  if (header.ack_bits != 0)
+    header.ack = ExpandSequence(header.ack, sequence.load());
+  if (header.type == PacketType::ACK)
+    header.sequence = header.ack;
+  if (header.type != PacketType::MSG || header.channel >= Channel::COUNT)
+    return;
+  if (Channel::IsReliable(header.channel))
+    header.sequence = ExpandSequence(
+        header.sequence, m_receiving ? m_highest_received : m_receive_base);
+  ChannelState &state = channels[header.channel];
+  header.channel_sequence =
+      ExpandSequence(header.channel_sequence, state.highest_received);
+  if (static_cast<int32_t>(header.channel_sequence -
+                           state.highest_received) > 0)
+    state.highest_received = header.channel_sequence;
+}
+
+bool Connection::RaiseMtu(const uint32_t probed) {
+  uint32_t current = mtu.load();
+  while (probed > current && !mtu.compare_exchange_weak(current, probed)) {
+  }
+  return probed > current;
+}
+
+bool Connection::InReceiveWindow(const uint32_t sequence) const {
+  return static_cast<int32_t>(sequence - m_receive_base) <
+         static_cast<int32_t>(RECEIVE_WINDOW);
+}
+
+bool Connection::WasReceived(const uint32_t sequence) const {
+  return static_cast<int32_t>(sequence - m_receive_base) < 0 ||
+         m_received_ahead.count(sequence) > 0;
+}
+
+bool Connection::MarkReceived(const uint32_t sequence) {
+  if (WasReceived(sequence) || !InReceiveWindow(sequence))
+    return false;
+  const bool first = !m_receiving;
+  m_receiving = true;
+
+  if (first || static_cast<int32_t>(sequence - m_highest_received) > 0) {
+    const uint32_t shift = sequence - m_highest_received;
+    m_ack_bits = shift < ACK_WINDOW ? m_ack_bits << shift : 0;
+    m_ack_bits |= 1;
+    m_highest_received = sequence;
+  } else if (m_highest_received - sequence < ACK_WINDOW) {
+    m_ack_bits |= 1u << (m_highest_received - sequence);
+  }
+  m_ack_state.store(static_cast<uint64_t>(m_highest_received) << 32 |
+                    m_ack_bits);
+
+  if (sequence != m_receive_base) {
+    m_received_ahead.insert(sequence);
+    return true;
+  }
+  // slide past everything that is now contiguous, looked up one by one
+  // since the set's order breaks where the sequences wrap
+  m_receive_base++;
+  while (m_received_ahead.erase(m_receive_base) > 0)
+    m_receive_base++;
+  return true;
+}
+
+bool Connection::InAckWindow(const uint32_t sequence) const {
+  return static_cast<int32_t>(m_highest_received - sequence) >= 0 &&
+         m_highest_received - sequence < ACK_WINDOW;
+}
+
+Connection::AckState Connection::TakeAck() {
+  m_ack_due.store(Clock::time_point::max());
+  m_unreported.store(0);
+  const uint64_t state = m_ack_state.load();
+  return {.ack = static_cast<uint32_t>(state >> 32),
+          .bits = static_cast<uint32_t>(state)};
+}
+
+bool Connection::ScheduleAck(const Clock::time_point due) {
+  if (m_unreported.fetch_add(1) + 1 >= ACK_WINDOW / 2) {
+    m_unreported.store(0);
+    return true;
+  }
+  Clock::time_point current = m_ack_due.load();
+  while (due < current && !m_ack_due.compare_exchange_weak(current, due)) {
+  }
+  return false;
+}
+
+bool Connection::AckDue(const Clock::time_point now) {
+  Clock::time_point due = m_ack_due.load();
+  return due <= now &&
+         m_ack_due.compare_exchange_strong(due, Clock::time_point::max());
+}
+
+Connection::Clock::time_point Connection::AckDeadline() const {
+  return m_ack_due.load();
+}
+
+} // namespace Hev
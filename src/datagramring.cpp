@@ -0,0 +1,81 @@
+#include "datagramring.h"
+#include "ringqueue.h"
+#include <new>
+
+namespace Hev {
+
+size_t DatagramRing::Stride(const size_t slot_len) {
+  return (sizeof(Slot) + slot_len + 63) / 64 * 64;
+}
+
+size_t DatagramRing::Bytes(const size_t capacity, const size_t slot_len) {
+  return sizeof(Header) + RoundUpCapacity(capacity) * Stride(slot_len);
+}
+
+DatagramRing DatagramRing::Create(void *memory, const size_t capacity,
+                                  const size_t slot_len) {
+  DatagramRing ring;
+  ring.m_header = new (memory) Header();
+  ring.m_header->capacity = RoundUpCapacity(capacity);
+  ring.m_header->slot_len = slot_len;
+  // nobody has looked yet, so the first datagram rings
+  ring.m_header->waiting.store(1, std::memory_order_relaxed);
+  ring.m_slots = static_cast<uint8_t *>(memory) + sizeof(Header);
+  ring.m_stride = Stride(slot_len);
+  for (size_t i = 0; i < ring.m_header->capacity; i++) {
+    Slot *slot = new (ring.m_slots + i * ring.m_stride) Slot();
+    slot->sequence.store(i, std::memory_order_relaxed);
+  }
+  ring.m_header->magic.store(MAGIC, std::memory_order_release);
+  return ring;
+}
+
+DatagramRing DatagramRing::Attach(void *memory, const size_t bytes) {
+  DatagramRing ring;
+  Header *header = static_cast<Header *>(memory);
+  if (bytes < sizeof(Header) ||
+      header->magic.load(std::memory_order_acquire) != MAGIC ||
+      bytes < Bytes(header->capacity, header->slot_len))
+    return ring;
+  ring.m_header = header;
+  ring.m_slots = static_cast<uint8_t *>(memory) + sizeof(Header);
+  ring.m_stride = Stride(header->slot_len);
+  return ring;
+}
+
+const bool DatagramRing::Empty() const {
+  const uint64_t head = m_header->head.load(std::memory_order_relaxed);
+  return SlotAt(head)->sequence.load(std::memory_order_acquire) != head + 1;
+}
+
+void DatagramRing::Sleep() {
+  m_header->waiting.store(1, std::memory_order_relaxed);
+  // pairs with the fence in Wake, either we see the datagram or the
+  // producer sees us waiting
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+const bool DatagramRing::Wake() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return m_header->waiting.load(std::memory_order_relaxed) != 0 &&
+         m_header->waiting.exchange(0, std::memory_order_relaxed) != 0;
+}
+
+const bool DatagramRing::TakeRung() {
+  return m_header->rung.load(std::memory_order_relaxed) != 0 &&
+         m_header->rung.exchange(0, std::memory_order_acquire) != 0;
+}
+
+void DatagramRing::Ring() {
+  m_header->rung.store(1, std::memory_order_release);
+}
+
+void DatagramRing::Close() {
+  m_header->closed.store(1, std::memory_order_release);
+}
+
+const bool DatagramRing::Closed() const {
+  return m_header->closed.load(std::memory_order_acquire) != 0;
+}
+
+} // namespace Hev
@@ -0,0 +1,33 @@
+#include "handler.h"
+#include <utility>
+
+namespace Hev {
+
+HandlerRegistry::HandlerRegistry() : m_count(0) {}
+
+void HandlerRegistry::Set(const uint8_t type, Handler handler) {
+  if (m_handlers[type])
+    m_count--;
+  m_handlers[type] = handler
+                        ? std::make_shared<const Handler>(std::move(handler))
+                        : nullptr;
+  if (m_handlers[type])
+    m_count++;
+}
+
+const Handler *HandlerRegistry::Find(const uint8_t *payload,
+                                     const size_t length) const {
+  // nothing to tell the type by
+  if (m_count == 0 || length == 0 || !payload)
+    return nullptr;
+  return m_handlers[payload[0]].get();
+}
+
+std::shared_ptr<const Handler>
+HandlerRegistry::Share(const uint8_t type) const {
+  return m_handlers[type];
+}
+
+bool HandlerRegistry::Empty() const { return m_count == 0; }
+
+} // namespace Hev
@@ -0,0 +1,117 @@
+#include "impairment.h"
+#include <algorithm>
+
+namespace Hev {
+
+// so both directions don't make the same choices for the same seed
+static const uint64_t INBOUND_SEED = 0x9e3779b97f4a7c15;
+
+static bool Later(const ImpairedLink::Datagram &a,
+                  const ImpairedLink::Datagram &b) {
+  return a.due != b.due ? a.due > b.due : a.order > b.order;
+}
+
+bool LinkConditions::Active() const {
+  return loss > 0 || delay.count() > 0 || jitter.count() > 0 ||
+         duplicate > 0 || reorder > 0 || bandwidth > 0;
+}
+
+ImpairedLink::ImpairedLink(const LinkConditions &conditions,
+                           const uint64_t seed)
+    : m_conditions(conditions), m_random(seed), m_chance(0, 1), m_order(0),
+      m_free_at(Clock::time_point::min()), m_stats() {}
+
+void ImpairedLink::Submit(std::vector<uint8_t> data, const sockaddr_in &peer,
+                          const Clock::time_point now) {
+  std::lock_guard lock(m_mutex);
+  m_stats.submitted++;
+  // every choice is drawn whether or not it is turned on, so changing
+  // one condition doesn't change what happens because of the others
+  const bool lost = m_chance(m_random) < m_conditions.loss;
+  const bool reordered = m_chance(m_random) < m_conditions.reorder;
+  const double jitter = m_chance(m_random);
+  const bool duplicated = m_chance(m_random) < m_conditions.duplicate;
+  const double duplicate_jitter = m_chance(m_random);
+  if (lost) {
+    m_stats.lost++;
+    return;
+  }
+  Clock::time_point due;
+  if (!Due(data.size(), now, reordered, jitter, &due))
+    return;
+  if (reordered &&
+      (m_conditions.delay.count() > 0 || m_conditions.jitter.count() > 0))
+    m_stats.reordered++;
+  // the copy goes out behind the original
+  Clock::time_point copy_due;
+  if (duplicated &&
+      Due(data.size(), now, false, duplicate_jitter, &copy_due)) {
+    m_stats.duplicated++;
+    Hold(data, peer, copy_due);
+  }
+  Hold(std::move(data), peer, due);
+}
+
+size_t ImpairedLink::Release(const Clock::time_point now,
+                             std::vector<Datagram> &due, const size_t max) {
+  std::lock_guard lock(m_mutex);
+  size_t released = 0;
+  while (released < max && !m_held.empty() && m_held.front().due <= now) {
+    std::pop_heap(m_held.begin(), m_held.end(), Later);
+    due.push_back(std::move(m_held.back()));
+    m_held.pop_back();
+    released++;
+  }
+  return released;
+}
+
+ImpairedLink::Clock::time_point ImpairedLink::NextDue() {
+  std::lock_guard lock(m_mutex);
+  return m_held.empty() ? Clock::time_point::max() : m_held.front().due;
+}
+
+ImpairedLink::Stats ImpairedLink::GetStats() {
+  std::lock_guard lock(m_mutex);
+  return m_stats;
+}
+
+void ImpairedLink::Hold(std::vector<uint8_t> data, const sockaddr_in &peer,
+                        const Clock::time_point due) {
+  m_held.push_back({.data = std::move(data),
+                    .peer = peer,
+                    .due = due,
+                    .order = m_order++});
+  std::push_heap(m_held.begin(), m_held.end(), Later);
+}
+
+bool ImpairedLink::Due(const size_t length, const Clock::time_point now,
+                       const bool reordered, const double jitter,
+                       Clock::time_point *due) {
+  Clock::time_point sent = now;
+  if (m_conditions.bandwidth > 0) {
+    // what is still queued ahead of it has to go out first
+    const Clock::time_point start = std::max(m_free_at, now);
+    const auto queued = std::chrono::duration<double>(start - now).count() *
+                        m_conditions.bandwidth;
+    if (queued + length > m_conditions.queue_limit) {
+      m_stats.overflowed++;
+      return false;
+    }
+    m_free_at = start + std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double>(
+                                double(length) / m_conditions.bandwidth));
+    sent = m_free_at;
+  }
+  *due = sent;
+  if (!reordered)
+    *due += m_conditions.delay +
+            std::chrono::duration_cast<Clock::duration>(
+                m_conditions.jitter * jitter);
+  return true;
+}
+
+Impairment::Impairment(const ImpairmentConfig &config)
+    : outbound(config.outbound, config.seed),
+      inbound(config.inbound, config.seed ^ INBOUND_SEED) {}
+
+} // namespace Hev
@@ -0,0 +1,422 @@
+#include "localtransport.h"
+#include "errors.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Hev {
+
+/* LocalNetwork
+ * every LocalTransport in the process by port, only looked in the
+ * first time a transport sends to a port
+ */
+struct LocalNetwork {
+  std::shared_mutex mutex;
+  std::unordered_map<uint16_t, std::shared_ptr<LocalTransport::Peer>>
+      transports;
+};
+
+static LocalNetwork &Network() {
+  static LocalNetwork network;
+  return network;
+}
+
+// the address datagrams from a transport bound to it come from
+static bool LocalAddress(const char *local_addr, const int local_port,
+                         sockaddr_in *addr) {
+  if (local_port <= 0 || local_port > UINT16_MAX)
+    return false;
+  *addr = {};
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(local_port);
+  if (inet_pton(AF_INET, local_addr, &addr->sin_addr) != 1)
+    return false;
+  if (addr->sin_addr.s_addr == htonl(INADDR_ANY))
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return true;
+}
+
+static void *MapRing(const int fd, const size_t bytes) {
+  void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                      fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+  return memory == MAP_FAILED ? nullptr : memory;
+}
+
+static std::string ShmName(const uint16_t port) {
+  return "/hevnet-" + std::to_string(port);
+}
+
+// in the abstract namespace, so it goes away with the socket
+static socklen_t BellAddress(const uint16_t port, sockaddr_un *addr) {
+  *addr = {};
+  addr->sun_family = AF_UNIX;
+  const std::string name = "hevnet-" + std::to_string(port);
+  std::memcpy(addr->sun_path + 1, name.data(), name.size());
+  return offsetof(sockaddr_un, sun_path) + 1 + name.size();
+}
+
+void RingTransport::Outgoing::CopyTo(uint8_t *out) const {
+  if (batch)
+    batch->Gather(index, out);
+  else
+    std::memcpy(out, data, length);
+}
+
+RingTransport::RingTransport(const sockaddr_in &local, void *memory,
+                             const size_t bytes, const int bell)
+    : m_local(local), m_memory(memory), m_bytes(bytes),
+      m_ring(DatagramRing::Attach(memory, bytes)), m_bell(bell) {}
+
+RingTransport::~RingTransport() {
+  m_ring.Close();
+  munmap(m_memory, m_bytes);
+  close(m_bell);
+}
+
+const int RingTransport::Receive(DatagramBatch &batch) {
+  batch.Clear();
+  const bool rung = m_ring.TakeRung();
+  auto put = [&](const uint8_t *data, const size_t length,
+                 const sockaddr_in &from) { batch.Put(data, length, from); };
+  while (batch.Size() < batch.Capacity() && m_ring.Pop(put))
+    ;
+  // woken for nothing means a producer rang and hasn't said so yet,
+  // the doorbell has to be cleared or we'd be woken again right away
+  // until it does
+  if (rung || batch.Size() == 0)
+    ClearBell();
+  // have the next datagram wake us, then take whatever came in while
+  // we weren't asleep yet
+  m_ring.Sleep();
+  while (batch.Size() < batch.Capacity() && m_ring.Pop(put))
+    ;
+  // a reactor won't come back for what's left over on its own
+  if (!m_ring.Empty())
+    RingSelf();
+  return batch.Size();
+}
+
+const int RingTransport::ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                                     sockaddr_in *from) {
+  const bool rung = m_ring.TakeRung();
+  int received = -1;
+  auto take = [&](const uint8_t *data, const size_t length,
+                  const sockaddr_in &sender) {
+    received = std::min(length, buffer_len);
+    std::memcpy(buffer, data, received);
+    *from = sender;
+  };
+  // the same as Receive, whatever happens the next datagram either
+  // finds us asleep or the doorbell already rung
+  const bool popped = m_ring.Pop(take);
+  if (rung || !popped)
+    ClearBell();
+  m_ring.Sleep();
+  if (!popped)
+    m_ring.Pop(take);
+  if (!m_ring.Empty())
+    RingSelf();
+  return received;
+}
+
+const int RingTransport::Send(DatagramBatch &batch, const size_t offset) {
+  for (size_t i = offset; i < batch.Size(); i++)
+    Deliver({.data = nullptr, .batch = &batch, .index = i,
+             .length = batch.Total(i)},
+            batch.Address(i));
+  return batch.Size() > offset ? batch.Size() - offset : 0;
+}
+
+const int RingTransport::SendTo(const uint8_t *data, const size_t length,
+                                const sockaddr_in &peer) {
+  Deliver({.data = data, .batch = nullptr, .index = 0, .length = length},
+          peer);
+  return length;
+}
+
+const int RingTransport::Wait(const bool write,
+                              const std::chrono::microseconds timeout) {
+  // there's always room, a full ring loses datagrams like a full
+  // socket buffer does
+  if (write || !m_ring.Empty())
+    return 0;
+  m_ring.Sleep();
+  if (!m_ring.Empty())
+    return 0;
+  pollfd bell = {.fd = m_bell, .events = POLLIN, .revents = 0};
+  const timespec wait = {.tv_sec = timeout.count() / 1000000,
+                         .tv_nsec = timeout.count() % 1000000 * 1000};
+  const int ready = ppoll(&bell, 1, &wait, nullptr);
+  if (ready == 0)
+    return TIMEOUT;
+  return ready < 0 ? -1 : 0;
+}
+
+bool RingTransport::Push(DatagramRing &ring, const Outgoing &datagram,
+                         bool *wake) const {
+  if (!ring.Push(datagram.length, m_local,
+                 [&](uint8_t *out) { datagram.CopyTo(out); }))
+    return false;
+  *wake = ring.Wake();
+  return true;
+}
+
+std::unique_ptr<Transport> LocalTransport::Bind(const char *local_addr,
+                                                const int local_port,
+                                                const size_t capacity) {
+  sockaddr_in local;
+  if (!LocalAddress(local_addr, local_port, &local))
+    return nullptr;
+  // mapped twice, once for the transport and once for its senders, so
+  // either can unmap theirs while the other is still using it
+  const size_t bytes = DatagramRing::Bytes(capacity, SLOT_LEN);
+  const int fd = memfd_create("hevnet-local", MFD_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  void *memory = nullptr;
+  void *shared = nullptr;
+  if (ftruncate(fd, bytes) == 0) {
+    memory = MapRing(fd, bytes);
+    shared = MapRing(fd, bytes);
+  }
+  close(fd);
+  const int bell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  const int shared_bell = bell < 0 ? -1 : dup(bell);
+  if (!memory || !shared || shared_bell < 0) {
+    if (memory)
+      munmap(memory, bytes);
+    if (shared)
+      munmap(shared, bytes);
+    if (bell >= 0)
+      close(bell);
+    return nullptr;
+  }
+  DatagramRing::Create(memory, capacity, SLOT_LEN);
+  // made in place, a copy would unmap it when it went away
+  std::shared_ptr<Peer> self(new Peer{.memory = shared, .bytes = bytes,
+                                      .ring = {}, .bell = shared_bell});
+  self->ring = DatagramRing::Attach(shared, bytes);
+  std::unique_ptr<LocalTransport> transport(
+      new LocalTransport(local, memory, bytes, bell, self));
+  LocalNetwork &network = Network();
+  std::lock_guard lock(network.mutex);
+  if (!network.transports.emplace(local_port, std::move(self)).second)
+    return nullptr;
+  return transport;
+}
+
+LocalTransport::LocalTransport(const sockaddr_in &local, void *memory,
+                               const size_t bytes, const int bell,
+                               std::shared_ptr<Peer> self)
+    : RingTransport(local, memory, bytes, bell), m_self(std::move(self)) {}
+
+LocalTransport::~LocalTransport() {
+  // senders that already have the ring see it closed, the rest don't
+  // find it
+  LocalNetwork &network = Network();
+  std::lock_guard lock(network.mutex);
+  auto it = network.transports.find(ntohs(m_local.sin_port));
+  if (it != network.transports.end() && it->second == m_self)
+    network.transports.erase(it);
+}
+
+LocalTransport::Peer::~Peer() {
+  munmap(memory, bytes);
+  close(bell);
+}
+
+bool LocalTransport::Deliver(const Outgoing &datagram,
+                             const sockaddr_in &peer) {
+  const uint16_t port = ntohs(peer.sin_port);
+  while (true) {
+    {
+      std::shared_lock lock(m_peers_mutex);
+      auto it = m_peers.find(port);
+      if (it != m_peers.end() && !it->second->ring.Closed()) {
+        bool wake = false;
+        if (!Push(it->second->ring, datagram, &wake))
+          return false;
+        if (wake)
+          Wake(*it->second);
+        return true;
+      }
+    }
+    // a peer we haven't sent to yet, or one that unbound and may have
+    // been bound again
+    std::lock_guard lock(m_peers_mutex);
+    if (!Open(port))
+      return false;
+  }
+}
+
+bool LocalTransport::Open(const uint16_t port) {
+  auto it = m_peers.find(port);
+  if (it != m_peers.end()) {
+    // another thread got to it first
+    if (!it->second->ring.Closed())
+      return true;
+    m_peers.erase(it);
+  }
+  LocalNetwork &network = Network();
+  std::shared_lock lock(network.mutex);
+  auto found = network.transports.find(port);
+  if (found == network.transports.end())
+    return false;
+  m_peers[port] = found->second;
+  return true;
+}
+
+void LocalTransport::RingSelf() { Wake(*m_self); }
+
+void LocalTransport::ClearBell() {
+  uint64_t count = 0;
+  read(m_bell, &count, sizeof(count));
+}
+
+void LocalTransport::Wake(Peer &peer) {
+  const uint64_t one = 1;
+  write(peer.bell, &one, sizeof(one));
+  peer.ring.Ring();
+}
+
+std::unique_ptr<Transport>
+SharedMemoryTransport::Bind(const char *local_addr, const int local_port,
+                            const size_t capacity) {
+  sockaddr_in local;
+  if (!LocalAddress(local_addr, local_port, &local))
+    return nullptr;
+  // the doorbell is claimed first, binding it fails while another
+  // process has the port
+  const int bell =
+      socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (bell < 0)
+    return nullptr;
+  sockaddr_un bell_addr;
+  const socklen_t bell_len = BellAddress(local_port, &bell_addr);
+  if (bind(bell, (const sockaddr *)&bell_addr, bell_len) < 0) {
+    close(bell);
+    return nullptr;
+  }
+  // so whatever is there was left behind by a process that died
+  const std::string name = ShmName(local_port);
+  shm_unlink(name.c_str());
+  const int fd =
+      shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+  const size_t bytes = DatagramRing::Bytes(capacity, SLOT_LEN);
+  void *memory = nullptr;
+  if (fd >= 0 && ftruncate(fd, bytes) == 0)
+    memory = MapRing(fd, bytes);
+  if (fd >= 0)
+    close(fd);
+  if (!memory) {
+    shm_unlink(name.c_str());
+    close(bell);
+    return nullptr;
+  }
+  DatagramRing::Create(memory, capacity, SLOT_LEN);
+  return std::unique_ptr<Transport>(
+      new SharedMemoryTransport(local, memory, bytes, bell));
+}
+
+SharedMemoryTransport::SharedMemoryTransport(const sockaddr_in &local,
+                                             void *memory, const size_t bytes,
+                                             const int bell)
+    : RingTransport(local, memory, bytes, bell) {}
+
+SharedMemoryTransport::~SharedMemoryTransport() {
+  // senders that already have it mapped see it closed once the ring
+  // is unmapped
+  shm_unlink(ShmName(ntohs(m_local.sin_port)).c_str());
+  for (auto &[port, peer] : m_peers)
+    munmap(peer.memory, peer.bytes);
+}
+
+bool SharedMemoryTransport::Deliver(const Outgoing &datagram,
+                                    const sockaddr_in &peer) {
+  const uint16_t port = ntohs(peer.sin_port);
+  while (true) {
+    {
+      std::shared_lock lock(m_peers_mutex);
+      auto it = m_peers.find(port);
+      if (it != m_peers.end() && !it->second.ring.Closed()) {
+        bool wake = false;
+        if (!Push(it->second.ring, datagram, &wake))
+          return false;
+        if (wake)
+          Wake(port, it->second.ring);
+        return true;
+      }
+    }
+    // a peer we haven't sent to yet, or one that went away and may
+    // have come back
+    std::lock_guard lock(m_peers_mutex);
+    if (!Open(port))
+      return false;
+  }
+}
+
+bool SharedMemoryTransport::Open(const uint16_t port) {
+  auto it = m_peers.find(port);
+  if (it != m_peers.end()) {
+    // another thread got to it first
+    if (!it->second.ring.Closed())
+      return true;
+    munmap(it->second.memory, it->second.bytes);
+    m_peers.erase(it);
+  }
+  const int fd = shm_open(ShmName(port).c_str(), O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0)
+    return false;
+  struct stat info = {};
+  void *memory = nullptr;
+  if (fstat(fd, &info) == 0 && info.st_size > 0)
+    memory = MapRing(fd, info.st_size);
+  close(fd);
+  if (!memory)
+    return false;
+  DatagramRing ring = DatagramRing::Attach(memory, info.st_size);
+  if (!ring.Valid() || ring.Closed()) {
+    munmap(memory, info.st_size);
+    return false;
+  }
+  m_peers[port] = {.memory = memory, .bytes = size_t(info.st_size),
+                   .ring = ring};
+  return true;
+}
+
+void SharedMemoryTransport::RingSelf() {
+  Wake(ntohs(m_local.sin_port), m_ring);
+}
+
+void SharedMemoryTransport::ClearBell() {
+  uint8_t byte;
+  while (recv(m_bell, &byte, sizeof(byte), MSG_DONTWAIT) >= 0)
+    ;
+}
+
+void SharedMemoryTransport::Wake(const uint16_t port,
+                                 DatagramRing &ring) const {
+  sockaddr_un addr;
+  const socklen_t len = BellAddress(port, &addr);
+  const uint8_t byte = 0;
+  if (sendto(m_bell, &byte, sizeof(byte), MSG_DONTWAIT, (const sockaddr *)&addr,
+             len) < 0 &&
+      errno == ECONNREFUSED) {
+    // nothing is bound to the doorbell, the process died
+    ring.Close();
+    return;
+  }
+  ring.Ring();
+}
+
+} // namespace Hev
@@ -0,0 +1,163 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Hev {
+
+size_t HistogramSnapshot::BucketOf(const uint64_t value) {
+  if (value < SUB_BUCKETS)
+    return value;
+  // the power of two it is in picks the row, the next SUB_BITS bits
+  // below the top one pick the bucket in it
+  const size_t exponent = 63 - __builtin_clzll(value);
+  const size_t shift = exponent - SUB_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t HistogramSnapshot::BucketHigh(const size_t bucket) {
+  if (bucket < SUB_BUCKETS)
+    return bucket;
+  const size_t shift = bucket / SUB_BUCKETS - 1;
+  const uint64_t low = (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return low + ((uint64_t(1) << shift) - 1);
+}
+
+uint64_t HistogramSnapshot::Percentile(const double percentile) const {
+  if (count == 0)
+    return 0;
+  const double clamped = std::clamp(percentile, 0.0, 100.0);
+  const uint64_t rank = std::max<uint64_t>(
+      static_cast<uint64_t>(std::ceil(clamped / 100 * count)), 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank)
+      return std::clamp(BucketHigh(i), min, max);
+  }
+  return max;
+}
+
+double HistogramSnapshot::Mean() const {
+  return count == 0 ? 0 : static_cast<double>(sum) / count;
+}
+
+void HistogramSnapshot::Merge(const HistogramSnapshot &other) {
+  if (other.count == 0)
+    return;
+  for (size_t i = 0; i < BUCKETS; i++)
+    counts[i] += other.counts[i];
+  min = count == 0 ? other.min : std::min(min, other.min);
+  max = std::max(max, other.max);
+  count += other.count;
+  sum += other.sum;
+}
+
+Histogram::Histogram() : m_counts(), m_sum(0), m_min(UINT64_MAX), m_max(0) {}
+
+void Histogram::Record(const uint64_t value) {
+  m_counts[HistogramSnapshot::BucketOf(value)].fetch_add(
+      1, std::memory_order_relaxed);
+  m_sum.fetch_add(value, std::memory_order_relaxed);
+  // the extremes rarely change, most calls only read them
+  uint64_t low = m_min.load(std::memory_order_relaxed);
+  while (value < low &&
+         !m_min.compare_exchange_weak(low, value, std::memory_order_relaxed))
+    ;
+  uint64_t high = m_max.load(std::memory_order_relaxed);
+  while (value > high &&
+         !m_max.compare_exchange_weak(high, value, std::memory_order_relaxed))
+    ;
+}
+
+HistogramSnapshot Histogram::Snapshot() const {
+  HistogramSnapshot snapshot;
+  for (size_t i = 0; i < HistogramSnapshot::BUCKETS; i++) {
+    snapshot.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.counts[i];
+  }
+  if (snapshot.count == 0)
+    return snapshot;
+  snapshot.sum = m_sum.load(std::memory_order_relaxed);
+  snapshot.min = m_min.load(std::memory_order_relaxed);
+  snapshot.max = m_max.load(std::memory_order_relaxed);
+  // a value counted in its bucket but not yet in the extremes
+  if (snapshot.min > snapshot.max)
+    snapshot.min = snapshot.max;
+  return snapshot;
+}
+
+void MetricsSnapshot::Merge(const MetricsSnapshot &other) {
+  datagrams_in += other.datagrams_in;
+  datagrams_out += other.datagrams_out;
+  bytes_in += other.bytes_in;
+  bytes_out += other.bytes_out;
+  send_calls += other.send_calls;
+  receive_calls += other.receive_calls;
+  acks_in += other.acks_in;
+  acks_out += other.acks_out;
+  retransmits += other.retransmits;
+  peer_timeouts += other.peer_timeouts;
+  for (size_t i = 0; i < DROP_REASONS; i++)
+    drops[i] += other.drops[i];
+  send_queue += other.send_queue;
+  received_queue += other.received_queue;
+  unacked_packets += other.unacked_packets;
+  rtt.Merge(other.rtt);
+  send_delay.Merge(other.send_delay);
+}
+
+void Metrics::Snapshot(MetricsSnapshot *snapshot) const {
+  snapshot->datagrams_in = datagrams_in.Load();
+  snapshot->datagrams_out = datagrams_out.Load();
+  snapshot->bytes_in = bytes_in.Load();
+  snapshot->bytes_out = bytes_out.Load();
+  snapshot->send_calls = send_calls.Load();
+  snapshot->receive_calls = receive_calls.Load();
+  snapshot->acks_in = acks_in.Load();
+  snapshot->acks_out = acks_out.Load();
+  snapshot->retransmits = retransmits.Load();
+  snapshot->peer_timeouts = peer_timeouts.Load();
+  for (size_t i = 0; i < MetricsSnapshot::DROP_REASONS; i++)
+    snapshot->drops[i] = drops[i].Load();
+  snapshot->send_queue = send_queue.Load();
+  snapshot->received_queue = received_queue.Load();
+  snapshot->unacked_packets = unacked_packets.Load();
+  snapshot->rtt = rtt.Snapshot();
+  snapshot->send_delay = send_delay.Snapshot();
+}
+
+MetricsRegistry &MetricsRegistry::Global() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+std::shared_ptr<Metrics> MetricsRegistry::Create() {
+  auto metrics = std::make_shared<Metrics>();
+  std::lock_guard lock(m_mutex);
+  m_metrics.push_back(metrics);
+  return metrics;
+}
+
+void MetricsRegistry::Snapshot(MetricsSnapshot *snapshot) {
+  std::lock_guard lock(m_mutex);
+  *snapshot = m_retired;
+  // big enough that it shouldn't go on the stack of every caller
+  auto one = std::make_unique<MetricsSnapshot>();
+  auto it = m_metrics.begin();
+  while (it != m_metrics.end()) {
+    (*it)->Snapshot(one.get());
+    // the socket is gone, nothing else can get hold of them now
+    if (it->use_count() == 1) {
+      one->send_queue = 0;
+      one->received_queue = 0;
+      one->unacked_packets = 0;
+      m_retired.Merge(*one);
+      it = m_metrics.erase(it);
+    } else {
+      it++;
+    }
+    snapshot->Merge(*one);
+  }
+}
+
+} // namespace Hev
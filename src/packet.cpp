@@ -1,48 +1,309 @@
 #include "packet.h"
+#include "bufferpool.h"
 #include <arpa/inet.h>
+#include <cstddef>
 #include <cstring>
 
 namespace Hev {
 
-std::pair<std::unique_ptr<uint8_t[]>, size_t>
-BuildPacket(uint32_t type, uint32_t sequence,
-            std::unique_ptr<uint8_t[]> &payload, uint32_t payload_len) {
+namespace {
 
-  size_t total_length = sizeof(TBHeader) + payload_len;
-  // get byte order correct
-  TBPacket packet = {.header = {.type = htons(type),
-                                .sequence = htonl(sequence),
-                                .length = htonl(payload_len)},
-                     .payload = nullptr};
-  packet.payload.swap(payload);
+// first byte of a COMPACT header, the low 4 bits are the packet's kind
+const uint8_t COMPACT_MARK = 0x80;
+const uint8_t HAS_ACK = 0x40;
+const uint8_t HAS_LENGTH = 0x20;
+const uint8_t HAS_FRAGMENT = 0x10;
+const uint8_t KIND_MASK = 0x0f;
+// kinds below Channel::COUNT are messages on that channel, the rest
+// are the control types in this order
+const uint16_t CONTROL_KINDS[] = {PacketType::SYN,  PacketType::ACK,
+                                  PacketType::SYNACK, PacketType::PING,
+                                  PacketType::PONG, PacketType::PROBE,
+                                  PacketType::PROBE_ACK};
+const size_t CONTROL_KIND_COUNT = sizeof(CONTROL_KINDS) / sizeof(uint16_t);
+// flags, a varint sequence, the channel sequence, the ack fields, the
+// length and the fragment fields
+const size_t COMPACT_MAX_LEN = 1 + 5 + 2 + 2 + 5 + 5 + 3 + 3;
+static_assert(COMPACT_MAX_LEN <= WireHeader::MAX_LEN);
+
+/* Kind
+ * returns: the COMPACT kind of a header, or 0xff if it has none
+ */
+uint8_t Kind(const TBHeader &header) {
+  if (header.type == PacketType::MSG)
+    return header.channel < Channel::COUNT ? header.channel : 0xff;
+  for (size_t i = 0; i < CONTROL_KIND_COUNT; i++) {
+    if (CONTROL_KINDS[i] == header.type)
+      return Channel::COUNT + i;
+  }
+  return 0xff;
+}
+
+uint8_t *PutVarint(uint8_t *out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+uint8_t *PutShort(uint8_t *out, const uint32_t value) {
+  *out++ = static_cast<uint8_t>(value >> 8);
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+bool GetVarint(const uint8_t *&in, const uint8_t *end, uint32_t *value) {
+  *value = 0;
+  for (int shift = 0; shift < 35 && in < end; shift += 7) {
+    const uint8_t byte = *in++;
+    *value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+bool GetShort(const uint8_t *&in, const uint8_t *end, uint32_t *value) {
+  if (end - in < 2)
+    return false;
+  *value = static_cast<uint32_t>(in[0]) << 8 | in[1];
+  in += 2;
+  return true;
+}
+
+uint8_t *PutLong(uint8_t *out, const uint32_t value) {
+  out = PutShort(out, value >> 16);
+  return PutShort(out, value);
+}
+
+uint32_t GetLong(const uint8_t *in) {
+  return static_cast<uint32_t>(in[0]) << 24 |
+         static_cast<uint32_t>(in[1]) << 16 |
+         static_cast<uint32_t>(in[2]) << 8 | in[3];
+}
+
+// written field by field in network byte order, the reserved byte keeps
+// the sequences where they were when the struct itself was sent
+void EncodeFull(WireHeader &wire) {
+  const TBHeader &fields = wire.fields;
+  uint8_t *out = wire.data;
+  out = PutShort(out, fields.type);
+  *out++ = fields.channel;
+  *out++ = 0;
+  out = PutLong(out, fields.sequence);
+  out = PutLong(out, fields.length);
+  out = PutLong(out, fields.ack);
+  out = PutLong(out, fields.ack_bits);
+  out = PutLong(out, fields.channel_sequence);
+  out = PutShort(out, fields.fragment_index);
+  out = PutShort(out, fields.fragment_count);
+  wire.length = out - wire.data;
+  wire.version = HeaderVersion::FULL;
+}
+
+void DecodeFull(const uint8_t *in, TBHeader *header) {
+  *header = {.type = static_cast<uint16_t>(in[0] << 8 | in[1]),
+             .channel = in[2],
+             .sequence = GetLong(in + 4),
+             .length = GetLong(in + 8),
+             .ack = GetLong(in + 12),
+             .ack_bits = GetLong(in + 16),
+             .channel_sequence = GetLong(in + 20),
+             .fragment_index = static_cast<uint16_t>(in[24] << 8 | in[25]),
+             .fragment_count = static_cast<uint16_t>(in[26] << 8 | in[27])};
+}
+
+void EncodeCompact(WireHeader &wire, const uint8_t kind,
+                   const bool with_length) {
+  const TBHeader &fields = wire.fields;
+  const bool message = kind < Channel::COUNT;
+  uint8_t flags = COMPACT_MARK | kind;
+  if (fields.ack_bits != 0)
+    flags |= HAS_ACK;
+  if (with_length)
+    flags |= HAS_LENGTH;
+  if (fields.fragment_count > 1)
+    flags |= HAS_FRAGMENT;
+
+  uint8_t *out = wire.data;
+  *out++ = flags;
+  // a standalone ACK's sequence is its ack, unreliable messages have
+  // none and control packets can't be expanded so they send it whole
+  if (message && Channel::IsReliable(kind))
+    out = PutShort(out, fields.sequence);
+  else if (!message && fields.type != PacketType::ACK)
+    out = PutVarint(out, fields.sequence);
+  if (message)
+    out = PutShort(out, fields.channel_sequence);
+  if (flags & HAS_ACK) {
+    out = PutShort(out, fields.ack);
+    // mostly set bits, inverted they fit in a byte
+    out = PutVarint(out, ~fields.ack_bits);
+  }
+  if (flags & HAS_LENGTH)
+    out = PutVarint(out, fields.length);
+  if (flags & HAS_FRAGMENT) {
+    out = PutVarint(out, fields.fragment_index);
+    out = PutVarint(out, fields.fragment_count);
+  }
+  wire.length = out - wire.data;
+  wire.version = HeaderVersion::COMPACT;
+}
+
+/* DecodeCompact
+ * returns: the length of the header, 0 if it is cut short or invalid
+ */
+size_t DecodeCompact(const uint8_t *buffer, const size_t buffer_len,
+                     TBHeader *header) {
+  const uint8_t *in = buffer;
+  const uint8_t *end = buffer + buffer_len;
+  const uint8_t flags = *in++;
+  const uint8_t kind = flags & KIND_MASK;
+  if (kind >= Channel::COUNT + CONTROL_KIND_COUNT)
+    return 0;
+  const bool message = kind < Channel::COUNT;
+  *header = {.type = message ? PacketType::MSG
+                             : CONTROL_KINDS[kind - Channel::COUNT],
+             .channel = message ? kind : Channel::RELIABLE,
+             .sequence = 0,
+             .length = 0,
+             .ack = 0,
+             .ack_bits = 0,
+             .channel_sequence = 0,
+             .fragment_index = 0,
+             .fragment_count = 1};
+  uint32_t value = 0;
+  if (message && Channel::IsReliable(kind)) {
+    if (!GetShort(in, end, &header->sequence))
+      return 0;
+  } else if (!message && header->type != PacketType::ACK) {
+    if (!GetVarint(in, end, &header->sequence))
+      return 0;
+  }
+  if (message && !GetShort(in, end, &header->channel_sequence))
+    return 0;
+  if (flags & HAS_ACK) {
+    if (!GetShort(in, end, &header->ack) || !GetVarint(in, end, &value))
+      return 0;
+    header->ack_bits = ~value;
+  }
+  if (flags & HAS_LENGTH) {
+    if (!GetVarint(in, end, &header->length))
+      return 0;
+  }
+  if (flags & HAS_FRAGMENT) {
+    uint32_t count = 0;
+    if (!GetVarint(in, end, &value) || !GetVarint(in, end, &count) ||
+        value > UINT16_MAX || count > UINT16_MAX)
+      return 0;
+    header->fragment_index = value;
+    header->fragment_count = count;
+  }
+  const size_t header_len = in - buffer;
+  // the last packet in a datagram runs to the end of it
+  if (!(flags & HAS_LENGTH))
+    header->length = buffer_len - header_len;
+  return header_len;
+}
+
+} // namespace
+
+WireHeader BuildHeader(uint32_t type, uint32_t sequence, uint32_t payload_len,
+                       uint32_t ack, uint32_t ack_bits, uint8_t channel,
+                       uint32_t channel_sequence, uint16_t fragment_index,
+                       uint16_t fragment_count) {
+  WireHeader wire = {};
+  wire.fields = {.type = static_cast<uint16_t>(type),
+                 .channel = channel,
+                 .sequence = sequence,
+                 .length = payload_len,
+                 .ack = ack,
+                 .ack_bits = ack_bits,
+                 .channel_sequence = channel_sequence,
+                 .fragment_index = fragment_index,
+                 .fragment_count = fragment_count};
+  EncodeFull(wire);
+  return wire;
+}
+
+void StampAck(WireHeader &header, uint32_t ack, uint32_t ack_bits,
+              uint8_t version) {
+  header.fields.ack = ack;
+  header.fields.ack_bits = ack_bits;
+  EncodeHeader(header, version, true);
+}
+
+void EncodeHeader(WireHeader &header, uint8_t version, bool with_length) {
+  const uint8_t kind = Kind(header.fields);
+  if (version == HeaderVersion::COMPACT && kind != 0xff)
+    EncodeCompact(header, kind, with_length);
+  else
+    EncodeFull(header);
+}
+
+size_t MaxHeaderLength(uint8_t version) {
+  return version == HeaderVersion::COMPACT ? COMPACT_MAX_LEN
+                                           : WireHeader::FULL_LEN;
+}
+
+uint32_t ExpandSequence(uint16_t low, uint32_t reference) {
+  // how far the low bits are from the reference's, either way
+  const int16_t distance =
+      static_cast<int16_t>(low - static_cast<uint16_t>(reference));
+  return reference + distance;
+}
+
+std::pair<Buffer, size_t> BuildPacket(uint32_t type, uint32_t sequence,
+                                      Buffer &payload, uint32_t payload_len) {
+
+  WireHeader header = BuildHeader(type, sequence, payload_len);
+  size_t total_length = header.length + payload_len;
+  Buffer taken_payload = nullptr;
+  taken_payload.swap(payload);
 
   // copy into buffer
   size_t offset = 0;
-  std::unique_ptr<uint8_t[]> buffer(
-      std::make_unique<uint8_t[]>(sizeof(TBHeader) + payload_len));
+  Buffer buffer = BufferPool::Instance().Acquire(total_length);
 
-  std::memcpy(buffer.get(), &packet.header, sizeof(TBHeader));
-  offset += sizeof(TBHeader);
-  std::memcpy(buffer.get() + offset, packet.payload.get(), payload_len);
+  std::memcpy(buffer.get(), header.data, header.length);
+  offset += header.length;
+  if (payload_len > 0)
+    std::memcpy(buffer.get() + offset, taken_payload.get(), payload_len);
   offset += payload_len;
 
   return std::make_pair(std::move(buffer), total_length);
 }
 
-TBPacket RebuildPacket(std::unique_ptr<uint8_t[]> buffer) {
-  TBPacket packet = {};
-  std::memcpy(&packet.header, buffer.get(), sizeof(TBHeader));
-  // convert to host byte order
-  packet.header = {.type = ntohs(packet.header.type),
-                   .sequence = ntohl(packet.header.sequence),
-                   .length = ntohl(packet.header.length)};
+size_t RebuildPacket(const uint8_t *buffer, const size_t buffer_len,
+                     TBPacket *packet) {
+  if (!packet || buffer_len == 0)
+    return 0;
+  size_t header_len = 0;
+  if (buffer[0] & COMPACT_MARK) {
+    packet->version = HeaderVersion::COMPACT;
+    header_len = DecodeCompact(buffer, buffer_len, &packet->header);
+    if (header_len == 0)
+      return 0;
+  } else {
+    if (buffer_len < WireHeader::FULL_LEN)
+      return 0;
+    packet->version = HeaderVersion::FULL;
+    header_len = WireHeader::FULL_LEN;
+    DecodeFull(buffer, &packet->header);
+  }
+  if (packet->header.length > buffer_len - header_len)
+    return 0;
+  packet->payload = nullptr;
   // check if there's a payload to copy
-  if (packet.header.length > 0) {
-    packet.payload = std::make_unique<uint8_t[]>(packet.header.length);
-    std::memcpy(packet.payload.get(), buffer.get() + sizeof(TBHeader),
-                packet.header.length);
+  if (packet->header.length > 0) {
+    packet->payload = BufferPool::Instance().Acquire(packet->header.length);
+    std::memcpy(packet->payload.get(), buffer + header_len,
+                packet->header.length);
   }
-  return packet;
+  packet->wire_length = header_len + packet->header.length;
+  return packet->wire_length;
 }
 
 } // namespace Hev
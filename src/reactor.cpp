@@ -0,0 +1,131 @@
+#include "reactor.h"
+#include "errors.h"
+#include <cerrno>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace Hev {
+
+Reactor::Reactor(const size_t io_threads, const int cpu) {
+  m_epoll = epoll_create1(EPOLL_CLOEXEC);
+  m_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  // the stop fd is level triggered and never read so that it
+  // wakes every thread, not just the first one
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = m_stop_fd;
+  epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_stop_fd, &event);
+
+  for (size_t i = 0; i < (io_threads > 0 ? io_threads : 1); i++) {
+    m_threads.emplace_back([this]() { this->Run(); });
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(cpus),
+                             &cpus);
+    }
+  }
+}
+
+Reactor::~Reactor() {
+  uint64_t stop = 1;
+  write(m_stop_fd, &stop, sizeof(stop));
+  for (auto &thread : m_threads) {
+    if (thread.joinable())
+      thread.join();
+  }
+  close(m_stop_fd);
+  close(m_epoll);
+}
+
+const int Reactor::Add(const int fd, Callback on_ready) {
+  auto handler = std::make_shared<Handler>();
+  handler->fd = fd;
+  handler->on_ready = std::move(on_ready);
+  handler->active = true;
+  {
+    std::lock_guard lock(m_mut);
+    if (m_handlers.count(fd) > 0)
+      return INVALID_PARAM;
+    m_handlers[fd] = handler;
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.fd = fd;
+  if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+    std::lock_guard lock(m_mut);
+    m_handlers.erase(fd);
+    return INVALID_PARAM;
+  }
+  return 0;
+}
+
+const int Reactor::Remove(const int fd) {
+  std::shared_ptr<Handler> handler;
+  {
+    std::lock_guard lock(m_mut);
+    auto it = m_handlers.find(fd);
+    if (it == m_handlers.end())
+      return INVALID_PARAM;
+    handler = it->second;
+    m_handlers.erase(it);
+  }
+  epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+  // from its own callback, which holds the lock and sees it's no
+  // longer active once it returns
+  if (handler->runner.load() == std::this_thread::get_id()) {
+    handler->active = false;
+    return 0;
+  }
+  // wait out a callback that is already running
+  std::unique_lock running(handler->running);
+  handler->active = false;
+  return 0;
+}
+
+void Reactor::Run() {
+  epoll_event events[MAX_EVENTS];
+  while (true) {
+    int ready = epoll_wait(m_epoll, events, MAX_EVENTS, -1);
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    for (int i = 0; i < ready; i++) {
+      const int fd = events[i].data.fd;
+      if (fd == m_stop_fd)
+        return;
+
+      std::shared_ptr<Handler> handler;
+      {
+        std::lock_guard lock(m_mut);
+        auto it = m_handlers.find(fd);
+        if (it == m_handlers.end())
+          continue;
+        handler = it->second;
+      }
+      std::unique_lock running(handler->running);
+      if (!handler->active)
+        continue;
+      handler->runner = std::this_thread::get_id();
+      handler->on_ready();
+      handler->runner = std::thread::id();
+      // removed itself, fd may already be watched again for someone else
+      if (!handler->active)
+        continue;
+      // one shot so nobody else picked it up while we were running,
+      // hand it back to epoll now that we're done
+      epoll_event event = {};
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.fd = fd;
+      epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &event);
+    }
+  }
+}
+
+} // namespace Hev
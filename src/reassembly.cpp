@@ -0,0 +1,76 @@
+#include "reassembly.h"
+#include "bufferpool.h"
+#include <cstring>
+
+namespace Hev {
+
+Reassembler::Reassembler(const size_t budget) : m_budget(budget), m_held(0) {}
+
+bool Reassembler::Accepts(const uint8_t channel,
+                          const uint32_t channel_sequence,
+                          const uint16_t count) const {
+  if (count == 0 || count > MAX_FRAGMENTS)
+    return false;
+  auto it = m_partials.find(Key(channel, channel_sequence));
+  if (it != m_partials.end())
+    return it->second.fragments.size() == count;
+  return m_held < m_budget;
+}
+
+bool Reassembler::Insert(Fragment fragment, const Clock::time_point now,
+                         Buffer *message, size_t *message_len) {
+  if (fragment.index >= fragment.count || fragment.length == 0)
+    return false;
+  const uint64_t key = Key(fragment.channel, fragment.channel_sequence);
+  auto it = m_partials.find(key);
+  if (it == m_partials.end()) {
+    Expire(now);
+    Partial partial = {.fragments = std::vector<Buffer>(fragment.count),
+                       .lengths = std::vector<size_t>(fragment.count, 0),
+                       .received = 0,
+                       .bytes = 0,
+                       .started = now};
+    it = m_partials.emplace(key, std::move(partial)).first;
+  }
+  Partial &partial = it->second;
+  // a duplicate, or a count that doesn't match the first fragment
+  if (fragment.index >= partial.fragments.size() ||
+      partial.lengths[fragment.index] > 0)
+    return false;
+
+  partial.fragments[fragment.index] = std::move(fragment.payload);
+  partial.lengths[fragment.index] = fragment.length;
+  partial.received++;
+  partial.bytes += fragment.length;
+  m_held += fragment.length;
+  if (partial.received < partial.fragments.size())
+    return false;
+
+  Buffer whole = BufferPool::Instance().Acquire(partial.bytes);
+  size_t offset = 0;
+  for (size_t i = 0; i < partial.fragments.size(); i++) {
+    std::memcpy(whole.get() + offset, partial.fragments[i].get(),
+                partial.lengths[i]);
+    offset += partial.lengths[i];
+  }
+  m_held -= partial.bytes;
+  m_partials.erase(it);
+  *message = std::move(whole);
+  *message_len = offset;
+  return true;
+}
+
+void Reassembler::Expire(const Clock::time_point now) {
+  for (auto it = m_partials.begin(); it != m_partials.end();) {
+    const uint8_t channel = it->first >> 32;
+    if (!Channel::IsReliable(channel) &&
+        now - it->second.started > UNRELIABLE_TIMEOUT) {
+      m_held -= it->second.bytes;
+      it = m_partials.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+} // namespace Hev
@@ -0,0 +1,110 @@
+#include "reorder.h"
+#include <algorithm>
+
+namespace Hev {
+
+ReorderBuffer::ReorderBuffer(const size_t window)
+    : m_window(window), m_next(1), m_stalled(false), m_held(0),
+      m_max_held(0), m_delivered(0), m_reordered(0), m_stalls(0),
+      m_stall_time(0), m_max_stall(0) {}
+
+void ReorderBuffer::Reset(const uint32_t next) {
+  for (auto &slot : m_slots) {
+    slot.payload = nullptr;
+    slot.filled = false;
+  }
+  m_next = next;
+  m_stalled = false;
+  m_held = 0;
+}
+
+bool ReorderBuffer::Fits(const uint32_t sequence) const {
+  // anything behind m_next was delivered already and always fits
+  return static_cast<int32_t>(sequence - m_next) <
+         static_cast<int64_t>(m_window);
+}
+
+void ReorderBuffer::Insert(const uint32_t sequence, Buffer payload,
+                           const size_t length, const Clock::time_point now) {
+  if (m_slots.empty())
+    m_slots.resize(m_window);
+  Slot &slot = SlotFor(sequence);
+  slot = {.payload = std::move(payload), .length = length, .filled = true};
+  size_t held = ++m_held;
+  if (sequence != m_next) {
+    m_reordered++;
+    if (!m_stalled) {
+      m_stalled = true;
+      m_stalled_since = now;
+      m_stalls++;
+    }
+  }
+  size_t max_held = m_max_held.load();
+  while (held > max_held && !m_max_held.compare_exchange_weak(max_held, held)) {
+  }
+}
+
+bool ReorderBuffer::Deliverable(const uint32_t sequence) {
+  if (sequence != m_next || m_held.load() > 0)
+    return false;
+  m_next++;
+  m_delivered++;
+  return true;
+}
+
+bool ReorderBuffer::Pop(Ready &ready, const Clock::time_point now) {
+  if (m_held.load() == 0)
+    return false;
+  Slot &slot = SlotFor(m_next);
+  if (!slot.filled)
+    return false;
+
+  if (m_stalled) {
+    // the gap just filled
+    const int64_t stall =
+        std::chrono::duration_cast<Micros>(now - m_stalled_since).count();
+    m_stall_time += stall;
+    int64_t max_stall = m_max_stall.load();
+    while (stall > max_stall &&
+           !m_max_stall.compare_exchange_weak(max_stall, stall)) {
+    }
+    m_stalled = false;
+  }
+
+  ready.payload = std::move(slot.payload);
+  ready.length = slot.length;
+  slot.filled = false;
+  m_next++;
+  m_held--;
+  m_delivered++;
+
+  // whatever is still held is now waiting behind the next gap
+  if (m_held.load() > 0 && !SlotFor(m_next).filled) {
+    m_stalled = true;
+    m_stalled_since = now;
+    m_stalls++;
+  }
+  return true;
+}
+
+void ReorderBuffer::Stats::Merge(const Stats &other) {
+  delivered += other.delivered;
+  reordered += other.reordered;
+  depth += other.depth;
+  max_depth = std::max(max_depth, other.max_depth);
+  stalls += other.stalls;
+  stall_time += other.stall_time;
+  max_stall = std::max(max_stall, other.max_stall);
+}
+
+ReorderBuffer::Stats ReorderBuffer::GetStats() const {
+  return {.delivered = m_delivered.load(),
+          .reordered = m_reordered.load(),
+          .depth = m_held.load(),
+          .max_depth = m_max_held.load(),
+          .stalls = m_stalls.load(),
+          .stall_time = Micros(m_stall_time.load()),
+          .max_stall = Micros(m_max_stall.load())};
+}
+
+} // namespace Hev
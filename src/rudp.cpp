@@ -1,87 +1,187 @@
 #include "rudp.h"
+#include "bufferpool.h"
 #include "errors.h"
 #include "packet.h"
-#include <bits/types/struct_timeval.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
-#include <iostream>
-#include <sys/select.h>
+#include <sys/timerfd.h>
 #include <thread>
 
-#define MAX_BUFFER_LEN 2048
 namespace Hev {
-TBD::TBD(const char *local_addr, const int local_port)
-    : m_sequence(0), m_connected(false) {
-  // set up local socket info where we'll be listening from
-  m_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  m_local_addr.sin_addr.s_addr = INADDR_ANY;
-  m_local_addr.sin_port = htons(local_port);
-  m_local_addr.sin_family = AF_INET;
+SharedBuffer TBD::s_probe_padding(new uint8_t[TBD::MAX_DATAGRAM_LEN]());
+SharedBuffer TBD::s_handshake_payload(new uint8_t[1]{HeaderVersion::LATEST});
+
+// a timerfd setting for a steady_clock time, disarmed for max. The
+// steady_clock is CLOCK_MONOTONIC so its times go straight in
+static itimerspec AbsoluteTimer(const Connection::Clock::time_point when) {
+  itimerspec at = {};
+  if (when == Connection::Clock::time_point::max())
+    return at;
+  const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      when.time_since_epoch())
+                      .count();
+  at.it_value.tv_sec = ns / 1000000000;
+  at.it_value.tv_nsec = ns % 1000000000;
+  // all zeroes would disarm it
+  if (ns == 0)
+    at.it_value.tv_nsec = 1;
+  return at;
 }
 
-TBD::TBD(TBD &&other) {
+TBD::TBD(std::unique_ptr<Transport> transport)
+    : m_transport(std::move(transport)), m_peer_count(0), m_max_peers(0),
+      m_hosting(false),
+      m_batch_size(DEFAULT_BATCH_SIZE), m_ack_delay(DEFAULT_ACK_DELAY),
+      m_coalesce_delay(DEFAULT_COALESCE_DELAY), m_ordered(false),
+      m_congestion([]() { return std::make_unique<NewRenoController>(); }),
+      m_metrics(MetricsRegistry::Global().Create()), m_connected(false),
+      m_dispatch(Dispatch::INLINE), m_pumped(1), m_reactor(nullptr),
+      m_wake_fd(-1), m_tick_fd(-1), m_impair_fd(-1), m_flush_pending(false),
+      m_send_waiting(0), m_send_progress(0) {}
+
+TBD::TBD(TBD &&other)
+    : m_dispatch(Dispatch::INLINE), m_pumped(1), m_reactor(nullptr),
+      m_wake_fd(-1), m_tick_fd(-1), m_impair_fd(-1), m_flush_pending(false),
+      m_send_waiting(0), m_send_progress(0) {
   if (this == &other)
     return;
 
-  this->m_sock = other.m_sock;
-  other.m_sock = -1;
-  this->m_local_addr = other.m_local_addr;
-  this->m_sequence = other.m_sequence;
-  this->m_connected = other.m_connected.load();
-
   // if it is running we want to kill the other thread so
   // we can start it on this object instead
-  other.m_connected = false;
-  if (other.m_receiver_thread.joinable()) {
+  const bool connected = other.m_connected.exchange(false);
+  // its callbacks are for the other socket
+  other.CancelHandshake();
+  bool running = false;
+  if (other.m_reactor_io) {
+    other.StopReactorIO();
+    running = true;
+  } else if (other.m_receiver_thread.joinable()) {
     // stop other threads
     other.m_sender_thread.join();
     other.m_receiver_thread.join();
-    other.m_ping_thread.join();
+    other.m_timers.Interrupt();
+    other.m_timer_thread.join();
+    running = true;
+  }
+
+  // only once nothing is looking peers up or sending through the
+  // transport on the other socket
+  this->m_peer = std::move(other.m_peer);
+  this->m_connections = std::move(other.m_connections);
+  this->m_peer_count = other.m_peer_count.load();
+  this->m_max_peers = other.m_max_peers;
+  this->m_hosting = other.m_hosting;
+  this->m_batch_size = other.m_batch_size;
+  this->m_ack_delay = other.m_ack_delay.load();
+  this->m_coalesce_delay = other.m_coalesce_delay.load();
+  this->m_ordered = other.m_ordered;
+  this->m_congestion = std::move(other.m_congestion);
+  this->m_executor = std::move(other.m_executor);
+  // the other socket's threads counted in them until they stopped
+  this->m_metrics = other.m_metrics;
+  this->m_handlers = std::move(other.m_handlers);
+  this->m_dispatch = other.m_dispatch;
+  this->m_connected = connected;
+  this->m_reactor = other.m_reactor;
+  this->m_transport = std::move(other.m_transport);
+  this->m_impairment = std::move(other.m_impairment);
+  if (running) {
     // move over any pending messages
     this->m_send_queue = std::move(other.m_send_queue);
     this->m_received_queues = std::move(other.m_received_queues);
+    this->m_pumped = std::move(other.m_pumped);
     // set up this threads
-    m_receiver_thread = SetupReceiverThread();
-    m_sender_thread = SetupSenderThread();
-    m_ping_thread = SetupPingThread();
+    StartIO();
   }
 }
 
 TBD::~TBD() {
   // signal the threads to close
   m_connected.store(false);
-  // we detach here to non block the user
-  // valgrind throws error for this
+  CancelHandshake();
+  StopReactorIO();
+  // the threads send and receive through the transport, which goes
+  // with the socket. They're woken from their waits rather than left
+  // to time out and joined
+  m_send_queue.release_all_blocks();
+  if (m_transport)
+    m_transport->Interrupt();
   if (m_sender_thread.joinable())
-    m_sender_thread.detach();
+    m_sender_thread.join();
   if (m_receiver_thread.joinable())
-    m_receiver_thread.detach();
-  if (m_ping_thread.joinable())
-    m_ping_thread.detach();
-  // shouldn't overwrite the standard fds
-  if (m_sock > 2)
-    close(m_sock);
+    m_receiver_thread.join();
+  // the timer thread only waits on the wheel, it is quick to stop and
+  // would otherwise be left holding this socket's timers
+  m_timers.Interrupt();
+  if (m_timer_thread.joinable())
+    m_timer_thread.join();
 }
 
 const int TBD::SetUpPeerInfo(const char *peer_ip, const int peer_port) {
   // peer addr info where we'll be sending to
-  m_peer_addr.sin_port = htons(peer_port);
-  m_peer_addr.sin_family = AF_INET;
-  inet_pton(AF_INET, peer_ip, &m_peer_addr.sin_addr);
+  sockaddr_in peer_addr = {};
+  peer_addr.sin_port = htons(peer_port);
+  peer_addr.sin_family = AF_INET;
+  if (inet_pton(AF_INET, peer_ip, &peer_addr.sin_addr) != 1)
+    return INVALID_PEER;
+  m_peer = std::make_shared<Connection>(peer_addr);
+  m_peer->SetMetrics(m_metrics);
+  if (m_congestion)
+    m_peer->SetCongestionControl(m_congestion());
+  m_connections.insert(m_peer->key, m_peer);
+  m_peer_count = 1;
   return 0;
 }
 
+std::shared_ptr<Connection> TBD::FindConnection(const sockaddr_in &addr) const {
+  std::shared_ptr<Connection> conn;
+  if (!m_connections.get(MakePeerKey(addr), conn))
+    return nullptr;
+  return conn;
+}
+
+std::shared_ptr<Connection> TBD::AcceptConnection(const sockaddr_in &addr,
+                                                  const uint32_t sequence) {
+  if (m_peer_count.load() >= m_max_peers)
+    return nullptr;
+  auto conn = std::make_shared<Connection>(addr);
+  conn->sequence = sequence;
+  conn->SetMetrics(m_metrics);
+  if (m_congestion)
+    conn->SetCongestionControl(m_congestion());
+  m_connections.insert(conn->key, conn);
+  m_peer_count++;
+  // it is probed right away, pinging can wait a round
+  ArmTimer(*conn, &Connection::keepalive_timer,
+           Connection::Clock::now() + KEEPALIVE_INTERVAL,
+           &TBD::OnKeepaliveTimer);
+  return conn;
+}
+
+void TBD::DropConnection(Connection &conn) {
+  if (!m_hosting) {
+    // lost our only peer
+    m_connected = false;
+    m_received_queues.release_all_blocks();
+    WakeReceiver();
+    return;
+  }
+  if (m_connections.Remove(conn.key))
+    m_peer_count--;
+  CancelTimers(conn);
+}
+
 TBD TBD::Bind(const char *local_addr, const int local_port) {
-  TBD socket(local_addr, local_port);
+  return Bind(UdpTransport::Bind(local_addr, local_port));
+}
 
-  // wait for a syn then send a a syn back
-  if (bind(socket.m_sock, (const sockaddr *)&socket.m_local_addr,
-           sizeof(socket.m_local_addr)) < 0) {
+TBD TBD::Bind(std::unique_ptr<Transport> transport) {
+  if (!transport) {
     throw 0;
   }
-
-  return socket;
+  return TBD(std::move(transport));
 }
 
 const int TBD::Listen(const char *peer_ip, const int peer_port) {
@@ -94,23 +194,21 @@ const int TBD::Listen(const char *peer_ip, const int peer_port) {
     TBPacket received_packet = {};
     sockaddr_in received_addr = {};
     int status = 0;
-    Buffer empty_buffer;
     times--;
     if ((status = RetrievePacket(received_packet, &received_addr)) != 0) {
       continue;
     }
     if (ProcessPacket(received_packet, received_addr, nullptr) ==
         RECEIVED_ACK) {
-      m_sequence = received_packet.header.sequence;
-      SendAndWait(empty_buffer, 0, PacketType::SYNACK);
+      m_peer->sequence = received_packet.header.sequence;
+      Buffer version = HandshakePayload();
+      SendAndWait(version, 1, PacketType::SYNACK);
       acked = true;
     }
   }
   if (acked) {
     m_connected.store(true);
-    m_receiver_thread = SetupReceiverThread();
-    m_sender_thread = SetupSenderThread();
-    m_ping_thread = SetupPingThread();
+    StartIO();
     return 0;
   } else {
     return HANDSHAKE_FAIL;
@@ -122,99 +220,354 @@ const int TBD::Connect(const char *peer_ip, const int peer_port) {
     return INVALID_PEER;
 
   int status = 0;
-  m_sequence = 1;
-  Buffer empty_buffer;
-  // send takes care of the SYNACK
-  if ((status = SendAndWait(empty_buffer, 0, PacketType::SYN)) < 0) {
+  m_peer->sequence = 1;
+  // tell the peer which header versions we speak, it answers with its
+  // own in the SYNACK. Send takes care of the SYNACK
+  Buffer version = HandshakePayload();
+  if ((status = SendAndWait(version, 1, PacketType::SYN)) < 0) {
     return status;
   }
   AckPacket(1, 1);
   m_connected.store(true);
-  m_receiver_thread = SetupReceiverThread();
-  m_sender_thread = SetupSenderThread();
-  m_ping_thread = SetupPingThread();
+  StartIO();
+  return 0;
+}
+
+const int TBD::Host(const size_t max_peers) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  if (max_peers == 0)
+    return INVALID_PARAM;
+  m_hosting = true;
+  m_max_peers = max_peers;
+  m_connected.store(true);
+  StartIO();
   return 0;
 }
 
-std::pair<Buffer, size_t> TBD::BuildAndUpdatePacket(Buffer &buffer,
-                                                    const size_t buffer_len,
-                                                    uint8_t type) {
-  auto packet_and_len = BuildPacket(type, m_sequence, buffer, buffer_len);
-  m_sequence += buffer_len;
-  return packet_and_len;
+SendPacket TBD::BuildFragment(Connection &conn, const SharedBuffer &payload,
+                              const size_t offset, const size_t length,
+                              const uint8_t type, const uint8_t channel,
+                              const uint32_t channel_sequence,
+                              const uint16_t index, const uint16_t count) {
+  uint32_t sequence = Channel::IsReliable(channel) ? conn.NextSequence() : 0;
+  SendPacket packet(BuildHeader(type, sequence, length, 0, 0, channel,
+                                channel_sequence, index, count),
+                    payload, length, sequence, conn.addr);
+  packet.payload_offset = offset;
+  return packet;
 }
 
-const int TBD::Send(Buffer &buffer, const size_t buffer_len, uint8_t type) {
+const int TBD::Send(Buffer &buffer, const size_t buffer_len, uint8_t type,
+                    uint8_t channel) {
   // not connected to a peer
   if (!m_connected)
     return SOCKET_CLOSED;
-  return QueueSend(buffer, buffer_len, type);
+  // in server mode there is no single peer to send to
+  if (!m_peer)
+    return INVALID_PEER;
+  return QueueSend(*m_peer, buffer, buffer_len, type, channel);
 }
 
-const int TBD::QueueSend(std::unique_ptr<uint8_t[]> &buffer,
-                         const size_t buffer_len, const uint8_t type) {
-  return QueuePacket(buffer, buffer_len, type, m_sequence);
+const int TBD::SendTo(const sockaddr_in &peer, Buffer &buffer,
+                      const size_t buffer_len, uint8_t type, uint8_t channel) {
+  if (!m_connected)
+    return SOCKET_CLOSED;
+  auto conn = FindConnection(peer);
+  if (!conn)
+    return INVALID_PEER;
+  return QueueSend(*conn, buffer, buffer_len, type, channel);
+}
+
+const int TBD::QueueSend(Connection &conn, Buffer &buffer,
+                         const size_t buffer_len, const uint8_t type,
+                         const uint8_t channel) {
+  if (channel >= Channel::COUNT)
+    return INVALID_PARAM;
+  const size_t header_len = MaxHeaderLength(conn.header_version.load());
+  const size_t fragment_len = conn.mtu.load() - UDP_OVERHEAD - header_len;
+  const size_t count =
+      buffer_len == 0 ? 1 : (buffer_len + fragment_len - 1) / fragment_len;
+  if (count > Reassembler::MAX_FRAGMENTS)
+    return MESSAGE_TOO_LARGE;
+  const bool reliable = Channel::IsReliable(channel);
+  if (reliable && (conn.UnackedSpan() + count > MAX_INFLIGHT ||
+                   !conn.WindowOpen(buffer_len + count * header_len)))
+    return QUEUE_FULL;
+  // every fragment's slot is reserved before the buffer is taken or a
+  // sequence is used, so a full queue leaves the message with the
+  // caller to send again
+  size_t slot = 0;
+  if (!m_send_queue.claim(count, &slot))
+    return QUEUE_FULL;
+
+  uint32_t channel_sequence =
+      conn.channels[channel].next_sequence.fetch_add(1);
+  SharedBuffer payload(std::move(buffer));
+  const auto now = Connection::Clock::now();
+  for (size_t i = 0; i < count; i++) {
+    const size_t offset = i * fragment_len;
+    SendPacket packet =
+        BuildFragment(conn, payload, offset,
+                      std::min(fragment_len, buffer_len - offset), type,
+                      channel, channel_sequence, i, count);
+    if (reliable)
+      conn.Track(packet, now);
+    FillSend(slot + i, std::move(packet));
+  }
+  m_metrics->send_queue.Set(m_send_queue.size());
+  WakeSender();
+  if (reliable)
+    ArmRetransmit(conn);
   return 0;
 }
 
-const int TBD::QueueRetransmit(SharedBuffer &buffer, const size_t buffer_len,
-                               const uint32_t sequence) {
-  m_send_queue.emplace(buffer, buffer_len, sequence);
+const int TBD::QueueRetransmit(const SendPacket &packet) {
+  // still tracked, the next retransmit timeout tries it again
+  if (!EnqueueSend(packet)) {
+    m_metrics->Drop(DropReason::QUEUE_OVERFLOW);
+    return QUEUE_FULL;
+  }
   return 0;
 }
 
-void TBD::QueueAck(uint32_t sequence, uint32_t length) {
-  Buffer empty_load;
-  auto [packet, packet_len] =
-      BuildPacket(PacketType::ACK, sequence + length, empty_load, 0);
-  m_send_queue.emplace(std::move(packet), packet_len, sequence + length);
+void TBD::QueueAck(Connection &conn, const Connection::AckState &ack) {
+  SendPacket packet(BuildHeader(PacketType::ACK, ack.ack, 0), nullptr, 0,
+                    ack.ack, conn.addr);
+  StampAck(packet.header, ack.ack, ack.bits, conn.header_version.load());
+  packet.stamp_ack = false;
+  if (EnqueueSend(std::move(packet))) {
+    m_metrics->acks_out.Add();
+    return;
+  }
+  // the ack fields were already taken, schedule another ACK so the
+  // peer isn't left retransmitting everything it sent since
+  m_metrics->Drop(DropReason::QUEUE_OVERFLOW);
+  const auto due = Connection::Clock::now() + m_ack_delay.load();
+  conn.ScheduleAck(due);
+  ArmTimer(conn, &Connection::ack_timer, due, &TBD::OnAckTimer);
 }
 
-const int TBD::QueuePacket(Buffer &buffer, const size_t buffer_len,
-                           const uint8_t type, const uint32_t sequence) {
-  auto [packet, packet_len] = BuildAndUpdatePacket(buffer, buffer_len, type);
-  m_send_queue.emplace(std::move(packet), packet_len, sequence);
-  return 0;
+bool TBD::QueueControl(const sockaddr_in &peer, const uint8_t type,
+                       const uint32_t sequence, const SharedBuffer &payload,
+                       const size_t payload_len) {
+  if (EnqueueSend(SendPacket(BuildHeader(type, sequence, payload_len),
+                             payload, payload_len, sequence, peer)))
+    return true;
+  m_metrics->Drop(DropReason::QUEUE_OVERFLOW);
+  return false;
+}
+
+void TBD::ProbeMtu(const Connection &conn) {
+  for (const uint32_t probe : MTU_PROBES) {
+    if (probe <= conn.mtu.load())
+      continue;
+    // the header is serialized now so the padding can make up the rest,
+    // a length about the size of the padding takes up as many bytes
+    WireHeader header = BuildHeader(PacketType::PROBE, probe, probe);
+    EncodeHeader(header, conn.header_version.load(), true);
+    const size_t padding = probe - UDP_OVERHEAD - header.length;
+    header.fields.length = padding;
+    EncodeHeader(header, header.version, true);
+    SendPacket packet(header, s_probe_padding, padding, probe, conn.addr);
+    // a probe that is too big never arrives, it can't take the acks
+    // with it
+    packet.stamp_ack = false;
+    EnqueueSend(std::move(packet));
+  }
 }
 
-const int TBD::SendConstructed(const Buffer &packet, const size_t packet_len) {
-  return SendConstructed(packet.get(), packet_len);
+const int TBD::SendConstructed(const Buffer &packet, const size_t packet_len,
+                               const sockaddr_in &peer) {
+  return SendConstructed(packet.get(), packet_len, peer);
 }
 
 const int TBD::SendConstructed(const SharedBuffer &packet,
-                               const size_t packet_len) {
-  return SendConstructed(packet.get(), packet_len);
+                               const size_t packet_len,
+                               const sockaddr_in &peer) {
+  return SendConstructed(packet.get(), packet_len, peer);
 }
 
-const int TBD::SendConstructed(const uint8_t *packet, const size_t packet_len) {
-  // setup the timeout
+const int TBD::SendConstructed(const uint8_t *packet, const size_t packet_len,
+                               const sockaddr_in &peer) {
+  // timeout or error
+  if (WaitForSocket(true) != 0) {
+    return -1;
+  }
+  return SendDatagram(packet, packet_len, peer);
+}
 
-  fd_set write_fds;
-  int select_ret = 0;
-  timeval tv;
-  tv.tv_sec = 2;
-  tv.tv_usec = 0;
-  FD_ZERO(&write_fds);
-  FD_SET(m_sock, &write_fds);
+const int TBD::SendDatagram(const uint8_t *data, const size_t length,
+                            const sockaddr_in &peer) {
+  if (m_impairment) {
+    m_impairment->outbound.Submit(std::vector<uint8_t>(data, data + length),
+                                  peer, Connection::Clock::now());
+    FlushImpaired();
+    return length;
+  }
+  const int sent = m_transport->SendTo(data, length, peer);
+  if (sent > 0) {
+    m_metrics->send_calls.Add();
+    m_metrics->datagrams_out.Add();
+    m_metrics->bytes_out.Add(sent);
+  }
+  return sent;
+}
+
+void TBD::FlushImpaired() {
+  // moved to another socket
+  if (!m_impairment)
+    return;
+  ImpairedLink &link = m_impairment->outbound;
+  std::vector<ImpairedLink::Datagram> due;
+  while (true) {
+    link.Release(Connection::Clock::now(), due);
+    for (auto &datagram : due) {
+      const int sent = m_transport->SendTo(
+          datagram.data.data(), datagram.data.size(), datagram.peer);
+      if (sent > 0) {
+        m_metrics->send_calls.Add();
+        m_metrics->datagrams_out.Add();
+        m_metrics->bytes_out.Add(sent);
+      }
+    }
+    due.clear();
+    const auto next = link.NextDue();
+    if (next == Connection::Clock::time_point::max())
+      return;
+    if (m_connected) {
+      ArmImpairment(next);
+      return;
+    }
+    std::this_thread::sleep_until(next);
+  }
+}
 
-  select_ret = select(m_sock + 1, NULL, &write_fds, NULL, &tv);
+void TBD::ArmImpairment(const Connection::Clock::time_point when) {
+  std::lock_guard lock(m_impair_timer.mutex);
+  if (m_impair_timer.at <= when)
+    return;
+  if (m_impair_timer.id != TimerWheel::INVALID)
+    m_timers.Cancel(m_impair_timer.id);
+  m_impair_timer.at = when;
+  m_impair_timer.id = m_timers.Schedule(when, [this, when]() {
+    {
+      std::lock_guard lock(m_impair_timer.mutex);
+      if (m_impair_timer.at == when) {
+        m_impair_timer.id = TimerWheel::INVALID;
+        m_impair_timer.at = Connection::Clock::time_point::max();
+      }
+    }
+    FlushImpaired();
+  });
+}
 
-  // timeout or error
-  if (select_ret == 0 || select_ret < 1) {
-    return -1;
+const size_t TBD::SendConstructedBatch(std::vector<SendPacket> &packets,
+                                       DatagramBatch &batch) {
+  batch.Clear();
+  std::shared_ptr<Connection> conn;
+  PeerKey last_peer = 0;
+  size_t datagram_len = 0;
+  const auto now = Connection::Clock::now();
+  // work out which packets share a datagram before adding any, a
+  // COMPACT header leaves its length out only if it is the last one
+  for (size_t i = 0; i < packets.size(); i++) {
+    SendPacket &packet = packets[i];
+    const PeerKey peer = MakePeerKey(packet.peer);
+    // packets in a batch tend to go to the same peer
+    if (!conn || conn->key != peer)
+      conn = FindConnection(packet.peer);
+    if (conn && packet.stamp_ack) {
+      Connection::AckState ack = conn->TakeAck();
+      StampAck(packet.header, ack.ack, ack.bits, conn->header_version.load());
+      // reliable data starts its round trip now
+      if (packet.sequence != 0 && packet.payload_len > 0)
+        conn->Sent(packet.sequence, now);
+    }
+    if (conn)
+      conn->outbound.Add(packet.Length(), now);
+    m_metrics->send_delay.Record(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            now - packet.queued_at)
+            .count());
+    const size_t mtu = conn ? conn->mtu.load() : Connection::DEFAULT_MTU;
+    packet.coalesced = i > 0 && peer == last_peer &&
+                       datagram_len + packet.Length() <= mtu - UDP_OVERHEAD;
+    if (packet.coalesced) {
+      datagram_len += packet.Length();
+      continue;
+    }
+    last_peer = peer;
+    datagram_len = packet.Length();
+  }
+  for (size_t i = 0; i < packets.size(); i++) {
+    SendPacket &packet = packets[i];
+    const bool last = i + 1 == packets.size() || !packets[i + 1].coalesced;
+    if (last && packet.stamp_ack &&
+        packet.header.version == HeaderVersion::COMPACT)
+      EncodeHeader(packet.header, HeaderVersion::COMPACT, false);
+    const uint8_t *payload = packet.payload.get() + packet.payload_offset;
+    // out of room for another packet in the datagram, any header before
+    // it still has its length so it can start a new one
+    if (packet.coalesced &&
+        batch.Append(packet.header.data, packet.header.length, payload,
+                     packet.payload_len))
+      continue;
+    batch.Add(packet.header.data, packet.header.length, payload,
+              packet.payload_len, packet.peer);
+  }
+  if (m_impairment) {
+    // the simulated network sends what it lets through, when it does
+    for (size_t i = 0; i < batch.Size(); i++)
+      m_impairment->outbound.Submit(batch.Flatten(i), batch.Address(i), now);
+    FlushImpaired();
+    m_metrics->send_queue.Set(m_send_queue.size());
+    return batch.Size();
   }
-  return sendto(m_sock, packet, packet_len, 0, (const sockaddr *)&m_peer_addr,
-                sizeof(m_peer_addr));
+  size_t sent = 0;
+  int total_tries = 0;
+  while (sent < batch.Size()) {
+    int status = -1;
+    if (WaitForSocket(true) == 0)
+      status = m_transport->Send(batch, sent);
+    if (status > 0) {
+      size_t bytes = 0;
+      for (size_t i = sent; i < sent + status; i++)
+        bytes += batch.Total(i);
+      m_metrics->send_calls.Add();
+      m_metrics->datagrams_out.Add(status);
+      m_metrics->bytes_out.Add(bytes);
+      sent += status;
+      total_tries = 0;
+    } else if (status < 0 && errno == EMSGSIZE) {
+      // an mtu probe bigger than our own interface takes
+      sent++;
+      total_tries = 0;
+    } else if (++total_tries >= MAX_TRIES) {
+      // give up on the packet at the front and move on to the rest
+      m_metrics->Drop(DropReason::SEND_FAILED);
+      sent++;
+      total_tries = 0;
+    }
+  }
+  m_metrics->send_queue.Set(m_send_queue.size());
+  return sent;
+}
+
+const int TBD::WaitForSocket(const bool write,
+                             const std::chrono::microseconds timeout) {
+  return m_transport->Wait(write, timeout);
 }
 
 const int TBD::SendAndWait(Buffer &buffer, const size_t buffer_len,
                            uint8_t type) {
-  auto [packet, packet_len] = BuildPacket(type, m_sequence, buffer, buffer_len);
+  auto [packet, packet_len] =
+      BuildPacket(type, m_peer->sequence, buffer, buffer_len);
   int status = -1;
   uint8_t total_tries = 0;
   bool acked = false;
   while (!acked && ++total_tries < MAX_TRIES) {
-    status = SendConstructed(packet, packet_len);
+    status = SendConstructed(packet, packet_len, m_peer->addr);
     if (status > 0) {
       total_tries += MAX_TRIES;
     }
@@ -233,137 +586,1070 @@ const int TBD::SendAndWait(Buffer &buffer, const size_t buffer_len,
   return status;
 }
 
-const int TBD::Receive(Buffer *buffer) {
+const int TBD::Receive(Buffer *buffer) { return Receive(buffer, nullptr); }
+
+const int TBD::Receive(Buffer *buffer, std::chrono::milliseconds ms) {
+  return Receive(buffer, nullptr, ms);
+}
+
+const int TBD::Receive(Buffer *buffer, sockaddr_in *peer) {
   // not connected to a peer
   if (!m_connected)
     return SOCKET_CLOSED;
-  Buffer payload;
-  if (!m_received_queues.pop_wait(&payload))
+  ReceivedMessage message;
+  if (!m_received_queues.pop_wait(&message))
     return RECEIVE_ERROR;
+  m_metrics->received_queue.Set(m_received_queues.size());
   if (!buffer)
     return INVALID_PARAM;
-  *buffer = std::move(payload);
+  *buffer = std::move(message.payload);
+  if (peer)
+    *peer = message.peer;
   return 0;
 }
 
-const int TBD::Receive(Buffer *buffer, std::chrono::milliseconds ms) {
+const int TBD::Receive(Buffer *buffer, sockaddr_in *peer,
+                       std::chrono::milliseconds ms) {
 
   // not connected to a peer
   if (!m_connected)
     return SOCKET_CLOSED;
-  Buffer payload;
-  if (!m_received_queues.pop_wait_till(ms, &payload))
+  ReceivedMessage message;
+  if (!m_received_queues.pop_wait_till(ms, &message))
     return RECEIVE_ERROR;
+  m_metrics->received_queue.Set(m_received_queues.size());
+  if (!buffer)
+    return INVALID_PARAM;
+  *buffer = std::move(message.payload);
+  if (peer)
+    *peer = message.peer;
+  return 0;
+}
+
+Task<int> TBD::ListenAsync(std::string peer_ip, const int peer_port) {
+  // held datagrams are waited out by sleeping, which the reactor can't
+  if (m_reactor && !m_impairment) {
+    // a named awaiter, gcc 12 destroys the members of a temporary one
+    // twice
+    Handshake handshake{.socket = this,
+                        .listening = true,
+                        .peer_ip = peer_ip.c_str(),
+                        .peer_port = peer_port};
+    co_return co_await handshake;
+  }
+  OnExecutor executor{.socket = this};
+  co_await executor;
+  co_return Listen(peer_ip.c_str(), peer_port);
+}
+
+Task<int> TBD::ConnectAsync(std::string peer_ip, const int peer_port) {
+  if (m_reactor && !m_impairment) {
+    Handshake handshake{.socket = this,
+                        .listening = false,
+                        .peer_ip = peer_ip.c_str(),
+                        .peer_port = peer_port};
+    co_return co_await handshake;
+  }
+  OnExecutor executor{.socket = this};
+  co_await executor;
+  co_return Connect(peer_ip.c_str(), peer_port);
+}
+
+Task<int> TBD::SendAsync(Buffer buffer, const size_t buffer_len,
+                         const uint8_t type, const uint8_t channel) {
+  while (true) {
+    // read first so room made while trying isn't missed
+    const uint64_t progress = m_send_progress.load();
+    const int status = Send(buffer, buffer_len, type, channel);
+    if (status != QUEUE_FULL)
+      co_return status;
+    co_await RoomToSend{.socket = this, .progress = progress};
+  }
+}
+
+Task<int> TBD::SendToAsync(const sockaddr_in peer, Buffer buffer,
+                           const size_t buffer_len, const uint8_t type,
+                           const uint8_t channel) {
+  while (true) {
+    const uint64_t progress = m_send_progress.load();
+    const int status = SendTo(peer, buffer, buffer_len, type, channel);
+    if (status != QUEUE_FULL)
+      co_return status;
+    co_await RoomToSend{.socket = this, .progress = progress};
+  }
+}
+
+Task<int> TBD::ReceiveAsync(Buffer *buffer, sockaddr_in *peer) {
   if (!buffer)
+    co_return INVALID_PARAM;
+  while (true) {
+    ReceivedMessage message;
+    if (m_received_queues.try_pop(&message)) {
+      m_metrics->received_queue.Set(m_received_queues.size());
+      *buffer = std::move(message.payload);
+      if (peer)
+        *peer = message.peer;
+      co_return 0;
+    }
+    if (!m_connected)
+      co_return SOCKET_CLOSED;
+    co_await MessageReady{.socket = this};
+  }
+}
+
+bool TBD::MessageReady::await_ready() const {
+  return !socket->m_received_queues.empty() || !socket->m_connected;
+}
+
+bool TBD::MessageReady::await_suspend(std::coroutine_handle<> handle) {
+  std::lock_guard lock(socket->m_waiters_mutex);
+  // a message that came in since await_ready saw the waiter missing
+  if (await_ready())
+    return false;
+  socket->m_receive_waiter = handle;
+  return true;
+}
+
+bool TBD::RoomToSend::await_ready() const {
+  return socket->m_send_progress.load() != progress;
+}
+
+bool TBD::RoomToSend::await_suspend(std::coroutine_handle<> handle) {
+  // counted before progress is checked, WakeSenders bumps progress
+  // before it counts so one of the two sees the other
+  socket->m_send_waiting++;
+  std::lock_guard lock(socket->m_waiters_mutex);
+  if (await_ready()) {
+    socket->m_send_waiting--;
+    return false;
+  }
+  socket->m_send_waiters.push_back(handle);
+  return true;
+}
+
+bool TBD::Handshake::await_suspend(std::coroutine_handle<> handle) {
+  return socket->StartHandshake(*this, handle);
+}
+
+// starts the wait of a handshake step for a datagram
+static void ArmHandshakeTimer(const int timer_fd,
+                              const Connection::Clock::duration wait) {
+  const itimerspec at = AbsoluteTimer(Connection::Clock::now() + wait);
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &at, nullptr);
+}
+
+bool TBD::StartHandshake(Handshake &awaiter,
+                         std::coroutine_handle<> handle) {
+  if (m_handshake && !m_handshake->done) {
+    awaiter.status = ALREADY_CONNECTED;
+    return false;
+  }
+  if (SetUpPeerInfo(awaiter.peer_ip, awaiter.peer_port) != 0) {
+    awaiter.status = INVALID_PEER;
+    return false;
+  }
+  if (!awaiter.listening) {
+    // the SYN Connect sends, the SYNACK is waited for below
+    m_peer->sequence = 1;
+    Buffer version = HandshakePayload();
+    auto [packet, packet_len] =
+        BuildPacket(PacketType::SYN, m_peer->sequence, version, 1);
+    const int status = SendConstructed(packet, packet_len, m_peer->addr);
+    if (status < 0) {
+      awaiter.status = status;
+      return false;
+    }
+  }
+  auto io = std::make_unique<HandshakeIO>();
+  io->awaiter = &awaiter;
+  io->waiter = handle;
+  io->listening = awaiter.listening;
+  io->replied = !awaiter.listening;
+  io->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  m_handshake = std::move(io);
+  // the callbacks wait until both are registered
+  std::lock_guard lock(m_handshake->mutex);
+  ArmHandshakeTimer(m_handshake->timer_fd, SOCKET_WAIT);
+  m_reactor->Add(m_transport->Fd(), [this]() { StepHandshake(true); });
+  m_reactor->Add(m_handshake->timer_fd, [this]() { StepHandshake(false); });
+  return true;
+}
+
+void TBD::StepHandshake(const bool readable) {
+  HandshakeIO &io = *m_handshake;
+  std::unique_lock lock(io.mutex);
+  if (io.done)
+    return;
+  // the same steps Listen and Connect take, each datagram or timeout
+  // is one of their waits
+  int result = RECEIVE_ERROR;
+  if (readable) {
+    TBPacket received_packet = {};
+    sockaddr_in received_addr = {};
+    if (RetrievePacket(received_packet, &received_addr) == 0)
+      result = ProcessPacket(received_packet, received_addr, nullptr);
+    if (!io.replied && result == RECEIVED_ACK) {
+      m_peer->sequence = received_packet.header.sequence;
+      Buffer version = HandshakePayload();
+      auto [packet, packet_len] =
+          BuildPacket(PacketType::SYNACK, m_peer->sequence, version, 1);
+      SendConstructed(packet, packet_len, m_peer->addr);
+      io.replied = true;
+      ArmHandshakeTimer(io.timer_fd, SOCKET_WAIT);
+      return;
+    }
+  } else {
+    uint64_t expirations = 0;
+    read(io.timer_fd, &expirations, sizeof(expirations));
+  }
+  // whatever answered our SYN or SYNACK, or nothing did
+  if (io.replied)
+    return FinishHandshake(lock, 0);
+  if (--io.tries == 0)
+    return FinishHandshake(lock, HANDSHAKE_FAIL);
+  ArmHandshakeTimer(io.timer_fd, SOCKET_WAIT);
+}
+
+void TBD::FinishHandshake(std::unique_lock<std::mutex> &lock,
+                          const int status) {
+  HandshakeIO &io = *m_handshake;
+  io.done = true;
+  if (status == 0 && !io.listening)
+    AckPacket(1, 1);
+  // the other callback may be waiting on the lock to see it's done
+  lock.unlock();
+  m_reactor->Remove(m_transport->Fd());
+  m_reactor->Remove(io.timer_fd);
+  close(io.timer_fd);
+  io.timer_fd = -1;
+  if (status == 0) {
+    m_connected.store(true);
+    StartIO();
+  }
+  io.awaiter->status = status;
+  // the coroutine may start another handshake, nothing of this one is
+  // used after
+  Resume(m_executor, std::exchange(io.waiter, nullptr));
+}
+
+void TBD::CancelHandshake() {
+  if (!m_handshake)
+    return;
+  std::unique_lock lock(m_handshake->mutex);
+  if (m_handshake->done)
+    return;
+  FinishHandshake(lock, SOCKET_CLOSED);
+}
+
+void TBD::WakeReceiver() {
+  std::coroutine_handle<> waiter;
+  {
+    std::lock_guard lock(m_waiters_mutex);
+    waiter = std::exchange(m_receive_waiter, nullptr);
+  }
+  if (waiter)
+    Resume(m_executor, waiter);
+}
+
+void TBD::WakeSenders() {
+  m_send_progress++;
+  if (m_send_waiting.load() == 0)
+    return;
+  std::vector<std::coroutine_handle<>> waiters;
+  {
+    std::lock_guard lock(m_waiters_mutex);
+    waiters.swap(m_send_waiters);
+    m_send_waiting -= waiters.size();
+  }
+  for (auto waiter : waiters)
+    Resume(m_executor, waiter);
+}
+
+const int TBD::SetHandler(const uint8_t type, Handler handler) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  m_handlers.Set(type, std::move(handler));
+  return 0;
+}
+
+const int TBD::SetDispatch(const Dispatch dispatch) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  m_dispatch = dispatch;
+  if (m_dispatch == Dispatch::PUMPED &&
+      m_pumped.capacity() < m_received_queues.capacity())
+    m_pumped = SPSCQueue<ReceivedMessage>(m_received_queues.capacity());
+  return 0;
+}
+
+const size_t TBD::Pump(const size_t max) {
+  size_t handled = 0;
+  ReceivedMessage message;
+  while (handled < max && m_pumped.try_pop(&message)) {
+    // the handler it was queued for, even if SetHandler has replaced
+    // it since the socket stopped
+    (*message.handler)({.type = message.payload[0],
+                        .payload = {message.payload.get(), message.length},
+                        .peer = message.peer,
+                        .channel = message.channel});
+    handled++;
+  }
+  return handled;
+}
+
+const size_t TBD::PeerCount() const { return m_peer_count.load(); }
+
+const int TBD::SetBatchSize(const size_t batch_size) {
+  if (batch_size == 0 || batch_size > MAX_BATCH_SIZE)
+    return INVALID_PARAM;
+  m_batch_size = batch_size;
+  return 0;
+}
+
+const int TBD::SetAckDelay(const std::chrono::milliseconds delay) {
+  if (delay.count() < 0 || delay > MAX_ACK_DELAY)
+    return INVALID_PARAM;
+  m_ack_delay = delay;
+  return 0;
+}
+
+const int TBD::SetCoalesceDelay(const std::chrono::milliseconds delay) {
+  if (delay.count() < 0 || delay > MAX_COALESCE_DELAY)
+    return INVALID_PARAM;
+  m_coalesce_delay = delay;
+  return 0;
+}
+
+const int TBD::SetOrderedDelivery(const bool ordered) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  m_ordered = ordered;
+  return 0;
+}
+
+const int TBD::SetCongestionControl(CongestionFactory factory) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  m_congestion = std::move(factory);
+  return 0;
+}
+
+const int TBD::SetImpairment(const ImpairmentConfig &config) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  if (config.outbound.Active() || config.inbound.Active())
+    m_impairment = std::make_unique<Impairment>(config);
+  else
+    m_impairment.reset();
+  return 0;
+}
+
+const int TBD::SetExecutor(Executor executor) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  m_executor = std::move(executor);
+  return 0;
+}
+
+const int TBD::GetMetrics(MetricsSnapshot *metrics) const {
+  if (!metrics)
+    return INVALID_PARAM;
+  m_metrics->Snapshot(metrics);
+  return 0;
+}
+
+const int TBD::GetConnectionStats(ConnectionStats *stats,
+                                  const sockaddr_in *peer) const {
+  if (!stats)
+    return INVALID_PARAM;
+  const auto now = Connection::Clock::now();
+  if (peer) {
+    auto conn = FindConnection(*peer);
+    if (!conn)
+      return INVALID_PEER;
+    *stats = conn->Stats(now);
+    return 0;
+  }
+  *stats = {};
+  m_connections.for_each(
+      [&](const PeerKey &, const std::shared_ptr<Connection> &conn) {
+        stats->Merge(conn->Stats(now));
+      });
+  return 0;
+}
+
+const int TBD::GetCongestionStats(CongestionController::Stats *stats,
+                                  const sockaddr_in *peer) const {
+  if (!stats)
+    return INVALID_PARAM;
+  if (peer) {
+    auto conn = FindConnection(*peer);
+    if (!conn)
+      return INVALID_PEER;
+    *stats = conn->CongestionStats();
+    return 0;
+  }
+  *stats = {};
+  m_connections.for_each(
+      [&](const PeerKey &, const std::shared_ptr<Connection> &conn) {
+        stats->Merge(conn->CongestionStats());
+      });
+  return 0;
+}
+
+const int TBD::GetImpairmentStats(ImpairedLink::Stats *outbound,
+                                  ImpairedLink::Stats *inbound) const {
+  if (outbound)
+    *outbound = m_impairment ? m_impairment->outbound.GetStats()
+                             : ImpairedLink::Stats{};
+  if (inbound)
+    *inbound = m_impairment ? m_impairment->inbound.GetStats()
+                            : ImpairedLink::Stats{};
+  return 0;
+}
+
+const int TBD::GetReorderStats(ReorderBuffer::Stats *stats,
+                               const sockaddr_in *peer) const {
+  if (!stats)
     return INVALID_PARAM;
-  *buffer = std::move(payload);
+  if (peer) {
+    auto conn = FindConnection(*peer);
+    if (!conn)
+      return INVALID_PEER;
+    *stats = conn->ReorderStats();
+    return 0;
+  }
+  *stats = {};
+  m_connections.for_each(
+      [&](const PeerKey &, const std::shared_ptr<Connection> &conn) {
+        stats->Merge(conn->ReorderStats());
+      });
+  return 0;
+}
+
+const int TBD::Attach(Reactor &reactor) {
+  if (m_connected)
+    return ALREADY_CONNECTED;
+  m_reactor = &reactor;
   return 0;
 }
 
+void TBD::StartIO() {
+  // the timers of peers from before the socket was moved were on the
+  // other socket's wheel
+  const auto now = Connection::Clock::now();
+  m_connections.for_each(
+      [&](const PeerKey &, const std::shared_ptr<Connection> &conn) {
+        for (auto timer : {&Connection::retransmit_timer,
+                           &Connection::ack_timer,
+                           &Connection::keepalive_timer}) {
+          Connection::Timer &armed = (*conn).*timer;
+          std::lock_guard lock(armed.mutex);
+          armed.id = TimerWheel::INVALID;
+          armed.at = Connection::Clock::time_point::max();
+        }
+        ArmTimer(*conn, &Connection::keepalive_timer, now,
+                 &TBD::OnKeepaliveTimer);
+        ArmRetransmit(*conn);
+        ArmTimer(*conn, &Connection::ack_timer, conn->AckDeadline(),
+                 &TBD::OnAckTimer);
+      });
+
+  // and so were the datagrams the simulated link is still holding
+  if (m_impairment) {
+    {
+      std::lock_guard lock(m_impair_timer.mutex);
+      m_impair_timer.id = TimerWheel::INVALID;
+      m_impair_timer.at = Connection::Clock::time_point::max();
+    }
+    ArmImpairment(m_impairment->outbound.NextDue());
+  }
+
+  if (!m_reactor) {
+    m_receiver_thread = SetupReceiverThread();
+    m_sender_thread = SetupSenderThread();
+    m_timer_thread = SetupTimerThread();
+    return;
+  }
+  m_reactor_io = std::make_unique<ReactorIO>(m_batch_size, MAX_DATAGRAM_LEN);
+  m_wake_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  m_tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  m_timers.SetWakeHook([this](const TimerWheel::Clock::time_point when) {
+    const itimerspec at = AbsoluteTimer(when);
+    timerfd_settime(m_tick_fd, TFD_TIMER_ABSTIME, &at, nullptr);
+  });
+
+  m_reactor->Add(m_transport->Fd(), [this]() {
+    // the held datagrams coming due share the receive buffers
+    std::unique_lock lock(m_receive_mutex, std::defer_lock);
+    if (m_impairment)
+      lock.lock();
+    // drain a few batches then let the reactor get to other sockets,
+    // it calls back right away if there's more waiting
+    for (int i = 0; i < MAX_DRAIN_ROUNDS; i++) {
+      if (ReadPackets(m_reactor_io->receive_batch,
+                      m_reactor_io->received_packets,
+                      m_reactor_io->received_addrs) != 0)
+        break;
+      DeliverPackets(m_reactor_io->received_packets,
+                     m_reactor_io->received_addrs);
+    }
+  });
+  m_reactor->Add(m_wake_fd, [this]() {
+    uint64_t count = 0;
+    read(m_wake_fd, &count, sizeof(count));
+    // cleared before flushing so a send racing with the flush
+    // wakes us up again
+    m_flush_pending = false;
+    const auto next =
+        FlushSendQueue(m_reactor_io->send_batch, m_reactor_io->send_packets,
+                       m_reactor_io->ready_packets);
+    // come back once the pacer lets the held packets go
+    if (next != Connection::Clock::time_point::max())
+      ScheduleFlush(next - Connection::Clock::now());
+  });
+  m_reactor->Add(m_tick_fd, [this]() {
+    uint64_t expirations = 0;
+    read(m_tick_fd, &expirations, sizeof(expirations));
+    if (m_connected)
+      m_timers.Advance(Connection::Clock::now());
+  });
+  if (m_impairment) {
+    m_impair_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    m_reactor->Add(m_impair_fd, [this]() {
+      uint64_t expirations = 0;
+      read(m_impair_fd, &expirations, sizeof(expirations));
+      std::lock_guard lock(m_receive_mutex);
+      // nothing came in on the socket but held datagrams are due
+      if (ReadPackets(m_reactor_io->receive_batch,
+                      m_reactor_io->received_packets,
+                      m_reactor_io->received_addrs) == 0)
+        DeliverPackets(m_reactor_io->received_packets,
+                       m_reactor_io->received_addrs);
+    });
+  }
+  // anything queued before we registered
+  WakeSender();
+}
+
+void TBD::StopReactorIO() {
+  if (!m_reactor_io)
+    return;
+  m_reactor->Remove(m_transport->Fd());
+  m_reactor->Remove(m_wake_fd);
+  m_reactor->Remove(m_tick_fd);
+  // nothing may arm the timerfd once it is closed
+  m_timers.SetWakeHook(nullptr);
+  close(m_wake_fd);
+  close(m_tick_fd);
+  m_wake_fd = -1;
+  m_tick_fd = -1;
+  if (m_impair_fd >= 0) {
+    m_reactor->Remove(m_impair_fd);
+    close(m_impair_fd);
+    m_impair_fd = -1;
+  }
+  m_reactor_io.reset();
+}
+
+bool TBD::EnqueueSend(SendPacket packet) {
+  packet.queued_at = Connection::Clock::now();
+  if (!m_send_queue.push(std::move(packet)))
+    return false;
+  m_metrics->send_queue.Set(m_send_queue.size());
+  WakeSender();
+  return true;
+}
+
+void TBD::FillSend(const size_t slot, SendPacket packet) {
+  packet.queued_at = Connection::Clock::now();
+  m_send_queue.fill(slot, std::move(packet));
+}
+
+void TBD::WakeSender() {
+  // the sender thread waits on the queue itself, only the reactor
+  // needs to be told and only once until it flushes. The flush is
+  // put off by the coalesce delay so more packets can join this one
+  if (m_reactor_io && !m_flush_pending.exchange(true))
+    ScheduleFlush(m_coalesce_delay.load());
+}
+
+void TBD::ScheduleFlush(const Connection::Clock::duration delay) {
+  // a zero timer is disarmed, the soonest is a nanosecond
+  const int64_t ns = std::max<int64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count(), 1);
+  itimerspec when = {};
+  when.it_value.tv_sec = ns / 1000000000;
+  when.it_value.tv_nsec = ns % 1000000000;
+  timerfd_settime(m_wake_fd, 0, &when, nullptr);
+}
+
+size_t TBD::CollectSends(DatagramBatch &batch,
+                         std::vector<SendPacket> &packets,
+                         const std::chrono::milliseconds wait) {
+  if (m_send_queue.pop_many_wait_till(wait, packets,
+                                      batch.Capacity() - packets.size()) == 0)
+    return packets.size();
+  const auto deadline = Connection::Clock::now() + m_coalesce_delay.load();
+  auto now = Connection::Clock::now();
+  while (packets.size() < batch.Capacity() && now < deadline) {
+    m_send_queue.pop_many_wait_till(
+        std::chrono::ceil<std::chrono::milliseconds>(deadline - now), packets,
+        batch.Capacity() - packets.size());
+    now = Connection::Clock::now();
+  }
+  return packets.size();
+}
+
+Connection::Clock::time_point
+TBD::FlushSendQueue(DatagramBatch &batch, std::vector<SendPacket> &packets,
+                    std::vector<SendPacket> &ready) {
+  while (true) {
+    if (packets.size() < batch.Capacity())
+      m_send_queue.pop_many_wait_till(std::chrono::milliseconds(0), packets,
+                                      batch.Capacity() - packets.size());
+    ready.clear();
+    const auto next = Pace(packets, ready);
+    if (ready.empty())
+      return next;
+    SendConstructedBatch(ready, batch);
+    WakeSenders();
+  }
+}
+
+Connection::Clock::time_point TBD::Pace(std::vector<SendPacket> &packets,
+                                        std::vector<SendPacket> &ready) {
+  const auto now = Connection::Clock::now();
+  auto next = Connection::Clock::time_point::max();
+  std::shared_ptr<Connection> conn;
+  // peers whose pacer said no, their later packets wait too so they
+  // still go out in order
+  std::vector<PeerKey> held;
+  size_t kept = 0;
+  for (auto &packet : packets) {
+    const PeerKey peer = MakePeerKey(packet.peer);
+    bool wait = false;
+    if (packet.payload_len > 0) {
+      if (std::find(held.begin(), held.end(), peer) != held.end()) {
+        wait = true;
+      } else {
+        if (!conn || conn->key != peer)
+          conn = FindConnection(packet.peer);
+        Connection::Clock::time_point at;
+        if (conn && !conn->Pace(packet.Length(), now, &at)) {
+          held.push_back(peer);
+          next = std::min(next, at);
+          wait = true;
+        }
+      }
+    }
+    if (!wait) {
+      ready.push_back(std::move(packet));
+      continue;
+    }
+    if (&packets[kept] != &packet)
+      packets[kept] = std::move(packet);
+    kept++;
+  }
+  packets.resize(kept);
+  return next;
+}
+
 const int TBD::RetrievePacket(TBPacket &packet, sockaddr_in *_received_addr) {
   TBPacket received_packet = {};
-  Buffer buffer = std::make_unique<uint8_t[]>(MAX_BUFFER_LEN);
-  size_t received_len = 0;
+  Buffer buffer = BufferPool::Instance().Acquire(MAX_DATAGRAM_LEN);
+  ssize_t received_len = 0;
   sockaddr_in received_addr;
-  socklen_t received_addr_len = sizeof(received_addr);
-  // setup the timeout
-  fd_set read_fds;
-  int select_ret = 0;
-  timeval tv;
-  tv.tv_sec = 2;
-  tv.tv_usec = 0;
-  FD_ZERO(&read_fds);
-  FD_SET(m_sock, &read_fds);
-
-  select_ret = select(m_sock + 1, &read_fds, NULL, NULL, &tv);
-
-  if (select_ret == 0) {
-    return TIMEOUT;
-  } else if (select_ret < 1) {
-    return -1;
+  int status = 0;
+  if ((status = WaitForSocket(false)) != 0) {
+    return status;
   }
-  received_len = recvfrom(m_sock, (uint8_t *)buffer.get(), MAX_BUFFER_LEN, 0,
-                          (sockaddr *)&received_addr, &received_addr_len);
+  received_len =
+      m_transport->ReceiveFrom(buffer.get(), MAX_DATAGRAM_LEN, &received_addr);
   // got nothing
   if (received_len < 0) {
     return RECEIVE_ERROR;
   }
-  packet = RebuildPacket(std::move(buffer));
+  m_metrics->receive_calls.Add();
+  m_metrics->datagrams_in.Add();
+  m_metrics->bytes_in.Add(received_len);
+  const uint8_t *data = buffer.get();
+  std::vector<ImpairedLink::Datagram> due;
+  if (m_impairment) {
+    // the handshake blocks anyway, wait for the next datagram to come
+    // off the simulated network
+    ImpairedLink &link = m_impairment->inbound;
+    link.Submit(std::vector<uint8_t>(data, data + received_len),
+                received_addr, Connection::Clock::now());
+    const auto next = link.NextDue();
+    if (next == Connection::Clock::time_point::max())
+      return RECEIVE_ERROR;
+    std::this_thread::sleep_until(next);
+    link.Release(next, due, 1);
+    data = due[0].data.data();
+    received_len = due[0].data.size();
+    received_addr = due[0].peer;
+  }
+  if (RebuildPacket(data, received_len, &received_packet) == 0) {
+    m_metrics->Drop(DropReason::MALFORMED);
+    return RECEIVE_ERROR;
+  }
+  packet = std::move(received_packet);
   if (_received_addr) {
     *(_received_addr) = received_addr;
   }
   return 0;
 }
 
+const int TBD::RetrievePackets(DatagramBatch &batch,
+                               std::vector<TBPacket> &packets,
+                               std::vector<sockaddr_in> &received_addrs) {
+  packets.clear();
+  received_addrs.clear();
+  auto wait = std::chrono::microseconds(SOCKET_WAIT);
+  if (m_impairment) {
+    // wake up for the next held datagram too
+    const auto next = m_impairment->inbound.NextDue();
+    const auto now = Connection::Clock::now();
+    if (next != Connection::Clock::time_point::max())
+      wait = std::min(wait, std::chrono::ceil<std::chrono::microseconds>(
+                                std::max(next - now, now - now)));
+  }
+  int status = 0;
+  if ((status = WaitForSocket(false, wait)) != 0 && !m_impairment) {
+    return status;
+  }
+  return ReadPackets(batch, packets, received_addrs);
+}
+
+const int TBD::ReadPackets(DatagramBatch &batch,
+                           std::vector<TBPacket> &packets,
+                           std::vector<sockaddr_in> &received_addrs) {
+  packets.clear();
+  received_addrs.clear();
+  // got nothing, though held datagrams may have come due
+  if (m_transport->Receive(batch) <= 0 && !m_impairment) {
+    return RECEIVE_ERROR;
+  }
+  if (batch.Size() > 0)
+    m_metrics->receive_calls.Add();
+  m_metrics->datagrams_in.Add(batch.Size());
+  const auto now = Connection::Clock::now();
+  for (size_t i = 0; i < batch.Size(); i++) {
+    m_metrics->bytes_in.Add(batch.Length(i));
+    if (batch.Truncated(i)) {
+      m_metrics->Drop(DropReason::MALFORMED);
+      continue;
+    }
+    if (m_impairment) {
+      m_impairment->inbound.Submit(
+          std::vector<uint8_t>(batch.Data(i), batch.Data(i) + batch.Length(i)),
+          batch.Address(i), now);
+      continue;
+    }
+    ParseDatagram(batch.Data(i), batch.Length(i), batch.Address(i), packets,
+                  received_addrs);
+  }
+  if (m_impairment)
+    ReleaseImpaired(packets, received_addrs);
+  return packets.empty() ? RECEIVE_ERROR : 0;
+}
+
+void TBD::ParseDatagram(const uint8_t *data, const size_t length,
+                        const sockaddr_in &addr, std::vector<TBPacket> &packets,
+                        std::vector<sockaddr_in> &received_addrs) {
+  // split up packets that were sent together
+  size_t offset = 0;
+  size_t used = 0;
+  TBPacket packet = {};
+  while ((used = RebuildPacket(data + offset, length - offset, &packet)) > 0) {
+    offset += used;
+    packets.push_back(std::move(packet));
+    received_addrs.push_back(addr);
+  }
+  // whatever is left over doesn't parse
+  if (offset < length)
+    m_metrics->Drop(DropReason::MALFORMED);
+}
+
+void TBD::ReleaseImpaired(std::vector<TBPacket> &packets,
+                          std::vector<sockaddr_in> &received_addrs) {
+  ImpairedLink &link = m_impairment->inbound;
+  std::vector<ImpairedLink::Datagram> due;
+  link.Release(Connection::Clock::now(), due);
+  for (auto &datagram : due)
+    ParseDatagram(datagram.data.data(), datagram.data.size(), datagram.peer,
+                  packets, received_addrs);
+  // the receiver thread works out its own wait
+  if (m_impair_fd < 0)
+    return;
+  const itimerspec at = AbsoluteTimer(link.NextDue());
+  timerfd_settime(m_impair_fd, TFD_TIMER_ABSTIME, &at, nullptr);
+}
+
 const uint32_t TBD::ProcessPacket(TBPacket &received_packet,
                                   sockaddr_in &received_addr,
-                                  Buffer *retrieved_buffer) {
-  const uint32_t received_seq = received_packet.header.sequence;
+                                  Buffer *retrieved_buffer,
+                                  size_t *retrieved_len) {
   const uint16_t packet_type = received_packet.header.type;
 
   // make sure received address is from whom we expect
-  if (received_addr.sin_addr.s_addr != m_peer_addr.sin_addr.s_addr) {
+  std::shared_ptr<Connection> conn = FindConnection(received_addr);
+  bool accepted = false;
+  if (!conn && m_hosting && packet_type == PacketType::SYN) {
+    // a new peer is reaching out to the server
+    conn = AcceptConnection(received_addr, received_packet.header.sequence);
+    accepted = true;
+  }
+  if (!conn) {
     // disregard
     return UNRECOGNIZED_PEER;
   }
+  conn->Heard();
+  conn->inbound.Add(received_packet.wire_length, Connection::Clock::now());
+  if (received_packet.version == HeaderVersion::COMPACT)
+    conn->ExpandHeader(received_packet.header);
+  const uint32_t received_seq = received_packet.header.sequence;
+  // whatever the packet is, its header says what the peer got from us
+  if (conn->Acknowledge({.ack = received_packet.header.ack,
+                         .bits = received_packet.header.ack_bits},
+                        Connection::Clock::now()) > 0)
+    WakeSenders();
+  // packets it reported lost are due right away
+  if (received_packet.header.ack_bits != 0)
+    ArmRetransmit(*conn);
+
+  // the sequence of a SYN or SYNACK is where the peer's data starts and
+  // the payload the newest header version it speaks. Peers from before
+  // there were versions send none
+  if (packet_type == PacketType::SYN || packet_type == PacketType::SYNACK) {
+    conn->ExpectSequence(received_seq);
+    const uint8_t version = received_packet.header.length > 0
+                                ? received_packet.payload[0]
+                                : HeaderVersion::FULL;
+    conn->header_version =
+        version < HeaderVersion::LATEST ? version : HeaderVersion::LATEST;
+  }
+
+  if (m_hosting && packet_type == PacketType::SYN) {
+    // answer the handshake without blocking the receiver thread. If the
+    // SYNACK is lost the peer sends the SYN again and gets another one
+    QueueControl(conn->addr, PacketType::SYNACK, conn->sequence,
+                 s_handshake_payload, 1);
+    if (accepted)
+      ProbeMtu(*conn);
+    return RECEIVED_ACK;
+  }
 
   if (packet_type & PacketType::SYNACK) {
-    // make sure the packet sequence is the same as current
-    // sequence
-    if (received_seq < m_sequence) {
-      std::cout << "Retransmitting\n";
-      // retransmit
-      std::vector<SendPacket> packets_to_retransmit(
-          m_unacked_packets.GetGreaterThan(received_seq));
-      for (auto &packet : packets_to_retransmit) {
-        QueueRetransmit(packet.buffer, packet.buffer_len, packet.sequence);
-      }
-    } else {
-    }
+    if (packet_type == PacketType::ACK)
+      m_metrics->acks_in.Add();
     return RECEIVED_ACK;
   }
   if (packet_type & PacketType::PING) {
-    Buffer empty_load;
-    QueueSend(empty_load, 0, PacketType::PONG);
+    QueueControl(conn->addr, PacketType::PONG, received_seq);
     return RECEIVED_PING;
   }
   if (packet_type & PacketType::PONG) {
-    m_ponged = true;
+    conn->Ponged(received_seq, Connection::Clock::now());
     return RECEIVED_PONG;
   }
-  // any other message we acknowledge it and return teh payload
-  QueueAck(received_seq, received_packet.header.length);
+  if (packet_type & PacketType::PROBE) {
+    // it made it here whole, tell the peer the size is good
+    QueueControl(conn->addr, PacketType::PROBE_ACK, received_seq);
+    return RECEIVED_PROBE;
+  }
+  if (packet_type & PacketType::PROBE_ACK) {
+    if (received_seq <= MAX_DATAGRAM_LEN + UDP_OVERHEAD)
+      conn->RaiseMtu(received_seq);
+    return RECEIVED_PROBE;
+  }
+  const TBHeader &header = received_packet.header;
+  const uint8_t channel = header.channel;
+  const uint32_t channel_seq = header.channel_sequence;
+  if (channel >= Channel::COUNT || header.fragment_count == 0 ||
+      header.fragment_index >= header.fragment_count)
+    return RECEIVE_ERROR;
+  const bool reliable = Channel::IsReliable(channel);
+  const bool ordered = channel == Channel::RELIABLE_ORDERED ||
+                       (channel == Channel::RELIABLE && m_ordered);
+  const bool fragmented = header.fragment_count > 1;
+  ReorderBuffer &reorder = conn->channels[channel].reorder;
+
+  // a retransmit of something we already have means our ACK was lost,
+  // so it's acknowledged again but not handed to the user twice
+  if (reliable && conn->WasReceived(received_seq)) {
+    AcknowledgeReceived(*conn, received_seq);
+    return RECEIVED_DUPLICATE;
+  }
+  // further ahead than the peer should ever get, it's kept track of
+  // once the packets before it arrive and the peer sends it again
+  if (reliable && !conn->InReceiveWindow(received_seq))
+    return QUEUE_FULL;
+  // no room to hand the payload over, don't acknowledge it so the
+  // peer sends it again once the user has caught up. In order, room is
+  // also needed for everything the reorder buffer might release with it
+  if (retrieved_buffer && ordered) {
+    if (DeliveryRoom() <= reorder.Held() || !reorder.Fits(channel_seq))
+      return QUEUE_FULL;
+  } else if (retrieved_buffer && DeliveryRoom() == 0) {
+    return QUEUE_FULL;
+  }
+  // same for a fragment of a new message while reassembly is out of
+  // memory
+  if (fragmented && !conn->reassembly.Accepts(channel, channel_seq,
+                                              header.fragment_count))
+    return QUEUE_FULL;
+  // any other message we acknowledge and return the payload
+  if (reliable) {
+    conn->MarkReceived(received_seq);
+    AcknowledgeReceived(*conn, received_seq);
+  }
+
+  Buffer payload = std::move(received_packet.payload);
+  size_t length = header.length;
+  if (fragmented &&
+      !conn->reassembly.Insert({.channel = channel,
+                                .channel_sequence = channel_seq,
+                                .index = header.fragment_index,
+                                .count = header.fragment_count,
+                                .payload = std::move(payload),
+                                .length = length},
+                               Reassembler::Clock::now(), &payload, &length))
+    return RECEIVED_FRAGMENT;
+
+  // a sequenced message is only wanted if it is newer than anything
+  // received on its channel
+  if (channel == Channel::UNRELIABLE_SEQUENCED &&
+      !conn->MarkNewest(channel, channel_seq))
+    return RECEIVED_STALE;
+  if (retrieved_buffer && ordered && !reorder.Deliverable(channel_seq)) {
+    DeliverInOrder(*conn, channel, channel_seq, std::move(payload), length);
+    return RECEIVED_HELD;
+  }
   if (retrieved_buffer)
-    *retrieved_buffer = std::move(received_packet.payload);
+    *retrieved_buffer = std::move(payload);
+  if (retrieved_len)
+    *retrieved_len = length;
   return RECEIVED_PACKET;
 }
 
+void TBD::AcknowledgeReceived(Connection &conn, const uint32_t sequence) {
+  // too far behind the newest for the ack fields, it gets its own
+  if (!conn.InAckWindow(sequence)) {
+    QueueAck(conn, {.ack = sequence, .bits = 1});
+    return;
+  }
+  const auto delay = m_ack_delay.load();
+  const auto due = Connection::Clock::now() + delay;
+  if (conn.ScheduleAck(due) || delay.count() == 0)
+    QueueAck(conn, conn.TakeAck());
+  else
+    ArmTimer(conn, &Connection::ack_timer, due, &TBD::OnAckTimer);
+}
+
+void TBD::DeliverInOrder(Connection &conn, const uint8_t channel,
+                         const uint32_t channel_sequence, Buffer payload,
+                         const size_t length) {
+  ReorderBuffer &reorder = conn.channels[channel].reorder;
+  const auto now = ReorderBuffer::Clock::now();
+  reorder.Insert(channel_sequence, std::move(payload), length, now);
+  ReorderBuffer::Ready ready;
+  while (reorder.Pop(ready, now)) {
+    Deliver(std::move(ready.payload), ready.length, conn.addr, channel);
+  }
+}
+
+void TBD::Deliver(Buffer payload, const size_t length,
+                  const sockaddr_in &peer, const uint8_t channel) {
+  const Handler *handler = m_handlers.Find(payload.get(), length);
+  if (!handler) {
+    m_received_queues.emplace(std::move(payload), length, peer, channel);
+    return;
+  }
+  if (m_dispatch == Dispatch::PUMPED) {
+    ReceivedMessage message(std::move(payload), length, peer, channel);
+    message.handler = m_handlers.Share(message.payload[0]);
+    m_pumped.push(std::move(message));
+    return;
+  }
+  (*handler)({.type = payload[0],
+              .payload = {payload.get(), length},
+              .peer = peer,
+              .channel = channel});
+}
+
+size_t TBD::DeliveryRoom() const {
+  size_t room = m_received_queues.capacity() - m_received_queues.size();
+  // any of them could turn out to be for a handler
+  if (m_dispatch == Dispatch::PUMPED && !m_handlers.Empty())
+    room = std::min(room, m_pumped.capacity() - m_pumped.size());
+  return room;
+}
+
+void TBD::CountDrop(const uint32_t status) {
+  switch (status) {
+  case UNRECOGNIZED_PEER:
+    m_metrics->Drop(DropReason::UNKNOWN_PEER);
+    break;
+  case RECEIVE_ERROR:
+    m_metrics->Drop(DropReason::MALFORMED);
+    break;
+  case RECEIVED_DUPLICATE:
+    m_metrics->Drop(DropReason::DUPLICATE);
+    break;
+  case RECEIVED_STALE:
+    m_metrics->Drop(DropReason::STALE);
+    break;
+  case QUEUE_FULL:
+    m_metrics->Drop(DropReason::NO_ROOM);
+    break;
+  }
+}
+
+Buffer TBD::HandshakePayload() {
+  Buffer payload = BufferPool::Instance().Acquire(1);
+  payload[0] = HeaderVersion::LATEST;
+  return payload;
+}
+
 void TBD::AckPacket(uint32_t sequence, uint32_t length) {
   Buffer empty_load;
   auto [packet, packet_len] =
       BuildPacket(PacketType::ACK, sequence + length, empty_load, 0);
 
-  sendto(m_sock, packet.get(), packet_len, 0, (const sockaddr *)&m_peer_addr,
-         sizeof(m_peer_addr));
+  if (SendDatagram(packet.get(), packet_len, m_peer->addr) > 0)
+    m_metrics->acks_out.Add();
 }
 
 std::thread TBD::SetupSenderThread() {
   return std::thread([this]() {
-    while (this->m_connected || !this->m_send_queue.empty()) {
-      SendPacket packet_struct;
-      if (!this->m_send_queue.pop_wait_till(std::chrono::milliseconds(2000),
-                                            &packet_struct))
-        continue;
-      int total_tries = 0;
-      int status = 0;
-      while (++total_tries < MAX_TRIES) {
-        status =
-            SendConstructed(packet_struct.buffer, packet_struct.buffer_len);
-        if (status > 0) {
-          // add packet to the ack map
-          this->m_unacked_packets.insert(packet_struct.sequence, packet_struct);
-          total_tries += MAX_TRIES;
-        }
+    DatagramBatch batch(this->m_batch_size);
+    // packets held back by pacing stay in packets between rounds
+    std::vector<SendPacket> packets;
+    std::vector<SendPacket> ready;
+    packets.reserve(this->m_batch_size);
+    ready.reserve(this->m_batch_size);
+    auto next = Connection::Clock::time_point::max();
+    while (this->m_connected || !this->m_send_queue.empty() ||
+           !packets.empty()) {
+      // wait for something new to send or for the pacer to let a held
+      // packet go, whichever is first
+      auto wait = std::chrono::milliseconds(2000);
+      if (next != Connection::Clock::time_point::max())
+        wait = std::chrono::ceil<std::chrono::milliseconds>(
+            std::max(next - Connection::Clock::now(),
+                     Connection::Clock::duration::zero()));
+      // flush as much of the backlog as fits in one batch
+      if (packets.size() < batch.Capacity())
+        CollectSends(batch, packets, wait);
+      else
+        std::this_thread::sleep_until(next);
+      ready.clear();
+      next = Pace(packets, ready);
+      if (!ready.empty()) {
+        SendConstructedBatch(ready, batch);
+        WakeSenders();
       }
     }
   });
@@ -372,49 +1658,137 @@ std::thread TBD::SetupSenderThread() {
 std::thread TBD::SetupReceiverThread() {
 
   return std::thread([this]() {
+    DatagramBatch batch(this->m_batch_size, MAX_DATAGRAM_LEN);
+    std::vector<TBPacket> received_packets;
+    std::vector<sockaddr_in> received_addrs;
+    received_packets.reserve(this->m_batch_size);
+    received_addrs.reserve(this->m_batch_size);
     while (this->m_connected) {
-      TBPacket received_packet{};
-      sockaddr_in received_addr;
-      Buffer received_buffer;
-
-      if (RetrievePacket(received_packet, &received_addr) != 0)
+      if (RetrievePackets(batch, received_packets, received_addrs) != 0)
         continue;
 
-      if (ProcessPacket(received_packet, received_addr, &received_buffer) !=
-          RECEIVED_PACKET)
-        continue;
-
-      this->m_received_queues.emplace(std::move(received_buffer));
+      DeliverPackets(received_packets, received_addrs);
     }
   });
 }
 
-std::thread TBD::SetupPingThread() {
+void TBD::DeliverPackets(std::vector<TBPacket> &packets,
+                         std::vector<sockaddr_in> &received_addrs) {
+  for (size_t i = 0; i < packets.size(); i++) {
+    Buffer received_buffer;
+    size_t received_len = 0;
+    const uint32_t status = ProcessPacket(packets[i], received_addrs[i],
+                                          &received_buffer, &received_len);
+    if (status != RECEIVED_PACKET) {
+      CountDrop(status);
+      continue;
+    }
+
+    Deliver(std::move(received_buffer), received_len, received_addrs[i],
+            packets[i].header.channel);
+  }
+  m_metrics->received_queue.Set(m_received_queues.size());
+  WakeReceiver();
+}
+
+std::thread TBD::SetupTimerThread() {
   return std::thread([this]() {
-    auto start = std::chrono::high_resolution_clock::now();
-    std::chrono::seconds timeout(60);
     while (this->m_connected) {
-      if (this->m_ponged.load()) {
-        auto now = std::chrono::high_resolution_clock::now();
-        auto diff = now - start;
-        this->m_ponged = false;
-      } else {
-        auto now = std::chrono::high_resolution_clock::now();
-        auto diff = now - start;
-        if (now - start > timeout) {
-          // lost connection
-          this->m_connected = false;
-          this->m_received_queues.release_all_blocks();
-        }
-      }
+      m_timers.Advance(Connection::Clock::now());
+      // woken early by anything scheduled sooner and by Interrupt
+      m_timers.Wait(TimerWheel::Clock::time_point::max());
+    }
+  });
+}
 
-      // send a ping
-      Buffer empty_load;
-      this->QueueSend(empty_load, 0, PacketType::PING);
-      // wait to check
-      std::this_thread::sleep_for(std::chrono::seconds(15));
+void TBD::ArmTimer(Connection &conn, Connection::Timer Connection::*timer,
+                   const Connection::Clock::time_point when,
+                   void (TBD::*handler)(Connection &)) {
+  if (when == Connection::Clock::time_point::max())
+    return;
+  Connection::Timer &armed = conn.*timer;
+  std::lock_guard lock(armed.mutex);
+  if (armed.at <= when)
+    return;
+  if (armed.id != TimerWheel::INVALID)
+    m_timers.Cancel(armed.id);
+  armed.at = when;
+  // the connection is looked up again when it goes off in case it was
+  // dropped in the meantime
+  armed.id = m_timers.Schedule(when, [this, key = conn.key, timer, when,
+                                      handler]() {
+    std::shared_ptr<Connection> conn;
+    if (!m_connections.get(key, conn))
+      return;
+    Connection::Timer &fired = (*conn).*timer;
+    {
+      std::lock_guard lock(fired.mutex);
+      // rearmed sooner meanwhile, the handler runs anyway and
+      // works out from the connection whether there's anything to do
+      if (fired.at == when) {
+        fired.id = TimerWheel::INVALID;
+        fired.at = Connection::Clock::time_point::max();
+      }
     }
+    (this->*handler)(*conn);
   });
 }
 
+void TBD::ArmRetransmit(Connection &conn) {
+  ArmTimer(conn, &Connection::retransmit_timer, conn.NextDeadline(),
+           &TBD::OnRetransmitTimer);
+}
+
+void TBD::CancelTimers(Connection &conn) {
+  for (auto timer : {&Connection::retransmit_timer, &Connection::ack_timer,
+                     &Connection::keepalive_timer}) {
+    Connection::Timer &armed = conn.*timer;
+    std::lock_guard lock(armed.mutex);
+    m_timers.Cancel(armed.id);
+    armed.id = TimerWheel::INVALID;
+    armed.at = Connection::Clock::time_point::max();
+  }
+}
+
+void TBD::OnRetransmitTimer(Connection &conn) {
+  std::vector<SendPacket> expired;
+  conn.CollectExpired(Connection::Clock::now(), expired);
+  m_metrics->retransmits.Add(expired.size());
+  for (auto &packet : expired) {
+    QueueRetransmit(packet);
+  }
+  ArmRetransmit(conn);
+}
+
+void TBD::OnAckTimer(Connection &conn) {
+  if (conn.AckDue(Connection::Clock::now())) {
+    QueueAck(conn, conn.TakeAck());
+    return;
+  }
+  // the ACK it was armed for went out with a packet, one scheduled
+  // after that may still be waiting
+  ArmTimer(conn, &Connection::ack_timer, conn.AckDeadline(),
+           &TBD::OnAckTimer);
+}
+
+void TBD::OnKeepaliveTimer(Connection &conn) {
+  const auto now = Connection::Clock::now();
+  if (now - conn.last_heard.load() > PEER_TIMEOUT) {
+    // lost connection
+    m_metrics->peer_timeouts.Add();
+    DropConnection(conn);
+    return;
+  }
+  // send a ping, its PONG is a round trip sample when no data is
+  // being acknowledged
+  const uint32_t sequence = conn.sequence;
+  conn.Pinged(sequence, now);
+  QueueControl(conn.addr, PacketType::PING, sequence);
+  // the first round goes out right after connecting, later ones
+  // catch a path that started taking bigger datagrams
+  ProbeMtu(conn);
+  ArmTimer(conn, &Connection::keepalive_timer, now + KEEPALIVE_INTERVAL,
+           &TBD::OnKeepaliveTimer);
+}
+
 } // namespace Hev
@@ -0,0 +1,92 @@
+#include "shardedserver.h"
+#include <algorithm>
+#include <linux/filter.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+namespace Hev {
+
+ShardedServer ShardedServer::Bind(const char *local_addr,
+                                  const int local_port,
+                                  const ShardConfig &config) {
+  // the cores we're allowed on, shards are pinned to them in turn
+  std::vector<int> cpus;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+  }
+  const size_t shards =
+      config.shards > 0 ? config.shards : std::max<size_t>(cpus.size(), 1);
+
+  UdpConfig udp = config.udp;
+  udp.reuse_port = true;
+  ShardedServer server;
+  server.m_reactors.reserve(shards);
+  server.m_shards.reserve(shards);
+  std::vector<int> socks;
+  std::vector<int> shard_cpus;
+  for (size_t i = 0; i < shards; i++) {
+    std::unique_ptr<Transport> transport =
+        UdpTransport::Bind(local_addr, local_port, udp);
+    if (!transport)
+      throw 0;
+    socks.push_back(transport->Fd());
+    const int cpu = config.pin && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+    shard_cpus.push_back(cpu);
+    server.m_reactors.push_back(std::make_unique<Reactor>(1, cpu));
+    server.m_shards.push_back(TBD::Bind(std::move(transport)));
+    server.m_shards.back().Attach(*server.m_reactors.back());
+  }
+  // the program is shared by the whole port, it has to go on after
+  // every shard has joined
+  if (config.steering == Steering::CPU && config.pin && !cpus.empty())
+    server.m_steered = SteerByCpu(socks.front(), shard_cpus);
+  return server;
+}
+
+bool ShardedServer::SteerByCpu(const int sock,
+                               const std::vector<int> &shard_cpus) {
+  // shards are numbered in the order they were bound. The program
+  // compares the core against each one a shard is pinned to and returns
+  // the first such shard. Cores without one get a number past the last
+  // shard, which has the kernel fall back to the hash
+  std::vector<sock_filter> code;
+  code.push_back(
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU)});
+  std::vector<bool> covered(CPU_SETSIZE, false);
+  for (size_t shard = 0; shard < shard_cpus.size(); shard++) {
+    const int cpu = shard_cpus[shard];
+    if (cpu < 0 || covered[cpu])
+      continue;
+    covered[cpu] = true;
+    code.push_back({BPF_JMP | BPF_JEQ | BPF_K, 0, 1, uint32_t(cpu)});
+    code.push_back({BPF_RET | BPF_K, 0, 0, uint32_t(shard)});
+  }
+  code.push_back({BPF_RET | BPF_K, 0, 0, uint32_t(shard_cpus.size())});
+  sock_fprog program = {.len = static_cast<unsigned short>(code.size()),
+                        .filter = code.data()};
+  return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+                    sizeof(program)) == 0;
+}
+
+const int ShardedServer::Host(const size_t max_peers) {
+  for (TBD &shard : m_shards) {
+    const int status = shard.Host(max_peers);
+    if (status != 0)
+      return status;
+  }
+  return 0;
+}
+
+const size_t ShardedServer::PeerCount() const {
+  size_t peers = 0;
+  for (const TBD &shard : m_shards)
+    peers += shard.PeerCount();
+  return peers;
+}
+
+} // namespace Hev
@@ -1,13 +1,23 @@
 #include "timer.h"
 namespace Hev {
 
-Timeout::Timeout(const int timeout_in_ms) : m_time(timeout_in_ms) {
+Timeout::Timeout(const int timeout_in_ms)
+    : m_time(timeout_in_ms), m_timer(TimerWheel::INVALID) {
   m_finished.store(false);
 }
 
+Timeout::~Timeout() {
+  if (m_timer != TimerWheel::INVALID)
+    TimerWheel::Shared().Cancel(m_timer);
+}
+
 const int Timeout::Start() {
+  TimerWheel &wheel = TimerWheel::Shared();
+  wheel.Cancel(m_timer);
   m_finished.store(false);
-  return timer(m_time, true, [this]() { this->m_finished.store(true); });
+  m_timer = wheel.Schedule(TimerWheel::Clock::now() + m_time,
+                           [this]() { this->m_finished.store(true); });
+  return 0;
 }
 
 const bool Timeout::IsFinished() const { return m_finished.load(); }
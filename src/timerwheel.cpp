@@ -0,0 +1,270 @@
+#include "timerwheel.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace Hev {
+
+TimerWheel::TimerWheel()
+    : m_start(Clock::now()), m_tick(0), m_level_count(), m_count(0),
+      m_wake_at(Clock::time_point::max()), m_interrupted(false) {
+  std::fill(std::begin(m_slots), std::end(m_slots), NIL);
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(const Clock::time_point when,
+                                         Callback callback) {
+  std::lock_guard lock(m_mutex);
+  uint32_t index;
+  if (!m_free.empty()) {
+    index = m_free.back();
+    m_free.pop_back();
+  } else {
+    index = m_nodes.size();
+    m_nodes.push_back({.callback = nullptr,
+                       .expiry = 0,
+                       .prev = NIL,
+                       .next = NIL,
+                       .generation = 1,
+                       .slot = NIL});
+  }
+  Node &node = m_nodes[index];
+  node.callback = std::move(callback);
+  node.expiry = ToTick(when, true);
+  Link(index, m_tick + 1);
+
+  // the driver is asleep past when this is due
+  const Clock::time_point due = ToTime(std::max(node.expiry, m_tick + 1));
+  if (due < m_wake_at) {
+    m_wake_at = due;
+    if (m_hook)
+      m_hook(m_wake_at);
+    m_wake.notify_all();
+  }
+  return static_cast<TimerId>(node.generation) << 32 | index;
+}
+
+bool TimerWheel::Cancel(const TimerId id) {
+  const uint32_t index = static_cast<uint32_t>(id);
+  const uint32_t generation = static_cast<uint32_t>(id >> 32);
+  std::lock_guard lock(m_mutex);
+  if (index >= m_nodes.size() || m_nodes[index].generation != generation ||
+      m_nodes[index].slot == NIL)
+    return false;
+  Unlink(index);
+  Release(index);
+  return true;
+}
+
+size_t TimerWheel::Advance(const Clock::time_point now) {
+  std::vector<Callback> due;
+  {
+    std::lock_guard lock(m_mutex);
+    const uint64_t target = ToTick(now, false);
+    while (m_tick < target) {
+      if (m_count == 0) {
+        m_tick = target;
+        break;
+      }
+      // nothing in the lowest ring, skip ahead to where it next takes
+      // timers from the ring above
+      if (m_level_count[0] == 0) {
+        const uint64_t boundary = ((m_tick >> SLOT_BITS) + 1) << SLOT_BITS;
+        if (boundary > target) {
+          m_tick = target;
+          break;
+        }
+        m_tick = boundary - 1;
+      }
+      m_tick++;
+      Cascade();
+      // everything in the slot is due now
+      const uint32_t slot = m_tick & SLOT_MASK;
+      while (m_slots[slot] != NIL) {
+        const uint32_t index = m_slots[slot];
+        Unlink(index);
+        due.push_back(std::move(m_nodes[index].callback));
+        Release(index);
+      }
+    }
+    UpdateWake();
+  }
+  for (auto &callback : due)
+    callback();
+  return due.size();
+}
+
+TimerWheel::Clock::time_point TimerWheel::NextExpiry() {
+  std::lock_guard lock(m_mutex);
+  const uint64_t tick = NextTick();
+  return tick == UINT64_MAX ? Clock::time_point::max() : ToTime(tick);
+}
+
+void TimerWheel::Wait(const Clock::time_point limit) {
+  std::unique_lock lock(m_mutex);
+  const Clock::time_point until = std::min(m_wake_at, limit);
+  const auto woken = [&]() { return m_interrupted || m_wake_at < until; };
+  // waiting until max overflows the conversion to the system's clock
+  if (until == Clock::time_point::max())
+    m_wake.wait(lock, woken);
+  else
+    m_wake.wait_until(lock, until, woken);
+}
+
+void TimerWheel::Interrupt() {
+  std::lock_guard lock(m_mutex);
+  m_interrupted = true;
+  m_wake.notify_all();
+}
+
+void TimerWheel::SetWakeHook(WakeHook hook) {
+  std::lock_guard lock(m_mutex);
+  m_hook = std::move(hook);
+  if (m_hook)
+    m_hook(m_wake_at);
+}
+
+size_t TimerWheel::Size() {
+  std::lock_guard lock(m_mutex);
+  return m_count;
+}
+
+TimerWheel &TimerWheel::Shared() {
+  static struct SharedWheel {
+    TimerWheel wheel;
+    std::atomic_bool running{true};
+    std::thread thread;
+
+    SharedWheel() {
+      thread = std::thread([this]() {
+        while (running) {
+          wheel.Advance(Clock::now());
+          wheel.Wait(Clock::time_point::max());
+        }
+      });
+    }
+    ~SharedWheel() {
+      running = false;
+      wheel.Interrupt();
+      thread.join();
+    }
+  } shared;
+  return shared.wheel;
+}
+
+uint64_t TimerWheel::ToTick(const Clock::time_point time,
+                            const bool round_up) const {
+  if (time <= m_start)
+    return 0;
+  if (time == Clock::time_point::max())
+    return UINT64_MAX / 2;
+  const auto elapsed = time - m_start;
+  uint64_t tick = elapsed / RESOLUTION;
+  if (round_up && elapsed % RESOLUTION != Clock::duration::zero())
+    tick++;
+  return tick;
+}
+
+TimerWheel::Clock::time_point TimerWheel::ToTime(const uint64_t tick) const {
+  const uint64_t last = (Clock::time_point::max() - m_start) / RESOLUTION;
+  if (tick >= last)
+    return Clock::time_point::max();
+  return m_start + tick * RESOLUTION;
+}
+
+void TimerWheel::Link(const uint32_t index, const uint64_t earliest) {
+  Node &node = m_nodes[index];
+  // already due, goes off as soon as it can
+  uint64_t expiry = std::max(node.expiry, earliest);
+  const uint64_t delta = expiry - m_tick;
+  size_t level = 0;
+  while (level < LEVELS && delta >> (SLOT_BITS * (level + 1)) != 0)
+    level++;
+  if (level == LEVELS) {
+    // past the top ring, it is put back in once that slot comes round
+    level = LEVELS - 1;
+    expiry = m_tick + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+  }
+  const uint32_t slot =
+      level * SLOTS + ((expiry >> (SLOT_BITS * level)) & SLOT_MASK);
+  node.slot = slot;
+  node.prev = NIL;
+  node.next = m_slots[slot];
+  if (node.next != NIL)
+    m_nodes[node.next].prev = index;
+  m_slots[slot] = index;
+  m_level_count[level]++;
+  m_count++;
+}
+
+void TimerWheel::Unlink(const uint32_t index) {
+  Node &node = m_nodes[index];
+  if (node.prev != NIL)
+    m_nodes[node.prev].next = node.next;
+  else
+    m_slots[node.slot] = node.next;
+  if (node.next != NIL)
+    m_nodes[node.next].prev = node.prev;
+  m_level_count[node.slot / SLOTS]--;
+  m_count--;
+  node.slot = NIL;
+}
+
+void TimerWheel::Release(const uint32_t index) {
+  Node &node = m_nodes[index];
+  node.callback = nullptr;
+  node.generation++;
+  m_free.push_back(index);
+}
+
+void TimerWheel::Cascade() {
+  if ((m_tick & SLOT_MASK) != 0)
+    return;
+  // the highest ring whose slot m_tick just reached
+  size_t top = 1;
+  while (top + 1 < LEVELS && ((m_tick >> (SLOT_BITS * top)) & SLOT_MASK) == 0)
+    top++;
+  for (size_t level = top; level >= 1; level--) {
+    const uint32_t slot =
+        level * SLOTS + ((m_tick >> (SLOT_BITS * level)) & SLOT_MASK);
+    uint32_t index = m_slots[slot];
+    m_slots[slot] = NIL;
+    while (index != NIL) {
+      const uint32_t next = m_nodes[index].next;
+      m_level_count[level]--;
+      m_count--;
+      // the slot of m_tick itself hasn't fired yet
+      Link(index, m_tick);
+      index = next;
+    }
+  }
+}
+
+uint64_t TimerWheel::NextTick() const {
+  if (m_count == 0)
+    return UINT64_MAX;
+  uint64_t next = UINT64_MAX;
+  for (size_t level = 0; level < LEVELS; level++) {
+    if (m_level_count[level] == 0)
+      continue;
+    // the first slot of the ring that has anything, the tick it fires
+    // or cascades at is when it can next matter
+    const size_t shift = SLOT_BITS * level;
+    const uint64_t base = m_tick >> shift;
+    for (uint64_t i = 1; i <= SLOTS; i++) {
+      if (m_slots[level * SLOTS + ((base + i) & SLOT_MASK)] != NIL) {
+        next = std::min(next, (base + i) << shift);
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+void TimerWheel::UpdateWake() {
+  const uint64_t tick = NextTick();
+  m_wake_at = tick == UINT64_MAX ? Clock::time_point::max() : ToTime(tick);
+  if (m_hook)
+    m_hook(m_wake_at);
+}
+
+} // namespace Hev
@@ -0,0 +1,148 @@
+#include "transport.h"
+#include "errors.h"
+#include <algorithm>
+#include <cstring>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace Hev {
+
+std::unique_ptr<Transport> UdpTransport::Bind(const char * /*local_addr*/,
+                                              const int local_port,
+                                              const UdpConfig &config) {
+  const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    return nullptr;
+  sockaddr_in addr = {};
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(local_port);
+  addr.sin_family = AF_INET;
+  // set DF on everything we send so a datagram too big for the path is
+  // dropped rather than fragmented, that's what makes mtu probes work.
+  // The kernel's own guess at the path mtu is ignored, we keep ours
+  int pmtu = IP_PMTUDISC_PROBE;
+  setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+  int on = 1;
+  if (config.reuse_port &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+    close(sock);
+    return nullptr;
+  }
+  const int interrupt = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (interrupt < 0 ||
+      bind(sock, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (interrupt >= 0)
+      close(interrupt);
+    close(sock);
+    return nullptr;
+  }
+  // kernels without the option don't know it, the segment size itself
+  // is set per send
+  int segment_size = 0;
+  socklen_t option_len = sizeof(segment_size);
+  const bool segment =
+      config.segment_sends && getsockopt(sock, SOL_UDP, UDP_SEGMENT,
+                                         &segment_size, &option_len) == 0;
+  const bool coalesce =
+      config.coalesce_receives &&
+      setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+  return std::unique_ptr<Transport>(
+      new UdpTransport(sock, interrupt, segment, coalesce));
+}
+
+UdpTransport::UdpTransport(const int sock, const int interrupt,
+                           const bool segment, const bool coalesce)
+    : m_sock(sock), m_interrupt(interrupt), m_segment(segment),
+      m_coalesce(coalesce) {}
+
+UdpTransport::~UdpTransport() {
+  // shouldn't overwrite the standard fds
+  if (m_sock > 2)
+    close(m_sock);
+  close(m_interrupt);
+}
+
+const int UdpTransport::Receive(DatagramBatch &batch) {
+  return batch.Receive(m_sock, m_coalesce);
+}
+
+const int UdpTransport::ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                                    sockaddr_in *from) {
+  iovec iov = {.iov_base = buffer, .iov_len = buffer_len};
+  alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int))];
+  msghdr msg = {};
+  msg.msg_name = from;
+  msg.msg_namelen = sizeof(*from);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (m_coalesce) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+  }
+  const int received = recvmsg(m_sock, &msg, MSG_DONTWAIT);
+  if (received < 0 || !m_coalesce)
+    return received;
+  // only the first of datagrams handed over together. This is for the
+  // handshake, which never sends runs, so the rest are repeats
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+      continue;
+    int gso_size = 0;
+    std::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+    if (gso_size > 0)
+      return std::min(received, gso_size);
+  }
+  return received;
+}
+
+const int UdpTransport::Send(DatagramBatch &batch, const size_t offset) {
+  if (m_segment.load(std::memory_order_relaxed)) {
+    const int sent = batch.Send(m_sock, offset, true);
+    if (sent >= 0)
+      return sent;
+    // the device can't split them, it never will
+    if (errno == EIO)
+      m_segment.store(false, std::memory_order_relaxed);
+    // a run too big for the path, sent one by one each datagram gets
+    // its own EMSGSIZE
+    else if (errno != EINVAL)
+      return -1;
+  }
+  return batch.Send(m_sock, offset);
+}
+
+const int UdpTransport::SendTo(const uint8_t *data, const size_t length,
+                               const sockaddr_in &peer) {
+  return sendto(m_sock, data, length, 0, (const sockaddr *)&peer,
+                sizeof(peer));
+}
+
+const int UdpTransport::Wait(const bool write,
+                             const std::chrono::microseconds timeout) {
+  pollfd fds[2] = {
+      {.fd = m_sock, .events = short(write ? POLLOUT : POLLIN), .revents = 0},
+      {.fd = m_interrupt, .events = POLLIN, .revents = 0}};
+  const timespec wait = {.tv_sec = timeout.count() / 1000000,
+                         .tv_nsec = timeout.count() % 1000000 * 1000};
+  const int ready = ppoll(fds, 2, &wait, nullptr);
+  if (ready < 0)
+    return -1;
+  if (fds[0].revents)
+    return 0;
+  if (fds[1].revents) {
+    uint64_t count = 0;
+    read(m_interrupt, &count, sizeof(count));
+  }
+  return TIMEOUT;
+}
+
+void UdpTransport::Interrupt() {
+  const uint64_t one = 1;
+  write(m_interrupt, &one, sizeof(one));
+}
+
+} // namespace Hev
@@ -0,0 +1,487 @@
+#include "uringtransport.h"
+#include "errors.h"
+#include "ringqueue.h"
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Hev {
+
+namespace {
+
+// what completions are for, sends are numbered by their slot
+constexpr uint64_t RECEIVE = ~0ull;
+constexpr uint64_t WAKE = ~0ull - 1;
+constexpr uint64_t CANCEL = ~0ull - 2;
+// room on the receive ring for the multishot receive, interrupts and
+// cancelling them
+constexpr uint32_t RECEIVE_ENTRIES = 8;
+// the kernel numbers provided buffers with 16 bits
+constexpr uint32_t MAX_RECEIVE_BUFFERS = 1 << 15;
+constexpr std::chrono::microseconds CANCEL_WAIT{100000};
+
+int Enter(const int fd, const uint32_t to_submit, const uint32_t wait_for,
+          const uint32_t flags, const void *arg, const size_t arg_len) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, wait_for, flags, arg,
+                 arg_len);
+}
+
+} // namespace
+
+bool UringTransport::Ring::Setup(const uint32_t entries,
+                                 const uint32_t cq_entries) {
+  io_uring_params params = {};
+  params.flags = IORING_SETUP_CLAMP;
+  if (cq_entries > 0) {
+    params.flags |= IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+  }
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return false;
+  // waiting with a timeout needs the extended arguments, and a full
+  // completion queue must not drop datagrams' buffers on the floor
+  if (!(params.features & IORING_FEAT_EXT_ARG) ||
+      !(params.features & IORING_FEAT_NODROP))
+    return false;
+  sq_bytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+  sq_memory = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_memory == MAP_FAILED) {
+    sq_memory = nullptr;
+    return false;
+  }
+  cq_memory = sq_memory;
+  if (!single) {
+    cq_memory = mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_memory == MAP_FAILED) {
+      cq_memory = nullptr;
+      return false;
+    }
+  }
+  sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes_memory = mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes_memory == MAP_FAILED)
+    return false;
+  sqes = static_cast<io_uring_sqe *>(sqes_memory);
+
+  uint8_t *sq = static_cast<uint8_t *>(sq_memory);
+  sq_head = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+  sq_tail = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+  sq_array = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+  sq_mask = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+  sq_entries = params.sq_entries;
+  uint8_t *cq = static_cast<uint8_t *>(cq_memory);
+  cq_head = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+  cq_mask = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  return true;
+}
+
+void UringTransport::Ring::Teardown() {
+  if (sqes)
+    munmap(sqes, sqes_bytes);
+  if (cq_memory && cq_memory != sq_memory)
+    munmap(cq_memory, cq_bytes);
+  if (sq_memory)
+    munmap(sq_memory, sq_bytes);
+  if (fd >= 0)
+    close(fd);
+  *this = Ring();
+}
+
+io_uring_sqe *UringTransport::Ring::Next() {
+  const uint32_t head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  const uint32_t tail = *sq_tail + sq_pending;
+  if (tail - head >= sq_entries)
+    return nullptr;
+  const uint32_t index = tail & sq_mask;
+  sq_array[index] = index;
+  io_uring_sqe *sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_pending++;
+  return sqe;
+}
+
+const int UringTransport::Ring::Submit() {
+  const uint32_t tail = *sq_tail + sq_pending;
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+  sq_pending = 0;
+  // anything a failed call left behind goes along too
+  const uint32_t to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (to_submit == 0)
+    return 0;
+  return Enter(fd, to_submit, 0, 0, nullptr, 0) < 0 ? -1 : 0;
+}
+
+const int UringTransport::Ring::Wait(const uint32_t wait_for,
+                                     const std::chrono::microseconds timeout) {
+  const __kernel_timespec wait = {.tv_sec = timeout.count() / 1000000,
+                                  .tv_nsec = timeout.count() % 1000000 * 1000};
+  const io_uring_getevents_arg arg = {.sigmask = 0,
+                                      .sigmask_sz = _NSIG / 8,
+                                      .pad = 0,
+                                      .ts = uint64_t(uintptr_t(&wait))};
+  if (Enter(fd, 0, wait_for, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg)) >= 0)
+    return 0;
+  return errno == ETIME || errno == EINTR ? TIMEOUT : -1;
+}
+
+const io_uring_cqe *UringTransport::Ring::Peek() const {
+  const uint32_t head = *cq_head;
+  if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    return nullptr;
+  return &cqes[head & cq_mask];
+}
+
+void UringTransport::Ring::Pop() {
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+std::unique_ptr<Transport> UringTransport::Bind(const char * /*local_addr*/,
+                                                const int local_port,
+                                                const UringConfig &config) {
+  if (config.receive_buffers == 0 ||
+      config.receive_buffers > MAX_RECEIVE_BUFFERS ||
+      config.send_slots == 0 || config.datagram_len == 0)
+    return nullptr;
+  const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    return nullptr;
+  sockaddr_in addr = {};
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(local_port);
+  addr.sin_family = AF_INET;
+  // probe the path mtu ourselves, see UdpTransport::Bind
+  int pmtu = IP_PMTUDISC_PROBE;
+  setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+  if (bind(sock, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return nullptr;
+  }
+  // cleans up whatever got set up if the rest fails
+  std::unique_ptr<UringTransport> transport(new UringTransport(sock, config));
+  const uint32_t buffers = transport->m_config.receive_buffers;
+  if (!transport->m_receive.Setup(RECEIVE_ENTRIES, buffers * 2) ||
+      !transport->m_send.Setup(config.send_slots, 0) ||
+      !transport->SetupBuffers())
+    return nullptr;
+  transport->Arm();
+  if (!transport->m_armed)
+    return nullptr;
+  return transport;
+}
+
+UringTransport::UringTransport(const int sock, const UringConfig &config)
+    : m_sock(sock), m_config(config), m_armed(false), m_receive_header(),
+      m_buffer_ring(nullptr), m_buffer_ring_bytes(0) {
+  // the kernel wants a power of two buffers
+  m_config.receive_buffers = RoundUpCapacity(config.receive_buffers);
+  // each buffer starts with what recvmsg would have filled in
+  m_receive_header.msg_namelen = sizeof(sockaddr_in);
+  m_buffer_len = (sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) +
+                  config.datagram_len + 63) /
+                 64 * 64;
+  m_buffers.resize(size_t(m_buffer_len) * m_config.receive_buffers);
+
+  m_slots.resize(config.send_slots);
+  m_send_buffers.resize(size_t(config.datagram_len) * config.send_slots);
+  m_free_slots.reserve(config.send_slots);
+  for (uint32_t i = 0; i < config.send_slots; i++) {
+    m_slots[i].data = m_send_buffers.data() + size_t(i) * config.datagram_len;
+    // popped off the back, so the first slot goes first
+    m_free_slots.push_back(config.send_slots - 1 - i);
+  }
+}
+
+UringTransport::~UringTransport() {
+  // the kernel may still be writing into the receive buffers or
+  // reading out of the send slots until it says it's done
+  if (m_receive.fd >= 0 && m_armed) {
+    Cancel(m_receive);
+    while (m_armed && m_receive.Wait(1, CANCEL_WAIT) >= 0) {
+      for (const io_uring_cqe *cqe; (cqe = m_receive.Peek());
+           m_receive.Pop()) {
+        if (cqe->user_data == RECEIVE && !(cqe->flags & IORING_CQE_F_MORE))
+          m_armed = false;
+      }
+    }
+  }
+  if (m_send.fd >= 0 && m_free_slots.size() < m_slots.size()) {
+    Cancel(m_send);
+    while (m_free_slots.size() < m_slots.size() &&
+           m_send.Wait(1, CANCEL_WAIT) >= 0)
+      Reap();
+  }
+  m_receive.Teardown();
+  m_send.Teardown();
+  if (m_buffer_ring)
+    munmap(m_buffer_ring, m_buffer_ring_bytes);
+  // shouldn't overwrite the standard fds
+  if (m_sock > 2)
+    close(m_sock);
+}
+
+bool UringTransport::SetupBuffers() {
+  const uint32_t count = m_config.receive_buffers;
+  const size_t page = sysconf(_SC_PAGESIZE);
+  m_buffer_ring_bytes =
+      (count * sizeof(io_uring_buf) + page - 1) / page * page;
+  void *memory = mmap(nullptr, m_buffer_ring_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return false;
+  m_buffer_ring = static_cast<io_uring_buf_ring *>(memory);
+  io_uring_buf_reg reg = {};
+  reg.ring_addr = uintptr_t(m_buffer_ring);
+  reg.ring_entries = count;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, m_receive.fd,
+              IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    return false;
+  for (uint32_t i = 0; i < count; i++)
+    Recycle(i);
+  return true;
+}
+
+void UringTransport::Recycle(const uint16_t id) {
+  const uint16_t tail = m_buffer_ring->tail;
+  // not through bufs, the kernel header wraps it in an empty struct
+  // which takes up a byte in C++ and pushes it 8 bytes along
+  io_uring_buf *buffers = reinterpret_cast<io_uring_buf *>(m_buffer_ring);
+  io_uring_buf &buffer = buffers[tail & (m_config.receive_buffers - 1)];
+  buffer.addr = uintptr_t(m_buffers.data() + size_t(id) * m_buffer_len);
+  buffer.len = m_buffer_len;
+  buffer.bid = id;
+  __atomic_store_n(&m_buffer_ring->tail, uint16_t(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+void UringTransport::Arm() {
+  std::lock_guard lock(m_receive_mutex);
+  if (m_armed)
+    return;
+  io_uring_sqe *sqe = m_receive.Next();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = m_sock;
+  sqe->addr = uintptr_t(&m_receive_header);
+  sqe->len = 1;
+  // report how long a datagram really was when it's cut off
+  sqe->msg_flags = MSG_TRUNC;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = RECEIVE;
+  m_armed = m_receive.Submit() == 0;
+}
+
+const int UringTransport::Take(const uint8_t **data, size_t *length,
+                               bool *truncated, sockaddr_in *from) {
+  const io_uring_cqe *cqe = m_receive.Peek();
+  *data = nullptr;
+  int id = -1;
+  if (cqe->user_data == RECEIVE) {
+    // out of buffers or its thread exited, posted again once we've
+    // made room
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      m_armed = false;
+    if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+      id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  }
+  const size_t received = id >= 0 ? cqe->res : 0;
+  m_receive.Pop();
+  const size_t offset = sizeof(io_uring_recvmsg_out) +
+                        m_receive_header.msg_namelen +
+                        m_receive_header.msg_controllen;
+  if (id < 0 || received < offset)
+    return id;
+  const uint8_t *buffer = m_buffers.data() + size_t(id) * m_buffer_len;
+  io_uring_recvmsg_out out;
+  std::memcpy(&out, buffer, sizeof(out));
+  *from = {};
+  std::memcpy(from, buffer + sizeof(out),
+              std::min<size_t>(out.namelen, sizeof(*from)));
+  *data = buffer + offset;
+  *length = std::min<size_t>(out.payloadlen, received - offset);
+  *truncated = (out.flags & MSG_TRUNC) || *length < out.payloadlen;
+  return id;
+}
+
+const int UringTransport::Receive(DatagramBatch &batch) {
+  batch.Clear();
+  while (batch.Size() < batch.Capacity() && m_receive.Peek()) {
+    const uint8_t *data;
+    size_t length;
+    bool truncated;
+    sockaddr_in from;
+    const int id = Take(&data, &length, &truncated, &from);
+    if (data)
+      batch.Put(data, length, from, truncated);
+    if (id >= 0)
+      Recycle(id);
+  }
+  Arm();
+  return batch.Size();
+}
+
+const int UringTransport::ReceiveFrom(uint8_t *buffer, const size_t buffer_len,
+                                      sockaddr_in *from) {
+  int received = -1;
+  while (received < 0 && m_receive.Peek()) {
+    const uint8_t *data;
+    size_t length;
+    bool truncated;
+    const int id = Take(&data, &length, &truncated, from);
+    if (data) {
+      received = std::min(length, buffer_len);
+      std::memcpy(buffer, data, received);
+    }
+    if (id >= 0)
+      Recycle(id);
+  }
+  Arm();
+  return received;
+}
+
+void UringTransport::Reap() {
+  for (const io_uring_cqe *cqe; (cqe = m_send.Peek()); m_send.Pop()) {
+    // a send that failed is lost like one the network dropped
+    if (cqe->user_data < m_slots.size())
+      m_free_slots.push_back(cqe->user_data);
+  }
+}
+
+bool UringTransport::Queue(const uint8_t *data, const DatagramBatch *batch,
+                           const size_t index, const size_t length,
+                           const sockaddr_in &peer) {
+  if (m_free_slots.empty())
+    return false;
+  io_uring_sqe *sqe = m_send.Next();
+  if (!sqe)
+    return false;
+  const uint32_t id = m_free_slots.back();
+  m_free_slots.pop_back();
+  SendSlot &slot = m_slots[id];
+  if (batch)
+    batch->Gather(index, slot.data);
+  else
+    std::memcpy(slot.data, data, length);
+  slot.peer = peer;
+  slot.iov = {.iov_base = slot.data, .iov_len = length};
+  slot.header = {};
+  slot.header.msg_name = &slot.peer;
+  slot.header.msg_namelen = sizeof(slot.peer);
+  slot.header.msg_iov = &slot.iov;
+  slot.header.msg_iovlen = 1;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = m_sock;
+  sqe->addr = uintptr_t(&slot.header);
+  sqe->len = 1;
+  sqe->user_data = id;
+  return true;
+}
+
+const int UringTransport::Send(DatagramBatch &batch, const size_t offset) {
+  std::lock_guard lock(m_send_mutex);
+  Reap();
+  size_t queued = 0;
+  for (size_t i = offset; i < batch.Size(); i++) {
+    const size_t length = batch.Total(i);
+    if (length > m_config.datagram_len) {
+      // reported when it's at the front, like sendmmsg would
+      if (queued > 0)
+        break;
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if (!Queue(nullptr, &batch, i, length, batch.Address(i)))
+      break;
+    queued++;
+  }
+  if (queued == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  // queued ones go out with the next submit if this one fails
+  m_send.Submit();
+  return queued;
+}
+
+const int UringTransport::SendTo(const uint8_t *data, const size_t length,
+                                 const sockaddr_in &peer) {
+  if (length > m_config.datagram_len) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  std::lock_guard lock(m_send_mutex);
+  Reap();
+  if (!Queue(data, nullptr, 0, length, peer)) {
+    errno = EAGAIN;
+    return -1;
+  }
+  m_send.Submit();
+  return length;
+}
+
+const int UringTransport::Wait(const bool write,
+                               const std::chrono::microseconds timeout) {
+  if (write) {
+    std::lock_guard lock(m_send_mutex);
+    Reap();
+    if (!m_free_slots.empty())
+      return 0;
+    const int status = m_send.Wait(1, timeout);
+    Reap();
+    if (!m_free_slots.empty())
+      return 0;
+    return status < 0 ? -1 : TIMEOUT;
+  }
+  Arm();
+  if (!m_receive.Peek()) {
+    if (m_receive.Wait(1, timeout) < 0)
+      return -1;
+  }
+  // an interrupt only wakes us up
+  const io_uring_cqe *cqe;
+  while ((cqe = m_receive.Peek()) && cqe->user_data == WAKE)
+    m_receive.Pop();
+  return cqe ? 0 : TIMEOUT;
+}
+
+void UringTransport::Interrupt() {
+  std::lock_guard lock(m_receive_mutex);
+  io_uring_sqe *sqe = m_receive.Next();
+  if (!sqe)
+    return;
+  sqe->opcode = IORING_OP_NOP;
+  sqe->user_data = WAKE;
+  m_receive.Submit();
+}
+
+void UringTransport::Cancel(Ring &ring) {
+  io_uring_sqe *sqe = ring.Next();
+  if (!sqe) {
+    ring.Submit();
+    if (!(sqe = ring.Next()))
+      return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = CANCEL;
+  ring.Submit();
+}
+
+} // namespace Hev
@@ -0,0 +1,32 @@
+// check.h
+// What the unit tests share. A test is a function that returns whether
+// it passed, a CHECK that fails prints where and fails the test
+#pragma once
+#include <cstdio>
+#include <initializer_list>
+#include <utility>
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,    \
+                   #condition);                                                \
+      return false;                                                            \
+    }                                                                          \
+  } while (0)
+
+using Test = std::pair<const char *, bool (*)()>;
+
+/* RunTests
+ * runs every test and reports the ones that failed
+ * returns: the exit code, 0 if they all passed
+ */
+inline int RunTests(std::initializer_list<Test> tests) {
+  int failed = 0;
+  for (const Test &test : tests) {
+    const bool passed = test.second();
+    std::printf("%s %s\n", passed ? "pass" : "FAIL", test.first);
+    failed += !passed;
+  }
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+#include "check.h"
+#include "congestion.h"
+
+using namespace Hev;
+using Micros = CongestionController::Micros;
+using Clock = CongestionController::Clock;
+
+namespace {
+
+const size_t SEGMENT = CongestionController::SEGMENT;
+const size_t MIN_WINDOW = CongestionController::MIN_WINDOW;
+
+bool DelayGrowsUnderTarget() {
+  DelayController controller;
+  const auto now = Clock::now();
+  const size_t start = controller.Window();
+  controller.OnAck(SEGMENT, Micros(10000), now);
+  CHECK(controller.Window() > start);
+  return true;
+}
+
+bool DelayShrinksPastTarget() {
+  DelayController controller;
+  const auto now = Clock::now();
+  controller.OnAck(SEGMENT, Micros(10000), now);
+  const size_t before = controller.Window();
+  controller.OnAck(SEGMENT, Micros(10000) + DelayController::TARGET * 2, now);
+  CHECK(controller.Window() < before);
+  CHECK(controller.Window() >= MIN_WINDOW);
+  return true;
+}
+
+bool DelayCutBiggerThanWindowStopsAtMinimum() {
+  DelayController controller;
+  const auto now = Clock::now();
+  // a timeout takes the window to its minimum
+  controller.OnLoss(true, Micros(10000), now);
+  CHECK(controller.Window() == MIN_WINDOW);
+  controller.OnAck(SEGMENT, Micros(10000), now);
+  controller.OnLoss(true, Micros(10000), now);
+  // 150ms of queueing is six times the target, the cut is a few
+  // times the whole window
+  controller.OnAck(SEGMENT, Micros(160000), now);
+  CHECK(controller.Window() == MIN_WINDOW);
+  // and it stays there however much more is acked that late
+  for (int i = 0; i < 100; i++)
+    controller.OnAck(4 * SEGMENT, Micros(500000), now);
+  CHECK(controller.Window() == MIN_WINDOW);
+  return true;
+}
+
+bool DelayLossHalvesOncePerRecovery() {
+  DelayController controller;
+  const auto now = Clock::now();
+  const size_t start = controller.Window();
+  controller.OnLoss(false, Micros(20000), now);
+  CHECK(controller.Window() == start / 2);
+  // a second loss within the round trip is the same congestion event
+  controller.OnLoss(false, Micros(20000), now + Micros(1000));
+  CHECK(controller.Window() == start / 2);
+  controller.OnLoss(false, Micros(20000), now + Micros(30000));
+  CHECK(controller.Window() == std::max(start / 4, MIN_WINDOW));
+  return true;
+}
+
+bool PacerWithoutRateNeverWaits() {
+  Pacer pacer;
+  Clock::time_point next;
+  const auto now = Clock::now();
+  for (int i = 0; i < 1000; i++)
+    CHECK(pacer.TryTake(64 * 1024, now, &next));
+  return true;
+}
+
+bool PacerGoesIntoDebtOnce() {
+  Pacer pacer;
+  pacer.SetRate(1000000);
+  const auto now = Clock::now();
+  Clock::time_point next;
+  // a packet bigger than the whole bucket still goes
+  CHECK(pacer.TryTake(64 * 1024, now, &next));
+  // but nothing after it until the debt is paid off
+  CHECK(!pacer.TryTake(1, now, &next));
+  CHECK(next > now);
+  CHECK(!pacer.TryTake(1, next - Micros(100), &next));
+  CHECK(pacer.TryTake(1, next + Micros(1), &next));
+  return true;
+}
+
+bool PacerBurstIsCapped() {
+  Pacer pacer;
+  const uint64_t rate = 1000000;
+  pacer.SetRate(rate);
+  const auto now = Clock::now();
+  Clock::time_point next;
+  // a long quiet stretch only builds up BURST worth of tokens
+  const auto later = now + std::chrono::seconds(10);
+  const size_t burst =
+      rate * std::chrono::duration<double>(Pacer::BURST).count();
+  size_t sent = 0;
+  while (pacer.TryTake(SEGMENT, later, &next))
+    sent += SEGMENT;
+  CHECK(sent >= burst);
+  CHECK(sent < burst + 2 * SEGMENT);
+  return true;
+}
+
+} // namespace
+
+int main() {
+  return RunTests({
+      {"delay grows under target", DelayGrowsUnderTarget},
+      {"delay shrinks past target", DelayShrinksPastTarget},
+      {"delay cut bigger than window stops at minimum",
+       DelayCutBiggerThanWindowStopsAtMinimum},
+      {"delay loss halves once per recovery", DelayLossHalvesOncePerRecovery},
+      {"pacer without rate never waits", PacerWithoutRateNeverWaits},
+      {"pacer goes into debt once", PacerGoesIntoDebtOnce},
+      {"pacer burst is capped", PacerBurstIsCapped},
+  });
+}
@@ -0,0 +1,69 @@
+#include "check.h"
+#include "connection.h"
+
+using namespace Hev;
+
+namespace {
+
+const uint32_t WINDOW = Connection::RECEIVE_WINDOW;
+
+bool FarAheadIsRefused() {
+  Connection conn(sockaddr_in{});
+  conn.ExpectSequence(100);
+  CHECK(conn.InReceiveWindow(100 + WINDOW - 1));
+  CHECK(!conn.InReceiveWindow(100 + WINDOW));
+  CHECK(!conn.MarkReceived(100 + WINDOW));
+  CHECK(!conn.WasReceived(100 + WINDOW));
+  // nor anything wildly far off either way
+  CHECK(!conn.MarkReceived(100 + 0x40000000));
+  CHECK(!conn.MarkReceived(100 + 0x90000000));
+  CHECK(conn.MarkReceived(100 + WINDOW - 1));
+  CHECK(conn.WasReceived(100 + WINDOW - 1));
+  return true;
+}
+
+bool WindowSlidesAcrossWrap() {
+  Connection conn(sockaddr_in{});
+  const uint32_t first = 0xfffffff0;
+  conn.ExpectSequence(first);
+  // everything but the first, out of order around the wrap
+  for (uint32_t i = 32; i > 0; i--)
+    CHECK(conn.MarkReceived(first + i));
+  CHECK(!conn.WasReceived(first));
+  CHECK(conn.WasReceived(first + 20));
+  CHECK(!conn.MarkReceived(first + 20));
+  // the first one lets the base slide past the wrap to the end
+  CHECK(conn.MarkReceived(first));
+  for (uint32_t i = 0; i <= 32; i++)
+    CHECK(conn.WasReceived(first + i));
+  CHECK(!conn.WasReceived(first + 33));
+  // the window now starts past zero
+  CHECK(conn.InReceiveWindow(first + 33 + WINDOW - 1));
+  CHECK(!conn.InReceiveWindow(first + 33 + WINDOW));
+  return true;
+}
+
+bool AcksTheNewestAcrossWrap() {
+  Connection conn(sockaddr_in{});
+  const uint32_t first = 0xfffffffe;
+  conn.ExpectSequence(first);
+  for (uint32_t i = 0; i < 4; i++)
+    CHECK(conn.MarkReceived(first + i));
+  CHECK(conn.InAckWindow(first));
+  CHECK(conn.InAckWindow(first + 3));
+  CHECK(!conn.InAckWindow(first + 4));
+  const Connection::AckState ack = conn.TakeAck();
+  CHECK(ack.ack == first + 3);
+  CHECK((ack.bits & 0xf) == 0xf);
+  return true;
+}
+
+} // namespace
+
+int main() {
+  return RunTests({
+      {"far ahead is refused", FarAheadIsRefused},
+      {"window slides across wrap", WindowSlidesAcrossWrap},
+      {"acks the newest across wrap", AcksTheNewestAcrossWrap},
+  });
+}
@@ -0,0 +1,159 @@
+#include "check.h"
+#include "packet.h"
+#include <arpa/inet.h>
+#include <cstring>
+
+using namespace Hev;
+
+namespace {
+
+bool SameFields(const TBHeader &a, const TBHeader &b) {
+  return a.type == b.type && a.channel == b.channel &&
+         a.sequence == b.sequence && a.length == b.length &&
+         a.ack == b.ack && a.ack_bits == b.ack_bits &&
+         a.channel_sequence == b.channel_sequence &&
+         a.fragment_index == b.fragment_index &&
+         a.fragment_count == b.fragment_count;
+}
+
+/* Decode
+ * the header of a datagram holding just the header and length bytes
+ * of payload
+ */
+bool Decode(const WireHeader &wire, const size_t length, TBPacket *packet) {
+  uint8_t datagram[WireHeader::MAX_LEN + 64] = {};
+  std::memcpy(datagram, wire.data, wire.length);
+  return RebuildPacket(datagram, wire.length + length, packet) ==
+         wire.length + length;
+}
+
+bool FullLayoutIsFixed() {
+  WireHeader wire = BuildHeader(PacketType::MSG, 0x01020304, 5, 0x05060708,
+                                0x090a0b0c, Channel::RELIABLE_ORDERED,
+                                0x0d0e0f10, 0x1112, 0x1314);
+  CHECK(wire.version == HeaderVersion::FULL);
+  CHECK(wire.length == WireHeader::FULL_LEN);
+  const uint8_t expected[] = {0x00, 0x10, 0x03, 0x00, 0x01, 0x02, 0x03,
+                              0x04, 0x00, 0x00, 0x00, 0x05, 0x05, 0x06,
+                              0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+                              0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14};
+  static_assert(sizeof(expected) == WireHeader::FULL_LEN);
+  CHECK(std::memcmp(wire.data, expected, sizeof(expected)) == 0);
+  TBPacket packet;
+  CHECK(Decode(wire, 5, &packet));
+  CHECK(packet.version == HeaderVersion::FULL);
+  CHECK(SameFields(packet.header, wire.fields));
+  return true;
+}
+
+bool CompactRoundTripsEveryKind() {
+  const uint16_t controls[] = {PacketType::SYN,  PacketType::SYNACK,
+                               PacketType::PING, PacketType::PONG,
+                               PacketType::PROBE, PacketType::PROBE_ACK};
+  for (const uint16_t type : controls) {
+    WireHeader wire = BuildHeader(type, 0xdeadbeef, 0);
+    EncodeHeader(wire, HeaderVersion::COMPACT, true);
+    CHECK(wire.version == HeaderVersion::COMPACT);
+    TBPacket packet;
+    CHECK(Decode(wire, 0, &packet));
+    // control sequences aren't shortened
+    CHECK(packet.header.type == type);
+    CHECK(packet.header.sequence == 0xdeadbeef);
+  }
+  for (uint8_t channel = 0; channel < Channel::COUNT; channel++) {
+    WireHeader wire = BuildHeader(PacketType::MSG, 70000, 40, 65000,
+                                  0xfffffffe, channel, 131072 + 9, 3, 7);
+    EncodeHeader(wire, HeaderVersion::COMPACT, true);
+    CHECK(wire.length < WireHeader::FULL_LEN);
+    TBPacket packet;
+    CHECK(Decode(wire, 40, &packet));
+    CHECK(packet.header.type == PacketType::MSG);
+    CHECK(packet.header.channel == channel);
+    CHECK(packet.header.length == 40);
+    CHECK(packet.header.ack_bits == 0xfffffffe);
+    CHECK(packet.header.fragment_index == 3);
+    CHECK(packet.header.fragment_count == 7);
+    // the low 16 bits come through, the connection fills in the rest
+    CHECK(packet.header.ack == (65000 & 0xffff));
+    CHECK(packet.header.channel_sequence == ((131072 + 9) & 0xffff));
+    if (Channel::IsReliable(channel))
+      CHECK(packet.header.sequence == (70000 & 0xffff));
+  }
+  return true;
+}
+
+bool CompactWithoutLengthRunsToTheEnd() {
+  WireHeader wire = BuildHeader(PacketType::MSG, 1, 17, 0, 0,
+                                Channel::UNRELIABLE, 2);
+  EncodeHeader(wire, HeaderVersion::COMPACT, false);
+  TBPacket packet;
+  CHECK(Decode(wire, 17, &packet));
+  CHECK(packet.header.length == 17);
+  return true;
+}
+
+bool SequencesExpandAcrossWrap() {
+  // every distance up to half the 16 bit space either way, around the
+  // 16 and 32 bit wraps
+  const uint32_t references[] = {0, 1, 0xfff0, 0xffff, 0x10000, 0x1fff0,
+                                 0xfffffff0, 0xffffffff};
+  for (const uint32_t reference : references) {
+    for (int32_t distance = -32768; distance < 32768; distance += 7) {
+      const uint32_t sent = reference + distance;
+      WireHeader wire = BuildHeader(PacketType::MSG, sent, 0, sent, 1,
+                                    Channel::RELIABLE, sent);
+      EncodeHeader(wire, HeaderVersion::COMPACT, true);
+      TBPacket packet;
+      CHECK(Decode(wire, 0, &packet));
+      CHECK(ExpandSequence(packet.header.sequence, reference) == sent);
+      CHECK(ExpandSequence(packet.header.ack, reference) == sent);
+      CHECK(ExpandSequence(packet.header.channel_sequence, reference) ==
+            sent);
+    }
+  }
+  return true;
+}
+
+bool CutShortIsRefused() {
+  WireHeader wire = BuildHeader(PacketType::MSG, 70000, 40, 65000, 3,
+                                Channel::RELIABLE, 9, 1, 2);
+  EncodeHeader(wire, HeaderVersion::COMPACT, true);
+  uint8_t datagram[WireHeader::MAX_LEN + 40] = {};
+  std::memcpy(datagram, wire.data, wire.length);
+  TBPacket packet;
+  for (size_t len = 1; len < wire.length + 40; len++)
+    CHECK(RebuildPacket(datagram, len, &packet) == 0);
+  CHECK(RebuildPacket(datagram, wire.length + 40, &packet) ==
+        wire.length + 40);
+  return true;
+}
+
+bool OldHeaderIsRefused() {
+  // type, two bytes of padding, sequence and length, then the payload
+  for (const uint32_t payload_len : {0u, 4u, 16u, 200u}) {
+    uint8_t datagram[12 + 200] = {};
+    const uint16_t type = htons(PacketType::MSG);
+    const uint32_t sequence = htonl(42);
+    const uint32_t length = htonl(payload_len);
+    std::memcpy(datagram, &type, 2);
+    std::memcpy(datagram + 4, &sequence, 4);
+    std::memcpy(datagram + 8, &length, 4);
+    TBPacket packet;
+    CHECK(RebuildPacket(datagram, 12 + payload_len, &packet) == 0);
+  }
+  return true;
+}
+
+} // namespace
+
+int main() {
+  return RunTests({
+      {"full layout is fixed", FullLayoutIsFixed},
+      {"compact round trips every kind", CompactRoundTripsEveryKind},
+      {"compact without length runs to the end",
+       CompactWithoutLengthRunsToTheEnd},
+      {"sequences expand across wrap", SequencesExpandAcrossWrap},
+      {"cut short is refused", CutShortIsRefused},
+      {"old header is refused", OldHeaderIsRefused},
+  });
+}
@@ -0,0 +1,212 @@
+#include "check.h"
+#include "ringqueue.h"
+
+#include <thread>
+#include <vector>
+
+using namespace Hev;
+
+namespace {
+
+const int MESSAGES = 200000;
+const int PRODUCERS = 4;
+
+bool SpscFullAndEmpty() {
+  SPSCQueue<int> queue(4);
+  int item = 0;
+  CHECK(queue.empty());
+  CHECK(!queue.try_pop(&item));
+  for (int i = 0; i < 4; i++)
+    CHECK(queue.push(int(i)));
+  CHECK(queue.full());
+  CHECK(!queue.push(4));
+  for (int i = 0; i < 4; i++) {
+    CHECK(queue.try_pop(&item));
+    CHECK(item == i);
+  }
+  CHECK(queue.empty());
+  CHECK(!queue.try_pop(&item));
+  return true;
+}
+
+bool SpscWrapsInOrder() {
+  SPSCQueue<int> queue(4);
+  int next_in = 0;
+  int next_out = 0;
+  int item = 0;
+  // filled up and two taken out each round, so the head and tail lap
+  // the ring over and over
+  for (int round = 0; round < 1000; round++) {
+    while (queue.push(int(next_in)))
+      next_in++;
+    CHECK(queue.size() == queue.capacity());
+    for (int i = 0; i < 2; i++) {
+      CHECK(queue.try_pop(&item));
+      CHECK(item == next_out++);
+    }
+  }
+  while (queue.try_pop(&item))
+    CHECK(item == next_out++);
+  CHECK(next_out == next_in);
+  return true;
+}
+
+bool SpscAcrossThreads() {
+  SPSCQueue<int> queue(64);
+  std::thread producer([&]() {
+    for (int i = 0; i < MESSAGES; i++)
+      while (!queue.push(int(i)))
+        std::this_thread::yield();
+  });
+  int expected = 0;
+  int item = 0;
+  while (expected < MESSAGES &&
+         queue.pop_wait_till(std::chrono::milliseconds(1000), &item)) {
+    if (item != expected)
+      break;
+    expected++;
+  }
+  producer.join();
+  CHECK(expected == MESSAGES);
+  CHECK(queue.empty());
+  return true;
+}
+
+bool MpscFullAndEmpty() {
+  MPSCQueue<int> queue(4);
+  int item = 0;
+  CHECK(!queue.try_pop(&item));
+  for (int i = 0; i < 4; i++)
+    CHECK(queue.push(int(i)));
+  CHECK(!queue.push(4));
+  CHECK(queue.try_pop(&item));
+  CHECK(item == 0);
+  // the freed slot is at the front of the next lap
+  CHECK(queue.push(4));
+  for (int i = 1; i < 5; i++) {
+    CHECK(queue.try_pop(&item));
+    CHECK(item == i);
+  }
+  CHECK(!queue.try_pop(&item));
+  return true;
+}
+
+// each producer's items carry its index in the top bits and arrive in
+// the order it pushed them
+bool MpscAcrossThreads() {
+  MPSCQueue<int> queue(64);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < PRODUCERS; p++)
+    producers.emplace_back([&queue, p]() {
+      for (int i = 0; i < MESSAGES / PRODUCERS; i++)
+        while (!queue.push(p << 24 | i))
+          std::this_thread::yield();
+    });
+  std::vector<int> next(PRODUCERS, 0);
+  int received = 0;
+  bool ordered = true;
+  int item = 0;
+  while (received < MESSAGES &&
+         queue.pop_wait_till(std::chrono::milliseconds(1000), &item)) {
+    const int producer = item >> 24;
+    ordered = ordered && (item & 0xffffff) == next[producer];
+    next[producer]++;
+    received++;
+  }
+  for (auto &producer : producers)
+    producer.join();
+  CHECK(ordered);
+  CHECK(received == MESSAGES);
+  return true;
+}
+
+bool MpscClaimIsAllOrNothing() {
+  MPSCQueue<int> queue(8);
+  size_t first = 0;
+  for (int i = 0; i < 5; i++)
+    CHECK(queue.push(int(i)));
+  CHECK(!queue.claim(4, &first));
+  CHECK(!queue.claim(9, &first));
+  CHECK(queue.claim(3, &first));
+  CHECK(!queue.push(8));
+  // the consumer stops at the first claimed slot until it is filled
+  int item = 0;
+  for (int i = 0; i < 5; i++)
+    CHECK(queue.try_pop(&item));
+  queue.fill(first + 1, 6);
+  CHECK(!queue.try_pop(&item));
+  queue.fill(first, 5);
+  queue.fill(first + 2, 7);
+  for (int i = 5; i < 8; i++) {
+    CHECK(queue.try_pop(&item));
+    CHECK(item == i);
+  }
+  CHECK(!queue.try_pop(&item));
+  return true;
+}
+
+// claims that straddle the end of the ring come out whole and in order
+bool MpscClaimsAcrossThreads() {
+  const size_t GROUP = 3;
+  const int GROUPS = MESSAGES / PRODUCERS / GROUP;
+  MPSCQueue<int> queue(16);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < PRODUCERS; p++)
+    producers.emplace_back([&queue, p]() {
+      for (int i = 0; i < GROUPS * int(GROUP); i += GROUP) {
+        size_t first = 0;
+        while (!queue.claim(GROUP, &first))
+          std::this_thread::yield();
+        for (size_t j = 0; j < GROUP; j++)
+          queue.fill(first + j, p << 24 | (i + j));
+      }
+    });
+  int received = 0;
+  bool whole = true;
+  int item = 0;
+  int group_start = 0;
+  while (received < PRODUCERS * GROUPS * int(GROUP) &&
+         queue.pop_wait_till(std::chrono::milliseconds(1000), &item)) {
+    // a group's items are next to each other, nobody else's in between
+    if (received % GROUP == 0)
+      group_start = item;
+    else
+      whole = whole && item == group_start + int(received % GROUP);
+    received++;
+  }
+  for (auto &producer : producers)
+    producer.join();
+  CHECK(whole);
+  CHECK(received == PRODUCERS * GROUPS * int(GROUP));
+  return true;
+}
+
+bool ReleaseWakesWaitingConsumer() {
+  MPSCQueue<int> queue(4);
+  std::thread releaser([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.release_all_blocks();
+  });
+  int item = 0;
+  const auto start = std::chrono::steady_clock::now();
+  const bool popped = queue.pop_wait(&item);
+  releaser.join();
+  CHECK(!popped);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  return true;
+}
+
+} // namespace
+
+int main() {
+  return RunTests({
+      {"spsc full and empty", SpscFullAndEmpty},
+      {"spsc wraps in order", SpscWrapsInOrder},
+      {"spsc across threads", SpscAcrossThreads},
+      {"mpsc full and empty", MpscFullAndEmpty},
+      {"mpsc across threads", MpscAcrossThreads},
+      {"mpsc claim is all or nothing", MpscClaimIsAllOrNothing},
+      {"mpsc claims across threads", MpscClaimsAcrossThreads},
+      {"release wakes waiting consumer", ReleaseWakesWaitingConsumer},
+  });
+}
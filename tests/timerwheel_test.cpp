@@ -0,0 +1,184 @@
+#include "check.h"
+#include "timerwheel.h"
+
+#include <vector>
+
+using namespace Hev;
+using Clock = TimerWheel::Clock;
+using std::chrono::milliseconds;
+
+namespace {
+
+const uint64_t SLOTS = TimerWheel::SLOTS;
+
+// the time tick 0 of the wheel is at, so the tests can land on ticks
+// exactly. A timer that is already due goes into tick 1
+Clock::time_point Start(TimerWheel &wheel) {
+  const TimerWheel::TimerId id =
+      wheel.Schedule(Clock::time_point::min(), []() {});
+  const Clock::time_point start = wheel.NextExpiry() - milliseconds(1);
+  wheel.Cancel(id);
+  return start;
+}
+
+// the ticks either side of where each ring hands its timers down
+const std::vector<uint64_t> BOUNDARIES = {
+    1,
+    2,
+    SLOTS - 1,
+    SLOTS,
+    SLOTS + 1,
+    2 * SLOTS - 1,
+    SLOTS * SLOTS - 1,
+    SLOTS * SLOTS,
+    SLOTS * SLOTS + 1,
+    3 * SLOTS * SLOTS + 1,
+    SLOTS * SLOTS * SLOTS - 1,
+    SLOTS * SLOTS * SLOTS,
+    SLOTS * SLOTS * SLOTS + 1,
+};
+
+bool FiresOnItsTickAcrossLevels() {
+  TimerWheel wheel;
+  const Clock::time_point start = Start(wheel);
+  std::vector<int> fired(BOUNDARIES.size(), 0);
+  for (size_t i = 0; i < BOUNDARIES.size(); i++)
+    wheel.Schedule(start + milliseconds(BOUNDARIES[i]),
+                   [&fired, i]() { fired[i]++; });
+  // jumping straight to each one, past everything in between
+  for (size_t i = 0; i < BOUNDARIES.size(); i++) {
+    CHECK(wheel.Advance(start + milliseconds(BOUNDARIES[i] - 1)) == 0);
+    CHECK(fired[i] == 0);
+    CHECK(wheel.Advance(start + milliseconds(BOUNDARIES[i])) == 1);
+    CHECK(fired[i] == 1);
+  }
+  CHECK(wheel.Size() == 0);
+  return true;
+}
+
+bool FiresOnItsTickOneTickAtATime() {
+  TimerWheel wheel;
+  const Clock::time_point start = Start(wheel);
+  const uint64_t last = 2 * SLOTS * SLOTS + 3;
+  uint64_t tick = 0;
+  std::vector<uint64_t> due;
+  for (uint64_t when : BOUNDARIES)
+    if (when <= last)
+      due.push_back(when);
+  // a few sharing a slot, in the middle of a higher ring's range
+  for (uint64_t when : {SLOTS * SLOTS + 5, SLOTS * SLOTS + 5, last})
+    due.push_back(when);
+  std::vector<uint64_t> fired_at(due.size(), 0);
+  for (size_t i = 0; i < due.size(); i++)
+    wheel.Schedule(start + milliseconds(due[i]),
+                   [&fired_at, &tick, i]() { fired_at[i] = tick; });
+  for (tick = 1; tick <= last; tick++)
+    wheel.Advance(start + milliseconds(tick));
+  for (size_t i = 0; i < due.size(); i++)
+    CHECK(fired_at[i] == due[i]);
+  CHECK(wheel.Size() == 0);
+  return true;
+}
+
+bool CancelsOnEitherSideOfACascade() {
+  TimerWheel wheel;
+  const Clock::time_point start = Start(wheel);
+  int fired = 0;
+  auto count = [&fired]() { fired++; };
+  const uint64_t ring = SLOTS * SLOTS;
+  // in the third ring until tick ring comes round
+  const TimerWheel::TimerId before =
+      wheel.Schedule(start + milliseconds(ring + 4), count);
+  const TimerWheel::TimerId after =
+      wheel.Schedule(start + milliseconds(ring + 4), count);
+  // handed down into the second ring rather than the first
+  const TimerWheel::TimerId second =
+      wheel.Schedule(start + milliseconds(ring + SLOTS + 4), count);
+  const TimerWheel::TimerId kept =
+      wheel.Schedule(start + milliseconds(ring + 4), count);
+  wheel.Advance(start + milliseconds(ring - 1));
+  CHECK(wheel.Cancel(before));
+  CHECK(!wheel.Cancel(before));
+  wheel.Advance(start + milliseconds(ring));
+  CHECK(wheel.Size() == 3);
+  CHECK(wheel.Cancel(after));
+  CHECK(wheel.Cancel(second));
+  CHECK(wheel.Size() == 1);
+  // the one left in the slot still goes off
+  CHECK(wheel.Advance(start + milliseconds(ring + 4)) == 1);
+  CHECK(fired == 1);
+  CHECK(!wheel.Cancel(kept));
+  CHECK(wheel.Advance(start + milliseconds(2 * ring)) == 0);
+  CHECK(fired == 1);
+  return true;
+}
+
+bool StaleIdDoesNotCancelReusedTimer() {
+  TimerWheel wheel;
+  const Clock::time_point start = Start(wheel);
+  int fired = 0;
+  const TimerWheel::TimerId old =
+      wheel.Schedule(start + milliseconds(1), [&fired]() { fired++; });
+  CHECK(wheel.Advance(start + milliseconds(1)) == 1);
+  // takes the node the old one freed
+  const TimerWheel::TimerId reused =
+      wheel.Schedule(start + milliseconds(10), [&fired]() { fired++; });
+  CHECK(reused != old);
+  CHECK(!wheel.Cancel(old));
+  CHECK(!wheel.Cancel(TimerWheel::INVALID));
+  CHECK(wheel.Advance(start + milliseconds(10)) == 1);
+  CHECK(fired == 2);
+  return true;
+}
+
+bool BeyondTheTopRingWaitsItsTurn() {
+  TimerWheel wheel;
+  const Clock::time_point start = Start(wheel);
+  const uint64_t reach = uint64_t(1) << (TimerWheel::SLOT_BITS *
+                                         TimerWheel::LEVELS);
+  const uint64_t when = reach + SLOTS * SLOTS + 7;
+  int fired = 0;
+  wheel.Schedule(start + milliseconds(when), [&fired]() { fired++; });
+  // put back into the top ring once, then handed all the way down
+  CHECK(wheel.Advance(start + milliseconds(reach)) == 0);
+  CHECK(wheel.Advance(start + milliseconds(when - 1)) == 0);
+  CHECK(wheel.Advance(start + milliseconds(when)) == 1);
+  CHECK(fired == 1);
+  return true;
+}
+
+bool CallbacksCanScheduleAndCancel() {
+  TimerWheel wheel;
+  const Clock::time_point start = Start(wheel);
+  int fired = 0;
+  const TimerWheel::TimerId later =
+      wheel.Schedule(start + milliseconds(2 * SLOTS), [&fired]() { fired++; });
+  bool cancelled = false;
+  wheel.Schedule(start + milliseconds(SLOTS), [&]() {
+    cancelled = wheel.Cancel(later);
+    // already due, goes off on the next Advance
+    wheel.Schedule(start, [&fired]() { fired++; });
+  });
+  CHECK(wheel.Advance(start + milliseconds(SLOTS)) == 1);
+  CHECK(cancelled);
+  CHECK(fired == 0);
+  CHECK(wheel.Advance(start + milliseconds(SLOTS + 1)) == 1);
+  CHECK(fired == 1);
+  CHECK(wheel.Advance(start + milliseconds(4 * SLOTS)) == 0);
+  CHECK(wheel.Size() == 0);
+  return true;
+}
+
+} // namespace
+
+int main() {
+  return RunTests({
+      {"fires on its tick across levels", FiresOnItsTickAcrossLevels},
+      {"fires on its tick one tick at a time", FiresOnItsTickOneTickAtATime},
+      {"cancels on either side of a cascade", CancelsOnEitherSideOfACascade},
+      {"stale id does not cancel reused timer",
+       StaleIdDoesNotCancelReusedTimer},
+      {"beyond the top ring waits its turn", BeyondTheTopRingWaitsItsTurn},
+      {"callbacks can schedule and cancel", CallbacksCanScheduleAndCancel},
+  });
+}